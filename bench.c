@@ -0,0 +1,541 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "pair.h"
+#include "pair-tlv.h"
+
+#ifdef CONFIG_GCRYPT
+# include <gcrypt.h>
+# define BACKEND "gcrypt"
+#else
+# define BACKEND "openssl"
+#endif
+
+// Measures the library in-process, with client and server contexts talking
+// directly to each other. Usage: bench [handshake iterations]
+
+#define CLIENT_DEVICE_ID "AABBCCDD11223344"
+#define SERVER_DEVICE_ID "FFEEDDCCBBAA9988"
+#define PIN "3939"
+
+#define ITERATIONS_DEFAULT 100
+#define STEPS_MAX 6
+
+// Each cipher size is run until about this many bytes have been processed
+#define CIPHER_BYTES_TOTAL (64 * 1024 * 1024)
+#define TLV_ITERATIONS 200000
+
+struct bench_handshake
+{
+  const char *name;
+  int nsteps;
+  double *total; // Per iteration, in seconds
+  double step[STEPS_MAX]; // Sum over all iterations
+};
+
+static uint8_t pairing_public_key[32];
+static char pairing_device_id[PAIR_AP_DEVICE_ID_LEN_MAX];
+
+
+/* --------------------------------- HELPERS -------------------------------- */
+
+static double
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+double_cmp(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void
+handshake_report(struct bench_handshake *hs, int iterations)
+{
+  double sum = 0;
+  int i;
+
+  for (i = 0; i < iterations; i++)
+    sum += hs->total[i];
+
+  qsort(hs->total, iterations, sizeof(double), double_cmp);
+
+  printf("%-22s %8.1f/s   p50 %7.3f ms   p99 %7.3f ms\n", hs->name, iterations / sum,
+    hs->total[iterations / 2] * 1000, hs->total[(iterations * 99) / 100] * 1000);
+
+  for (i = 0; i < hs->nsteps; i++)
+    printf("  M%d %9.3f ms\n", i + 1, hs->step[i] * 1000 / iterations);
+}
+
+static int
+pairing_add_cb(uint8_t public_key[32], const char *device_id, void *cb_arg)
+{
+  memcpy(pairing_public_key, public_key, sizeof(pairing_public_key));
+  snprintf(pairing_device_id, sizeof(pairing_device_id), "%s", device_id);
+  return 0;
+}
+
+static int
+pairing_get_cb(uint8_t public_key[32], const char *device_id, void *cb_arg)
+{
+  if (strcmp(device_id, pairing_device_id) != 0)
+    return -1;
+
+  memcpy(public_key, pairing_public_key, sizeof(pairing_public_key));
+  return 0;
+}
+
+
+/* ------------------------------- HANDSHAKES ------------------------------- */
+
+// Timings of the steps are given by the message that the step produces, so
+// e.g. M2 is the server reading M1 and writing M2. The last step includes the
+// client reading the final message.
+static int
+setup_run(double *step, enum pair_type type, char **client_setup_keys)
+{
+  struct pair_setup_context *cctx;
+  struct pair_setup_context *sctx;
+  const char *keys;
+  uint8_t *msg[STEPS_MAX] = { NULL };
+  size_t len[STEPS_MAX];
+  int nsteps = (type == PAIR_CLIENT_HOMEKIT_TRANSIENT) ? 4 : 6;
+  double start;
+  int ret = -1;
+  int i;
+
+  cctx = pair_setup_new(type, PIN, NULL, NULL, CLIENT_DEVICE_ID);
+  sctx = pair_setup_new(PAIR_SERVER_HOMEKIT, PIN, pairing_add_cb, NULL, SERVER_DEVICE_ID);
+  if (!cctx || !sctx)
+    goto out;
+
+  for (i = 0; i < nsteps; i++)
+    {
+      start = now();
+
+      switch (i)
+	{
+	  case 0:
+	    msg[i] = pair_setup_request1(&len[i], cctx);
+	    break;
+	  case 2:
+	    if (pair_setup_response1(cctx, msg[i - 1], len[i - 1]) == 0)
+	      msg[i] = pair_setup_request2(&len[i], cctx);
+	    break;
+	  case 4:
+	    if (pair_setup_response2(cctx, msg[i - 1], len[i - 1]) == 0)
+	      msg[i] = pair_setup_request3(&len[i], cctx);
+	    break;
+	  default:
+	    if (pair_setup(&msg[i], &len[i], sctx, msg[i - 1], len[i - 1]) < 0)
+	      msg[i] = NULL;
+	}
+
+      if (!msg[i])
+	goto out;
+
+      if (i == 3 && nsteps == 4 && pair_setup_response2(cctx, msg[i], len[i]) < 0)
+	goto out;
+      if (i == 5 && pair_setup_response3(cctx, msg[i], len[i]) < 0)
+	goto out;
+
+      step[i] += now() - start;
+    }
+
+  if (pair_setup_result(client_setup_keys ? &keys : NULL, NULL, cctx) < 0)
+    goto out;
+
+  if (client_setup_keys)
+    *client_setup_keys = strdup(keys);
+
+  ret = 0;
+
+ out:
+  if (ret < 0)
+    printf("Setup failed: %s / %s\n", cctx ? pair_setup_errmsg(cctx) : "-", sctx ? pair_setup_errmsg(sctx) : "-");
+  for (i = 0; i < nsteps; i++)
+    free(msg[i]);
+  pair_setup_free(cctx);
+  pair_setup_free(sctx);
+  return ret;
+}
+
+static int
+verify_run(double *step, const char *client_setup_keys)
+{
+  struct pair_verify_context *cctx;
+  struct pair_verify_context *sctx;
+  uint8_t *msg[4] = { NULL };
+  size_t len[4];
+  double start;
+  int ret = -1;
+  int i;
+
+  cctx = pair_verify_new(PAIR_CLIENT_HOMEKIT_NORMAL, client_setup_keys, NULL, NULL, CLIENT_DEVICE_ID);
+  sctx = pair_verify_new(PAIR_SERVER_HOMEKIT, NULL, pairing_get_cb, NULL, SERVER_DEVICE_ID);
+  if (!cctx || !sctx)
+    goto out;
+
+  for (i = 0; i < 4; i++)
+    {
+      start = now();
+
+      switch (i)
+	{
+	  case 0:
+	    msg[i] = pair_verify_request1(&len[i], cctx);
+	    break;
+	  case 2:
+	    if (pair_verify_response1(cctx, msg[i - 1], len[i - 1]) == 0)
+	      msg[i] = pair_verify_request2(&len[i], cctx);
+	    break;
+	  default:
+	    if (pair_verify(&msg[i], &len[i], sctx, msg[i - 1], len[i - 1]) < 0)
+	      msg[i] = NULL;
+	}
+
+      if (!msg[i])
+	goto out;
+
+      if (i == 3 && pair_verify_response2(cctx, msg[i], len[i]) < 0)
+	goto out;
+
+      step[i] += now() - start;
+    }
+
+  if (pair_verify_result(NULL, cctx) < 0 || pair_verify_result(NULL, sctx) < 0)
+    goto out;
+
+  ret = 0;
+
+ out:
+  if (ret < 0)
+    printf("Verify failed: %s / %s\n", cctx ? pair_verify_errmsg(cctx) : "-", sctx ? pair_verify_errmsg(sctx) : "-");
+  for (i = 0; i < 4; i++)
+    free(msg[i]);
+  pair_verify_free(cctx);
+  pair_verify_free(sctx);
+  return ret;
+}
+
+static int
+bench_handshakes(int iterations)
+{
+  struct bench_handshake hs[] = {
+    { .name = "pair-setup normal", .nsteps = 6 },
+    { .name = "pair-setup transient", .nsteps = 4 },
+    { .name = "pair-verify", .nsteps = 4 },
+  };
+  char *keys = NULL;
+  double start;
+  int ret;
+  int i;
+  int j;
+
+  for (i = 0; i < sizeof(hs) / sizeof(hs[0]); i++)
+    hs[i].total = calloc(iterations, sizeof(double));
+
+  for (j = 0; j < iterations; j++)
+    {
+      start = now();
+      free(keys);
+      keys = NULL;
+      ret = setup_run(hs[0].step, PAIR_CLIENT_HOMEKIT_NORMAL, &keys);
+      hs[0].total[j] = now() - start;
+      if (ret < 0)
+	goto error;
+
+      start = now();
+      ret = setup_run(hs[1].step, PAIR_CLIENT_HOMEKIT_TRANSIENT, NULL);
+      hs[1].total[j] = now() - start;
+      if (ret < 0)
+	goto error;
+
+      start = now();
+      ret = verify_run(hs[2].step, keys);
+      hs[2].total[j] = now() - start;
+      if (ret < 0)
+	goto error;
+    }
+
+  for (i = 0; i < sizeof(hs) / sizeof(hs[0]); i++)
+    handshake_report(&hs[i], iterations);
+
+  ret = 0;
+
+ error:
+  for (i = 0; i < sizeof(hs) / sizeof(hs[0]); i++)
+    free(hs[i].total);
+  free(keys);
+  return ret;
+}
+
+
+/* --------------------------------- CIPHER --------------------------------- */
+
+static int
+bench_cipher(void)
+{
+  size_t sizes[] = { 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576, 4194304 };
+  struct pair_cipher_context *cctx;
+  struct pair_cipher_context *sctx;
+  uint8_t shared_secret[32];
+  uint8_t *plain;
+  uint8_t *encrypted;
+  uint8_t *decrypted;
+  size_t encrypted_len;
+  size_t decrypted_len;
+  double encrypt_time;
+  double decrypt_time;
+  double start;
+  int iterations;
+  int ret = -1;
+  int i;
+  int j;
+
+  for (i = 0; i < sizeof(shared_secret); i++)
+    shared_secret[i] = i;
+
+  cctx = pair_cipher_new(PAIR_CLIENT_HOMEKIT_NORMAL, 0, shared_secret, sizeof(shared_secret));
+  sctx = pair_cipher_new(PAIR_SERVER_HOMEKIT, 2, shared_secret, sizeof(shared_secret)); // Server side of control channel 0
+  plain = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+  if (!cctx || !sctx || !plain)
+    goto out;
+
+  memset(plain, 0x5a, sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+
+  printf("%-10s %14s %14s\n", "payload", "encrypt MB/s", "decrypt MB/s");
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+      iterations = CIPHER_BYTES_TOTAL / sizes[i];
+      encrypt_time = 0;
+      decrypt_time = 0;
+
+      // Client encrypts, server decrypts, so the nonces stay in step
+      for (j = 0; j < iterations; j++)
+	{
+	  start = now();
+	  if (pair_encrypt(&encrypted, &encrypted_len, plain, sizes[i], cctx) != sizes[i])
+	    {
+	      printf("Encryption failed: %s\n", pair_cipher_errmsg(cctx));
+	      goto out;
+	    }
+	  encrypt_time += now() - start;
+
+	  start = now();
+	  if (pair_decrypt(&decrypted, &decrypted_len, encrypted, encrypted_len, sctx) != encrypted_len)
+	    {
+	      printf("Decryption failed: %s\n", pair_cipher_errmsg(sctx));
+	      free(encrypted);
+	      goto out;
+	    }
+	  decrypt_time += now() - start;
+
+	  free(encrypted);
+	  free(decrypted);
+	}
+
+      printf("%-10zu %14.1f %14.1f\n", sizes[i],
+	(double)sizes[i] * iterations / encrypt_time / 1e6, (double)sizes[i] * iterations / decrypt_time / 1e6);
+    }
+
+  ret = 0;
+
+ out:
+  free(plain);
+  pair_cipher_free(cctx);
+  pair_cipher_free(sctx);
+  return ret;
+}
+
+
+/* ----------------------------------- TLV ---------------------------------- */
+
+static void
+tlv_result_print(const char *name, double elapsed)
+{
+  printf("%-24s %12.0f/s\n", name, TLV_ITERATIONS / elapsed);
+}
+
+// A message like setup M3, which has the largest items. Each way of writing and
+// reading it is measured, the legacy API first.
+static int
+bench_tlv(void)
+{
+  pair_tlv_values_t *tlv;
+  pair_tlv_arena_t *arena;
+  pair_tlv_writer_t writer;
+  uint8_t state = 3;
+  uint8_t public_key[384];
+  uint8_t proof[64];
+  uint8_t buffer[1024];
+  const uint8_t *value;
+  size_t value_len;
+  size_t len;
+  double start;
+  int i;
+
+  memset(public_key, 0x11, sizeof(public_key));
+  memset(proof, 0x22, sizeof(proof));
+
+  start = now();
+  for (i = 0; i < TLV_ITERATIONS; i++)
+    {
+      tlv = pair_tlv_new();
+      pair_tlv_add_value(tlv, TLVType_State, &state, sizeof(state));
+      pair_tlv_add_value(tlv, TLVType_PublicKey, public_key, sizeof(public_key));
+      pair_tlv_add_value(tlv, TLVType_Proof, proof, sizeof(proof));
+
+      len = sizeof(buffer);
+      if (pair_tlv_format(tlv, buffer, &len) < 0)
+	{
+	  printf("TLV format failed\n");
+	  pair_tlv_free(tlv);
+	  return -1;
+	}
+      pair_tlv_free(tlv);
+    }
+  tlv_result_print("format (legacy)", now() - start);
+
+  start = now();
+  for (i = 0; i < TLV_ITERATIONS; i++)
+    {
+      pair_tlv_writer_init(&writer, buffer, sizeof(buffer));
+      pair_tlv_writer_add(&writer, TLVType_State, &state, sizeof(state));
+      pair_tlv_writer_add(&writer, TLVType_PublicKey, public_key, sizeof(public_key));
+      pair_tlv_writer_add(&writer, TLVType_Proof, proof, sizeof(proof));
+
+      if (!pair_tlv_writer_finish(&writer, &len))
+	{
+	  printf("TLV writer failed\n");
+	  return -1;
+	}
+    }
+  tlv_result_print("writer", now() - start);
+
+  start = now();
+  for (i = 0; i < TLV_ITERATIONS; i++)
+    {
+      tlv = pair_tlv_new();
+      if (pair_tlv_parse(buffer, len, tlv) < 0 || !pair_tlv_get_value(tlv, TLVType_PublicKey))
+	{
+	  printf("TLV parse failed\n");
+	  pair_tlv_free(tlv);
+	  return -1;
+	}
+      pair_tlv_free(tlv);
+    }
+  tlv_result_print("parse (legacy)", now() - start);
+
+  start = now();
+  for (i = 0; i < TLV_ITERATIONS; i++)
+    {
+      arena = pair_tlv_arena_parse_view(buffer, len);
+      if (!arena || !pair_tlv_arena_get(arena, TLVType_PublicKey))
+	{
+	  printf("TLV parse view failed\n");
+	  pair_tlv_arena_free(arena);
+	  return -1;
+	}
+      pair_tlv_arena_free(arena);
+    }
+  tlv_result_print("parse view", now() - start);
+
+  start = now();
+  for (i = 0; i < TLV_ITERATIONS; i++)
+    {
+      if (pair_tlv_peek(buffer, len, TLVType_State, &value, &value_len) != 0 || value_len != sizeof(state))
+	{
+	  printf("TLV peek failed\n");
+	  return -1;
+	}
+    }
+  tlv_result_print("peek state", now() - start);
+
+  printf("(%zu byte message)\n", len);
+
+  return 0;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  int iterations = ITERATIONS_DEFAULT;
+
+  if (argc > 2)
+    {
+      printf("%s [handshake iterations]\n", argv[0]);
+      return -1;
+    }
+
+  if (argc == 2)
+    iterations = atoi(argv[1]);
+
+  if (iterations < 1)
+    {
+      printf("Bad number of iterations\n");
+      return -1;
+    }
+
+// libgcrypt requires that the application initializes the library
+#ifdef CONFIG_GCRYPT
+  if (!gcry_check_version(NULL))
+    {
+      printf("libgcrypt not initialized\n");
+      return -1;
+    }
+  gcry_control(GCRYCTL_DISABLE_SECMEM, 0);
+  gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+#endif
+
+  printf("Backend: %s, %d handshake iterations\n\n", BACKEND, iterations);
+
+  if (bench_handshakes(iterations) < 0)
+    return -1;
+
+  printf("\n");
+  if (bench_cipher() < 0)
+    return -1;
+
+  printf("\n");
+  if (bench_tlv() < 0)
+    return -1;
+
+  return 0;
+}
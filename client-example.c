@@ -8,6 +8,7 @@
 
 #include "evrtsp/evrtsp.h"
 #include "pair.h"
+#include "pair-engine.h"
 
 #ifdef CONFIG_GCRYPT
 # include <gcrypt.h>
@@ -24,6 +25,8 @@
 #define ENDPOINT_SETUP_HOMEKIT "/pair-setup"
 #define CONTENTTYPE_SETUP_HOMEKIT "application/octet-stream"
 
+#define ENGINE_ACTIVE_MAX 8 // Devices paired at the same time with "many"
+
 
 typedef void (*request_cb)(struct evrtsp_request *, void *);
 
@@ -37,9 +40,16 @@ static const char *content_type_setup;
 static enum pair_type pair_type;
 
 static struct pair_cipher_context *cipher_ctx;
+static struct pair_decrypt_stream *decrypt_stream;
 static struct pair_verify_context *verify_ctx;
 static struct pair_setup_context *setup_ctx;
 
+// The connections and cipher contexts that the engine hands over, they are
+// freed when the event loop has stopped
+static struct evrtsp_connection **engine_evcons;
+static struct pair_cipher_context **engine_cipher_ctxs;
+static int engine_npaired;
+
 
 static char *
 prompt_pin(void)
@@ -167,33 +177,89 @@ options_request(void)
 }
 
 static void
-rtsp_cipher(struct evbuffer *evbuf, void *arg, int encrypt)
+rtsp_cipher(struct evbuffer *out, struct evbuffer *in, void *arg, int encrypt)
 {
-  uint8_t *out = NULL;
-  size_t out_len = 0;
+  struct evbuffer_iovec in_iov[8];
+  struct evbuffer_iovec out_iov;
+  uint8_t *ciphertext;
+  size_t ciphertext_len;
+  const uint8_t *chunk;
+  size_t chunk_len;
+  size_t plain_len;
   ssize_t processed;
+  size_t drain_len;
+  int nframes;
+  int n;
+  int i;
 
-  uint8_t *in = evbuffer_pullup(evbuf, -1);
-  size_t in_len = evbuffer_get_length(evbuf);
-
+  // The request that was just queued, as one block
   if (encrypt)
-    processed = pair_encrypt(&out, &out_len, in, in_len, cipher_ctx);
-  else
-    processed = pair_decrypt(&out, &out_len, in, in_len, cipher_ctx);
-
-  evbuffer_drain(evbuf, in_len);
-
-  if (processed < 0)
     {
-      printf("Error while ciphering: %s\n", pair_cipher_errmsg(cipher_ctx));
+      processed = pair_encrypt(&ciphertext, &ciphertext_len, evbuffer_pullup(in, -1), evbuffer_get_length(in), cipher_ctx);
+      evbuffer_drain(in, evbuffer_get_length(in));
+      if (processed < 0)
+	{
+	  printf("Error while encrypting: %s\n", pair_cipher_errmsg(cipher_ctx));
+	  return;
+	}
+
+      evbuffer_add(out, ciphertext, ciphertext_len);
+      free(ciphertext);
       return;
     }
-  else if (processed != in_len)
+
+  // What was just read, decrypted chunk by chunk. An incomplete block at the
+  // end is kept by the stream and completed by the next read, so all of the
+  // input can be drained.
+  while (evbuffer_get_length(in) > 0)
     {
-      printf("Partial ciphering, only %zd of %zu input bytes were processed\n", processed, in_len);
+      drain_len = 0;
+      n = evbuffer_peek(in, -1, NULL, in_iov, sizeof(in_iov)/sizeof(in_iov[0]));
+      if (n > sizeof(in_iov)/sizeof(in_iov[0]))
+	n = sizeof(in_iov)/sizeof(in_iov[0]);
+
+      for (i = 0; i < n; i++)
+	{
+	  chunk = in_iov[i].iov_base;
+	  chunk_len = in_iov[i].iov_len;
+
+	  while (chunk_len > 0)
+	    {
+	      // Plaintext is never longer than the ciphertext + a buffered block
+	      if (evbuffer_reserve_space(out, chunk_len + 1024, &out_iov, 1) != 1)
+		{
+		  printf("Error reserving space for decryption\n");
+		  goto error;
+		}
+
+	      plain_len = out_iov.iov_len;
+	      processed = pair_decrypt_stream_process(out_iov.iov_base, &plain_len, &nframes, chunk, chunk_len, decrypt_stream);
+	      if (processed < 0)
+		{
+		  printf("Error while decrypting: %s\n", pair_cipher_errmsg(cipher_ctx));
+		  goto error;
+		}
+
+	      out_iov.iov_len = plain_len;
+	      evbuffer_commit_space(out, &out_iov, 1);
+
+	      chunk += processed;
+	      chunk_len -= processed;
+	    }
+
+	  drain_len += in_iov[i].iov_len;
+	}
+
+      evbuffer_drain(in, drain_len);
     }
 
-  evbuffer_add(evbuf, out, out_len);
+  return;
+
+  // The stream can't get back in sync after an error, so drop what is left and
+  // stop, instead of failing on the same bytes with every read
+ error:
+  evbuffer_drain(in, evbuffer_get_length(in));
+  event_base_loopbreak(evbase);
 }
 
 static void
@@ -221,6 +287,10 @@ verify_step2_response(struct evrtsp_request *req, void *arg)
   if (!cipher_ctx)
     goto error;
 
+  decrypt_stream = pair_decrypt_stream_new(cipher_ctx);
+  if (!decrypt_stream)
+    goto error;
+
   evrtsp_connection_set_ciphercb(evcon, rtsp_cipher, NULL);
 
   ret = options_request();
@@ -234,7 +304,10 @@ verify_step2_response(struct evrtsp_request *req, void *arg)
  error:
   printf("Error: %s\n", pair_verify_errmsg(verify_ctx));
   pair_verify_free(verify_ctx);
+  pair_decrypt_stream_free(decrypt_stream);
   pair_cipher_free(cipher_ctx);
+  decrypt_stream = NULL;
+  cipher_ctx = NULL;
   event_base_loopbreak(evbase);
 }
 
@@ -392,6 +465,10 @@ setup_step2_response(struct evrtsp_request *req, void *arg)
       if (!cipher_ctx)
 	goto error;
 
+      decrypt_stream = pair_decrypt_stream_new(cipher_ctx);
+      if (!decrypt_stream)
+	goto error;
+
       evrtsp_connection_set_ciphercb(evcon, rtsp_cipher, NULL);
 
       ret = options_request();
@@ -523,36 +600,128 @@ setup_start_request(void)
 }
 
 
+static void
+engine_done_cb(struct pair_engine_result *result, const struct pair_engine_device *device, void *cb_arg)
+{
+  struct pair_engine *engine = cb_arg;
+
+  if (result->ret < 0)
+    {
+      printf("%s:%hu failed after %d attempt(s): %s\n", device->address, device->port, result->attempts, result->errmsg);
+    }
+  else
+    {
+      printf("%s:%hu paired after %d attempt(s)\n", device->address, device->port, result->attempts);
+
+      // This is called from a callback of the connection, so it can't be freed
+      // here
+      engine_evcons[engine_npaired] = result->evcon;
+      engine_cipher_ctxs[engine_npaired] = result->cipher_ctx;
+      engine_npaired++;
+    }
+
+  if (pair_engine_count(engine) == 0)
+    event_base_loopbreak(evbase);
+}
+
+// Pairs with all the devices in addresses ("ip_address:port") at the same time.
+// credentials is either the client setup keys, "pin=<pin>" or "-" (transient)
+static int
+engine_run(const char *credentials, char **addresses, int naddresses)
+{
+  struct pair_engine *engine;
+  struct pair_engine_device device = { 0 };
+  char *address;
+  char *port;
+  int ret = -1;
+  int i;
+
+  engine_evcons = calloc(naddresses, sizeof(struct evrtsp_connection *));
+  engine_cipher_ctxs = calloc(naddresses, sizeof(struct pair_cipher_context *));
+  engine = pair_engine_new(evbase, ENGINE_ACTIVE_MAX, DEVICE_ID);
+  if (!engine_evcons || !engine_cipher_ctxs || !engine)
+    goto out;
+
+  device.type = pair_type;
+  if (strncmp(credentials, "pin=", 4) == 0)
+    device.pin = credentials + 4;
+  else if (strcmp(credentials, "-") != 0)
+    device.client_setup_keys = credentials;
+
+  for (i = 0; i < naddresses; i++)
+    {
+      address = strdup(addresses[i]);
+      port = strrchr(address, ':');
+      if (!port)
+	{
+	  printf("Address %s has no port\n", address);
+	  free(address);
+	  goto out;
+	}
+
+      *port = '\0';
+      device.address = address;
+      device.port = atoi(port + 1);
+
+      ret = pair_engine_add(engine, &device, engine_done_cb, engine);
+      free(address);
+      if (ret < 0)
+	{
+	  printf("Could not add %s\n", addresses[i]);
+	  goto out;
+	}
+    }
+
+  event_base_dispatch(evbase);
+
+  printf("Paired with %d of %d device(s)\n", engine_npaired, naddresses);
+  ret = (engine_npaired == naddresses) ? 0 : -1;
+
+ out:
+  pair_engine_free(engine);
+  for (i = 0; i < engine_npaired; i++)
+    {
+      evrtsp_connection_free(engine_evcons[i]);
+      pair_cipher_free(engine_cipher_ctxs[i]);
+    }
+  free(engine_evcons);
+  free(engine_cipher_ctxs);
+  return ret;
+}
+
 int
 main( int argc, char * argv[] )
 {
   int ret;
+  int many = (argc >= 5 && strcmp(argv[1], "many") == 0);
 
-  if (argc < 4 || argc > 5)
+  if (!many && (argc < 4 || argc > 5))
     {
       printf("%s ip_address port homekit|fruit|transient [skip_pin]\n", argv[0]);
+      printf("%s many homekit|fruit|transient client_setup_keys|pin=<pin>|- ip_address:port [ip_address:port ...]\n", argv[0]);
       return -1;
     }
 
   const char *address = argv[1];
   const char *port = argv[2];
+  const char *type = many ? argv[2] : argv[3];
   int skip_pin = (argc == 5);
 
-  if (strcmp(argv[3], "fruit") == 0)
+  if (strcmp(type, "fruit") == 0)
     {
       printf("Pair type is fruit\n");
       pair_type = PAIR_CLIENT_FRUIT;
       endpoint_setup = ENDPOINT_SETUP_FRUIT;
       content_type_setup = CONTENTTYPE_SETUP_FRUIT;
     }
-  else if (strcmp(argv[3], "homekit") == 0)
+  else if (strcmp(type, "homekit") == 0)
     {
       printf("Pair type is homekit (normal)\n");
       pair_type = PAIR_CLIENT_HOMEKIT_NORMAL;
       endpoint_setup = ENDPOINT_SETUP_HOMEKIT;
       content_type_setup = CONTENTTYPE_SETUP_HOMEKIT;
     }
-  else if (strcmp(argv[3], "transient") == 0)
+  else if (strcmp(type, "transient") == 0)
     {
       printf("Pair type is homekit (transient)\n");
       pair_type = PAIR_CLIENT_HOMEKIT_TRANSIENT;
@@ -572,6 +741,14 @@ main( int argc, char * argv[] )
 #endif
 
   evbase = event_base_new();
+
+  if (many)
+    {
+      ret = engine_run(argv[3], argv + 4, argc - 4);
+      event_base_free(evbase);
+      return ret;
+    }
+
   evcon = evrtsp_connection_new(address, atoi(port));
   evrtsp_connection_set_base(evcon, evbase);
 
@@ -590,6 +767,8 @@ main( int argc, char * argv[] )
 
  the_end:
   evrtsp_connection_free(evcon);
+  pair_decrypt_stream_free(decrypt_stream);
+  pair_cipher_free(cipher_ctx);
   event_base_free(evbase);
 
   return 0;
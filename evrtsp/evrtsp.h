@@ -133,9 +133,24 @@ void evrtsp_connection_free(struct evrtsp_connection *evcon);
 void evrtsp_connection_set_closecb(struct evrtsp_connection *evcon,
     void (*)(struct evrtsp_connection *, void *), void *);
 
-/** Set a callback for encryption/decryption. */
+/**
+ * Set a callback for encryption/decryption. The callback gets only the data
+ * that was just read or queued in the second buffer, and must drain what it
+ * deciphers from there and add the result to the first buffer. Data left in
+ * the second buffer is given again with the next data.
+ */
 void evrtsp_connection_set_ciphercb(struct evrtsp_connection *evcon,
-    void (*)(struct evbuffer *, void *, int encrypt), void *);
+    void (*)(struct evbuffer *out, struct evbuffer *in, void *, int encrypt),
+    void *);
+
+/**
+ * Opt-in pipelining: up to depth queued requests are written back to back,
+ * without waiting for the responses, and the responses are matched to the
+ * requests by CSeq. Requests made while the responses are being read are
+ * written when they have all been read. Depth 0 or 1 disables.
+ */
+void evrtsp_connection_set_pipeline(struct evrtsp_connection *evcon,
+    int depth);
 
 /**
  * Associates an event base with the connection - can only be called
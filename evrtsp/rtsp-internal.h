@@ -61,6 +61,8 @@ struct evrtsp_connection {
 	struct event close_ev;
 	struct evbuffer *input_buffer;
 	struct evbuffer *output_buffer;
+	struct evbuffer *cipher_input;	/* read, not yet deciphered */
+	struct evbuffer *cipher_output;	/* queued, not yet ciphered */
 	
 	char *bind_address;		/* address to use for binding the src */
 	u_short bind_port;		/* local port for binding the src */
@@ -77,6 +79,9 @@ struct evrtsp_connection {
 	enum evrtsp_connection_state state;
 	int cseq;
 
+	int pipeline_depth;		/* max requests in flight, 0/1 for one */
+	int inflight;			/* written requests at head of queue */
+
 	TAILQ_HEAD(evcon_requestq, evrtsp_request) requests;
 	
 	void (*cb)(struct evrtsp_connection *, void *);
@@ -85,7 +90,8 @@ struct evrtsp_connection {
 	void (*closecb)(struct evrtsp_connection *, void *);
 	void *closecb_arg;
 
-	void (*ciphercb)(struct evbuffer *evbuf, void *, int encrypt);
+	void (*ciphercb)(struct evbuffer *out, struct evbuffer *in, void *,
+	    int encrypt);
 	void *ciphercb_arg;
 
 	struct event_base *base;
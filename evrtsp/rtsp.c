@@ -187,6 +187,7 @@ static void evrtsp_connection_start_detectclose(
 static void evrtsp_connection_stop_detectclose(
 	struct evrtsp_connection *evcon);
 static void evrtsp_request_dispatch(struct evrtsp_connection* evcon);
+static void evrtsp_pipeline_fill(struct evrtsp_connection *evcon);
 static void evrtsp_read_firstline(struct evrtsp_connection *evcon,
 				  struct evrtsp_request *req);
 static void evrtsp_read_header(struct evrtsp_connection *evcon,
@@ -326,14 +327,13 @@ evrtsp_connected(struct evrtsp_connection *evcon)
  * Create the headers needed for an RTSP request
  */
 static void
-evrtsp_make_header_request(struct evrtsp_connection *evcon,
-    struct evrtsp_request *req)
+evrtsp_make_header_request(struct evbuffer *buf, struct evrtsp_request *req)
 {
 	const char *method;
 
 	/* Generate request line */
 	method = evrtsp_method(req->type);
-	evbuffer_add_printf(evcon->output_buffer, "%s %s RTSP/%d.%d\r\n",
+	evbuffer_add_printf(buf, "%s %s RTSP/%d.%d\r\n",
 	    method, req->uri, req->major, req->minor);
 
 	/* Content-Length is mandatory, absent means 0 */
@@ -347,24 +347,30 @@ evrtsp_make_header_request(struct evrtsp_connection *evcon,
 	  }
 }
 
-void
-evrtsp_make_header(struct evrtsp_connection *evcon, struct evrtsp_request *req)
+static void
+evrtsp_make_header_buffer(struct evbuffer *buf, struct evrtsp_request *req)
 {
 	struct evkeyval *header;
 
-	evrtsp_make_header_request(evcon, req);
+	evrtsp_make_header_request(buf, req);
 
 	TAILQ_FOREACH(header, req->output_headers, next) {
-		evbuffer_add_printf(evcon->output_buffer, "%s: %s\r\n",
+		evbuffer_add_printf(buf, "%s: %s\r\n",
 		    header->key, header->value);
 	}
-	evbuffer_add(evcon->output_buffer, "\r\n", 2);
+	evbuffer_add(buf, "\r\n", 2);
 
 	if (evbuffer_get_length(req->output_buffer) > 0) {
-		evbuffer_add_buffer(evcon->output_buffer, req->output_buffer);
+		evbuffer_add_buffer(buf, req->output_buffer);
 	}
 }
 
+void
+evrtsp_make_header(struct evrtsp_connection *evcon, struct evrtsp_request *req)
+{
+	evrtsp_make_header_buffer(evcon->output_buffer, req);
+}
+
 /* Separated host, port and file from URI */
 
 int /* FIXME: needed? */
@@ -428,17 +434,21 @@ void
 evrtsp_connection_fail(struct evrtsp_connection *evcon,
     enum evrtsp_connection_error error)
 {
-	struct evrtsp_request* req = TAILQ_FIRST(&evcon->requests);
+	struct evcon_requestq failed;
+	struct evrtsp_request* req;
 	void (*cb)(struct evrtsp_request *, void *);
 	void *cb_arg;
-	assert(req != NULL);
-
-	/* save the callback for later; the cb might free our object */
-	cb = req->cb;
-	cb_arg = req->cb_arg;
+	int n;
+	assert(TAILQ_FIRST(&evcon->requests) != NULL);
 
-	TAILQ_REMOVE(&evcon->requests, req, next);
-	evrtsp_request_free(req);
+	/* pipelined requests that were written fail with the connection */
+	TAILQ_INIT(&failed);
+	n = evcon->inflight;
+	do {
+		req = TAILQ_FIRST(&evcon->requests);
+		TAILQ_REMOVE(&evcon->requests, req, next);
+		TAILQ_INSERT_TAIL(&failed, req, next);
+	} while (--n > 0 && TAILQ_FIRST(&evcon->requests) != NULL);
 
 	/* xxx: maybe we should fail all requests??? */
 
@@ -449,9 +459,18 @@ evrtsp_connection_fail(struct evrtsp_connection *evcon,
 	if (TAILQ_FIRST(&evcon->requests) != NULL)
 		evrtsp_connection_connect(evcon);
 
-	/* inform the user */
-	if (cb != NULL)
-		(*cb)(NULL, cb_arg);
+	/* inform the users */
+	while ((req = TAILQ_FIRST(&failed)) != NULL) {
+		/* save the callback for later; the cb might free our object */
+		cb = req->cb;
+		cb_arg = req->cb_arg;
+
+		TAILQ_REMOVE(&failed, req, next);
+		evrtsp_request_free(req);
+
+		if (cb != NULL)
+			(*cb)(NULL, cb_arg);
+	}
 }
 
 void
@@ -504,6 +523,24 @@ evrtsp_connection_done(struct evrtsp_connection *evcon)
 	TAILQ_REMOVE(&evcon->requests, req, next);
 	req->evcon = NULL;
 
+	if (evcon->inflight > 1 && evcon->state != EVCON_DISCONNECTED) {
+		/*
+		 * More pipelined responses to read. Some of them may
+		 * already be in the input buffer, so wake up the reader
+		 * to parse those once the user has been notified.
+		 */
+		evcon->inflight--;
+		evrtsp_start_read(evcon);
+		if (evbuffer_get_length(evcon->input_buffer) > 0)
+			event_active(&evcon->ev, EV_READ, 1);
+
+		(*req->cb)(req, req->cb_arg);
+
+		evrtsp_request_free(req);
+		return;
+	}
+
+	evcon->inflight = 0;
 	evcon->state = EVCON_IDLE;
 
 	if (TAILQ_FIRST(&evcon->requests) != NULL) {
@@ -560,10 +597,9 @@ evrtsp_read_body(struct evrtsp_connection *evcon, struct evrtsp_request *req)
 		/* Read until connection close. */
 		evbuffer_add_buffer(req->input_buffer, buf);
 	} else if (evbuffer_get_length(buf) >= req->ntoread) {
-		/* Completed content length */
-		evbuffer_add(req->input_buffer, evbuffer_pullup(buf,-1),
+		/* Completed content length, moved without copying */
+		evbuffer_remove_buffer(buf, req->input_buffer,
 		    (size_t)req->ntoread);
-		evbuffer_drain(buf, (size_t)req->ntoread);
 		req->ntoread = 0;
 		evrtsp_connection_done(evcon);
 		return;
@@ -588,6 +624,10 @@ evrtsp_read(int fd, short what, void *arg)
 	struct evbuffer *buf = evcon->input_buffer;
 	int n;
 
+	/* Encrypted data is read aside and deciphered into the input buffer */
+	if (evcon->ciphercb)
+		buf = evcon->cipher_input;
+
 	if (what == EV_TIMEOUT) {
 		event_warn("%s: read timeout", __func__);
 		evrtsp_connection_fail(evcon, EVCON_RTSP_TIMEOUT);
@@ -600,12 +640,21 @@ evrtsp_read(int fd, short what, void *arg)
 		if (errno != EINTR && errno != EAGAIN) {
 			event_warn("%s: evbuffer_read", __func__);
 			evrtsp_connection_fail(evcon, EVCON_RTSP_EOF);
-		} else {
+			return;
+		} else if (evcon->inflight == 0 ||
+		    evbuffer_get_length(evcon->input_buffer) == 0) {
 			evrtsp_add_event(&evcon->ev, evcon->timeout,
 			    RTSP_READ_TIMEOUT);	       
+			return;
 		}
-		return;
+		/* woken up to parse pipelined responses already read */
 	} else if (n == 0) {
+		/* Connection closed, with pipelined responses missing */
+		if (evcon->inflight > 1) {
+			evrtsp_connection_fail(evcon, EVCON_RTSP_EOF);
+			return;
+		}
+
 		/* Connection closed */
 		evcon->state = EVCON_DISCONNECTED;
 		evrtsp_connection_done(evcon);
@@ -613,7 +662,8 @@ evrtsp_read(int fd, short what, void *arg)
 	}
 
 	if (evcon->ciphercb)
-		evcon->ciphercb(evcon->input_buffer, evcon->ciphercb_arg, 0);
+		evcon->ciphercb(evcon->input_buffer, evcon->cipher_input,
+		    evcon->ciphercb_arg, 0);
 
 	switch (evcon->state) {
 	case EVCON_READING_FIRSTLINE:
@@ -697,9 +747,118 @@ evrtsp_connection_free(struct evrtsp_connection *evcon)
 	if (evcon->output_buffer != NULL)
 		evbuffer_free(evcon->output_buffer);
 
+	if (evcon->cipher_input != NULL)
+		evbuffer_free(evcon->cipher_input);
+
+	if (evcon->cipher_output != NULL)
+		evbuffer_free(evcon->cipher_output);
+
 	free(evcon);
 }
 
+static void
+evrtsp_request_output(struct evrtsp_connection *evcon,
+    struct evrtsp_request *req)
+{
+	/*
+	 * Create the header from the store arguments. forked-daapd
+	 * customisation for encryption: the request is put together in
+	 * cipher_output, so the callback only gets the bytes just queued.
+	 */
+	if (evcon->ciphercb) {
+		evrtsp_make_header_buffer(evcon->cipher_output, req);
+		evcon->ciphercb(evcon->output_buffer, evcon->cipher_output,
+		    evcon->ciphercb_arg, 1);
+	} else
+		evrtsp_make_header(evcon, req);
+}
+
+/*
+ * Queues the requests that are not written yet behind the ones in flight,
+ * until there are pipeline_depth of them. They are written back to back,
+ * and the responses are read in the state machine one after the other.
+ */
+static void
+evrtsp_pipeline_fill(struct evrtsp_connection *evcon)
+{
+	struct evrtsp_request *req;
+	int i = 0;
+
+	TAILQ_FOREACH(req, &evcon->requests, next) {
+		if (i++ < evcon->inflight)
+			continue;
+		if (evcon->inflight >= evcon->pipeline_depth)
+			break;
+
+		evrtsp_request_output(evcon, req);
+
+		req->kind = EVRTSP_RESPONSE;
+		evcon->inflight++;
+	}
+}
+
+/*
+ * Servers should answer pipelined requests in order, but match the response
+ * to the request with the same CSeq. If it isn't the first, the parsed status
+ * line and headers are moved to that request, which then becomes the first.
+ */
+static struct evrtsp_request *
+evrtsp_pipeline_match(struct evrtsp_connection *evcon,
+    struct evrtsp_request *req)
+{
+	struct evrtsp_request *match;
+	struct evkeyvalq *headers;
+	const char *cseq;
+	const char *req_cseq;
+	char *line;
+	int code;
+	char major, minor;
+	int i = 0;
+
+	cseq = evrtsp_find_header(req->input_headers, "CSeq");
+	if (cseq == NULL)
+		return (req);
+
+	TAILQ_FOREACH(match, &evcon->requests, next) {
+		if (i++ == evcon->inflight) {
+			event_warnx("%s: response with unknown CSeq %s",
+			    __func__, cseq);
+			return (NULL);
+		}
+
+		req_cseq = evrtsp_find_header(match->output_headers, "CSeq");
+		if (req_cseq != NULL && strcmp(req_cseq, cseq) == 0)
+			break;
+	}
+
+	if (match == NULL || match == req)
+		return (req);
+
+	headers = match->input_headers;
+	match->input_headers = req->input_headers;
+	req->input_headers = headers;
+
+	line = match->response_code_line;
+	match->response_code_line = req->response_code_line;
+	req->response_code_line = line;
+
+	code = match->response_code;
+	match->response_code = req->response_code;
+	req->response_code = code;
+
+	major = match->major;
+	minor = match->minor;
+	match->major = req->major;
+	match->minor = req->minor;
+	req->major = major;
+	req->minor = minor;
+
+	TAILQ_REMOVE(&evcon->requests, match, next);
+	TAILQ_INSERT_HEAD(&evcon->requests, match, next);
+
+	return (match);
+}
+
 static void
 evrtsp_request_dispatch(struct evrtsp_connection* evcon)
 {
@@ -717,12 +876,10 @@ evrtsp_request_dispatch(struct evrtsp_connection* evcon)
 
 	evcon->state = EVCON_WRITING;
 
-	/* Create the header from the store arguments */
-	evrtsp_make_header(evcon, req);
-
-	/* forked-daapd customisation for encryption */
-	if (evcon->ciphercb)
-		evcon->ciphercb(evcon->output_buffer, evcon->ciphercb_arg, 1);
+	if (evcon->pipeline_depth > 1)
+		evrtsp_pipeline_fill(evcon);
+	else
+		evrtsp_request_output(evcon, req);
 
 	evrtsp_write_buffer(evcon, evrtsp_write_connectioncb, NULL);
 }
@@ -743,11 +900,16 @@ evrtsp_connection_reset(struct evrtsp_connection *evcon)
 		evcon->fd = -1;
 	}
 	evcon->state = EVCON_DISCONNECTED;
+	evcon->inflight = 0;
 
 	evbuffer_drain(evcon->input_buffer,
 	    evbuffer_get_length(evcon->input_buffer));
 	evbuffer_drain(evcon->output_buffer,
 	    evbuffer_get_length(evcon->output_buffer));
+	evbuffer_drain(evcon->cipher_input,
+	    evbuffer_get_length(evcon->cipher_input));
+	evbuffer_drain(evcon->cipher_output,
+	    evbuffer_get_length(evcon->cipher_output));
 }
 
 static void
@@ -1196,6 +1358,14 @@ evrtsp_read_header(struct evrtsp_connection *evcon, struct evrtsp_request *req)
 	/* Done reading headers, do the real work */
 	switch (req->kind) {
 	case EVRTSP_RESPONSE:
+	  if (evcon->inflight > 1) {
+	    req = evrtsp_pipeline_match(evcon, req);
+	    if (req == NULL) {
+	      evrtsp_connection_fail(evcon, EVCON_RTSP_INVALID_HEADER);
+	      break;
+	    }
+	  }
+
 	  event_debug(("%s: start of read body on %d",
 		       __func__, fd));
 	  evrtsp_get_body(evcon, req);
@@ -1276,6 +1446,16 @@ evrtsp_connection_new(const char *address, unsigned short port)
 		event_warn("%s: evbuffer_new failed", __func__);
 		goto error;
 	}
+
+	if ((evcon->cipher_input = evbuffer_new()) == NULL) {
+		event_warn("%s: evbuffer_new failed", __func__);
+		goto error;
+	}
+
+	if ((evcon->cipher_output = evbuffer_new()) == NULL) {
+		event_warn("%s: evbuffer_new failed", __func__);
+		goto error;
+	}
 	
 	evcon->state = EVCON_DISCONNECTED;
 	TAILQ_INIT(&evcon->requests);
@@ -1313,12 +1493,19 @@ evrtsp_connection_set_closecb(struct evrtsp_connection *evcon,
 
 void
 evrtsp_connection_set_ciphercb(struct evrtsp_connection *evcon,
-    void (*cb)(struct evbuffer *, void *, int encrypt), void *cbarg)
+    void (*cb)(struct evbuffer *, struct evbuffer *, void *, int encrypt),
+    void *cbarg)
 {
 	evcon->ciphercb = cb;
 	evcon->ciphercb_arg = cbarg;
 }
 
+void
+evrtsp_connection_set_pipeline(struct evrtsp_connection *evcon, int depth)
+{
+	evcon->pipeline_depth = depth;
+}
+
 void
 evrtsp_connection_get_local_address(struct evrtsp_connection *evcon,
     char **address, u_short *port, int *family)
@@ -1454,6 +1641,9 @@ event_debug(("%s: TEST", __func__));
 	 */
 	if (TAILQ_FIRST(&evcon->requests) == req)
 		evrtsp_request_dispatch(evcon);
+	else if (evcon->pipeline_depth > 1 && evcon->state == EVCON_WRITING)
+		/* Still writing, so we can join the pipelined requests */
+		evrtsp_pipeline_fill(evcon);
 
 	return (0);
 }
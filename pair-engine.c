@@ -0,0 +1,673 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <sys/queue.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+#include "pair-engine.h"
+#include "pair-tlv.h"
+
+#define ENGINE_USER_AGENT "AirPlay/381.13"
+
+#define ENGINE_ENDPOINT_SETUP_FRUIT "/pair-setup-pin"
+#define ENGINE_CONTENTTYPE_SETUP_FRUIT "application/x-apple-binary-plist"
+#define ENGINE_ENDPOINT_SETUP_HOMEKIT "/pair-setup"
+#define ENGINE_CONTENTTYPE_SETUP_HOMEKIT "application/octet-stream"
+#define ENGINE_ENDPOINT_VERIFY "/pair-verify"
+#define ENGINE_CONTENTTYPE_VERIFY "application/octet-stream"
+
+#define ENGINE_TIMEOUT_DEFAULT 10
+#define ENGINE_RETRIES_DEFAULT 2
+#define ENGINE_RETRY_DELAY_DEFAULT 5
+
+enum engine_job_state
+{
+  JOB_QUEUED,
+  JOB_RUNNING,
+  JOB_FAILED,
+  JOB_WAITING,
+};
+
+enum engine_job_step
+{
+  STEP_SETUP1,
+  STEP_SETUP2,
+  STEP_SETUP3,
+  STEP_VERIFY1,
+  STEP_VERIFY2,
+};
+
+struct engine_job
+{
+  struct pair_engine *engine;
+
+  struct pair_engine_device device;
+  pair_engine_cb cb;
+  void *cb_arg;
+
+  enum engine_job_state state;
+  enum engine_job_step step;
+  int attempts;
+  int cseq;
+
+  // Why the last attempt failed, and if and when to try again
+  const char *errmsg;
+  bool is_retryable;
+  int retry_delay;
+
+  char *client_setup_keys;
+  struct evrtsp_connection *evcon;
+  struct pair_setup_context *setup_ctx;
+  struct pair_verify_context *verify_ctx;
+
+  // Attempt timeout, deferred failure handling and retry delay
+  struct event *timer;
+
+  TAILQ_ENTRY(engine_job) entry;
+  TAILQ_ENTRY(engine_job) queue_entry;
+};
+
+struct pair_engine
+{
+  struct event_base *evbase;
+  char *device_id;
+
+  int max_active;
+  int active;
+
+  int timeout;
+  int max_retries;
+  int retry_delay;
+
+  TAILQ_HEAD(, engine_job) jobs;
+  TAILQ_HEAD(, engine_job) queue;
+};
+
+static void
+engine_schedule(struct pair_engine *engine);
+
+
+/* ---------------------------------- JOBS ---------------------------------- */
+
+static void
+job_free(struct engine_job *job)
+{
+  if (!job)
+    return;
+
+  if (job->timer)
+    event_free(job->timer);
+  if (job->evcon)
+    evrtsp_connection_free(job->evcon);
+
+  pair_setup_free(job->setup_ctx);
+  pair_verify_free(job->verify_ctx);
+
+  free(job->client_setup_keys);
+  free((char *)job->device.address);
+  free((char *)job->device.client_setup_keys);
+  free((char *)job->device.pin);
+  free(job);
+}
+
+static bool
+job_is_homekit(struct engine_job *job)
+{
+  return (job->device.type == PAIR_CLIENT_HOMEKIT_NORMAL || job->device.type == PAIR_CLIENT_HOMEKIT_TRANSIENT);
+}
+
+// Failures are handled from the timer, so that the connection isn't freed from
+// inside one of its own callbacks
+static void
+job_fail(struct engine_job *job, const char *errmsg, bool is_retryable, int retry_delay)
+{
+  struct timeval tv = { 0, 0 };
+
+  job->state = JOB_FAILED;
+  job->errmsg = errmsg;
+  job->is_retryable = is_retryable;
+  job->retry_delay = retry_delay;
+
+  evtimer_add(job->timer, &tv);
+}
+
+// Looks for a TLV error in a homekit response to decide whether the device
+// should be tried again, and when
+static void
+job_fail_response(struct engine_job *job, const char *errmsg, const uint8_t *data, size_t len)
+{
+  const uint8_t *value;
+  size_t size;
+  uint32_t retry_delay = 0;
+  int i;
+
+  if (!job_is_homekit(job) || pair_tlv_peek(data, len, TLVType_Error, &value, &size) != 0 || size != 1)
+    {
+      job_fail(job, errmsg, false, 0);
+      return;
+    }
+
+  switch (value[0])
+    {
+      case TLVError_Backoff:
+	if (pair_tlv_peek(data, len, TLVType_RetryDelay, &value, &size) == 0 && size <= sizeof(retry_delay))
+	  {
+	    for (i = 0; i < size; i++)
+	      retry_delay |= (uint32_t)value[i] << (8 * i); // Little endian
+	  }
+	job_fail(job, errmsg, true, (retry_delay > INT_MAX) ? INT_MAX : retry_delay);
+	break;
+      case TLVError_Unknown:
+      case TLVError_MaxPeers:
+      case TLVError_Busy:
+	job_fail(job, errmsg, true, 0);
+	break;
+      default:
+	job_fail(job, errmsg, false, 0);
+    }
+}
+
+static void
+job_response_cb(struct evrtsp_request *req, void *arg);
+
+static int
+job_request(struct engine_job *job, const char *url, const uint8_t *data, size_t len, const char *content_type)
+{
+  struct evrtsp_request *req;
+  char buffer[16];
+
+  req = evrtsp_request_new(job_response_cb, job);
+  if (!req)
+    return -1;
+
+  evbuffer_add(req->output_buffer, data, len);
+  evrtsp_add_header(req->output_headers, "Content-Type", content_type);
+
+  job->cseq++;
+  snprintf(buffer, sizeof(buffer), "%d", job->cseq);
+  evrtsp_add_header(req->output_headers, "CSeq", buffer);
+
+  evrtsp_add_header(req->output_headers, "User-Agent", ENGINE_USER_AGENT);
+
+  if (job->device.type == PAIR_CLIENT_HOMEKIT_NORMAL)
+    evrtsp_add_header(req->output_headers, "X-Apple-HKP", "3");
+  else if (job->device.type == PAIR_CLIENT_HOMEKIT_TRANSIENT)
+    evrtsp_add_header(req->output_headers, "X-Apple-HKP", "4");
+
+  return evrtsp_make_request(job->evcon, req, EVRTSP_REQ_POST, url);
+}
+
+static int
+job_step_request(struct engine_job *job)
+{
+  const char *endpoint;
+  const char *content_type;
+  uint8_t *data;
+  size_t len;
+  int ret;
+
+  if (job->device.type == PAIR_CLIENT_FRUIT)
+    {
+      endpoint = ENGINE_ENDPOINT_SETUP_FRUIT;
+      content_type = ENGINE_CONTENTTYPE_SETUP_FRUIT;
+    }
+  else
+    {
+      endpoint = ENGINE_ENDPOINT_SETUP_HOMEKIT;
+      content_type = ENGINE_CONTENTTYPE_SETUP_HOMEKIT;
+    }
+
+  switch (job->step)
+    {
+      case STEP_SETUP1:
+	data = pair_setup_request1(&len, job->setup_ctx);
+	break;
+      case STEP_SETUP2:
+	data = pair_setup_request2(&len, job->setup_ctx);
+	break;
+      case STEP_SETUP3:
+	data = pair_setup_request3(&len, job->setup_ctx);
+	break;
+      case STEP_VERIFY1:
+	data = pair_verify_request1(&len, job->verify_ctx);
+	endpoint = ENGINE_ENDPOINT_VERIFY;
+	content_type = ENGINE_CONTENTTYPE_VERIFY;
+	break;
+      case STEP_VERIFY2:
+	data = pair_verify_request2(&len, job->verify_ctx);
+	endpoint = ENGINE_ENDPOINT_VERIFY;
+	content_type = ENGINE_CONTENTTYPE_VERIFY;
+	break;
+      default:
+	data = NULL;
+    }
+
+  if (!data)
+    {
+      job->errmsg = job->setup_ctx ? pair_setup_errmsg(job->setup_ctx) : pair_verify_errmsg(job->verify_ctx);
+      return -1;
+    }
+
+  ret = job_request(job, endpoint, data, len, content_type);
+  free(data);
+  if (ret < 0)
+    {
+      job->errmsg = "Could not make request to device";
+      return -1;
+    }
+
+  return 0;
+}
+
+static void
+job_complete(struct engine_job *job, struct pair_result *result)
+{
+  struct pair_engine *engine = job->engine;
+  struct pair_engine_result res = { 0 };
+
+  // Fruit pairing only gives a shared secret, there is no cipher for it
+  if (job_is_homekit(job))
+    {
+      res.cipher_ctx = pair_cipher_new(job->device.type, 0, result->shared_secret, result->shared_secret_len);
+      if (!res.cipher_ctx)
+	{
+	  job_fail(job, "Could not create cipher context", false, 0);
+	  return;
+	}
+    }
+
+  res.attempts = job->attempts;
+  res.result = result;
+  res.client_setup_keys = job->client_setup_keys;
+  res.evcon = job->evcon;
+
+  evtimer_del(job->timer);
+  TAILQ_REMOVE(&engine->jobs, job, entry);
+  engine->active--;
+
+  job->cb(&res, &job->device, job->cb_arg);
+
+  job->evcon = NULL; // Now owned by the callback
+  job_free(job);
+
+  engine_schedule(engine);
+}
+
+static void
+job_response_cb(struct evrtsp_request *req, void *arg)
+{
+  struct engine_job *job = arg;
+  struct pair_result *result;
+  const char *keys;
+  uint8_t *data;
+  size_t len;
+  int ret;
+
+  // No request or no response code if the connection failed
+  if (!req || req->response_code == 0)
+    {
+      job_fail(job, "No response from device", true, 0);
+      return;
+    }
+
+  if (req->response_code != RTSP_OK)
+    {
+      job_fail(job, "Device returned an error code", req->response_code != RTSP_UNAUTHORIZED && req->response_code != RTSP_FORBIDDEN, 0);
+      return;
+    }
+
+  data = evbuffer_pullup(req->input_buffer, -1);
+  len = evbuffer_get_length(req->input_buffer);
+
+  switch (job->step)
+    {
+      case STEP_SETUP1:
+	ret = pair_setup_response1(job->setup_ctx, data, len);
+	break;
+      case STEP_SETUP2:
+	ret = pair_setup_response2(job->setup_ctx, data, len);
+	break;
+      case STEP_SETUP3:
+	ret = pair_setup_response3(job->setup_ctx, data, len);
+	break;
+      case STEP_VERIFY1:
+	ret = pair_verify_response1(job->verify_ctx, data, len);
+	break;
+      case STEP_VERIFY2:
+	ret = pair_verify_response2(job->verify_ctx, data, len);
+	break;
+      default:
+	ret = -1;
+    }
+
+  if (ret < 0)
+    {
+      job_fail_response(job, job->setup_ctx ? pair_setup_errmsg(job->setup_ctx) : pair_verify_errmsg(job->verify_ctx), data, len);
+      return;
+    }
+
+  switch (job->step)
+    {
+      case STEP_SETUP1:
+	job->step = STEP_SETUP2;
+	break;
+      case STEP_SETUP2:
+	if (job->device.type == PAIR_CLIENT_HOMEKIT_TRANSIENT)
+	  {
+	    if (pair_setup_result(NULL, &result, job->setup_ctx) < 0)
+	      goto setup_error;
+
+	    job_complete(job, result);
+	    return;
+	  }
+	job->step = STEP_SETUP3;
+	break;
+      case STEP_SETUP3:
+	if (pair_setup_result(&keys, NULL, job->setup_ctx) < 0)
+	  goto setup_error;
+
+	// Verify with the keys we just got, the setup context can go
+	job->client_setup_keys = strdup(keys);
+	job->verify_ctx = pair_verify_new(job->device.type, job->client_setup_keys, NULL, NULL, job->engine->device_id);
+	if (!job->verify_ctx)
+	  {
+	    job_fail(job, "Could not create verification context", false, 0);
+	    return;
+	  }
+
+	pair_setup_free(job->setup_ctx);
+	job->setup_ctx = NULL;
+	job->step = STEP_VERIFY1;
+	break;
+      case STEP_VERIFY1:
+	// A resumed session is complete after the first step
+	if (pair_verify_result(&result, job->verify_ctx) == 0)
+	  {
+	    job_complete(job, result);
+	    return;
+	  }
+	job->step = STEP_VERIFY2;
+	break;
+      case STEP_VERIFY2:
+	if (pair_verify_result(&result, job->verify_ctx) < 0)
+	  {
+	    job_fail(job, pair_verify_errmsg(job->verify_ctx), false, 0);
+	    return;
+	  }
+
+	job_complete(job, result);
+	return;
+    }
+
+  if (job_step_request(job) < 0)
+    job_fail(job, job->errmsg, false, 0);
+
+  return;
+
+ setup_error:
+  job_fail(job, pair_setup_errmsg(job->setup_ctx), false, 0);
+}
+
+static void
+job_start(struct engine_job *job)
+{
+  struct pair_engine *engine = job->engine;
+  struct timeval tv = { engine->timeout, 0 };
+
+  job->state = JOB_RUNNING;
+  job->attempts++;
+  job->cseq = 0;
+  engine->active++;
+
+  evtimer_add(job->timer, &tv);
+
+  job->evcon = evrtsp_connection_new(job->device.address, job->device.port);
+  if (!job->evcon)
+    {
+      job_fail(job, "Could not create connection", false, 0);
+      return;
+    }
+
+  evrtsp_connection_set_base(job->evcon, engine->evbase);
+
+  // Pair-verify with the keys given by the user or from an earlier setup
+  if (job->client_setup_keys || job->device.client_setup_keys)
+    {
+      job->verify_ctx = pair_verify_new(job->device.type, job->client_setup_keys ? job->client_setup_keys : job->device.client_setup_keys, NULL, NULL, engine->device_id);
+      job->step = STEP_VERIFY1;
+    }
+  else
+    {
+      job->setup_ctx = pair_setup_new(job->device.type, job->device.pin, NULL, NULL, engine->device_id);
+      job->step = STEP_SETUP1;
+    }
+
+  if (!job->verify_ctx && !job->setup_ctx)
+    {
+      job_fail(job, "Could not create pairing context", false, 0);
+      return;
+    }
+
+  if (job_step_request(job) < 0)
+    job_fail(job, job->errmsg, true, 0);
+}
+
+// Ends an attempt that failed or timed out, and either retries it later or
+// reports the failure
+static void
+job_attempt_end(struct engine_job *job)
+{
+  struct pair_engine *engine = job->engine;
+  struct pair_engine_result res = { 0 };
+  struct timeval tv = { 0, 0 };
+
+  if (job->evcon)
+    evrtsp_connection_free(job->evcon);
+  pair_setup_free(job->setup_ctx);
+  pair_verify_free(job->verify_ctx);
+  job->evcon = NULL;
+  job->setup_ctx = NULL;
+  job->verify_ctx = NULL;
+
+  engine->active--;
+
+  if (job->is_retryable && job->attempts <= engine->max_retries)
+    {
+      tv.tv_sec = job->retry_delay > 0 ? job->retry_delay : engine->retry_delay;
+      job->state = JOB_WAITING;
+      evtimer_add(job->timer, &tv);
+      return;
+    }
+
+  res.ret = -1;
+  res.errmsg = job->errmsg;
+  res.attempts = job->attempts;
+
+  TAILQ_REMOVE(&engine->jobs, job, entry);
+
+  job->cb(&res, &job->device, job->cb_arg);
+
+  job_free(job);
+}
+
+static void
+job_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+  struct engine_job *job = arg;
+  struct pair_engine *engine = job->engine;
+
+  switch (job->state)
+    {
+      case JOB_RUNNING:
+	job->errmsg = "Timeout waiting for device";
+	job->is_retryable = true;
+	job->retry_delay = 0;
+	job_attempt_end(job);
+	break;
+      case JOB_FAILED:
+	job_attempt_end(job);
+	break;
+      case JOB_WAITING:
+	job->state = JOB_QUEUED;
+	TAILQ_INSERT_TAIL(&engine->queue, job, queue_entry);
+	break;
+      case JOB_QUEUED:
+	break;
+    }
+
+  engine_schedule(engine);
+}
+
+
+/* --------------------------------- ENGINE --------------------------------- */
+
+static void
+engine_schedule(struct pair_engine *engine)
+{
+  struct engine_job *job;
+
+  while (engine->active < engine->max_active && (job = TAILQ_FIRST(&engine->queue)))
+    {
+      TAILQ_REMOVE(&engine->queue, job, queue_entry);
+      job_start(job);
+    }
+}
+
+struct pair_engine *
+pair_engine_new(struct event_base *evbase, int max_active, const char *device_id)
+{
+  struct pair_engine *engine;
+
+  if (!evbase || max_active < 1 || !device_id)
+    return NULL;
+
+  engine = calloc(1, sizeof(struct pair_engine));
+  if (!engine)
+    return NULL;
+
+  engine->device_id = strdup(device_id);
+  if (!engine->device_id)
+    {
+      free(engine);
+      return NULL;
+    }
+
+  engine->evbase = evbase;
+  engine->max_active = max_active;
+  engine->timeout = ENGINE_TIMEOUT_DEFAULT;
+  engine->max_retries = ENGINE_RETRIES_DEFAULT;
+  engine->retry_delay = ENGINE_RETRY_DELAY_DEFAULT;
+
+  TAILQ_INIT(&engine->jobs);
+  TAILQ_INIT(&engine->queue);
+
+  return engine;
+}
+
+void
+pair_engine_free(struct pair_engine *engine)
+{
+  struct engine_job *job;
+
+  if (!engine)
+    return;
+
+  while ((job = TAILQ_FIRST(&engine->jobs)))
+    {
+      TAILQ_REMOVE(&engine->jobs, job, entry);
+      job_free(job);
+    }
+
+  free(engine->device_id);
+  free(engine);
+}
+
+void
+pair_engine_set_retry(struct pair_engine *engine, int timeout_secs, int max_retries, int retry_delay_secs)
+{
+  engine->timeout = timeout_secs;
+  engine->max_retries = max_retries;
+  engine->retry_delay = retry_delay_secs;
+}
+
+int
+pair_engine_add(struct pair_engine *engine, const struct pair_engine_device *device, pair_engine_cb cb, void *cb_arg)
+{
+  struct engine_job *job;
+
+  if (device->type != PAIR_CLIENT_FRUIT && device->type != PAIR_CLIENT_HOMEKIT_NORMAL && device->type != PAIR_CLIENT_HOMEKIT_TRANSIENT)
+    return -1;
+
+  if (!device->address || !cb)
+    return -1;
+
+  job = calloc(1, sizeof(struct engine_job));
+  if (!job)
+    return -1;
+
+  job->engine = engine;
+  job->cb = cb;
+  job->cb_arg = cb_arg;
+  job->device.type = device->type;
+  job->device.port = device->port;
+  job->device.address = strdup(device->address);
+  if (device->client_setup_keys)
+    job->device.client_setup_keys = strdup(device->client_setup_keys);
+  if (device->pin)
+    job->device.pin = strdup(device->pin);
+
+  job->timer = evtimer_new(engine->evbase, job_timer_cb, job);
+
+  if (!job->device.address || !job->timer || (device->client_setup_keys && !job->device.client_setup_keys) || (device->pin && !job->device.pin))
+    {
+      job_free(job);
+      return -1;
+    }
+
+  job->state = JOB_QUEUED;
+  TAILQ_INSERT_TAIL(&engine->jobs, job, entry);
+  TAILQ_INSERT_TAIL(&engine->queue, job, queue_entry);
+
+  engine_schedule(engine);
+
+  return 0;
+}
+
+int
+pair_engine_count(struct pair_engine *engine)
+{
+  struct engine_job *job;
+  int count = 0;
+
+  TAILQ_FOREACH(job, &engine->jobs, entry)
+    count++;
+
+  return count;
+}
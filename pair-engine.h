@@ -0,0 +1,86 @@
+#ifndef __PAIR_AP_ENGINE_H__
+#define __PAIR_AP_ENGINE_H__
+
+#include <event2/event.h>
+
+#include "pair.h"
+#include "evrtsp/evrtsp.h"
+
+/* Client side engine that pairs with many devices at once on one event loop.
+ * Each device gets its own evrtsp connection, over which the engine runs the
+ * pair-setup and/or pair-verify steps, with at most max_active devices being
+ * paired at the same time. The others wait in a queue.
+ *
+ * If an attempt fails because the connection failed or timed out, or because
+ * the device told us it is busy or to back off, the device is retried after a
+ * delay. With TLVError_Backoff the delay is the TLVType_RetryDelay the device
+ * gave, otherwise the one set with pair_engine_set_retry(). Authentication
+ * errors are not retried.
+ *
+ * Usage:
+ *   engine = pair_engine_new(evbase, 8, DEVICE_ID);
+ *   pair_engine_add(engine, &device, done_cb, cb_arg); // For each device
+ *   event_base_dispatch(evbase);
+ */
+struct pair_engine;
+
+struct pair_engine_device
+{
+  const char *address;
+  unsigned short port;
+  enum pair_type type; // PAIR_CLIENT_FRUIT or PAIR_CLIENT_HOMEKIT_*
+
+  // If set the engine only does pair-verify, otherwise it first does a
+  // pair-setup with the pin (which must be known, the engine doesn't make a
+  // /pair-pin-start request). Transient pairing only does pair-setup.
+  const char *client_setup_keys;
+  const char *pin;
+};
+
+struct pair_engine_result
+{
+  int ret; // 0 if the pairing completed, otherwise -1
+  const char *errmsg;
+  int attempts;
+
+  // Only set if ret is 0. The result and the keys from pair-setup (NULL if
+  // there was no setup) are only valid during the callback. The callback
+  // takes ownership of the cipher context and of the connection, which has no
+  // cipher callback set yet. With PAIR_CLIENT_FRUIT there is no cipher context
+  // (cipher_ctx is NULL), only the shared secret in the result.
+  struct pair_result *result;
+  const char *client_setup_keys;
+  struct pair_cipher_context *cipher_ctx;
+  struct evrtsp_connection *evcon;
+};
+
+typedef void (*pair_engine_cb)(struct pair_engine_result *result, const struct pair_engine_device *device, void *cb_arg);
+
+struct pair_engine *
+pair_engine_new(struct event_base *evbase, int max_active, const char *device_id);
+
+/* Devices that are being paired or waiting are dropped without callbacks
+ */
+void
+pair_engine_free(struct pair_engine *engine);
+
+/* timeout_secs is the time an attempt may take, max_retries the number of
+ * retries after the first attempt, and retry_delay_secs the delay before a
+ * retry when the device didn't ask for a specific delay. The defaults are 10,
+ * 2 and 5.
+ */
+void
+pair_engine_set_retry(struct pair_engine *engine, int timeout_secs, int max_retries, int retry_delay_secs);
+
+/* The strings in device are copied. cb is called when the device is paired or
+ * has failed for the last time. Returns -1 if the pair type isn't a client type.
+ */
+int
+pair_engine_add(struct pair_engine *engine, const struct pair_engine_device *device, pair_engine_cb cb, void *cb_arg);
+
+/* Number of devices that are being paired or waiting for it
+ */
+int
+pair_engine_count(struct pair_engine *engine);
+
+#endif  /* !__PAIR_AP_ENGINE_H__ */
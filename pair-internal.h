@@ -61,7 +61,9 @@ struct pair_server_setup_context
 
   bool is_transient;
 
-  uint8_t *pkA;
+  // Copied from the client's request 2, which is checked against these sizes,
+  // so they don't need separate allocations
+  uint8_t pkA[384]; // Max with the 3072 bit group
   uint64_t pkA_len;
 
   uint8_t *pkB;
@@ -70,7 +72,7 @@ struct pair_server_setup_context
   uint8_t *b;
   int b_len;
 
-  uint8_t *M1;
+  uint8_t M1[64]; // SHA-512
   uint64_t M1_len;
 
   const uint8_t *M2;
@@ -98,6 +100,8 @@ struct pair_setup_context
   enum pair_status status;
   const char *errmsg;
 
+  struct pair_stats_handshake stats;
+
   struct pair_result result;
   char result_str[256]; // Holds the hex string version of the keys that pair_verify_new() needs
 
@@ -130,6 +134,11 @@ struct pair_client_verify_context
   uint8_t server_eph_public_key[crypto_box_PUBLICKEYBYTES]; // 32
 
   uint8_t shared_secret[crypto_scalarmult_BYTES]; // 32
+
+  // Set if request 1 asked for pair-resume of a cached session
+  bool resume_tried;
+  uint8_t resume_session_id[8];
+  uint8_t resume_shared_secret[crypto_scalarmult_BYTES]; // 32
 };
 
 struct pair_server_verify_context
@@ -151,6 +160,12 @@ struct pair_server_verify_context
   uint8_t client_eph_public_key[crypto_box_PUBLICKEYBYTES]; // 32
 
   uint8_t shared_secret[crypto_scalarmult_BYTES]; // 32
+
+  // Set if the client's pair-resume request was accepted, then response 1
+  // completes the verification with a new session ID
+  bool is_resume;
+  uint8_t resume_session_id[8];
+  uint8_t resume_key[32]; // For the auth tag of response 1
 };
 
 struct pair_verify_context
@@ -160,6 +175,8 @@ struct pair_verify_context
   enum pair_status status;
   const char *errmsg;
 
+  struct pair_stats_handshake stats;
+
   struct pair_result result;
 
   union pair_verify_union
@@ -169,6 +186,16 @@ struct pair_verify_context
   } vctx;
 };
 
+#if CONFIG_SODIUM_CHACHA
+typedef uint8_t *CipherCTX;
+#elif CONFIG_GCRYPT
+#include <gcrypt.h>
+typedef gcry_cipher_hd_t CipherCTX;
+#elif CONFIG_OPENSSL
+#include <openssl/evp.h>
+typedef EVP_CIPHER_CTX *CipherCTX;
+#endif
+
 struct pair_cipher_context
 {
   struct pair_definition *type;
@@ -176,6 +203,10 @@ struct pair_cipher_context
   uint8_t encryption_key[32];
   uint8_t decryption_key[32];
 
+  // Keyed once when the context is created, then reused for every frame
+  CipherCTX encryption_ctx;
+  CipherCTX decryption_ctx;
+
   uint64_t encryption_counter;
   uint64_t decryption_counter;
 
@@ -183,9 +214,33 @@ struct pair_cipher_context
   uint64_t encryption_counter_prev;
   uint64_t decryption_counter_prev;
 
+  // Parallel encryption, see pair_cipher_parallel_set()
+  int parallel_jobs;
+  pair_executor_cb executor;
+  void *executor_arg;
+
+  struct pair_stats_cipher stats;
+
   const char *errmsg;
 };
 
+// Max size of a block: the 2 byte length, up to 0x400 bytes of ciphertext and
+// the 16 byte auth tag
+#define PAIR_BLOCK_LEN_MAX (2 + 0x400 + 16)
+
+struct pair_decrypt_stream
+{
+  struct pair_cipher_context *cctx;
+
+  // Incomplete block that was received in a previous call
+  uint8_t partial[PAIR_BLOCK_LEN_MAX];
+  size_t partial_len;
+
+  // For rollback
+  uint8_t partial_prev[PAIR_BLOCK_LEN_MAX];
+  size_t partial_len_prev;
+};
+
 struct pair_definition
 {
   int (*pair_setup_new)(struct pair_setup_context *sctx, const char *pin, pair_cb add_cb, void *cb_arg, const char *device_id);
@@ -201,6 +256,7 @@ struct pair_definition
   int (*pair_setup_response3)(struct pair_setup_context *sctx, const uint8_t *in, size_t in_len);
 
   int (*pair_verify_new)(struct pair_verify_context *vctx, const char *client_setup_keys, pair_cb cb, void *cb_arg, const char *device_id);
+  int (*pair_verify_new_with_keys)(struct pair_verify_context *vctx, const uint8_t *client_private_key, const uint8_t *server_public_key, const char *device_id);
   void (*pair_verify_free)(struct pair_verify_context *vctx);
   int (*pair_verify_result)(struct pair_verify_context *vctx);
 
@@ -215,13 +271,29 @@ struct pair_definition
   int (*pair_list)(uint8_t **out, size_t *out_len, pair_list_cb cb, void *cb_arg, const uint8_t *in, size_t in_len);
 
   struct pair_cipher_context *(*pair_cipher_new)(struct pair_definition *type, int channel, const uint8_t *shared_secret, size_t shared_secret_len);
+  int (*pair_cipher_new_multi)(struct pair_cipher_context **cctx, struct pair_definition *type, const int *channels, int nchannels, const uint8_t *shared_secret, size_t shared_secret_len);
   void (*pair_cipher_free)(struct pair_cipher_context *cctx);
 
   ssize_t (*pair_encrypt)(uint8_t **ciphertext, size_t *ciphertext_len, const uint8_t *plaintext, size_t plaintext_len, struct pair_cipher_context *cctx);
   ssize_t (*pair_decrypt)(uint8_t **plaintext, size_t *plaintext_len, const uint8_t *ciphertext, size_t ciphertext_len, struct pair_cipher_context *cctx);
+  ssize_t (*pair_encrypt_into)(uint8_t *ciphertext, size_t *ciphertext_len, const uint8_t *plaintext, size_t plaintext_len, struct pair_cipher_context *cctx);
+  ssize_t (*pair_decrypt_into)(uint8_t *plaintext, size_t *plaintext_len, const uint8_t *ciphertext, size_t ciphertext_len, struct pair_cipher_context *cctx);
+  ssize_t (*pair_decrypt_stream)(uint8_t *plaintext, size_t *plaintext_len, int *nframes, const uint8_t *ciphertext, size_t ciphertext_len, struct pair_decrypt_stream *stream);
+  ssize_t (*pair_encrypt_fanout)(uint8_t **ciphertext, size_t *ciphertext_len, const uint8_t *plaintext, size_t plaintext_len, struct pair_cipher_context **cctx, int ncctx, int njobs, pair_executor_cb executor, void *cb_arg);
+  ssize_t (*pair_encryptv)(uint8_t *ciphertext, size_t *ciphertext_len, const struct iovec *iov, int iovcnt, struct pair_cipher_context *cctx);
+  ssize_t (*pair_encrypted_len)(size_t plaintext_len);
+  ssize_t (*pair_decrypted_len)(const uint8_t *ciphertext, size_t ciphertext_len);
 
   int (*pair_state_get)(const char **errmsg, const uint8_t *in, size_t in_len);
   void (*pair_public_key_get)(uint8_t server_public_key[32], const char *device_id);
+
+  int (*pair_setup_verifier_cache)(int rotation_secs);
+  int (*pair_server_identity_set)(const char *device_id, const uint8_t *public_key, const uint8_t *private_key);
+
+  int (*pair_precompute_set)(int size);
+  int (*pair_precompute_fill)(int max);
+
+  int (*pair_verify_resume_cache)(int max_entries, int ttl_secs);
 };
 
 
@@ -231,6 +303,30 @@ bool
 is_initialized(void);
 
 
+/* ------------------------------- STATISTICS ------------------------------ */
+
+/* Returns a CLOCK_MONOTONIC timestamp in ns if statistics are on, otherwise 0,
+ * which makes stats_modexp_end() do nothing
+ */
+uint64_t
+stats_start(void);
+
+void
+stats_modexp_end(uint64_t start);
+
+void
+stats_decrypt_auth_failure(struct pair_cipher_context *cctx);
+
+
+/* -------------------------------- EXECUTOR ------------------------------- */
+
+/* Runs job(job_args[i]) for all njobs and returns when all are done. If
+ * executor is NULL the jobs run in threads started for the purpose.
+ */
+void
+executor_run(pair_executor_cb executor, void *cb_arg, pair_job_cb job, void **job_args, int njobs);
+
+
 /* -------------------- GCRYPT AND OPENSSL COMPABILITY --------------------- */
 /*                   partly borrowed from ffmpeg (rtmpdh.c)                  */
 
@@ -253,7 +349,9 @@ is_initialized(void);
 #define bnum_bn2bin(bn, buf, len)     gcry_mpi_print(GCRYMPI_FMT_USG, buf, len, NULL, bn)
 #define bnum_bin2bn(bn, buf, len)     gcry_mpi_scan(&bn, GCRYMPI_FMT_USG, buf, len, NULL)
 #define bnum_hex2bn(bn, buf)          gcry_mpi_scan(&bn, GCRYMPI_FMT_HEX, buf, 0, 0)
-#define bnum_random(bn, num_bits)     gcry_mpi_randomize(bn, num_bits, GCRY_WEAK_RANDOM)
+// Top bit set like BN_rand(bn, num_bits, 0, 0), so the number always has the
+// full length (e.g. the 16 byte salt)
+#define bnum_random(bn, num_bits)     do { gcry_mpi_randomize(bn, num_bits, GCRY_WEAK_RANDOM); gcry_mpi_set_bit(bn, num_bits - 1); } while (0)
 #define bnum_add(bn, a, b)            gcry_mpi_add(bn, a, b)
 #define bnum_sub(bn, a, b)            gcry_mpi_sub(bn, a, b)
 #define bnum_mul(bn, a, b)            gcry_mpi_mul(bn, a, b)
@@ -267,12 +365,25 @@ __attribute__((unused)) static void bnum_modadd(bnum bn, bnum a, bnum b, bnum m)
 {
   gcry_mpi_addm(bn, a, b, m);
 }
+// gcrypt handles temporaries internally and has no public Montgomery context,
+// so these are just dummies that make the code using them backend independent
+typedef int bnum_ctx;
+typedef int bnum_mont;
+#define bnum_ctx_new(ctx)             ctx = 1
+#define bnum_ctx_free(ctx)            (void)ctx
+#define bnum_mont_new(mont, m, ctx)   mont = 1
+#define bnum_mont_free(mont)          (void)mont
+#define bnum_mul_ctx(bn, a, b, ctx)   gcry_mpi_mul(bn, a, b)
+#define bnum_mod_ctx(bn, a, b, ctx)   gcry_mpi_mod(bn, a, b)
+#define bnum_modadd_ctx(bn, a, b, m, ctx)         gcry_mpi_addm(bn, a, b, m)
+#define bnum_modexp_mont(bn, y, q, p, mont, ctx)  gcry_mpi_powm(bn, y, q, p)
 #elif CONFIG_OPENSSL
 #include <openssl/crypto.h>
 #include <openssl/bn.h>
 #include <openssl/rand.h>
 #include <openssl/sha.h>
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
 #define bnum_new(bn)                  bn = BN_new()
 #define bnum_free(bn)                 BN_free(bn)
 #define bnum_num_bytes(bn)            BN_num_bytes(bn)
@@ -312,6 +423,25 @@ __attribute__((unused)) static void bnum_modadd(bnum bn, bnum a, bnum b, bnum m)
   BN_mod_add(bn, a, b, m, ctx);
   BN_CTX_free(ctx);
 }
+// Variants of the above where the caller keeps a BN_CTX for multiple
+// operations, and where modexp uses a cached Montgomery context for p
+typedef BN_CTX* bnum_ctx;
+typedef BN_MONT_CTX* bnum_mont;
+#define bnum_ctx_new(ctx)             ctx = BN_CTX_new()
+#define bnum_ctx_free(ctx)            BN_CTX_free(ctx)
+#define bnum_mont_new(mont, m, ctx)                       \
+    do {                                                  \
+        mont = BN_MONT_CTX_new();                         \
+        if (mont && !BN_MONT_CTX_set(mont, m, ctx)) {     \
+            BN_MONT_CTX_free(mont);                       \
+            mont = NULL;                                  \
+        }                                                 \
+    } while (0)
+#define bnum_mont_free(mont)          BN_MONT_CTX_free(mont)
+#define bnum_mul_ctx(bn, a, b, ctx)   BN_mul(bn, a, b, ctx)
+#define bnum_mod_ctx(bn, a, b, ctx)   BN_mod(bn, a, b, ctx)
+#define bnum_modadd_ctx(bn, a, b, m, ctx)         BN_mod_add(bn, a, b, m, ctx)
+#define bnum_modexp_mont(bn, y, q, p, mont, ctx)  BN_mod_exp_mont(bn, y, q, p, ctx, mont)
 #endif
 
 
@@ -379,6 +509,27 @@ void
 hash_num(enum hash_alg alg, const bnum n, unsigned char *dest);
 
 
+/* ---------------------- SRP FIXED-BASE EXPONENTIATION --------------------- */
+
+/* The SRP generator g is fixed per group, so g^x can be calculated from a
+ * table of precomputed powers of g (Lim-Lee comb), which takes only about a
+ * third of the multiplications of a normal modexp. A table has 2^6 entries of
+ * the size of N, so about 24 KB for the 3072 bit group. Compile with
+ * -DCONFIG_NO_SRP_FIXED_BASE to not build tables, e.g. on constrained devices.
+ */
+struct bnum_fixed_base;
+
+struct bnum_fixed_base *
+bnum_fixed_base_new(bnum g, bnum N, bnum_mont mont, int max_bits);
+void
+bnum_fixed_base_free(struct bnum_fixed_base *fb);
+
+/* Calculates result = g^exp mod N. Returns -1 if exp has more than the
+ * max_bits the table was made for, then use bnum_modexp_mont() instead.
+ */
+int
+bnum_fixed_base_modexp(bnum result, const bnum exp, struct bnum_fixed_base *fb, bnum_ctx ctx);
+
 /* ----------------------------- OTHER HELPERS -------------------------------*/
 
 #ifdef DEBUG_PAIR
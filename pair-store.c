@@ -0,0 +1,641 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pair-store.h"
+
+/* The file starts with STORE_MAGIC and then has fixed size records, each an
+ * add or a remove of a pairing. The records are in the order they were made,
+ * so replaying them gives the current pairings. A record that was only partly
+ * written (e.g. because of a crash) is truncated away when the file is loaded.
+ * Each record ends with a checksum of the rest of it, and records that are
+ * damaged are skipped, since that doesn't affect the records after them. They
+ * are dropped by the next compaction. Files from before the checksum was added
+ * (STORE_MAGIC_V1) are loaded and then rewritten in the current format.
+ *
+ *   op (1 byte) | device_id length (1 byte) | device_id (64 bytes) | public key (32 bytes) | checksum (4 bytes)
+ */
+#define STORE_MAGIC "PAIRSTR2"
+#define STORE_MAGIC_LEN 8
+#define STORE_CHECKSUM_LEN 4
+#define STORE_RECORD_LEN (2 + PAIR_AP_DEVICE_ID_LEN_MAX + 32 + STORE_CHECKSUM_LEN)
+#define STORE_MAGIC_V1 "PAIRSTR1"
+#define STORE_RECORD_LEN_V1 (STORE_RECORD_LEN - STORE_CHECKSUM_LEN)
+#define STORE_OP_ADD 'A'
+#define STORE_OP_REMOVE 'R'
+
+// Compact when the file has this many records and most of them are stale
+#define STORE_COMPACT_MIN 64
+
+#define STORE_BUCKETS_MIN 64
+
+struct pair_store_entry
+{
+  char device_id[PAIR_AP_DEVICE_ID_LEN_MAX];
+  uint8_t public_key[32];
+  uint32_t hash;
+
+  struct pair_store_entry *next;
+};
+
+struct pair_store
+{
+  pthread_rwlock_t lck;
+
+  struct pair_store_entry **buckets;
+  size_t nbuckets;
+  int count;
+
+  char *path;
+  int fd;
+  size_t nrecords; // Number of records in the file
+};
+
+
+/* ------------------------------ HASH TABLE -------------------------------- */
+
+// FNV-1a
+static uint32_t
+hash_get(const char *device_id)
+{
+  uint32_t hash = 2166136261u;
+
+  for (; *device_id; device_id++)
+    {
+      hash ^= (uint8_t)*device_id;
+      hash *= 16777619u;
+    }
+
+  return hash;
+}
+
+// Caller must hold store->lck
+static struct pair_store_entry **
+entry_find(struct pair_store *store, const char *device_id, uint32_t hash)
+{
+  struct pair_store_entry **prev;
+
+  for (prev = &store->buckets[hash % store->nbuckets]; *prev; prev = &(*prev)->next)
+    {
+      if ((*prev)->hash == hash && strcmp((*prev)->device_id, device_id) == 0)
+	break;
+    }
+
+  return prev;
+}
+
+static void
+buckets_grow(struct pair_store *store)
+{
+  struct pair_store_entry **buckets;
+  struct pair_store_entry *entry;
+  size_t nbuckets;
+  size_t i;
+
+  nbuckets = 2 * store->nbuckets;
+  buckets = calloc(nbuckets, sizeof(struct pair_store_entry *));
+  if (!buckets)
+    return; // Chains just get longer
+
+  for (i = 0; i < store->nbuckets; i++)
+    {
+      while ((entry = store->buckets[i]))
+	{
+	  store->buckets[i] = entry->next;
+	  entry->next = buckets[entry->hash % nbuckets];
+	  buckets[entry->hash % nbuckets] = entry;
+	}
+    }
+
+  free(store->buckets);
+  store->buckets = buckets;
+  store->nbuckets = nbuckets;
+}
+
+static int
+table_add(struct pair_store *store, const char *device_id, const uint8_t *public_key)
+{
+  struct pair_store_entry **prev;
+  struct pair_store_entry *entry;
+  uint32_t hash;
+
+  hash = hash_get(device_id);
+  prev = entry_find(store, device_id, hash);
+  if (*prev)
+    {
+      memcpy((*prev)->public_key, public_key, sizeof((*prev)->public_key));
+      return 0;
+    }
+
+  entry = calloc(1, sizeof(struct pair_store_entry));
+  if (!entry)
+    return -1;
+
+  snprintf(entry->device_id, sizeof(entry->device_id), "%s", device_id);
+  memcpy(entry->public_key, public_key, sizeof(entry->public_key));
+  entry->hash = hash;
+  *prev = entry;
+  store->count++;
+
+  if (store->count > store->nbuckets)
+    buckets_grow(store);
+
+  return 0;
+}
+
+static int
+table_remove(struct pair_store *store, const char *device_id)
+{
+  struct pair_store_entry **prev;
+  struct pair_store_entry *entry;
+
+  prev = entry_find(store, device_id, hash_get(device_id));
+  entry = *prev;
+  if (!entry)
+    return -1;
+
+  *prev = entry->next;
+  free(entry);
+  store->count--;
+
+  return 0;
+}
+
+
+/* --------------------------------- FILE ----------------------------------- */
+
+// FNV-1a of the record without the checksum, stored little endian at the end
+static uint32_t
+record_checksum(const uint8_t *record)
+{
+  uint32_t hash = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < STORE_RECORD_LEN - STORE_CHECKSUM_LEN; i++)
+    {
+      hash ^= record[i];
+      hash *= 16777619u;
+    }
+
+  return hash;
+}
+
+static void
+record_make(uint8_t *record, uint8_t op, const char *device_id, const uint8_t *public_key)
+{
+  size_t len = strlen(device_id);
+  uint32_t checksum;
+  int i;
+
+  memset(record, 0, STORE_RECORD_LEN);
+  record[0] = op;
+  record[1] = len;
+  memcpy(record + 2, device_id, len);
+  if (public_key)
+    memcpy(record + 2 + PAIR_AP_DEVICE_ID_LEN_MAX, public_key, 32);
+
+  checksum = record_checksum(record);
+  for (i = 0; i < STORE_CHECKSUM_LEN; i++)
+    record[STORE_RECORD_LEN - STORE_CHECKSUM_LEN + i] = checksum >> (8 * i);
+}
+
+static bool
+record_is_valid(const uint8_t *record, bool has_checksum)
+{
+  size_t len = record[1];
+  uint32_t checksum = 0;
+  int i;
+
+  for (i = 0; has_checksum && i < STORE_CHECKSUM_LEN; i++)
+    checksum |= (uint32_t)record[STORE_RECORD_LEN - STORE_CHECKSUM_LEN + i] << (8 * i);
+
+  if (has_checksum && checksum != record_checksum(record))
+    return false;
+
+  if (len == 0 || len >= PAIR_AP_DEVICE_ID_LEN_MAX || memchr(record + 2, '\0', len))
+    return false;
+
+  return (record[0] == STORE_OP_ADD || record[0] == STORE_OP_REMOVE);
+}
+
+// The record must be valid, only fails if out of memory
+static int
+record_apply(struct pair_store *store, const uint8_t *record)
+{
+  char device_id[PAIR_AP_DEVICE_ID_LEN_MAX];
+  size_t len = record[1];
+
+  memcpy(device_id, record + 2, len);
+  device_id[len] = '\0';
+
+  if (record[0] == STORE_OP_ADD)
+    return table_add(store, device_id, record + 2 + PAIR_AP_DEVICE_ID_LEN_MAX);
+
+  table_remove(store, device_id); // Not an error if it is gone already
+  return 0;
+}
+
+static int
+write_all(int fd, const uint8_t *data, size_t len)
+{
+  ssize_t ret;
+
+  while (len > 0)
+    {
+      ret = write(fd, data, len);
+      if (ret < 0 && errno == EINTR)
+	continue;
+      if (ret < 0)
+	return -1;
+
+      data += ret;
+      len -= ret;
+    }
+
+  return 0;
+}
+
+// Caller must hold store->lck for writing
+static int
+record_append(struct pair_store *store, uint8_t op, const char *device_id, const uint8_t *public_key)
+{
+  uint8_t record[STORE_RECORD_LEN];
+
+  if (store->fd < 0)
+    return 0;
+
+  record_make(record, op, device_id, public_key);
+
+  // Don't leave a partial record, the next append would be misaligned
+  if (write_all(store->fd, record, sizeof(record)) < 0 || fdatasync(store->fd) < 0)
+    {
+      // If this fails too, file_load() drops the partial record
+      (void)!ftruncate(store->fd, STORE_MAGIC_LEN + store->nrecords * STORE_RECORD_LEN);
+      return -1;
+    }
+
+  store->nrecords++;
+  return 0;
+}
+
+static int file_compact(struct pair_store *store);
+
+// The file is mapped and its records replayed into the table. Invalid records
+// are skipped, and a short record at the end is truncated away, so that appends
+// stay aligned.
+static int
+file_load(struct pair_store *store)
+{
+  struct stat sb;
+  uint8_t *map;
+  const uint8_t *record;
+  size_t record_len;
+  size_t nrecords;
+  size_t i;
+  bool is_v1;
+
+  if (fstat(store->fd, &sb) < 0)
+    return -1;
+
+  if (sb.st_size == 0)
+    return write_all(store->fd, (const uint8_t *)STORE_MAGIC, STORE_MAGIC_LEN);
+
+  if (sb.st_size < STORE_MAGIC_LEN)
+    return -1;
+
+  map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, store->fd, 0);
+  if (map == MAP_FAILED)
+    return -1;
+
+  is_v1 = (memcmp(map, STORE_MAGIC_V1, STORE_MAGIC_LEN) == 0);
+  if (!is_v1 && memcmp(map, STORE_MAGIC, STORE_MAGIC_LEN) != 0)
+    {
+      munmap(map, sb.st_size);
+      return -1;
+    }
+
+  record_len = is_v1 ? STORE_RECORD_LEN_V1 : STORE_RECORD_LEN;
+  nrecords = (sb.st_size - STORE_MAGIC_LEN) / record_len;
+  for (i = 0; i < nrecords; i++)
+    {
+      record = map + STORE_MAGIC_LEN + i * record_len;
+      if (!record_is_valid(record, !is_v1))
+	{
+#ifdef DEBUG_PAIR
+	  printf("Skipping invalid record %zu in pairing store %s\n", i, store->path);
+#endif
+	  continue;
+	}
+
+      if (record_apply(store, record) < 0)
+	{
+	  munmap(map, sb.st_size);
+	  return -1;
+	}
+    }
+
+  munmap(map, sb.st_size);
+
+  // Appends must be in the current format, so the old file is replaced
+  if (is_v1)
+    return file_compact(store);
+
+  store->nrecords = nrecords;
+
+  if (sb.st_size != STORE_MAGIC_LEN + nrecords * STORE_RECORD_LEN)
+    return ftruncate(store->fd, STORE_MAGIC_LEN + nrecords * STORE_RECORD_LEN);
+
+  return 0;
+}
+
+// Makes a rename in the directory of path durable
+static int
+dir_sync(const char *path)
+{
+  char *copy;
+  int fd;
+  int ret;
+
+  copy = strdup(path);
+  if (!copy)
+    return -1;
+
+  fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+  free(copy);
+  if (fd < 0)
+    return -1;
+
+  ret = fsync(fd);
+  close(fd);
+  return ret;
+}
+
+// Writes the current pairings to a new file and replaces the old one with it,
+// so the old file is intact if something goes wrong. Caller must hold
+// store->lck for writing.
+static int
+file_compact(struct pair_store *store)
+{
+  struct pair_store_entry *entry;
+  uint8_t record[STORE_RECORD_LEN];
+  char *tmp_path;
+  size_t len;
+  size_t i;
+  int fd;
+
+  if (store->fd < 0)
+    return 0;
+
+  len = strlen(store->path) + sizeof(".tmp");
+  tmp_path = malloc(len);
+  if (!tmp_path)
+    return -1;
+
+  snprintf(tmp_path, len, "%s.tmp", store->path);
+
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+  if (fd < 0)
+    goto error;
+
+  if (write_all(fd, (const uint8_t *)STORE_MAGIC, STORE_MAGIC_LEN) < 0)
+    goto error_close;
+
+  for (i = 0; i < store->nbuckets; i++)
+    {
+      for (entry = store->buckets[i]; entry; entry = entry->next)
+	{
+	  record_make(record, STORE_OP_ADD, entry->device_id, entry->public_key);
+	  if (write_all(fd, record, sizeof(record)) < 0)
+	    goto error_close;
+	}
+    }
+
+  if (fsync(fd) < 0 || rename(tmp_path, store->path) < 0)
+    goto error_close;
+
+  close(store->fd);
+  store->fd = fd;
+  store->nrecords = store->count;
+
+  free(tmp_path);
+  return dir_sync(store->path);
+
+ error_close:
+  close(fd);
+  unlink(tmp_path);
+ error:
+  free(tmp_path);
+  return -1;
+}
+
+// Caller must hold store->lck for writing
+static void
+file_compact_maybe(struct pair_store *store)
+{
+  if (store->nrecords >= STORE_COMPACT_MIN && store->nrecords > 2 * store->count)
+    file_compact(store); // If it fails we just keep appending to the old file
+}
+
+
+/* ---------------------------------- API ----------------------------------- */
+
+struct pair_store *
+pair_store_new(const char *path)
+{
+  struct pair_store *store;
+
+  store = calloc(1, sizeof(struct pair_store));
+  if (!store)
+    return NULL;
+
+  pthread_rwlock_init(&store->lck, NULL);
+  store->fd = -1;
+
+  store->nbuckets = STORE_BUCKETS_MIN;
+  store->buckets = calloc(store->nbuckets, sizeof(struct pair_store_entry *));
+  if (!store->buckets)
+    goto error;
+
+  if (!path)
+    return store;
+
+  store->path = strdup(path);
+  if (!store->path)
+    goto error;
+
+  store->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+  if (store->fd < 0 || file_load(store) < 0)
+    goto error;
+
+  file_compact_maybe(store);
+
+  return store;
+
+ error:
+  pair_store_free(store);
+  return NULL;
+}
+
+void
+pair_store_free(struct pair_store *store)
+{
+  struct pair_store_entry *entry;
+  size_t i;
+
+  if (!store)
+    return;
+
+  for (i = 0; store->buckets && i < store->nbuckets; i++)
+    {
+      while ((entry = store->buckets[i]))
+	{
+	  store->buckets[i] = entry->next;
+	  free(entry);
+	}
+    }
+
+  if (store->fd >= 0)
+    close(store->fd);
+
+  pthread_rwlock_destroy(&store->lck);
+  free(store->buckets);
+  free(store->path);
+  free(store);
+}
+
+int
+pair_store_count(struct pair_store *store)
+{
+  int count;
+
+  pthread_rwlock_rdlock(&store->lck);
+  count = store->count;
+  pthread_rwlock_unlock(&store->lck);
+
+  return count;
+}
+
+int
+pair_store_compact(struct pair_store *store)
+{
+  int ret;
+
+  pthread_rwlock_wrlock(&store->lck);
+  ret = file_compact(store);
+  pthread_rwlock_unlock(&store->lck);
+
+  return ret;
+}
+
+int
+pair_store_add_cb(uint8_t public_key[32], const char *device_id, void *cb_arg)
+{
+  struct pair_store *store = cb_arg;
+  int ret;
+
+  if (!device_id || strlen(device_id) == 0 || strlen(device_id) >= PAIR_AP_DEVICE_ID_LEN_MAX)
+    return -1;
+
+  pthread_rwlock_wrlock(&store->lck);
+
+  // Persist first, so that what we have in memory is never ahead of the file
+  ret = record_append(store, STORE_OP_ADD, device_id, public_key);
+  if (ret == 0)
+    ret = table_add(store, device_id, public_key);
+  if (ret == 0)
+    file_compact_maybe(store);
+
+  pthread_rwlock_unlock(&store->lck);
+
+  return ret;
+}
+
+int
+pair_store_remove_cb(uint8_t public_key[32], const char *device_id, void *cb_arg)
+{
+  struct pair_store *store = cb_arg;
+  int ret;
+
+  if (!device_id || strlen(device_id) >= PAIR_AP_DEVICE_ID_LEN_MAX)
+    return -1;
+
+  pthread_rwlock_wrlock(&store->lck);
+
+  ret = *entry_find(store, device_id, hash_get(device_id)) ? 0 : -1;
+  if (ret == 0)
+    ret = record_append(store, STORE_OP_REMOVE, device_id, NULL);
+  if (ret == 0)
+    ret = table_remove(store, device_id);
+  if (ret == 0)
+    file_compact_maybe(store);
+
+  pthread_rwlock_unlock(&store->lck);
+
+  return ret;
+}
+
+int
+pair_store_get_cb(uint8_t public_key[32], const char *device_id, void *cb_arg)
+{
+  struct pair_store *store = cb_arg;
+  struct pair_store_entry *entry;
+
+  pthread_rwlock_rdlock(&store->lck);
+
+  entry = *entry_find(store, device_id, hash_get(device_id));
+  if (entry)
+    memcpy(public_key, entry->public_key, sizeof(entry->public_key));
+
+  pthread_rwlock_unlock(&store->lck);
+
+  return entry ? 0 : -1;
+}
+
+void
+pair_store_list_cb(pair_cb enum_cb, void *enum_cb_arg, void *cb_arg)
+{
+  struct pair_store *store = cb_arg;
+  struct pair_store_entry *entry;
+  size_t i;
+
+  pthread_rwlock_rdlock(&store->lck);
+
+  for (i = 0; i < store->nbuckets; i++)
+    {
+      for (entry = store->buckets[i]; entry; entry = entry->next)
+	enum_cb(entry->public_key, entry->device_id, enum_cb_arg);
+    }
+
+  pthread_rwlock_unlock(&store->lck);
+}
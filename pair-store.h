@@ -0,0 +1,75 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef __PAIR_AP_STORE_H__
+#define __PAIR_AP_STORE_H__
+
+#include <stdint.h>
+
+#include "pair.h"
+
+/* A store of the pairings (client device ID + public key) that a server has
+ * made, for use with the pair_cb and pair_list_cb callbacks. Pairings are kept
+ * in a hash table keyed by device ID, and if a path is given they are also
+ * appended to a file, so they are loaded again by the next pair_store_new().
+ * The file is rewritten without the removed and replaced pairings when enough
+ * of it is stale. The store can be used by several threads, lookups only take
+ * a read lock.
+ *
+ * Give the store as cb_arg to the callbacks, e.g.:
+ *   pair_setup_new(PAIR_SERVER_HOMEKIT, NULL, pair_store_add_cb, store, id);
+ *   pair_verify_new(PAIR_SERVER_HOMEKIT, NULL, pair_store_get_cb, store, id);
+ *   pair_list(PAIR_SERVER_HOMEKIT, &out, &out_len, pair_store_list_cb, store, in, in_len);
+ */
+struct pair_store;
+
+/* Path can be NULL for a store that is only kept in memory. Returns NULL if the
+ * file can't be opened or isn't a pairing store.
+ */
+struct pair_store *
+pair_store_new(const char *path);
+
+void
+pair_store_free(struct pair_store *store);
+
+int
+pair_store_count(struct pair_store *store);
+
+/* Rewrites the file with just the current pairings
+ */
+int
+pair_store_compact(struct pair_store *store);
+
+int
+pair_store_add_cb(uint8_t public_key[32], const char *device_id, void *cb_arg);
+
+int
+pair_store_remove_cb(uint8_t public_key[32], const char *device_id, void *cb_arg);
+
+int
+pair_store_get_cb(uint8_t public_key[32], const char *device_id, void *cb_arg);
+
+void
+pair_store_list_cb(pair_cb enum_cb, void *enum_cb_arg, void *cb_arg);
+
+#endif  /* !__PAIR_AP_STORE_H__ */
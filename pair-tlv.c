@@ -33,92 +33,293 @@
 #include "pair-internal.h"
 
 
-static int
-tlv_add_value_(pair_tlv_values_t *values, uint8_t type, uint8_t *value, size_t size) {
-    pair_tlv_t *tlv = malloc(sizeof(pair_tlv_t));
-    if (!tlv) {
-        return PAIR_TLV_ERROR_MEMORY;
+// Types below this are found with the lookup table, others by a scan
+#define TLV_INDEX_SIZE 20
+
+// Estimates used by pair_tlv_new()
+#define TLV_ITEMS_DEFAULT 8
+#define TLV_DATA_DEFAULT 512
+
+struct tlv_block {
+    struct tlv_block *next;
+    size_t len;
+    size_t used;
+    uint8_t data[];
+};
+
+struct pair_tlv_arena {
+    pair_tlv_t *items;
+    size_t items_len;
+    size_t items_cap;
+
+    // Index + 1 of the first item with a given type, 0 if there is none
+    size_t index[TLV_INDEX_SIZE];
+
+    // The initial items array and the first block are part of the same
+    // allocation as the container itself, further blocks are only made if the
+    // estimate was too small
+    struct tlv_block *blocks;
+    struct tlv_block *block_inline;
+    pair_tlv_t *items_inline;
+};
+
+
+static uint8_t *
+tlv_data_reserve(pair_tlv_arena_t *arena, size_t size) {
+    struct tlv_block *block = arena->blocks;
+    uint8_t *data;
+
+    if (!block || block->len - block->used < size) {
+        size_t len = block ? 2 * block->len : TLV_DATA_DEFAULT;
+        if (len < size)
+            len = size;
+
+        block = malloc(sizeof(struct tlv_block) + len);
+        if (!block)
+            return NULL;
+
+        block->len = len;
+        block->used = 0;
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+
+    data = block->data + block->used;
+    block->used += size;
+    return data;
+}
+
+// If view is set, the item will point to it instead of reserving arena space
+static pair_tlv_t *
+tlv_item_add(pair_tlv_arena_t *arena, uint8_t type, const uint8_t *view, size_t size) {
+    pair_tlv_t *item;
+
+    if (arena->items_len == arena->items_cap) {
+        size_t cap = arena->items_cap ? 2 * arena->items_cap : TLV_ITEMS_DEFAULT;
+        pair_tlv_t *items = malloc(cap * sizeof(pair_tlv_t));
+        if (!items)
+            return NULL;
+
+        if (arena->items_len)
+            memcpy(items, arena->items, arena->items_len * sizeof(pair_tlv_t));
+        if (arena->items != arena->items_inline)
+            free(arena->items);
+
+        arena->items = items;
+        arena->items_cap = cap;
+    }
+
+    item = &arena->items[arena->items_len];
+    item->type = type;
+    item->size = size;
+    item->value = NULL;
+
+    if (view) {
+        item->value = (uint8_t *)view;
+    } else if (size) {
+        item->value = tlv_data_reserve(arena, size);
+        if (!item->value)
+            return NULL;
     }
-    tlv->type = type;
-    tlv->size = size;
-    tlv->value = value;
-    tlv->next = NULL;
-
-    if (!values->head) {
-        values->head = tlv;
-    } else {
-        pair_tlv_t *t = values->head;
-        while (t->next) {
-            t = t->next;
+
+    arena->items_len++;
+    if (type < TLV_INDEX_SIZE && !arena->index[type])
+        arena->index[type] = arena->items_len;
+
+    return item;
+}
+
+// Finds the item starting at *pos and advances *pos to the next one. The item
+// may be fragmented, i.e. split into chunks of 255 bytes followed by a last
+// chunk of the same type, in which case size is the sum of the chunks.
+static int
+tlv_item_next(const uint8_t *buffer, size_t length, size_t *pos, uint8_t *type, size_t *size) {
+    size_t i = *pos;
+    size_t chunk_size;
+
+    *type = buffer[i];
+    *size = 0;
+
+    do {
+        if (length - i < 2)
+            return PAIR_TLV_ERROR_INVALID;
+
+        chunk_size = buffer[i+1];
+        if (length - i - 2 < chunk_size)
+            return PAIR_TLV_ERROR_INVALID;
+
+        *size += chunk_size;
+        i += chunk_size + 2;
+    } while (chunk_size == 255 && i < length && buffer[i] == *type);
+
+    *pos = i;
+    return 0;
+}
+
+// With view set, items that are not fragmented will point into buffer, so
+// only fragmented items are copied (coalesced) into the arena
+static int
+tlv_parse(const uint8_t *buffer, size_t length, pair_tlv_arena_t *arena, bool view) {
+    size_t i = 0;
+    int ret;
+
+    while (i < length) {
+        size_t start = i;
+        uint8_t type;
+        size_t size;
+
+        ret = tlv_item_next(buffer, length, &i, &type, &size);
+        if (ret < 0)
+            return ret;
+
+        if (view && size && i - start == size + 2) {
+            if (!tlv_item_add(arena, type, &buffer[start+2], size))
+                return PAIR_TLV_ERROR_MEMORY;
+            continue;
+        }
+
+        pair_tlv_t *item = tlv_item_add(arena, type, NULL, size);
+        if (!item)
+            return PAIR_TLV_ERROR_MEMORY;
+
+        uint8_t *p = item->value;
+        size_t remaining = size;
+        while (remaining) {
+            size_t chunk_size = buffer[start+1];
+            memcpy(p, &buffer[start+2], chunk_size);
+            p += chunk_size;
+            start += chunk_size + 2;
+            remaining -= chunk_size;
         }
-        t->next = tlv;
     }
 
     return 0;
 }
 
 
-pair_tlv_values_t *
-pair_tlv_new() {
-    pair_tlv_values_t *values = malloc(sizeof(pair_tlv_values_t));
-    if (!values)
+pair_tlv_arena_t *
+pair_tlv_arena_new(size_t items, size_t data_len) {
+    pair_tlv_arena_t *arena;
+    struct tlv_block *block;
+    size_t items_size = items * sizeof(pair_tlv_t);
+
+    // One allocation for the container, the items array and the first block
+    arena = calloc(1, sizeof(pair_tlv_arena_t) + items_size + sizeof(struct tlv_block) + data_len);
+    if (!arena)
+        return NULL;
+
+    arena->items_inline = (pair_tlv_t *)(arena + 1);
+    arena->items = arena->items_inline;
+    arena->items_cap = items;
+
+    if (data_len) {
+        block = (struct tlv_block *)((uint8_t *)arena->items_inline + items_size);
+        block->len = data_len;
+        arena->blocks = block;
+        arena->block_inline = block;
+    }
+
+    return arena;
+}
+
+static pair_tlv_arena_t *
+tlv_arena_parse(const uint8_t *buffer, size_t length, bool view) {
+    pair_tlv_arena_t *arena;
+    size_t items = 0;
+    size_t data_len = 0;
+    size_t i = 0;
+    size_t start;
+    uint8_t type;
+    size_t size;
+
+    // First pass validates and finds the exact sizes, so the second pass can
+    // copy into an arena that has the right size
+    while (i < length) {
+        start = i;
+        if (tlv_item_next(buffer, length, &i, &type, &size) < 0)
+            return NULL;
+
+        items++;
+        if (!view || i - start != size + 2)
+            data_len += size;
+    }
+
+    arena = pair_tlv_arena_new(items, data_len);
+    if (!arena)
         return NULL;
 
-    values->head = NULL;
-    return values;
+    if (tlv_parse(buffer, length, arena, view) < 0) {
+        pair_tlv_arena_free(arena);
+        return NULL;
+    }
+
+    return arena;
+}
+
+pair_tlv_arena_t *
+pair_tlv_arena_parse(const uint8_t *buffer, size_t length) {
+    return tlv_arena_parse(buffer, length, false);
+}
+
+pair_tlv_arena_t *
+pair_tlv_arena_parse_view(const uint8_t *buffer, size_t length) {
+    return tlv_arena_parse(buffer, length, true);
 }
 
 void
-pair_tlv_free(pair_tlv_values_t *values) {
-    if (!values)
+pair_tlv_arena_free(pair_tlv_arena_t *arena) {
+    if (!arena)
         return;
 
-    pair_tlv_t *t = values->head;
-    while (t) {
-        pair_tlv_t *t2 = t;
-        t = t->next;
-        if (t2->value)
-            free(t2->value);
-        free(t2);
+    struct tlv_block *block = arena->blocks;
+    while (block) {
+        struct tlv_block *next = block->next;
+        if (block != arena->block_inline)
+            free(block);
+        block = next;
     }
-    free(values);
+
+    if (arena->items != arena->items_inline)
+        free(arena->items);
+
+    free(arena);
 }
 
 int
-pair_tlv_add_value(pair_tlv_values_t *values, uint8_t type, const uint8_t *value, size_t size) {
-    uint8_t *data = NULL;
-    int ret;
-    if (size) {
-        data = malloc(size);
-        if (!data) {
-            return PAIR_TLV_ERROR_MEMORY;
-        }
-        memcpy(data, value, size);
-    }
-    ret = tlv_add_value_(values, type, data, size);
-    if (ret < 0)
-        free(data);
-    return ret;
+pair_tlv_arena_add(pair_tlv_arena_t *arena, uint8_t type, const uint8_t *value, size_t size) {
+    pair_tlv_t *item = tlv_item_add(arena, type, NULL, size);
+    if (!item)
+        return PAIR_TLV_ERROR_MEMORY;
+
+    if (size)
+        memcpy(item->value, value, size);
+
+    return 0;
 }
 
 pair_tlv_t *
-pair_tlv_get_value(const pair_tlv_values_t *values, uint8_t type) {
-    pair_tlv_t *t = values->head;
-    while (t) {
-        if (t->type == type)
-            return t;
-        t = t->next;
+pair_tlv_arena_get(const pair_tlv_arena_t *arena, uint8_t type) {
+    if (type < TLV_INDEX_SIZE) {
+        if (!arena->index[type])
+            return NULL;
+        return &arena->items[arena->index[type] - 1];
+    }
+
+    for (size_t i = 0; i < arena->items_len; i++) {
+        if (arena->items[i].type == type)
+            return &arena->items[i];
     }
     return NULL;
 }
 
 int
-pair_tlv_format(const pair_tlv_values_t *values, uint8_t *buffer, size_t *size) {
+pair_tlv_arena_format(const pair_tlv_arena_t *arena, uint8_t *buffer, size_t *size) {
     size_t required_size = 0;
-    pair_tlv_t *t = values->head;
-    while (t) {
+    for (size_t i = 0; i < arena->items_len; i++) {
+        const pair_tlv_t *t = &arena->items[i];
         required_size += t->size + 2 * ((t->size + 254) / 255);
-        t = t->next;
+        if (!t->size)
+            required_size += 2;
     }
 
     if (*size < required_size) {
@@ -128,14 +329,13 @@ pair_tlv_format(const pair_tlv_values_t *values, uint8_t *buffer, size_t *size)
 
     *size = required_size;
 
-    t = values->head;
-    while (t) {
+    for (size_t i = 0; i < arena->items_len; i++) {
+        const pair_tlv_t *t = &arena->items[i];
         uint8_t *data = t->value;
         if (!t->size) {
             buffer[0] = t->type;
             buffer[1] = 0;
             buffer += 2;
-            t = t->next;
             continue;
         }
 
@@ -150,69 +350,169 @@ pair_tlv_format(const pair_tlv_values_t *values, uint8_t *buffer, size_t *size)
             buffer += chunk_size + 2;
             data += chunk_size;
         }
-
-        t = t->next;
     }
 
     return 0;
 }
 
+
+
 int
-pair_tlv_parse(const uint8_t *buffer, size_t length, pair_tlv_values_t *values) {
+pair_tlv_peek(const uint8_t *buffer, size_t length, uint8_t type, const uint8_t **value, size_t *size) {
     size_t i = 0;
-    int ret;
+
     while (i < length) {
-        uint8_t type = buffer[i];
-        size_t size = 0;
-        uint8_t *data = NULL;
-
-        // scan TLVs to accumulate total size of subsequent TLVs with same type (chunked data)
-        size_t j = i;
-        while (j < length && buffer[j] == type && buffer[j+1] == 255) {
-            size_t chunk_size = buffer[j+1];
-            size += chunk_size;
-            j += chunk_size + 2;
-        }
-        if (j < length && buffer[j] == type) {
-            size_t chunk_size = buffer[j+1];
-            size += chunk_size;
-        }
+        size_t start = i;
+        uint8_t item_type;
+        size_t item_size;
 
-        // allocate memory to hold all pieces of chunked data and copy data there
-        if (size != 0) {
-            data = malloc(size);
-            if (!data)
-                return PAIR_TLV_ERROR_MEMORY;
+        if (tlv_item_next(buffer, length, &i, &item_type, &item_size) < 0)
+            return PAIR_TLV_ERROR_INVALID;
+
+        if (item_type != type)
+            continue;
+
+        if (i - start != item_size + 2)
+            return PAIR_TLV_ERROR_INVALID;
+
+        *value = &buffer[start+2];
+        *size = item_size;
+        return 0;
+    }
+
+    return PAIR_TLV_ERROR_NOT_FOUND;
+}
+
+
+void
+pair_tlv_writer_init(pair_tlv_writer_t *writer, uint8_t *buffer, size_t size) {
+    memset(writer, 0, sizeof(pair_tlv_writer_t));
+
+    writer->size = size;
+    if (buffer) {
+        writer->buffer = buffer;
+        return;
+    }
+
+    writer->is_allocated = 1;
+    writer->buffer = malloc(size ? size : 1);
+    if (!writer->buffer)
+        writer->error = PAIR_TLV_ERROR_MEMORY;
+}
+
+int
+pair_tlv_writer_add(pair_tlv_writer_t *writer, uint8_t type, const uint8_t *value, size_t size) {
+    size_t required_size = PAIR_TLV_LEN(size);
 
-            uint8_t *p = data;
+    if (writer->error)
+        return writer->error;
 
-            size_t remaining = size;
-            while (remaining) {
-                size_t chunk_size = buffer[i+1];
-                memcpy(p, &buffer[i+2], chunk_size);
-                p += chunk_size;
-                i += chunk_size + 2;
-                remaining -= chunk_size;
-            }
+    if (writer->size - writer->len < required_size) {
+        if (!writer->is_allocated) {
+            writer->error = PAIR_TLV_ERROR_INSUFFICIENT_SIZE;
+            return writer->error;
         }
 
-        ret = tlv_add_value_(values, type, data, size);
-        if (ret < 0) {
-            free(data);
-            return ret;
+        size_t new_size = 2 * writer->size;
+        if (new_size < writer->len + required_size)
+            new_size = writer->len + required_size;
+
+        uint8_t *buffer = realloc(writer->buffer, new_size);
+        if (!buffer) {
+            writer->error = PAIR_TLV_ERROR_MEMORY;
+            return writer->error;
         }
+
+        writer->buffer = buffer;
+        writer->size = new_size;
     }
 
+    uint8_t *p = writer->buffer + writer->len;
+    if (!size) {
+        p[0] = type;
+        p[1] = 0;
+    }
+
+    size_t remaining = size;
+    while (remaining) {
+        size_t chunk_size = (remaining > 255) ? 255 : remaining;
+        p[0] = type;
+        p[1] = chunk_size;
+        memcpy(&p[2], value, chunk_size);
+        remaining -= chunk_size;
+        value += chunk_size;
+        p += chunk_size + 2;
+    }
+
+    writer->len += required_size;
     return 0;
 }
 
+uint8_t *
+pair_tlv_writer_finish(pair_tlv_writer_t *writer, size_t *len) {
+    uint8_t *buffer = writer->buffer;
+
+    if (writer->error) {
+        pair_tlv_writer_discard(writer);
+        return NULL;
+    }
+
+    *len = writer->len;
+
+    // Caller owns the buffer now
+    writer->buffer = NULL;
+    writer->is_allocated = 0;
+    return buffer;
+}
+
+void
+pair_tlv_writer_discard(pair_tlv_writer_t *writer) {
+    if (writer->is_allocated)
+        free(writer->buffer);
+
+    writer->buffer = NULL;
+    writer->is_allocated = 0;
+}
+
+
+pair_tlv_values_t *
+pair_tlv_new() {
+    return pair_tlv_arena_new(TLV_ITEMS_DEFAULT, TLV_DATA_DEFAULT);
+}
+
+void
+pair_tlv_free(pair_tlv_values_t *values) {
+    pair_tlv_arena_free(values);
+}
+
+int
+pair_tlv_add_value(pair_tlv_values_t *values, uint8_t type, const uint8_t *value, size_t size) {
+    return pair_tlv_arena_add(values, type, value, size);
+}
+
+pair_tlv_t *
+pair_tlv_get_value(const pair_tlv_values_t *values, uint8_t type) {
+    return pair_tlv_arena_get(values, type);
+}
+
+int
+pair_tlv_format(const pair_tlv_values_t *values, uint8_t *buffer, size_t *size) {
+    return pair_tlv_arena_format(values, buffer, size);
+}
+
+int
+pair_tlv_parse(const uint8_t *buffer, size_t length, pair_tlv_values_t *values) {
+    return tlv_parse(buffer, length, values, false);
+}
+
 #ifdef DEBUG_PAIR
 void
 pair_tlv_debug(const pair_tlv_values_t *values)
 {
   printf("Received TLV values\n");
-  for (pair_tlv_t *t=values->head; t; t=t->next)
+  for (size_t i = 0; i < values->items_len; i++)
     {
+      pair_tlv_t *t = &values->items[i];
       printf("Type %d value (%zu bytes): \n", t->type, t->size);
       hexdump("", t->value, t->size);
     }
@@ -5,6 +5,8 @@
 
 #define PAIR_TLV_ERROR_MEMORY -1
 #define PAIR_TLV_ERROR_INSUFFICIENT_SIZE -2
+#define PAIR_TLV_ERROR_INVALID -3
+#define PAIR_TLV_ERROR_NOT_FOUND -4
 
 typedef enum {
   TLVType_Method = 0,        // (integer) Method to use for pairing. See PairMethod
@@ -27,6 +29,7 @@ typedef enum {
   TLVType_FragmentData = 13, // (bytes) Non-last fragment of data. If length is 0,
                              // it's an ACK.
   TLVType_FragmentLast = 14, // (bytes) Last fragment of data
+  TLVType_SessionID = 14,    // (bytes) Pair-resume session ID, same value as FragmentLast
   TLVType_Flags = 19,        // Added from airplay2_receiver
   TLVType_Separator = 0xff,
 } TLVType;
@@ -45,18 +48,83 @@ typedef enum {
                                 // request at this time
 } TLVError;
 
-typedef struct _tlv {
-    struct _tlv *next;
+typedef struct {
     uint8_t type;
     uint8_t *value;
     size_t size;
 } pair_tlv_t;
 
 
+/* Container for TLV items. The items are kept in an array in the order they
+ * were added, and their values are copied into an arena that is allocated
+ * together with the container, so a container that is given a large enough
+ * estimate only makes one allocation and is freed in one call. If the estimate
+ * is too small the container grows, which means that item pointers returned
+ * by pair_tlv_arena_get() are only valid until the next add. Items with the
+ * common TLVType values are found by a lookup table, so getting an item does
+ * not depend on the number of items.
+ */
+typedef struct pair_tlv_arena pair_tlv_arena_t;
+
+pair_tlv_arena_t *pair_tlv_arena_new(size_t items, size_t data_len);
+
+pair_tlv_arena_t *pair_tlv_arena_parse(const uint8_t *buffer, size_t length);
+
+/* Like pair_tlv_arena_parse(), but the values of items that are not fragmented
+ * point directly into buffer instead of being copied. Only fragmented items
+ * (values > 255 bytes) are coalesced into the arena. The values must not be
+ * modified, and the result can only be used while buffer is valid.
+ */
+pair_tlv_arena_t *pair_tlv_arena_parse_view(const uint8_t *buffer, size_t length);
+
+void pair_tlv_arena_free(pair_tlv_arena_t *arena);
+
+int pair_tlv_arena_add(pair_tlv_arena_t *arena, uint8_t type, const uint8_t *value, size_t size);
+
+pair_tlv_t *pair_tlv_arena_get(const pair_tlv_arena_t *arena, uint8_t type);
+
+int pair_tlv_arena_format(const pair_tlv_arena_t *arena, uint8_t *buffer, size_t *size);
+
+
+/* Writes TLV items directly into a buffer, fragmenting values that are larger
+ * than 255 bytes as they are written. If a buffer is given the writer will
+ * only use that buffer, otherwise it allocates one of the given size and grows
+ * it as needed. Errors are sticky, so a number of items can be written and the
+ * result checked once with pair_tlv_writer_finish(), which returns the buffer
+ * (that the caller then owns, if it was allocated by the writer) or NULL.
+ * pair_tlv_writer_discard() frees an allocated buffer that was not finished.
+ */
 typedef struct {
-    pair_tlv_t *head;
-} pair_tlv_values_t;
+    uint8_t *buffer;
+    size_t len;
+    size_t size;
+    int is_allocated;
+    int error;
+} pair_tlv_writer_t;
+
+// Encoded length of an item with a value of the given size
+#define PAIR_TLV_LEN(size) ((size) + 2 * ((size) ? ((size) + 254) / 255 : 1))
+
+void pair_tlv_writer_init(pair_tlv_writer_t *writer, uint8_t *buffer, size_t size);
+
+int pair_tlv_writer_add(pair_tlv_writer_t *writer, uint8_t type, const uint8_t *value, size_t size);
+
+uint8_t *pair_tlv_writer_finish(pair_tlv_writer_t *writer, size_t *len);
+
+void pair_tlv_writer_discard(pair_tlv_writer_t *writer);
+
+
+/* Finds the first item of the given type by scanning the raw TLV bytes,
+ * without allocating anything. value will point into buffer. Meant for small
+ * items like State, Error and Method, so fragmented items (values larger than
+ * 255 bytes) are reported as invalid. Returns 0 if found and
+ * PAIR_TLV_ERROR_NOT_FOUND if not.
+ */
+int pair_tlv_peek(const uint8_t *buffer, size_t length, uint8_t type, const uint8_t **value, size_t *size);
+
 
+/* Compatibility API, wraps the above */
+typedef pair_tlv_arena_t pair_tlv_values_t;
 
 pair_tlv_values_t *pair_tlv_new();
 
@@ -26,6 +26,10 @@
 #include <string.h>
 #include <ctype.h> // for isprint()
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 
 #include <sodium.h>
 #include "utils.h"
@@ -64,6 +68,61 @@ bool is_initialized(void)
   return true;
 }
 
+/* --------------------------------- EXECUTOR ------------------------------- */
+
+struct executor_thread
+{
+  pthread_t tid;
+  pair_job_cb job;
+  void *job_arg;
+  bool started;
+};
+
+static void *
+executor_thread_run(void *arg)
+{
+  struct executor_thread *thread = arg;
+
+  thread->job(thread->job_arg);
+  return NULL;
+}
+
+void executor_run(pair_executor_cb executor, void *cb_arg, pair_job_cb job, void **job_args, int njobs)
+{
+  struct executor_thread *threads;
+  int i;
+
+  if (executor)
+  {
+    executor(job, job_args, njobs, cb_arg);
+    return;
+  }
+
+  // The first job runs in the calling thread
+  threads = calloc(njobs, sizeof(struct executor_thread));
+  for (i = 1; threads && i < njobs; i++)
+  {
+    threads[i].job = job;
+    threads[i].job_arg = job_args[i];
+    threads[i].started = (pthread_create(&threads[i].tid, NULL, executor_thread_run, &threads[i]) == 0);
+  }
+
+  for (i = 0; i < njobs; i++)
+  {
+    // Also runs jobs in this thread that we couldn't start a thread for
+    if (!threads || !threads[i].started)
+      job(job_args[i]);
+  }
+
+  for (i = 1; threads && i < njobs; i++)
+  {
+    if (threads[i].started)
+      pthread_join(threads[i].tid, NULL);
+  }
+
+  free(threads);
+}
+
 /* -------------------------- SHARED HASHING HELPERS ------------------------ */
 
 int hash_init(enum hash_alg alg, HashCTX *c)
@@ -228,7 +287,9 @@ bnum H_nn_pad(enum hash_alg alg, const bnum n1, const bnum n2, int padded_len)
   bnum_bn2bin(n2, bin + offset_n2, len_n2);
   hash(alg, bin, nbytes, buff);
   free(bin);
+#ifdef DEBUG_PAIR
   print_bytes(buff, hash_length(alg));
+#endif
   bnum_bin2bn(bn, buff, hash_length(alg));
   return bn;
 }
@@ -269,6 +330,186 @@ void hash_num(enum hash_alg alg, const bnum n, unsigned char *dest)
   free(bin);
 }
 
+/* ---------------------- SRP FIXED-BASE EXPONENTIATION --------------------- */
+
+// Number of teeth in the comb, the table will have 2^FIXED_BASE_TEETH entries
+#define FIXED_BASE_TEETH 6
+
+struct bnum_fixed_base
+{
+  int max_bits;
+  int cols; // max_bits / FIXED_BASE_TEETH, rounded up
+
+  // Not owned, these belong to the group
+  bnum N;
+  bnum_mont mont;
+
+  // table[j] is the product of g^(2^(i * cols)) for each bit i set in j. With
+  // OpenSSL the entries are in Montgomery form. table[0] is not used.
+  bnum table[1 << FIXED_BASE_TEETH];
+};
+
+#if CONFIG_OPENSSL
+#define fixed_base_mulm(r, a, b, fb, ctx) BN_mod_mul_montgomery(r, a, b, fb->mont, ctx)
+#define fixed_base_bit_is_set(n, i)       BN_is_bit_set(n, i)
+#define fixed_base_num_bits(n)            BN_num_bits(n)
+#elif CONFIG_GCRYPT
+#define fixed_base_mulm(r, a, b, fb, ctx) gcry_mpi_mulm(r, a, b, fb->N)
+#define fixed_base_bit_is_set(n, i)       gcry_mpi_test_bit(n, i)
+#define fixed_base_num_bits(n)            gcry_mpi_get_nbits(n)
+#endif
+
+void bnum_fixed_base_free(struct bnum_fixed_base *fb)
+{
+  int i;
+
+  if (!fb)
+    return;
+
+  for (i = 1; i < (1 << FIXED_BASE_TEETH); i++)
+    bnum_free(fb->table[i]);
+
+  free(fb);
+}
+
+struct bnum_fixed_base *
+bnum_fixed_base_new(bnum g, bnum N, bnum_mont mont, int max_bits)
+{
+#ifdef CONFIG_NO_SRP_FIXED_BASE
+  return NULL;
+#else
+  struct bnum_fixed_base *fb;
+  bnum_ctx ctx;
+  bnum gpow;
+  int lowbit;
+  int i;
+  int j;
+
+  fb = calloc(1, sizeof(struct bnum_fixed_base));
+  if (!fb)
+    return NULL;
+
+  fb->N = N;
+  fb->mont = mont;
+  fb->max_bits = max_bits;
+  fb->cols = (max_bits + FIXED_BASE_TEETH - 1) / FIXED_BASE_TEETH;
+
+  bnum_ctx_new(ctx);
+  bnum_new(gpow);
+  if (!ctx || !gpow)
+    goto error;
+
+  for (i = 1; i < (1 << FIXED_BASE_TEETH); i++)
+  {
+    bnum_new(fb->table[i]);
+    if (!fb->table[i])
+      goto error;
+  }
+
+#if CONFIG_OPENSSL
+  if (!BN_to_montgomery(gpow, g, mont, ctx))
+    goto error;
+#elif CONFIG_GCRYPT
+  gcry_mpi_mod(gpow, g, N);
+#endif
+
+  // First the entries with a single bit set, table[1 << i] = g^(2^(i * cols))
+  for (i = 0; i < FIXED_BASE_TEETH; i++)
+  {
+#if CONFIG_OPENSSL
+    if (!BN_copy(fb->table[1 << i], gpow))
+      goto error;
+#elif CONFIG_GCRYPT
+    gcry_mpi_set(fb->table[1 << i], gpow);
+#endif
+
+    for (j = 0; j < fb->cols; j++)
+      fixed_base_mulm(gpow, gpow, gpow, fb, ctx);
+  }
+
+  // The rest are products of those
+  for (i = 1; i < (1 << FIXED_BASE_TEETH); i++)
+  {
+    lowbit = i & -i;
+    if (i == lowbit)
+      continue;
+
+    fixed_base_mulm(fb->table[i], fb->table[i ^ lowbit], fb->table[lowbit], fb, ctx);
+  }
+
+  bnum_free(gpow);
+  bnum_ctx_free(ctx);
+  return fb;
+
+ error:
+  bnum_free(gpow);
+  if (ctx)
+    bnum_ctx_free(ctx);
+  bnum_fixed_base_free(fb);
+  return NULL;
+#endif
+}
+
+int bnum_fixed_base_modexp(bnum result, const bnum exp, struct bnum_fixed_base *fb, bnum_ctx ctx)
+{
+  bnum r;
+  bool is_one;
+  int col;
+  int i;
+  int j;
+
+  if (!fb || fixed_base_num_bits(exp) > fb->max_bits)
+    return -1;
+
+  bnum_new(r);
+  if (!r)
+    return -1;
+
+  // Process one column of the comb at a time, starting with the most
+  // significant bits of each tooth
+  for (col = fb->cols - 1, is_one = true; col >= 0; col--)
+  {
+    if (!is_one)
+      fixed_base_mulm(r, r, r, fb, ctx);
+
+    for (i = 0, j = 0; i < FIXED_BASE_TEETH; i++)
+    {
+      if (fixed_base_bit_is_set(exp, i * fb->cols + col))
+        j |= 1 << i;
+    }
+
+    if (!j)
+      continue;
+
+    if (is_one)
+    {
+#if CONFIG_OPENSSL
+      BN_copy(r, fb->table[j]);
+#elif CONFIG_GCRYPT
+      gcry_mpi_set(r, fb->table[j]);
+#endif
+      is_one = false;
+    }
+    else
+      fixed_base_mulm(r, r, fb->table[j], fb, ctx);
+  }
+
+#if CONFIG_OPENSSL
+  if (is_one)
+    BN_one(result);
+  else
+    BN_from_montgomery(result, r, fb->mont, ctx);
+#elif CONFIG_GCRYPT
+  if (is_one)
+    gcry_mpi_set_ui(result, 1);
+  else
+    gcry_mpi_set(result, r);
+#endif
+
+  bnum_free(r);
+  return 0;
+}
+
 /* ----------------------------- OTHER HELPERS -------------------------------*/
 
 #ifdef DEBUG_PAIR
@@ -317,6 +558,237 @@ void bnum_dump(const char *msg, bnum n)
 }
 #endif
 
+/* -------------------------------- STATISTICS -------------------------------*/
+
+// The flag is read with a relaxed load in every step and cipher call, so that
+// disabled statistics cost no more than a branch. The global counters are
+// updated with relaxed atomics, since steps can run on pair_async threads.
+static int stats_enabled;
+static struct pair_stats stats_global;
+static pair_stats_step_cb stats_step_cb;
+static void *stats_step_cb_arg;
+
+#define STATS_ADD(p, n) __atomic_add_fetch((p), (n), __ATOMIC_RELAXED)
+
+static inline bool
+stats_on(void)
+{
+  return __atomic_load_n(&stats_enabled, __ATOMIC_RELAXED);
+}
+
+static uint64_t
+stats_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t stats_start(void)
+{
+  if (!stats_on())
+    return 0;
+
+  return stats_now();
+}
+
+void stats_modexp_end(uint64_t start)
+{
+  if (!start)
+    return;
+
+  STATS_ADD(&stats_global.modexp_ns, stats_now() - start);
+  STATS_ADD(&stats_global.modexp_count, 1);
+}
+
+void stats_decrypt_auth_failure(struct pair_cipher_context *cctx)
+{
+  if (!stats_on())
+    return;
+
+  cctx->stats.decrypt_auth_failures++;
+  STATS_ADD(&stats_global.cipher.decrypt_auth_failures, 1);
+}
+
+// Step n is message 2n - 1 when the client makes the request and the server
+// reads it, and message 2n when the server makes the response and the client
+// reads it
+static int
+stats_msg_no(struct pair_definition *type, bool is_request, int n)
+{
+  bool is_server = (type == &pair_server_homekit);
+
+  return (is_request != is_server) ? 2 * n - 1 : 2 * n;
+}
+
+// Only counts the end once, e.g. if the caller retries a failed step
+static void
+stats_ended(uint64_t *counter, uint64_t *global_counter, struct pair_stats_handshake *hs)
+{
+  if (!hs->started || hs->completed || hs->auth_failed || hs->failed)
+    return;
+
+  *counter = 1;
+  STATS_ADD(global_counter, 1);
+}
+
+static void
+stats_step_end(struct pair_stats_handshake *hs, struct pair_stats_handshake *global, bool is_verify, int msg_no, int ret, enum pair_status status, uint64_t start)
+{
+  uint64_t end;
+
+  end = stats_now();
+
+  if (!hs->started)
+  {
+    hs->started = 1;
+    STATS_ADD(&global->started, 1);
+  }
+
+  hs->step_ns[msg_no - 1] += end - start;
+  hs->step_count[msg_no - 1]++;
+  STATS_ADD(&global->step_ns[msg_no - 1], end - start);
+  STATS_ADD(&global->step_count[msg_no - 1], 1);
+
+  // A server that rejects the peer still makes a response with the error, so
+  // the status tells if it failed as much as ret
+  if (status == PAIR_STATUS_COMPLETED)
+    stats_ended(&hs->completed, &global->completed, hs);
+  else if (status == PAIR_STATUS_AUTH_FAILED)
+    stats_ended(&hs->auth_failed, &global->auth_failed, hs);
+  else if (ret < 0 || status == PAIR_STATUS_INVALID)
+    stats_ended(&hs->failed, &global->failed, hs);
+
+  if (stats_step_cb)
+    stats_step_cb(is_verify, msg_no, ret, start, end, stats_step_cb_arg);
+}
+
+static void
+stats_setup_step(struct pair_setup_context *sctx, bool is_request, int n, int ret, uint64_t start)
+{
+  if (!start)
+    return;
+
+  stats_step_end(&sctx->stats, &stats_global.setup, false, stats_msg_no(sctx->type, is_request, n), ret, sctx->status, start);
+}
+
+static void
+stats_verify_step(struct pair_verify_context *vctx, bool is_request, int n, int ret, uint64_t start)
+{
+  if (!start)
+    return;
+
+  stats_step_end(&vctx->stats, &stats_global.verify, true, stats_msg_no(vctx->type, is_request, n), ret, vctx->status, start);
+}
+
+// The cipher functions set the _prev counters when they start, so after a
+// successful call the difference is the number of frames
+static void
+stats_encrypted(struct pair_cipher_context *cctx, size_t bytes)
+{
+  uint64_t frames = cctx->encryption_counter - cctx->encryption_counter_prev;
+
+  cctx->stats.bytes_encrypted += bytes;
+  cctx->stats.frames_encrypted += frames;
+  STATS_ADD(&stats_global.cipher.bytes_encrypted, bytes);
+  STATS_ADD(&stats_global.cipher.frames_encrypted, frames);
+}
+
+static void
+stats_decrypted(struct pair_cipher_context *cctx, size_t bytes)
+{
+  uint64_t frames = cctx->decryption_counter - cctx->decryption_counter_prev;
+
+  cctx->stats.bytes_decrypted += bytes;
+  cctx->stats.frames_decrypted += frames;
+  STATS_ADD(&stats_global.cipher.bytes_decrypted, bytes);
+  STATS_ADD(&stats_global.cipher.frames_decrypted, frames);
+}
+
+
+/* ------------------------------- CONTEXT POOL ------------------------------*/
+
+// Released setup and verify contexts are kept on a free list for reuse, up to
+// context_pool_size of each kind, see pair_context_pool_set(). The contexts
+// are wiped when released, so the list link is the only thing to clear when
+// one is taken again.
+#define CONTEXT_POOL_SIZE_MAX 65536
+
+struct context_pool_entry
+{
+  struct context_pool_entry *next;
+};
+
+struct context_pool
+{
+  struct context_pool_entry *head;
+  int count;
+  size_t len;
+};
+
+static pthread_mutex_t context_pool_lck = PTHREAD_MUTEX_INITIALIZER;
+static int context_pool_size;
+static struct context_pool context_pool_setup = { .len = sizeof(struct pair_setup_context) };
+static struct context_pool context_pool_verify = { .len = sizeof(struct pair_verify_context) };
+
+static void *
+context_alloc(struct context_pool *pool)
+{
+  struct context_pool_entry *entry;
+
+  pthread_mutex_lock(&context_pool_lck);
+  entry = pool->head;
+  if (entry)
+  {
+    pool->head = entry->next;
+    pool->count--;
+  }
+  pthread_mutex_unlock(&context_pool_lck);
+
+  if (!entry)
+    return calloc(1, pool->len);
+
+  memset(entry, 0, sizeof(struct context_pool_entry));
+  return entry;
+}
+
+static void
+context_release(struct context_pool *pool, void *ctx)
+{
+  struct context_pool_entry *entry = ctx;
+
+  sodium_memzero(ctx, pool->len);
+
+  pthread_mutex_lock(&context_pool_lck);
+  if (pool->count < context_pool_size)
+  {
+    entry->next = pool->head;
+    pool->head = entry;
+    pool->count++;
+    entry = NULL;
+  }
+  pthread_mutex_unlock(&context_pool_lck);
+
+  free(entry);
+}
+
+// Must be called with the lock held
+static void
+context_pool_trim(struct context_pool *pool, int size)
+{
+  struct context_pool_entry *entry;
+
+  while (pool->count > size)
+  {
+    entry = pool->head;
+    pool->head = entry->next;
+    pool->count--;
+    free(entry);
+  }
+}
+
+
 /* ----------------------------------- API -----------------------------------*/
 
 struct pair_setup_context *
@@ -327,7 +799,7 @@ pair_setup_new(enum pair_type type, const char *pin, pair_cb add_cb, void *cb_ar
   if (!pair[type]->pair_setup_new)
     return NULL;
 
-  sctx = calloc(1, sizeof(struct pair_setup_context));
+  sctx = context_alloc(&context_pool_setup);
   if (!sctx)
     return NULL;
 
@@ -335,7 +807,7 @@ pair_setup_new(enum pair_type type, const char *pin, pair_cb add_cb, void *cb_ar
 
   if (pair[type]->pair_setup_new(sctx, pin, add_cb, cb_arg, device_id) < 0)
   {
-    free(sctx);
+    context_release(&context_pool_setup, sctx);
     return NULL;
   }
 
@@ -350,7 +822,7 @@ void pair_setup_free(struct pair_setup_context *sctx)
   if (sctx->type->pair_setup_free)
     sctx->type->pair_setup_free(sctx);
 
-  free(sctx);
+  context_release(&context_pool_setup, sctx);
 }
 
 const char *
@@ -375,7 +847,12 @@ int pair_setup(uint8_t **out, size_t *out_len, struct pair_setup_context *sctx,
 
   state = sctx->type->pair_state_get(&sctx->errmsg, in, in_len);
   if (state < 0)
+  {
+    // E.g. the peer sent an error, which ends the handshake without a step
+    if (stats_on())
+      stats_ended(&sctx->stats.failed, &stats_global.setup.failed, &sctx->stats);
     return -1;
+  }
 
   switch (state)
   {
@@ -431,73 +908,106 @@ int pair_setup(uint8_t **out, size_t *out_len, struct pair_setup_context *sctx,
 uint8_t *
 pair_setup_request1(size_t *len, struct pair_setup_context *sctx)
 {
+  uint64_t start;
+  uint8_t *out;
+
   if (!sctx->type->pair_setup_request1)
   {
     sctx->errmsg = "Setup request 1: Unsupported";
     return NULL;
   }
 
-  return sctx->type->pair_setup_request1(len, sctx);
+  start = stats_start();
+  out = sctx->type->pair_setup_request1(len, sctx);
+  stats_setup_step(sctx, true, 1, out ? 0 : -1, start);
+  return out;
 }
 
 uint8_t *
 pair_setup_request2(size_t *len, struct pair_setup_context *sctx)
 {
+  uint64_t start;
+  uint8_t *out;
+
   if (!sctx->type->pair_setup_request2)
   {
     sctx->errmsg = "Setup request 2: Unsupported";
     return NULL;
   }
 
-  return sctx->type->pair_setup_request2(len, sctx);
+  start = stats_start();
+  out = sctx->type->pair_setup_request2(len, sctx);
+  stats_setup_step(sctx, true, 2, out ? 0 : -1, start);
+  return out;
 }
 
 uint8_t *
 pair_setup_request3(size_t *len, struct pair_setup_context *sctx)
 {
+  uint64_t start;
+  uint8_t *out;
+
   if (!sctx->type->pair_setup_request3)
   {
     sctx->errmsg = "Setup request 3: Unsupported";
     return NULL;
   }
 
-  return sctx->type->pair_setup_request3(len, sctx);
+  start = stats_start();
+  out = sctx->type->pair_setup_request3(len, sctx);
+  stats_setup_step(sctx, true, 3, out ? 0 : -1, start);
+  return out;
 }
 
 int pair_setup_response1(struct pair_setup_context *sctx, const uint8_t *in, size_t in_len)
 {
+  uint64_t start;
+  int ret;
+
   if (!sctx->type->pair_setup_response1)
   {
     sctx->errmsg = "Setup response 1: Unsupported";
     return -1;
   }
 
-  return sctx->type->pair_setup_response1(sctx, in, in_len);
+  start = stats_start();
+  ret = sctx->type->pair_setup_response1(sctx, in, in_len);
+  stats_setup_step(sctx, false, 1, ret < 0 ? -1 : 0, start);
+  return ret;
 }
 
 int pair_setup_response2(struct pair_setup_context *sctx, const uint8_t *in, size_t in_len)
 {
+  uint64_t start;
+  int ret;
+
   if (!sctx->type->pair_setup_response2)
   {
     sctx->errmsg = "Setup response 2: Unsupported";
     return -1;
   }
 
-  return sctx->type->pair_setup_response2(sctx, in, in_len);
+  start = stats_start();
+  ret = sctx->type->pair_setup_response2(sctx, in, in_len);
+  stats_setup_step(sctx, false, 2, ret < 0 ? -1 : 0, start);
+  return ret;
 }
 
 int pair_setup_response3(struct pair_setup_context *sctx, const uint8_t *in, size_t in_len)
 {
+  uint64_t start;
+  int ret;
+
   if (!sctx->type->pair_setup_response3)
   {
     sctx->errmsg = "Setup response 3: Unsupported";
     return -1;
   }
 
-  if (sctx->type->pair_setup_response3(sctx, in, in_len) != 0)
-    return -1;
-
-  return 0;
+  start = stats_start();
+  ret = (sctx->type->pair_setup_response3(sctx, in, in_len) != 0) ? -1 : 0;
+  stats_setup_step(sctx, false, 3, ret, start);
+  return ret;
 }
 
 int pair_setup_result(const char **client_setup_keys, struct pair_result **result, struct pair_setup_context *sctx)
@@ -521,6 +1031,14 @@ int pair_setup_result(const char **client_setup_keys, struct pair_result **resul
   return 0;
 }
 
+int pair_setup_verifier_cache(enum pair_type type, int rotation_secs)
+{
+  if (!pair[type]->pair_setup_verifier_cache)
+    return -1;
+
+  return pair[type]->pair_setup_verifier_cache(rotation_secs);
+}
+
 struct pair_verify_context *
 pair_verify_new(enum pair_type type, const char *client_setup_keys, pair_cb get_cb, void *cb_arg, const char *device_id)
 {
@@ -529,7 +1047,7 @@ pair_verify_new(enum pair_type type, const char *client_setup_keys, pair_cb get_
   if (!pair[type]->pair_verify_new)
     return NULL;
 
-  vctx = calloc(1, sizeof(struct pair_verify_context));
+  vctx = context_alloc(&context_pool_verify);
   if (!vctx)
     return NULL;
 
@@ -537,7 +1055,33 @@ pair_verify_new(enum pair_type type, const char *client_setup_keys, pair_cb get_
 
   if (pair[type]->pair_verify_new(vctx, client_setup_keys, get_cb, cb_arg, device_id) < 0)
   {
-    free(vctx);
+    context_release(&context_pool_verify, vctx);
+    return NULL;
+  }
+
+  return vctx;
+}
+
+struct pair_verify_context *
+pair_verify_new_with_keys(enum pair_type type, const uint8_t client_private_key[64], const uint8_t server_public_key[32], const char *device_id)
+{
+  struct pair_verify_context *vctx;
+
+  if (!pair[type]->pair_verify_new_with_keys)
+    return NULL;
+
+  if (!client_private_key)
+    return NULL;
+
+  vctx = context_alloc(&context_pool_verify);
+  if (!vctx)
+    return NULL;
+
+  vctx->type = pair[type];
+
+  if (pair[type]->pair_verify_new_with_keys(vctx, client_private_key, server_public_key, device_id) < 0)
+  {
+    context_release(&context_pool_verify, vctx);
     return NULL;
   }
 
@@ -552,7 +1096,7 @@ void pair_verify_free(struct pair_verify_context *vctx)
   if (vctx->type->pair_verify_free)
     vctx->type->pair_verify_free(vctx);
 
-  free(vctx);
+  context_release(&context_pool_verify, vctx);
 }
 
 const char *
@@ -577,7 +1121,12 @@ int pair_verify(uint8_t **out, size_t *out_len, struct pair_verify_context *vctx
 
   state = vctx->type->pair_state_get(&vctx->errmsg, in, in_len);
   if (state < 0)
+  {
+    // E.g. the peer sent an error, which ends the handshake without a step
+    if (stats_on())
+      stats_ended(&vctx->stats.failed, &stats_global.verify.failed, &vctx->stats);
     return -1;
+  }
 
   switch (state)
   {
@@ -592,7 +1141,7 @@ int pair_verify(uint8_t **out, size_t *out_len, struct pair_verify_context *vctx
     break;
   case 2:
     ret = pair_verify_response1(vctx, in, in_len);
-    if (ret < 0)
+    if (ret < 0 || vctx->status == PAIR_STATUS_COMPLETED) // Completed if pair-resume
       break;
     *out = pair_verify_request2(out_len, vctx);
     break;
@@ -612,6 +1161,9 @@ int pair_verify(uint8_t **out, size_t *out_len, struct pair_verify_context *vctx
     ret = -1;
   }
 
+  if (ret == 0 && vctx->status == PAIR_STATUS_COMPLETED)
+    return 0; // Client is done, nothing more to send
+
   if (ret < 0 || !(*out))
     return -1;
 
@@ -621,50 +1173,71 @@ int pair_verify(uint8_t **out, size_t *out_len, struct pair_verify_context *vctx
 uint8_t *
 pair_verify_request1(size_t *len, struct pair_verify_context *vctx)
 {
+  uint64_t start;
+  uint8_t *out;
+
   if (!vctx->type->pair_verify_request1)
   {
     vctx->errmsg = "Verify request 1: Unsupported";
     return NULL;
   }
 
-  return vctx->type->pair_verify_request1(len, vctx);
+  start = stats_start();
+  out = vctx->type->pair_verify_request1(len, vctx);
+  stats_verify_step(vctx, true, 1, out ? 0 : -1, start);
+  return out;
 }
 
 uint8_t *
 pair_verify_request2(size_t *len, struct pair_verify_context *vctx)
 {
+  uint64_t start;
+  uint8_t *out;
+
   if (!vctx->type->pair_verify_request2)
   {
     vctx->errmsg = "Verify request 2: Unsupported";
     return NULL;
   }
 
-  return vctx->type->pair_verify_request2(len, vctx);
+  start = stats_start();
+  out = vctx->type->pair_verify_request2(len, vctx);
+  stats_verify_step(vctx, true, 2, out ? 0 : -1, start);
+  return out;
 }
 
 int pair_verify_response1(struct pair_verify_context *vctx, const uint8_t *in, size_t in_len)
 {
+  uint64_t start;
+  int ret;
+
   if (!vctx->type->pair_verify_response1)
   {
     vctx->errmsg = "Verify response 1: Unsupported";
     return -1;
   }
 
-  return vctx->type->pair_verify_response1(vctx, in, in_len);
+  start = stats_start();
+  ret = vctx->type->pair_verify_response1(vctx, in, in_len);
+  stats_verify_step(vctx, false, 1, ret < 0 ? -1 : 0, start);
+  return ret;
 }
 
 int pair_verify_response2(struct pair_verify_context *vctx, const uint8_t *in, size_t in_len)
 {
+  uint64_t start;
+  int ret;
+
   if (!vctx->type->pair_verify_response2)
   {
     vctx->errmsg = "Verify response 2: Unsupported";
     return -1;
   }
 
-  if (vctx->type->pair_verify_response2(vctx, in, in_len) != 0)
-    return -1;
-
-  return 0;
+  start = stats_start();
+  ret = (vctx->type->pair_verify_response2(vctx, in, in_len) != 0) ? -1 : 0;
+  stats_verify_step(vctx, false, 2, ret, start);
+  return ret;
 }
 
 int pair_verify_result(struct pair_result **result, struct pair_verify_context *vctx)
@@ -686,6 +1259,14 @@ int pair_verify_result(struct pair_result **result, struct pair_verify_context *
   return 0;
 }
 
+int pair_verify_resume_cache(enum pair_type type, int max_entries, int ttl_secs)
+{
+  if (!pair[type]->pair_verify_resume_cache)
+    return -1;
+
+  return pair[type]->pair_verify_resume_cache(max_entries, ttl_secs);
+}
+
 struct pair_cipher_context *
 pair_cipher_new(enum pair_type type, int channel, const uint8_t *shared_secret, size_t shared_secret_len)
 {
@@ -695,6 +1276,15 @@ pair_cipher_new(enum pair_type type, int channel, const uint8_t *shared_secret,
   return pair[type]->pair_cipher_new(pair[type], channel, shared_secret, shared_secret_len);
 }
 
+int
+pair_cipher_new_multi(struct pair_cipher_context **cctx, enum pair_type type, const int *channels, int nchannels, const uint8_t *shared_secret, size_t shared_secret_len)
+{
+  if (!pair[type]->pair_cipher_new_multi)
+    return -1;
+
+  return pair[type]->pair_cipher_new_multi(cctx, pair[type], channels, nchannels, shared_secret, shared_secret_len);
+}
+
 void pair_cipher_free(struct pair_cipher_context *cctx)
 {
   if (!cctx)
@@ -715,37 +1305,292 @@ pair_cipher_errmsg(struct pair_cipher_context *cctx)
 ssize_t
 pair_encrypt(uint8_t **ciphertext, size_t *ciphertext_len, const uint8_t *plaintext, size_t plaintext_len, struct pair_cipher_context *cctx)
 {
+  ssize_t ret;
+
   if (!cctx->type->pair_encrypt)
   {
     cctx->errmsg = "Encryption unsupported";
     return -1;
   }
 
-  return cctx->type->pair_encrypt(ciphertext, ciphertext_len, plaintext, plaintext_len, cctx);
+  ret = cctx->type->pair_encrypt(ciphertext, ciphertext_len, plaintext, plaintext_len, cctx);
+  if (ret >= 0 && stats_on())
+    stats_encrypted(cctx, ret);
+
+  return ret;
 }
 
 ssize_t
 pair_decrypt(uint8_t **plaintext, size_t *plaintext_len, const uint8_t *ciphertext, size_t ciphertext_len, struct pair_cipher_context *cctx)
 {
+  ssize_t ret;
+
   if (!cctx->type->pair_decrypt)
   {
     cctx->errmsg = "Decryption unsupported";
     return -1;
   }
 
-  return cctx->type->pair_decrypt(plaintext, plaintext_len, ciphertext, ciphertext_len, cctx);
+  ret = cctx->type->pair_decrypt(plaintext, plaintext_len, ciphertext, ciphertext_len, cctx);
+  if (ret >= 0 && stats_on())
+    stats_decrypted(cctx, *plaintext_len);
+
+  return ret;
 }
 
-void pair_encrypt_rollback(struct pair_cipher_context *cctx)
+ssize_t
+pair_encrypt_into(uint8_t *ciphertext, size_t *ciphertext_len, const uint8_t *plaintext, size_t plaintext_len, struct pair_cipher_context *cctx)
 {
-  cctx->encryption_counter = cctx->encryption_counter_prev;
-}
+  ssize_t ret;
+
+  if (!cctx->type->pair_encrypt_into)
+  {
+    cctx->errmsg = "Encryption unsupported";
+    return -1;
+  }
+
+  ret = cctx->type->pair_encrypt_into(ciphertext, ciphertext_len, plaintext, plaintext_len, cctx);
+  if (ret >= 0 && stats_on())
+    stats_encrypted(cctx, ret);
+
+  return ret;
+}
+
+ssize_t
+pair_decrypt_into(uint8_t *plaintext, size_t *plaintext_len, const uint8_t *ciphertext, size_t ciphertext_len, struct pair_cipher_context *cctx)
+{
+  ssize_t ret;
+
+  if (!cctx->type->pair_decrypt_into)
+  {
+    cctx->errmsg = "Decryption unsupported";
+    return -1;
+  }
+
+  ret = cctx->type->pair_decrypt_into(plaintext, plaintext_len, ciphertext, ciphertext_len, cctx);
+  if (ret >= 0 && stats_on())
+    stats_decrypted(cctx, *plaintext_len);
+
+  return ret;
+}
+
+ssize_t
+pair_encryptv(uint8_t *ciphertext, size_t *ciphertext_len, const struct iovec *iov, int iovcnt, struct pair_cipher_context *cctx)
+{
+  ssize_t ret;
+
+  if (!cctx->type->pair_encryptv)
+  {
+    cctx->errmsg = "Encryption unsupported";
+    return -1;
+  }
+
+  ret = cctx->type->pair_encryptv(ciphertext, ciphertext_len, iov, iovcnt, cctx);
+  if (ret >= 0 && stats_on())
+    stats_encrypted(cctx, ret);
+
+  return ret;
+}
+
+ssize_t
+pair_encrypt_fanout(uint8_t **ciphertext, size_t *ciphertext_len, const uint8_t *plaintext, size_t plaintext_len, struct pair_cipher_context **cctx, int ncctx, int njobs, pair_executor_cb executor, void *cb_arg)
+{
+  ssize_t ret;
+  int i;
+
+  if (ncctx <= 0)
+    return -1;
+
+  if (!cctx[0]->type->pair_encrypt_fanout)
+  {
+    cctx[0]->errmsg = "Encryption unsupported";
+    return -1;
+  }
+
+  for (i = 1; i < ncctx; i++)
+  {
+    if (cctx[i]->type->pair_encrypt_fanout != cctx[0]->type->pair_encrypt_fanout)
+    {
+      cctx[0]->errmsg = "Fanout encryption needs cipher contexts of the same kind";
+      return -1;
+    }
+  }
+
+  ret = cctx[0]->type->pair_encrypt_fanout(ciphertext, ciphertext_len, plaintext, plaintext_len, cctx, ncctx, njobs, executor, cb_arg);
+  if (ret >= 0 && stats_on())
+  {
+    for (i = 0; i < ncctx; i++)
+      stats_encrypted(cctx[i], ret);
+  }
+
+  return ret;
+}
+
+ssize_t
+pair_encrypted_len(size_t plaintext_len, struct pair_cipher_context *cctx)
+{
+  if (!cctx->type->pair_encrypted_len)
+  {
+    cctx->errmsg = "Encryption unsupported";
+    return -1;
+  }
+
+  return cctx->type->pair_encrypted_len(plaintext_len);
+}
+
+ssize_t
+pair_decrypted_len(const uint8_t *ciphertext, size_t ciphertext_len, struct pair_cipher_context *cctx)
+{
+  if (!cctx->type->pair_decrypted_len)
+  {
+    cctx->errmsg = "Decryption unsupported";
+    return -1;
+  }
+
+  return cctx->type->pair_decrypted_len(ciphertext, ciphertext_len);
+}
+
+int
+pair_cipher_parallel_set(struct pair_cipher_context *cctx, int njobs, pair_executor_cb executor, void *cb_arg)
+{
+  if (njobs < 0)
+  {
+    cctx->errmsg = "Invalid number of parallel jobs";
+    return -1;
+  }
+
+  cctx->parallel_jobs = njobs;
+  cctx->executor = executor;
+  cctx->executor_arg = cb_arg;
+
+  return 0;
+}
+
+void pair_encrypt_rollback(struct pair_cipher_context *cctx)
+{
+  cctx->encryption_counter = cctx->encryption_counter_prev;
+}
 
 void pair_decrypt_rollback(struct pair_cipher_context *cctx)
 {
   cctx->decryption_counter = cctx->decryption_counter_prev;
 }
 
+struct pair_decrypt_stream *
+pair_decrypt_stream_new(struct pair_cipher_context *cctx)
+{
+  struct pair_decrypt_stream *stream;
+
+  if (!cctx->type->pair_decrypt_stream)
+  {
+    cctx->errmsg = "Stream decryption unsupported";
+    return NULL;
+  }
+
+  stream = calloc(1, sizeof(struct pair_decrypt_stream));
+  if (!stream)
+    return NULL;
+
+  stream->cctx = cctx;
+
+  return stream;
+}
+
+void
+pair_decrypt_stream_free(struct pair_decrypt_stream *stream)
+{
+  if (!stream)
+    return;
+
+  sodium_memzero(stream, sizeof(struct pair_decrypt_stream));
+  free(stream);
+}
+
+ssize_t
+pair_decrypt_stream_process(uint8_t *plaintext, size_t *plaintext_len, int *nframes, const uint8_t *ciphertext, size_t ciphertext_len, struct pair_decrypt_stream *stream)
+{
+  ssize_t ret;
+
+  ret = stream->cctx->type->pair_decrypt_stream(plaintext, plaintext_len, nframes, ciphertext, ciphertext_len, stream);
+  if (ret >= 0 && stats_on())
+    stats_decrypted(stream->cctx, *plaintext_len);
+
+  return ret;
+}
+
+void
+pair_decrypt_stream_rollback(struct pair_decrypt_stream *stream)
+{
+  stream->cctx->decryption_counter = stream->cctx->decryption_counter_prev;
+
+  memcpy(stream->partial, stream->partial_prev, stream->partial_len_prev);
+  stream->partial_len = stream->partial_len_prev;
+}
+
+void pair_stats_enable(int enable)
+{
+  __atomic_store_n(&stats_enabled, enable ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+void pair_stats_step_cb_set(pair_stats_step_cb cb, void *cb_arg)
+{
+  stats_step_cb = cb;
+  stats_step_cb_arg = cb_arg;
+}
+
+// struct pair_stats only has uint64_t members, so it can be copied and reset
+// as an array with atomic loads and stores
+void pair_stats_get(struct pair_stats *stats)
+{
+  uint64_t *src = (uint64_t *)&stats_global;
+  uint64_t *dst = (uint64_t *)stats;
+  size_t i;
+
+  for (i = 0; i < sizeof(struct pair_stats) / sizeof(uint64_t); i++)
+    dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+void pair_stats_reset(void)
+{
+  uint64_t *dst = (uint64_t *)&stats_global;
+  size_t i;
+
+  for (i = 0; i < sizeof(struct pair_stats) / sizeof(uint64_t); i++)
+    __atomic_store_n(&dst[i], 0, __ATOMIC_RELAXED);
+}
+
+const struct pair_stats_handshake *
+pair_setup_stats(struct pair_setup_context *sctx)
+{
+  return &sctx->stats;
+}
+
+const struct pair_stats_handshake *
+pair_verify_stats(struct pair_verify_context *vctx)
+{
+  return &vctx->stats;
+}
+
+const struct pair_stats_cipher *
+pair_cipher_stats(struct pair_cipher_context *cctx)
+{
+  return &cctx->stats;
+}
+
+int pair_context_pool_set(int size)
+{
+  if (size < 0 || size > CONTEXT_POOL_SIZE_MAX)
+    return -1;
+
+  pthread_mutex_lock(&context_pool_lck);
+  context_pool_size = size;
+  context_pool_trim(&context_pool_setup, size);
+  context_pool_trim(&context_pool_verify, size);
+  pthread_mutex_unlock(&context_pool_lck);
+
+  return 0;
+}
+
 int pair_add(enum pair_type type, uint8_t **out, size_t *out_len, pair_cb add_cb, void *cb_arg, const uint8_t *in, size_t in_len)
 {
   if (!pair[type]->pair_add)
@@ -796,3 +1641,304 @@ void pair_public_key_get(enum pair_type type, uint8_t server_public_key[32], con
 
   pair[type]->pair_public_key_get(server_public_key, device_id);
 }
+
+int pair_server_identity_set(enum pair_type type, const char *device_id, const uint8_t public_key[32], const uint8_t private_key[64])
+{
+  if (!pair[type]->pair_server_identity_set)
+    return -1;
+
+  return pair[type]->pair_server_identity_set(device_id, public_key, private_key);
+}
+
+int pair_precompute_set(enum pair_type type, int size)
+{
+  if (!pair[type]->pair_precompute_set)
+    return -1;
+
+  return pair[type]->pair_precompute_set(size);
+}
+
+int pair_precompute_fill(enum pair_type type, int max)
+{
+  if (!pair[type]->pair_precompute_fill)
+    return -1;
+
+  return pair[type]->pair_precompute_fill(max);
+}
+
+/* ---------------------------- ASYNC HANDSHAKES ---------------------------- */
+
+#define PAIR_ASYNC_THREADS_MAX 64
+
+struct pair_async_job
+{
+  struct pair_setup_context *sctx;
+  struct pair_verify_context *vctx;
+  uint8_t *in;
+  size_t in_len;
+
+  int ret;
+  uint8_t *out;
+  size_t out_len;
+
+  pair_async_cb cb;
+  void *cb_arg;
+
+  struct pair_async_job *next;
+};
+
+// Jobs are run in the order they are queued, and callbacks are made in the
+// order the jobs complete
+struct pair_async_queue
+{
+  struct pair_async_job *head;
+  struct pair_async_job **tail;
+};
+
+struct pair_async
+{
+  pthread_t *threads;
+  int nthreads;
+
+  pthread_mutex_t lck;
+  pthread_cond_t cond;
+  bool is_stopping;
+
+  struct pair_async_queue queued;
+  struct pair_async_queue completed;
+
+  // Worker threads write a byte to pipefd[1] when a job is completed
+  int pipefd[2];
+};
+
+static void
+async_queue_push(struct pair_async_queue *queue, struct pair_async_job *job)
+{
+  job->next = NULL;
+  *queue->tail = job;
+  queue->tail = &job->next;
+}
+
+static struct pair_async_job *
+async_queue_pop(struct pair_async_queue *queue)
+{
+  struct pair_async_job *job = queue->head;
+
+  if (!job)
+    return NULL;
+
+  queue->head = job->next;
+  if (!queue->head)
+    queue->tail = &queue->head;
+
+  return job;
+}
+
+static void
+async_job_free(struct pair_async_job *job)
+{
+  free(job->in);
+  free(job->out);
+  free(job);
+}
+
+static void *
+async_thread_run(void *arg)
+{
+  struct pair_async *async = arg;
+  struct pair_async_job *job;
+  uint8_t byte = 0;
+
+  pthread_mutex_lock(&async->lck);
+  for (;;)
+  {
+    while (!async->queued.head && !async->is_stopping)
+      pthread_cond_wait(&async->cond, &async->lck);
+
+    // Queued jobs are finished before stopping, see pair_async_free()
+    job = async_queue_pop(&async->queued);
+    if (!job)
+      break;
+
+    pthread_mutex_unlock(&async->lck);
+
+    if (job->sctx)
+      job->ret = pair_setup(&job->out, &job->out_len, job->sctx, job->in, job->in_len);
+    else
+      job->ret = pair_verify(&job->out, &job->out_len, job->vctx, job->in, job->in_len);
+
+    pthread_mutex_lock(&async->lck);
+
+    async_queue_push(&async->completed, job);
+
+    // If the pipe is full there is already a byte waiting, so ignore errors
+    (void)!write(async->pipefd[1], &byte, 1);
+  }
+  pthread_mutex_unlock(&async->lck);
+
+  return NULL;
+}
+
+struct pair_async *
+pair_async_new(int nthreads)
+{
+  struct pair_async *async;
+  int i;
+
+  if (nthreads < 1 || nthreads > PAIR_ASYNC_THREADS_MAX)
+    return NULL;
+
+  async = calloc(1, sizeof(struct pair_async));
+  if (!async)
+    return NULL;
+
+  async->queued.tail = &async->queued.head;
+  async->completed.tail = &async->completed.head;
+  pthread_mutex_init(&async->lck, NULL);
+  pthread_cond_init(&async->cond, NULL);
+
+  async->threads = calloc(nthreads, sizeof(pthread_t));
+  if (!async->threads || pipe(async->pipefd) < 0)
+    goto error;
+
+  if (fcntl(async->pipefd[0], F_SETFL, O_NONBLOCK) < 0 || fcntl(async->pipefd[1], F_SETFL, O_NONBLOCK) < 0)
+    goto error_pipe;
+
+  for (async->nthreads = 0; async->nthreads < nthreads; async->nthreads++)
+  {
+    if (pthread_create(&async->threads[async->nthreads], NULL, async_thread_run, async) != 0)
+      break;
+  }
+
+  if (async->nthreads == 0)
+    goto error_pipe;
+
+  return async;
+
+ error_pipe:
+  for (i = 0; i < 2; i++)
+    close(async->pipefd[i]);
+ error:
+  pthread_cond_destroy(&async->cond);
+  pthread_mutex_destroy(&async->lck);
+  free(async->threads);
+  free(async);
+  return NULL;
+}
+
+void pair_async_free(struct pair_async *async)
+{
+  struct pair_async_job *job;
+  int i;
+
+  if (!async)
+    return;
+
+  pthread_mutex_lock(&async->lck);
+  async->is_stopping = true;
+  pthread_cond_broadcast(&async->cond);
+  pthread_mutex_unlock(&async->lck);
+
+  for (i = 0; i < async->nthreads; i++)
+    pthread_join(async->threads[i], NULL);
+
+  while ((job = async_queue_pop(&async->completed)))
+    async_job_free(job);
+
+  close(async->pipefd[0]);
+  close(async->pipefd[1]);
+  pthread_cond_destroy(&async->cond);
+  pthread_mutex_destroy(&async->lck);
+  free(async->threads);
+  free(async);
+}
+
+int pair_async_fd(struct pair_async *async)
+{
+  return async->pipefd[0];
+}
+
+int pair_async_dispatch(struct pair_async *async)
+{
+  struct pair_async_queue completed;
+  struct pair_async_job *job;
+  uint8_t buf[64];
+  int n = 0;
+
+  // Drain first, so a job completing after we took the list gives a new byte
+  while (read(async->pipefd[0], buf, sizeof(buf)) > 0)
+    ; // EMPTY
+
+  pthread_mutex_lock(&async->lck);
+  completed = async->completed;
+  if (!completed.head)
+    completed.tail = &completed.head;
+  async->completed.head = NULL;
+  async->completed.tail = &async->completed.head;
+  pthread_mutex_unlock(&async->lck);
+
+  while ((job = async_queue_pop(&completed)))
+  {
+    // Ownership of the output goes to the callback
+    job->cb(job->ret, job->out, job->out_len, job->cb_arg);
+    job->out = NULL;
+    async_job_free(job);
+    n++;
+  }
+
+  return n;
+}
+
+static int
+async_submit(struct pair_async *async, struct pair_setup_context *sctx, struct pair_verify_context *vctx, const uint8_t *in, size_t in_len, pair_async_cb cb, void *cb_arg)
+{
+  struct pair_async_job *job;
+
+  if (!cb)
+    return -1;
+
+  job = calloc(1, sizeof(struct pair_async_job));
+  if (!job)
+    return -1;
+
+  if (in_len > 0)
+  {
+    job->in = malloc(in_len);
+    if (!job->in)
+    {
+      free(job);
+      return -1;
+    }
+
+    memcpy(job->in, in, in_len);
+    job->in_len = in_len;
+  }
+
+  job->sctx = sctx;
+  job->vctx = vctx;
+  job->cb = cb;
+  job->cb_arg = cb_arg;
+
+  pthread_mutex_lock(&async->lck);
+  async_queue_push(&async->queued, job);
+  pthread_cond_signal(&async->cond);
+  pthread_mutex_unlock(&async->lck);
+
+  return 0;
+}
+
+int pair_async_setup(struct pair_async *async, struct pair_setup_context *sctx, const uint8_t *in, size_t in_len, pair_async_cb cb, void *cb_arg)
+{
+  if (!sctx)
+    return -1;
+
+  return async_submit(async, sctx, NULL, in, in_len, cb, cb_arg);
+}
+
+int pair_async_verify(struct pair_async *async, struct pair_verify_context *vctx, const uint8_t *in, size_t in_len, pair_async_cb cb, void *cb_arg)
+{
+  if (!vctx)
+    return -1;
+
+  return async_submit(async, NULL, vctx, in, in_len, cb, cb_arg);
+}
@@ -69,9 +69,13 @@ struct pair_result
 struct pair_setup_context;
 struct pair_verify_context;
 struct pair_cipher_context;
+struct pair_decrypt_stream;
+struct iovec;
 
 typedef int (*pair_cb)(uint8_t public_key[32], const char *device_id, void *cb_arg);
 typedef void (*pair_list_cb)(pair_cb list_cb, void *list_cb_arg, void *cb_arg);
+typedef void (*pair_job_cb)(void *job_arg);
+typedef void (*pair_executor_cb)(pair_job_cb job, void **job_args, int njobs, void *cb_arg);
 
 
 /* ------------------------------- pair setup ------------------------------- */
@@ -116,12 +120,24 @@ pair_setup(uint8_t **out, size_t *out_len, struct pair_setup_context *sctx, cons
 /* Returns the result of a pairing, or negative if pairing is not completed. See
  * 'struct pair_result' for info about pairing results. The string is a
  * representation of the result that is easy to persist and can be used to feed
- * back into pair_verify_new. The result and string becomes invalid when you
- * free sctx.
+ * back into pair_verify_new, or the keys in the result can be stored in binary
+ * and given to pair_verify_new_with_keys. The result and string becomes invalid
+ * when you free sctx.
  */
 int
 pair_setup_result(const char **client_setup_keys, struct pair_result **result, struct pair_setup_context *sctx);
 
+/* Server
+ * Enables a process-wide cache of the SRP salt and verifier that are made from
+ * the PIN when a client starts a pair setup. Since they take some time to
+ * calculate, the cache is useful if there are many setup requests with the
+ * same PIN, e.g. with transient pairing. The salt and verifier are replaced
+ * after rotation_secs. Set rotation_secs to 0 to disable (the default), this
+ * also clears the cache. Returns -1 if not supported by the pair type.
+ */
+int
+pair_setup_verifier_cache(enum pair_type type, int rotation_secs);
+
 /* These are for constructing specific message types and reading specific
  * message types. Not needed for Homekit pairing if you use pair_setup().
  */
@@ -164,6 +180,17 @@ pair_verify_new(enum pair_type type, const char *client_setup_keys, pair_cb get_
 void
 pair_verify_free(struct pair_verify_context *vctx);
 
+/* Client
+ * Same as pair_verify_new(), but with the keys in binary form instead of the
+ * hex string, e.g. the keys from 'struct pair_result' that a client has stored
+ * itself. The private key is in the 64 byte libsodium format (seed + public
+ * key), so the client public key is not given separately. server_public_key is
+ * optional, if it is NULL the server's signature is not validated (like with a
+ * key string without the server key).
+ */
+struct pair_verify_context *
+pair_verify_new_with_keys(enum pair_type type, const uint8_t client_private_key[64], const uint8_t server_public_key[32], const char *device_id);
+
 /* Returns last error message
  */
 const char *
@@ -182,6 +209,25 @@ pair_verify(uint8_t **out, size_t *out_len, struct pair_verify_context *sctx, co
 int
 pair_verify_result(struct pair_result **result, struct pair_verify_context *vctx);
 
+/* Client and server
+ * Enables a process-wide cache of sessions from completed pair verifications,
+ * so that a peer reconnecting within ttl_secs can do a pair-resume instead of
+ * a full pair verify. With pair-resume the verification completes after the
+ * first request and response, so a client using pair_verify() gets 0 with no
+ * output, and a client using the individual message functions should check
+ * pair_verify_result() after pair_verify_response1(). If the server doesn't
+ * have the session any more, it falls back to a normal pair verify. Sessions
+ * can only be resumed once, and the oldest is dropped when there are more than
+ * max_entries. The client only caches sessions with servers whose public key
+ * it has. A server only resumes sessions it verified with the same device_id,
+ * and if it has a get callback, only for controllers that are still paired, so
+ * the result has the controller's device_id as with a full verify. Set
+ * max_entries or ttl_secs to 0 to disable (the default), this also
+ * clears the cache. Returns -1 if not supported by the pair type.
+ */
+int
+pair_verify_resume_cache(enum pair_type type, int max_entries, int ttl_secs);
+
 /* These are for constructing specific message types and reading specific
  * message types. Not needed for Homekit pairing where you can use pair_verify().
  */
@@ -202,9 +248,25 @@ pair_verify_response2(struct pair_verify_context *vctx, const uint8_t *in, size_
  * pair_verify_result() - or, in case of transient pairing, from
  * pair_setup_result(). Give the shared secret as input to this function to
  * create a ciphering context.
+ *
+ * The ciphering context has its own copy of the keys, so once it has been
+ * created the setup and verify contexts can be freed (after copying anything
+ * else needed from the result). For a server with many connections this
+ * leaves only the ciphering context per encrypted session.
  */
 struct pair_cipher_context *
 pair_cipher_new(enum pair_type type, int channel, const uint8_t *shared_secret, size_t shared_secret_len);
+
+/* Creates ciphering contexts for nchannels channels from the same shared
+ * secret, e.g. for both the control and the event connection. This is faster
+ * than calling pair_cipher_new() for each channel, since the parts of the key
+ * derivation that are the same are only done once. cctx must have room for
+ * nchannels contexts, which must each be freed with pair_cipher_free().
+ * Returns 0 on success, -1 on error (no contexts are then returned).
+ */
+int
+pair_cipher_new_multi(struct pair_cipher_context **cctx, enum pair_type type, const int *channels, int nchannels, const uint8_t *shared_secret, size_t shared_secret_len);
+
 void
 pair_cipher_free(struct pair_cipher_context *cctx);
 
@@ -227,6 +289,82 @@ pair_encrypt(uint8_t **ciphertext, size_t *ciphertext_len, const uint8_t *plaint
 ssize_t
 pair_decrypt(uint8_t **plaintext, size_t *plaintext_len, const uint8_t *ciphertext, size_t ciphertext_len, struct pair_cipher_context *cctx);
 
+/* Like pair_encrypt()/pair_decrypt(), but the output is written to a buffer
+ * supplied by the caller, so nothing is allocated. On input *ciphertext_len
+ * (*plaintext_len) is the size of the buffer, on return it is the number of
+ * bytes written. Only as many blocks as fit in the buffer are processed, so
+ * check the return value like with pair_encrypt()/pair_decrypt(). If not even
+ * one block fits -1 is returned.
+ */
+ssize_t
+pair_encrypt_into(uint8_t *ciphertext, size_t *ciphertext_len, const uint8_t *plaintext, size_t plaintext_len, struct pair_cipher_context *cctx);
+ssize_t
+pair_decrypt_into(uint8_t *plaintext, size_t *plaintext_len, const uint8_t *ciphertext, size_t ciphertext_len, struct pair_cipher_context *cctx);
+
+/* Like pair_encrypt_into(), but the plaintext is gathered from iovcnt buffers,
+ * e.g. headers and body of a message, so they don't have to be copied into one
+ * contiguous buffer first. Blocks are built across the buffer boundaries. The
+ * return value is the total number of plaintext bytes encrypted.
+ */
+ssize_t
+pair_encryptv(uint8_t *ciphertext, size_t *ciphertext_len, const struct iovec *iov, int iovcnt, struct pair_cipher_context *cctx);
+
+/* Encrypts the same plaintext for ncctx sessions, e.g. a message that goes to
+ * all receivers in multi-room. The ciphertexts all have the same length, so
+ * there is a single allocation where the ciphertext for cctx[i] starts at
+ * *ciphertext + i * *ciphertext_len. Free with free(*ciphertext). The sessions
+ * can be distributed over up to njobs parallel jobs, see
+ * pair_cipher_parallel_set() about executor. Either all or none of the
+ * sessions are encrypted, and on success plaintext_len is returned.
+ */
+ssize_t
+pair_encrypt_fanout(uint8_t **ciphertext, size_t *ciphertext_len, const uint8_t *plaintext, size_t plaintext_len, struct pair_cipher_context **cctx, int ncctx, int njobs, pair_executor_cb executor, void *cb_arg);
+
+/* Returns the exact size of the buffer pair_encrypt_into() needs to encrypt
+ * plaintext_len bytes in one go, and the size pair_decrypt_into() needs for
+ * the complete blocks in the ciphertext. On error -1 is returned.
+ */
+ssize_t
+pair_encrypted_len(size_t plaintext_len, struct pair_cipher_context *cctx);
+ssize_t
+pair_decrypted_len(const uint8_t *ciphertext, size_t ciphertext_len, struct pair_cipher_context *cctx);
+
+/* Streaming decryption, for when the ciphertext arrives in chunks that don't
+ * follow the block boundaries. A block that is incomplete at the end of a chunk
+ * is kept in the stream context (at most one block), and completed by the next
+ * call. Plaintext is written to the caller's buffer as soon as a block has been
+ * authenticated. On input *plaintext_len is the size of the buffer, on return
+ * the number of bytes written, and *nframes is the number of blocks decrypted.
+ * The return value is the number of ciphertext bytes consumed, which is all of
+ * it unless the plaintext buffer was full. On error -1 is returned.
+ *
+ * The stream context references cctx, so it must be freed before cctx.
+ */
+struct pair_decrypt_stream *
+pair_decrypt_stream_new(struct pair_cipher_context *cctx);
+void
+pair_decrypt_stream_free(struct pair_decrypt_stream *stream);
+
+ssize_t
+pair_decrypt_stream_process(uint8_t *plaintext, size_t *plaintext_len, int *nframes, const uint8_t *ciphertext, size_t ciphertext_len, struct pair_decrypt_stream *stream);
+
+/* Rolls back the nonce and the buffered partial block to where they were before
+ * the last call to pair_decrypt_stream_process()
+ */
+void
+pair_decrypt_stream_rollback(struct pair_decrypt_stream *stream);
+
+/* Opt-in parallel encryption of large payloads. With njobs > 1 the blocks of a
+ * large plaintext given to pair_encrypt() or pair_encrypt_into() are split in
+ * up to njobs ranges that are encrypted in parallel. The result, incl. the
+ * nonce and what pair_encrypt_rollback() does, is the same as when encrypting
+ * serially. By default a thread is started per job, but you can give your own
+ * executor, e.g. a thread pool. It must run job(job_args[i]) for all njobs
+ * and only return when they have all completed. njobs 0 or 1 disables.
+ */
+int
+pair_cipher_parallel_set(struct pair_cipher_context *cctx, int njobs, pair_executor_cb executor, void *cb_arg);
+
 /* Rolls back the nonce
  */
 void
@@ -235,6 +373,129 @@ void
 pair_decrypt_rollback(struct pair_cipher_context *cctx);
 
 
+/* ------------------------- non-blocking handshakes ------------------------ */
+
+/* For running pair_setup() and pair_verify() on worker threads, so that e.g. an
+ * event loop isn't blocked while a step does its SRP or Ed25519 work. Create a
+ * pool of nthreads workers with pair_async_new(), and watch the fd returned by
+ * pair_async_fd() for reading. When it is readable, call pair_async_dispatch(),
+ * which makes the callbacks of the steps that have completed. The callbacks
+ * are made in the thread that calls pair_async_dispatch(), and get what
+ * pair_setup() or pair_verify() returned and output. The callback must free
+ * out. pair_async_dispatch() returns the number of callbacks made.
+ *
+ * pair_async_setup() and pair_async_verify() copy the input, so it doesn't need
+ * to be kept, but the context must not be used or freed before the callback has
+ * been made. Note that the setup and verify callbacks (e.g. add_cb) given to
+ * the context will be called from a worker thread. Returns -1 on error, and
+ * then no callback will be made.
+ *
+ * pair_async_free() waits for running and queued steps to finish, but doesn't
+ * make their callbacks.
+ */
+struct pair_async;
+
+typedef void (*pair_async_cb)(int ret, uint8_t *out, size_t out_len, void *cb_arg);
+
+struct pair_async *
+pair_async_new(int nthreads);
+
+void
+pair_async_free(struct pair_async *async);
+
+int
+pair_async_fd(struct pair_async *async);
+
+int
+pair_async_dispatch(struct pair_async *async);
+
+int
+pair_async_setup(struct pair_async *async, struct pair_setup_context *sctx, const uint8_t *in, size_t in_len, pair_async_cb cb, void *cb_arg);
+
+int
+pair_async_verify(struct pair_async *async, struct pair_verify_context *vctx, const uint8_t *in, size_t in_len, pair_async_cb cb, void *cb_arg);
+
+
+/* -------------------------------- statistics ------------------------------ */
+
+/* Opt-in counters and step timing, for feeding a metrics system. Statistics
+ * are off by default, and then the only cost is a check of a flag in each
+ * handshake step and cipher call. Turn them on with pair_stats_enable(1).
+ *
+ * The counters are kept both globally, see pair_stats_get(), and per context,
+ * where each kind of context only has its own part. The modexp counters are
+ * only global, since the SRP work is also done outside of a context when
+ * filling the precompute pool. All times are in nanoseconds.
+ *
+ * A handshake is counted as started at its first step, and as ended at the
+ * step that completes it or at the first failing step. Auth failures are
+ * counted by the side that rejected the peer, e.g. due to a wrong PIN or
+ * signature. The side that gets the error message counts a failure.
+ */
+#define PAIR_STATS_MSG_MAX 6
+
+struct pair_stats_handshake
+{
+  uint64_t started;
+  uint64_t completed;
+  uint64_t auth_failed;
+  uint64_t failed; // Other errors, e.g. invalid messages
+  uint64_t step_ns[PAIR_STATS_MSG_MAX]; // Time spent making or reading M1, M2, ...
+  uint64_t step_count[PAIR_STATS_MSG_MAX];
+};
+
+struct pair_stats_cipher
+{
+  uint64_t bytes_encrypted; // Plaintext bytes
+  uint64_t frames_encrypted;
+  uint64_t bytes_decrypted;
+  uint64_t frames_decrypted;
+  uint64_t decrypt_auth_failures;
+};
+
+struct pair_stats
+{
+  struct pair_stats_handshake setup;
+  struct pair_stats_handshake verify;
+  struct pair_stats_cipher cipher;
+
+  uint64_t modexp_ns; // SRP modular exponentiation
+  uint64_t modexp_count;
+};
+
+/* Called at the end of each setup or verify step, if statistics are on.
+ * msg_no is the number of the message the step made or read (1-6 for
+ * pair-setup and 1-4 for pair-verify), and ret is -1 if the step failed. The
+ * timestamps are from CLOCK_MONOTONIC. Note that with pair_async_setup() and
+ * pair_async_verify() the callback is made from a worker thread.
+ */
+typedef void (*pair_stats_step_cb)(int is_verify, int msg_no, int ret, uint64_t start_ns, uint64_t end_ns, void *cb_arg);
+
+void
+pair_stats_enable(int enable);
+
+/* Should be set before handshakes are started, since it isn't synchronized
+ * with running steps. Set cb to NULL to remove it.
+ */
+void
+pair_stats_step_cb_set(pair_stats_step_cb cb, void *cb_arg);
+
+void
+pair_stats_get(struct pair_stats *stats);
+
+void
+pair_stats_reset(void);
+
+const struct pair_stats_handshake *
+pair_setup_stats(struct pair_setup_context *sctx);
+
+const struct pair_stats_handshake *
+pair_verify_stats(struct pair_verify_context *vctx);
+
+const struct pair_stats_cipher *
+pair_cipher_stats(struct pair_cipher_context *cctx);
+
+
 /* --------------------------------- other ---------------------------------- */
 
 /* These are for Homekit pairing where they are called by the controller, e.g.
@@ -263,4 +524,42 @@ pair_state_get(enum pair_type type, const char **errmsg, const uint8_t *in, size
 void
 pair_public_key_get(enum pair_type type, uint8_t server_public_key[32], const char *device_id);
 
+/* For servers, registers the keypair to use for device_id, e.g. a keypair that
+ * the server has stored itself. Without a registered keypair, pair_ap derives
+ * one from device_id as described above, and keeps it so it is only derived
+ * once. The private key is in the 64 byte libsodium format (seed + public
+ * key). Set both keys to NULL to remove the registration. Returns -1 if the
+ * input is invalid or the pair type does not support it.
+ */
+int
+pair_server_identity_set(enum pair_type type, const char *device_id, const uint8_t public_key[32], const uint8_t private_key[64]);
+
+/* Opt-in pool of precomputed ephemeral keys, so that the asymmetric work that
+ * pair-setup and pair-verify need can be done before a request arrives.
+ * pair_precompute_set() sets the number of entries of each kind the pool can
+ * hold (max 1024), or disables the pool and wipes its contents if size is 0
+ * (the default). The pool is shared by all Homekit pair types. Entries are
+ * only used once.
+ *
+ * pair_precompute_fill() makes up to max new entries, or fewer if the pool
+ * becomes full, and returns the number made (or -1 on error). It does the
+ * work without holding the pool lock, so it is meant to be called off the hot
+ * path, e.g. from an idle timer or a worker thread.
+ */
+int
+pair_precompute_set(enum pair_type type, int size);
+
+int
+pair_precompute_fill(enum pair_type type, int max);
+
+/* Opt-in pool of released setup and verify contexts, so that a server doing
+ * many handshakes reuses the memory instead of allocating new contexts each
+ * time. Up to size contexts of each kind are kept (max 65536), and size 0 (the
+ * default) frees the pool. Contexts are wiped with sodium_memzero() when they
+ * are freed, whether they go to the pool or not. The pool is shared by all pair
+ * types. Returns -1 if size is invalid.
+ */
+int
+pair_context_pool_set(int size);
+
 #endif  /* !__PAIR_AP_H__ */
@@ -34,6 +34,7 @@
 #include <sodium.h>
 
 #include <assert.h>
+#include <pthread.h>
 
 #include "pair-internal.h"
 
@@ -61,12 +62,18 @@ typedef struct
   bnum N;
   bnum g;
   int N_len;
+  bnum k;                                    // H(N | PAD(g))
+  bnum_mont mont;                            // Montgomery context for N
+  struct bnum_fixed_base *g_table;           // For g^x, only standard groups
+  unsigned char H_xor[SHA512_DIGEST_LENGTH]; // H(N) xor H(g)
+  bool is_shared;                            // Owned by ng_cache, don't free
 } NGConstant;
 
 struct SRPUser
 {
   enum hash_alg     alg;
   NGConstant        *ng;
+  bnum_ctx          ctx;
 
   bnum a;
   bnum A;
@@ -109,10 +116,45 @@ static struct NGHex global_Ng_constants[] =
 };
 
 
+// The constants for the standard groups never change, so they are created
+// once per group and hash algorithm, and then shared by all SRP sessions
+struct ng_cache_entry
+{
+  SRP_NGType ng_type;
+  enum hash_alg alg;
+  NGConstant *ng;
+};
+
+static struct ng_cache_entry ng_cache[SRP_NG_CUSTOM * 5]; // 5 hash algorithms
+static int ng_cache_len;
+static pthread_mutex_t ng_cache_lck = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+ng_destroy(NGConstant *ng)
+{
+  if (!ng)
+    return;
+
+  bnum_free(ng->N);
+  bnum_free(ng->g);
+  bnum_free(ng->k);
+  bnum_fixed_base_free(ng->g_table);
+  bnum_mont_free(ng->mont);
+  free(ng);
+}
+
 static NGConstant *
-new_ng(SRP_NGType ng_type, const char *n_hex, const char *g_hex)
+ng_create(enum hash_alg alg, SRP_NGType ng_type, const char *n_hex, const char *g_hex)
 {
-  NGConstant *ng = calloc(1, sizeof(NGConstant));
+  unsigned char H_N[SHA512_DIGEST_LENGTH];
+  unsigned char H_g[SHA512_DIGEST_LENGTH];
+  NGConstant *ng;
+  bnum_ctx ctx;
+  int i;
+
+  ng = calloc(1, sizeof(NGConstant));
+  if (!ng)
+    return NULL;
 
   if ( ng_type != SRP_NG_CUSTOM )
     {
@@ -122,21 +164,108 @@ new_ng(SRP_NGType ng_type, const char *n_hex, const char *g_hex)
 
   bnum_hex2bn(ng->N, n_hex);
   bnum_hex2bn(ng->g, g_hex);
+  if (!ng->N || !ng->g)
+    goto error;
 
   ng->N_len = bnum_num_bytes(ng->N);
 
+  bnum_ctx_new(ctx);
+  if (!ctx)
+    goto error;
+
+  bnum_mont_new(ng->mont, ng->N, ctx);
+  bnum_ctx_free(ctx);
+  if (!ng->mont)
+    goto error;
+
+  // Custom groups aren't cached, so a table would only be used once. The table
+  // is made for the random 256 bit a and b, larger exponents (like x, if it is
+  // a SHA-512 hash) will just use normal modexp.
+  if (ng_type != SRP_NG_CUSTOM)
+    ng->g_table = bnum_fixed_base_new(ng->g, ng->N, ng->mont, 256);
+
+  ng->k = H_nn_pad(alg, ng->N, ng->g, ng->N_len); // MODIFIED from H_nn(alg, ng->N, ng->g)
+  if (!ng->k)
+    goto error;
+
+  hash_num(alg, ng->N, H_N);
+  hash_num(alg, ng->g, H_g);
+
+  for (i = 0; i < hash_length(alg); i++)
+    ng->H_xor[i] = H_N[i] ^ H_g[i];
+
+  return ng;
+
+ error:
+  ng_destroy(ng);
+  return NULL;
+}
+
+static NGConstant *
+new_ng(enum hash_alg alg, SRP_NGType ng_type, const char *n_hex, const char *g_hex)
+{
+  NGConstant *ng = NULL;
+  int i;
+
+  if (ng_type == SRP_NG_CUSTOM)
+    return ng_create(alg, ng_type, n_hex, g_hex);
+
+  pthread_mutex_lock(&ng_cache_lck);
+
+  for (i = 0; i < ng_cache_len; i++)
+    {
+      if (ng_cache[i].ng_type == ng_type && ng_cache[i].alg == alg)
+	{
+	  ng = ng_cache[i].ng;
+	  goto out;
+	}
+    }
+
+  ng = ng_create(alg, ng_type, NULL, NULL);
+  if (ng && ng_cache_len < sizeof(ng_cache)/sizeof(ng_cache[0]))
+    {
+      ng->is_shared = true;
+      ng_cache[ng_cache_len].ng_type = ng_type;
+      ng_cache[ng_cache_len].alg = alg;
+      ng_cache[ng_cache_len].ng = ng;
+      ng_cache_len++;
+    }
+
+ out:
+  pthread_mutex_unlock(&ng_cache_lck);
   return ng;
 }
 
 static void
 free_ng(NGConstant * ng)
 {
-  if (!ng)
+  if (!ng || ng->is_shared)
     return;
 
-  bnum_free(ng->N);
-  bnum_free(ng->g);
-  free(ng);
+  ng_destroy(ng);
+}
+
+// result = g^exp mod N, using the precomputed table if possible
+static void
+ng_modexp_g(bnum result, NGConstant *ng, bnum exp, bnum_ctx ctx)
+{
+  uint64_t start = stats_start();
+
+  if (!ng->g_table || bnum_fixed_base_modexp(result, exp, ng->g_table, ctx) != 0)
+    bnum_modexp_mont(result, ng->g, exp, ng->N, ng->mont, ctx);
+
+  stats_modexp_end(start);
+}
+
+// result = y^exp mod N
+static void
+ng_modexp(bnum result, NGConstant *ng, bnum y, bnum exp, bnum_ctx ctx)
+{
+  uint64_t start = stats_start();
+
+  bnum_modexp_mont(result, y, exp, ng->N, ng->mont, ctx);
+
+  stats_modexp_end(start);
 }
 
 static bnum
@@ -178,25 +307,15 @@ static void
 calculate_M(enum hash_alg alg, NGConstant *ng, unsigned char *dest, const char *I, const bnum s,
             const bnum A, const bnum B, const unsigned char *K, int K_len)
 {
-  unsigned char H_N[ SHA512_DIGEST_LENGTH ];
-  unsigned char H_g[ SHA512_DIGEST_LENGTH ];
   unsigned char H_I[ SHA512_DIGEST_LENGTH ];
-  unsigned char H_xor[ SHA512_DIGEST_LENGTH ];
   HashCTX       ctx;
-  int           i = 0;
   int           hash_len = hash_length(alg);
 
-  hash_num( alg, ng->N, H_N );
-  hash_num( alg, ng->g, H_g );
-
   hash(alg, (const unsigned char *)I, strlen(I), H_I);
 
-  for (i=0; i < hash_len; i++ )
-    H_xor[i] = H_N[i] ^ H_g[i];
-    
   hash_init( alg, &ctx );
 
-  hash_update( alg, &ctx, H_xor, hash_len );
+  hash_update( alg, &ctx, ng->H_xor, hash_len );
   hash_update( alg, &ctx, H_I,   hash_len );
   update_hash_n( alg, &ctx, s );
   update_hash_n( alg, &ctx, A );
@@ -232,13 +351,14 @@ srp_user_new(enum hash_alg alg, SRP_NGType ng_type, const char *username,
     goto err_exit;
 
   usr->alg = alg;
-  usr->ng  = new_ng( ng_type, n_hex, g_hex );
+  usr->ng  = new_ng( alg, ng_type, n_hex, g_hex );
 
   bnum_new(usr->a);
   bnum_new(usr->A);
   bnum_new(usr->S);
+  bnum_ctx_new(usr->ctx);
 
-  if (!usr->ng || !usr->a || !usr->A || !usr->S)
+  if (!usr->ng || !usr->a || !usr->A || !usr->S || !usr->ctx)
     goto err_exit;
 
   usr->username     = malloc(ulen);
@@ -263,6 +383,9 @@ srp_user_new(enum hash_alg alg, SRP_NGType ng_type, const char *username,
   bnum_free(usr->a);
   bnum_free(usr->A);
   bnum_free(usr->S);
+  if (usr->ctx)
+    bnum_ctx_free(usr->ctx);
+  free_ng(usr->ng);
 
   free(usr->username);
   if (usr->password)
@@ -284,6 +407,7 @@ srp_user_free(struct SRPUser *usr)
   bnum_free(usr->a);
   bnum_free(usr->A);
   bnum_free(usr->S);
+  bnum_ctx_free(usr->ctx);
 
   free_ng(usr->ng);
 
@@ -317,7 +441,7 @@ srp_user_start_authentication(struct SRPUser *usr, const char **username,
                               const unsigned char **bytes_A, int *len_A)
 {
   bnum_random(usr->a, 256);
-  bnum_modexp(usr->A, usr->ng->g, usr->a, usr->ng->N);
+  ng_modexp_g(usr->A, usr->ng, usr->a, usr->ctx);
 
   *len_A   = bnum_num_bytes(usr->A);
   *bytes_A = malloc(*len_A);
@@ -342,7 +466,7 @@ srp_user_process_challenge(struct SRPUser *usr, const unsigned char *bytes_s, in
                            const unsigned char *bytes_B, int len_B,
                            const unsigned char **bytes_M, int *len_M )
 {
-  bnum s, B, k, v;
+  bnum s, B, v;
   bnum tmp1, tmp2, tmp3;
   bnum u, x;
 
@@ -351,13 +475,13 @@ srp_user_process_challenge(struct SRPUser *usr, const unsigned char *bytes_s, in
 
   bnum_bin2bn(s, bytes_s, len_s);
   bnum_bin2bn(B, bytes_B, len_B);
-  k    = H_nn_pad(usr->alg, usr->ng->N, usr->ng->g, usr->ng->N_len);
+
   bnum_new(v);
   bnum_new(tmp1);
   bnum_new(tmp2);
   bnum_new(tmp3);
 
-  if (!s || !B || !k || !v || !tmp1 || !tmp2 || !tmp3)
+  if (!s || !B || !v || !tmp1 || !tmp2 || !tmp3)
     goto cleanup1;
 
   u = H_nn_pad(usr->alg, usr->A, B, usr->ng->N_len);
@@ -368,15 +492,14 @@ srp_user_process_challenge(struct SRPUser *usr, const unsigned char *bytes_s, in
   // SRP-6a safety check
   if (!bnum_is_zero(B) && !bnum_is_zero(u))
     {
-      bnum_modexp(v, usr->ng->g, x, usr->ng->N);
+      ng_modexp_g(v, usr->ng, x, usr->ctx);  // v = g^x
 
       // S = (B - k*(g^x)) ^ (a + ux)
-      bnum_mul(tmp1, u, x);
+      bnum_mul_ctx(tmp1, u, x, usr->ctx);
       bnum_add(tmp2, usr->a, tmp1);        // tmp2 = (a + ux)
-      bnum_modexp(tmp1, usr->ng->g, x, usr->ng->N);
-      bnum_mul(tmp3, k, tmp1);             // tmp3 = k*(g^x)
+      bnum_mul_ctx(tmp3, usr->ng->k, v, usr->ctx); // tmp3 = k*(g^x)
       bnum_sub(tmp1, B, tmp3);             // tmp1 = (B - K*(g^x))
-      bnum_modexp(usr->S, tmp1, tmp2, usr->ng->N);
+      ng_modexp(usr->S, usr->ng, tmp1, tmp2, usr->ctx);
 
       usr->session_key_len = hash_session_key(usr->alg, usr->S, usr->session_key);
 
@@ -395,7 +518,6 @@ srp_user_process_challenge(struct SRPUser *usr, const unsigned char *bytes_s, in
   bnum_free(tmp2);
   bnum_free(tmp1);
   bnum_free(v);
-  bnum_free(k);
   bnum_free(B);
   bnum_free(s);
 }
@@ -866,43 +988,59 @@ client_setup_result(struct pair_setup_context *handle)
 }
 
 
+// The fruit verification doesn't validate the server's signature, so
+// server_public_key isn't used
 static int
-client_verify_new(struct pair_verify_context *handle, const char *client_setup_keys, pair_cb cb, void *cb_arg, const char *device_id)
+client_verify_new_with_keys(struct pair_verify_context *handle, const uint8_t *client_private_key, const uint8_t *server_public_key, const char *device_id)
 {
   struct pair_client_verify_context *vctx = &handle->vctx.client;
+
+  if (!is_initialized())
+    return -1;
+
+  if (device_id && strlen(device_id) != 16)
+    return -1;
+
+  if (device_id)
+    memcpy(vctx->device_id, device_id, strlen(device_id));
+
+  memcpy(vctx->client_private_key, client_private_key, sizeof(vctx->client_private_key));
+
+  crypto_sign_ed25519_sk_to_pk(vctx->client_public_key, vctx->client_private_key);
+
+  return 0;
+}
+
+static int
+client_verify_new(struct pair_verify_context *handle, const char *client_setup_keys, pair_cb cb, void *cb_arg, const char *device_id)
+{
+  uint8_t client_private_key[crypto_sign_SECRETKEYBYTES];
   char hex[] = { 0, 0, 0 };
   size_t hexkey_len;
   const char *ptr;
+  int ret;
   int i;
 
-  if (!is_initialized())
-    return -1;
-
   if (!client_setup_keys)
     return -1;
 
   hexkey_len = strlen(client_setup_keys);
 
-  if (hexkey_len != 2 * sizeof(vctx->client_private_key))
-    return -1;
-
-  if (device_id && strlen(device_id) != 16)
+  if (hexkey_len != 2 * sizeof(client_private_key))
     return -1;
 
-  if (device_id)
-    memcpy(vctx->device_id, device_id, strlen(device_id));
-
   ptr = client_setup_keys;
-  for (i = 0; i < sizeof(vctx->client_private_key); i++, ptr+=2)
+  for (i = 0; i < sizeof(client_private_key); i++, ptr+=2)
     {
       hex[0] = ptr[0];
       hex[1] = ptr[1];
-      vctx->client_private_key[i] = strtol(hex, NULL, 16);
+      client_private_key[i] = strtol(hex, NULL, 16);
     }
 
-  crypto_sign_ed25519_sk_to_pk(vctx->client_public_key, vctx->client_private_key);
+  ret = client_verify_new_with_keys(handle, client_private_key, NULL, device_id);
 
-  return 0;
+  sodium_memzero(client_private_key, sizeof(client_private_key));
+  return ret;
 }
 
 static uint8_t *
@@ -1053,6 +1191,7 @@ struct pair_definition pair_client_fruit =
   .pair_setup_response3 = client_setup_response3,
 
   .pair_verify_new = client_verify_new,
+  .pair_verify_new_with_keys = client_verify_new_with_keys,
 
   .pair_verify_request1 = client_verify_request1,
   .pair_verify_request2 = client_verify_request2,
@@ -40,6 +40,9 @@
 #include <inttypes.h>
 
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h> // for struct iovec
 
 #include <sodium.h>
 
@@ -52,7 +55,6 @@
 #define USERNAME "Pair-Setup"
 #define AUTHTAG_LENGTH 16
 #define NONCE_LENGTH 12 // 96 bits according to chacha poly1305
-#define REQUEST_BUFSIZE 4096
 #define ENCRYPTED_LEN_MAX 0x400
 
 // #define DEBUG_SHORT_A 1
@@ -75,6 +77,10 @@ enum pair_keys
   PAIR_CONTROL_READ,
   PAIR_EVENTS_WRITE,
   PAIR_EVENTS_READ,
+  PAIR_RESUME_MSG01,
+  PAIR_RESUME_MSG02,
+  PAIR_RESUME_SHARED_SECRET,
+  PAIR_VERIFY_RESUME_SESSION_ID,
 };
 
 struct pair_keys_map
@@ -110,6 +116,12 @@ static struct pair_keys_map pair_keys_map[] =
   // Encryption/decryption of event channel
   { 0, "Events-Salt", "Events-Write-Encryption-Key", "" },
   { 0, "Events-Salt", "Events-Read-Encryption-Key", "" },
+
+  // Used for pair-resume, where the salt is the client public key + session ID
+  { 0x01, NULL, "Pair-Resume-Request-Info", "PR-Msg01" },
+  { 0x02, NULL, "Pair-Resume-Response-Info", "PR-Msg02" },
+  { 0, NULL, "Pair-Resume-Shared-Secret-Info", "" },
+  { 0, "Pair-Verify-ResumeSessionID-Salt", "Pair-Verify-ResumeSessionID-Info", "" },
 };
 
 enum pair_method {
@@ -118,7 +130,8 @@ enum pair_method {
   PairingMethodPairVerify         = 0x02,
   PairingMethodAddPairing         = 0x03,
   PairingMethodRemovePairing      = 0x04,
-  PairingMethodListPairings       = 0x05
+  PairingMethodListPairings       = 0x05,
+  PairingMethodPairResume         = 0x06
 };
 
 enum pair_flags {
@@ -142,15 +155,22 @@ typedef enum
 
 typedef struct
 {
+  SRP_NGType ng_type;
   int N_len;
   bnum N;
   bnum g;
+  bnum k;                                    // H(N | PAD(g))
+  bnum_mont mont;                            // Montgomery context for N
+  struct bnum_fixed_base *g_table;           // For g^x, only standard groups
+  unsigned char H_xor[SHA512_DIGEST_LENGTH]; // H(N) xor H(g)
+  bool is_shared;                            // Owned by ng_cache, don't free
 } NGConstant;
 
 struct SRPUser
 {
   enum hash_alg     alg;
   NGConstant        *ng;
+  bnum_ctx          ctx;
 
   bnum a;
   bnum A;
@@ -225,10 +245,45 @@ static struct NGHex global_Ng_constants[] =
 };
 
 
+// The constants for the standard groups never change, so they are created
+// once per group and hash algorithm, and then shared by all SRP sessions
+struct ng_cache_entry
+{
+  SRP_NGType ng_type;
+  enum hash_alg alg;
+  NGConstant *ng;
+};
+
+static struct ng_cache_entry ng_cache[SRP_NG_CUSTOM * 5]; // 5 hash algorithms
+static int ng_cache_len;
+static pthread_mutex_t ng_cache_lck = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+ng_destroy(NGConstant *ng)
+{
+  if (!ng)
+    return;
+
+  bnum_free(ng->N);
+  bnum_free(ng->g);
+  bnum_free(ng->k);
+  bnum_fixed_base_free(ng->g_table);
+  bnum_mont_free(ng->mont);
+  free(ng);
+}
+
 static NGConstant *
-new_ng(SRP_NGType ng_type, const char *n_hex, const char *g_hex)
+ng_create(enum hash_alg alg, SRP_NGType ng_type, const char *n_hex, const char *g_hex)
 {
-  NGConstant *ng = calloc(1, sizeof(NGConstant));
+  unsigned char H_N[SHA512_DIGEST_LENGTH];
+  unsigned char H_g[SHA512_DIGEST_LENGTH];
+  NGConstant *ng;
+  bnum_ctx ctx;
+  int i;
+
+  ng = calloc(1, sizeof(NGConstant));
+  if (!ng)
+    return NULL;
 
   if ( ng_type != SRP_NG_CUSTOM )
     {
@@ -238,23 +293,367 @@ new_ng(SRP_NGType ng_type, const char *n_hex, const char *g_hex)
 
   bnum_hex2bn(ng->N, n_hex);
   bnum_hex2bn(ng->g, g_hex);
+  if (!ng->N || !ng->g)
+    goto error;
 
   ng->N_len = bnum_num_bytes(ng->N);
+  ng->ng_type = ng_type;
+
+  bnum_ctx_new(ctx);
+  if (!ctx)
+    goto error;
+
+  bnum_mont_new(ng->mont, ng->N, ctx);
+  bnum_ctx_free(ctx);
+  if (!ng->mont)
+    goto error;
+
+  // Custom groups aren't cached, so a table would only be used once. The table
+  // is made for the random 256 bit a and b, larger exponents (like x, if it is
+  // a SHA-512 hash) will just use normal modexp.
+  if (ng_type != SRP_NG_CUSTOM)
+    ng->g_table = bnum_fixed_base_new(ng->g, ng->N, ng->mont, 256);
 
   assert(ng_type == SRP_NG_CUSTOM || ng->N_len == global_Ng_constants[ng_type].N_len);
 
+  ng->k = H_nn_pad(alg, ng->N, ng->g, ng->N_len); // MODIFIED from H_nn(alg, ng->N, ng->g)
+  if (!ng->k)
+    goto error;
+
+  hash_num(alg, ng->N, H_N);
+  hash_num(alg, ng->g, H_g);
+
+  for (i = 0; i < hash_length(alg); i++)
+    ng->H_xor[i] = H_N[i] ^ H_g[i];
+
+  return ng;
+
+ error:
+  ng_destroy(ng);
+  return NULL;
+}
+
+static NGConstant *
+new_ng(enum hash_alg alg, SRP_NGType ng_type, const char *n_hex, const char *g_hex)
+{
+  NGConstant *ng = NULL;
+  int i;
+
+  if (ng_type == SRP_NG_CUSTOM)
+    return ng_create(alg, ng_type, n_hex, g_hex);
+
+  pthread_mutex_lock(&ng_cache_lck);
+
+  for (i = 0; i < ng_cache_len; i++)
+    {
+      if (ng_cache[i].ng_type == ng_type && ng_cache[i].alg == alg)
+	{
+	  ng = ng_cache[i].ng;
+	  goto out;
+	}
+    }
+
+  ng = ng_create(alg, ng_type, NULL, NULL);
+  if (ng && ng_cache_len < sizeof(ng_cache)/sizeof(ng_cache[0]))
+    {
+      ng->is_shared = true;
+      ng_cache[ng_cache_len].ng_type = ng_type;
+      ng_cache[ng_cache_len].alg = alg;
+      ng_cache[ng_cache_len].ng = ng;
+      ng_cache_len++;
+    }
+
+ out:
+  pthread_mutex_unlock(&ng_cache_lck);
   return ng;
 }
 
 static void
 free_ng(NGConstant * ng)
 {
-  if (!ng)
+  if (!ng || ng->is_shared)
     return;
 
-  bnum_free(ng->N);
-  bnum_free(ng->g);
-  free(ng);
+  ng_destroy(ng);
+}
+
+// result = g^exp mod N, using the precomputed table if possible
+static void
+ng_modexp_g(bnum result, NGConstant *ng, bnum exp, bnum_ctx ctx)
+{
+  uint64_t start = stats_start();
+
+  if (!ng->g_table || bnum_fixed_base_modexp(result, exp, ng->g_table, ctx) != 0)
+    bnum_modexp_mont(result, ng->g, exp, ng->N, ng->mont, ctx);
+
+  stats_modexp_end(start);
+}
+
+// result = y^exp mod N
+static void
+ng_modexp(bnum result, NGConstant *ng, bnum y, bnum exp, bnum_ctx ctx)
+{
+  uint64_t start = stats_start();
+
+  bnum_modexp_mont(result, y, exp, ng->N, ng->mont, ctx);
+
+  stats_modexp_end(start);
+}
+
+/* Optional pool of ephemeral values that are made in advance, so that most of
+ * the asymmetric work is moved out of the request-response round trip. There
+ * are X25519 keypairs for pair-verify, and SRP exponents e with g^e for the
+ * client's a/A and the server's b/B in pair-setup. The pool is filled by
+ * pair_precompute_fill(), e.g. from an idle timer or a worker thread. Each
+ * entry is handed out only once and is wiped when taken.
+ */
+#define EPH_POOL_SIZE_MAX 1024
+#define EPH_POOL_NG_TYPE SRP_NG_3072 // The group that Homekit uses
+#define EPH_POOL_SRP_EXP_LEN 32 // Same as the 256 bit a and b
+#define EPH_POOL_SRP_N_LEN 384
+
+struct eph_x25519
+{
+  uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+  uint8_t private_key[crypto_box_SECRETKEYBYTES];
+};
+
+struct eph_srp
+{
+  unsigned char e[EPH_POOL_SRP_EXP_LEN];
+  int e_len;
+  unsigned char ge[EPH_POOL_SRP_N_LEN]; // g^e mod N
+  int ge_len;
+};
+
+struct eph_pool
+{
+  int size; // Capacity of each array, 0 means disabled
+
+  struct eph_x25519 *x25519;
+  int x25519_count;
+
+  struct eph_srp *srp;
+  int srp_count;
+};
+
+static struct eph_pool eph_pool;
+static pthread_mutex_t eph_pool_lck = PTHREAD_MUTEX_INITIALIZER;
+
+// Caller must hold eph_pool_lck
+static void
+eph_pool_clear(void)
+{
+  if (eph_pool.x25519)
+    sodium_memzero(eph_pool.x25519, eph_pool.size * sizeof(struct eph_x25519));
+  if (eph_pool.srp)
+    sodium_memzero(eph_pool.srp, eph_pool.size * sizeof(struct eph_srp));
+
+  free(eph_pool.x25519);
+  free(eph_pool.srp);
+  memset(&eph_pool, 0, sizeof(struct eph_pool));
+}
+
+static int
+eph_pool_set(int size)
+{
+  int ret = 0;
+
+  if (size < 0 || size > EPH_POOL_SIZE_MAX)
+    return -1;
+
+  pthread_mutex_lock(&eph_pool_lck);
+
+  eph_pool_clear();
+
+  if (size > 0)
+    {
+      eph_pool.x25519 = calloc(size, sizeof(struct eph_x25519));
+      eph_pool.srp = calloc(size, sizeof(struct eph_srp));
+      if (eph_pool.x25519 && eph_pool.srp)
+	eph_pool.size = size;
+      else
+	{
+	  eph_pool_clear();
+	  ret = -1;
+	}
+    }
+
+  pthread_mutex_unlock(&eph_pool_lck);
+  return ret;
+}
+
+static int
+eph_srp_make(struct eph_srp *entry, NGConstant *ng, bnum_ctx ctx)
+{
+  bnum e, ge;
+  int ret = -1;
+
+  bnum_new(e);
+  bnum_new(ge);
+  if (!e || !ge)
+    goto out;
+
+  bnum_random(e, 8 * EPH_POOL_SRP_EXP_LEN);
+  ng_modexp_g(ge, ng, e, ctx);
+
+  entry->e_len = bnum_num_bytes(e);
+  entry->ge_len = bnum_num_bytes(ge);
+  if (entry->e_len > sizeof(entry->e) || entry->ge_len > sizeof(entry->ge))
+    goto out;
+
+  bnum_bn2bin(e, entry->e, entry->e_len);
+  bnum_bn2bin(ge, entry->ge, entry->ge_len);
+  ret = 0;
+
+ out:
+  bnum_free(e);
+  bnum_free(ge);
+  return ret;
+}
+
+// Makes up to max new entries (or until the pool is full), returns the number
+// of entries made. Most of the work is done without holding the lock.
+static int
+eph_pool_fill(int max)
+{
+  struct eph_x25519 x25519;
+  struct eph_srp srp;
+  NGConstant *ng = NULL;
+  bnum_ctx ctx;
+  bool need_x25519;
+  bool need_srp;
+  int n;
+
+  bnum_ctx_new(ctx);
+  if (!ctx)
+    return -1;
+
+  for (n = 0; n < max; n++)
+    {
+      pthread_mutex_lock(&eph_pool_lck);
+      need_x25519 = (eph_pool.x25519_count < eph_pool.size);
+      need_srp = (eph_pool.srp_count < eph_pool.size);
+      pthread_mutex_unlock(&eph_pool_lck);
+
+      // Fill the X25519 keys first, since they are cheap
+      if (need_x25519)
+	{
+	  crypto_box_keypair(x25519.public_key, x25519.private_key);
+
+	  pthread_mutex_lock(&eph_pool_lck);
+	  if (eph_pool.x25519_count < eph_pool.size)
+	    eph_pool.x25519[eph_pool.x25519_count++] = x25519;
+	  pthread_mutex_unlock(&eph_pool_lck);
+
+	  sodium_memzero(&x25519, sizeof(x25519));
+	}
+      else if (need_srp)
+	{
+	  if (!ng)
+	    ng = new_ng(HASH_SHA512, EPH_POOL_NG_TYPE, NULL, NULL);
+	  if (!ng || eph_srp_make(&srp, ng, ctx) < 0)
+	    goto error;
+
+	  pthread_mutex_lock(&eph_pool_lck);
+	  if (eph_pool.srp_count < eph_pool.size)
+	    eph_pool.srp[eph_pool.srp_count++] = srp;
+	  pthread_mutex_unlock(&eph_pool_lck);
+
+	  sodium_memzero(&srp, sizeof(srp));
+	}
+      else
+	break;
+    }
+
+  bnum_ctx_free(ctx);
+  free_ng(ng);
+  return n;
+
+ error:
+  sodium_memzero(&srp, sizeof(srp));
+  bnum_ctx_free(ctx);
+  free_ng(ng);
+  return -1;
+}
+
+static int
+eph_pool_x25519_take(uint8_t *public_key, uint8_t *private_key)
+{
+  struct eph_x25519 *entry;
+
+  pthread_mutex_lock(&eph_pool_lck);
+  if (eph_pool.x25519_count == 0)
+    {
+      pthread_mutex_unlock(&eph_pool_lck);
+      return -1;
+    }
+
+  entry = &eph_pool.x25519[--eph_pool.x25519_count];
+  memcpy(public_key, entry->public_key, sizeof(entry->public_key));
+  memcpy(private_key, entry->private_key, sizeof(entry->private_key));
+  sodium_memzero(entry, sizeof(struct eph_x25519));
+
+  pthread_mutex_unlock(&eph_pool_lck);
+  return 0;
+}
+
+// Replaces *e and *ge with values from the pool
+static int
+eph_pool_srp_take(bnum *e, bnum *ge)
+{
+  struct eph_srp entry;
+  bnum e_new = NULL;
+  bnum ge_new = NULL;
+
+  pthread_mutex_lock(&eph_pool_lck);
+  if (eph_pool.srp_count == 0)
+    {
+      pthread_mutex_unlock(&eph_pool_lck);
+      return -1;
+    }
+
+  eph_pool.srp_count--;
+  entry = eph_pool.srp[eph_pool.srp_count];
+  sodium_memzero(&eph_pool.srp[eph_pool.srp_count], sizeof(struct eph_srp));
+
+  pthread_mutex_unlock(&eph_pool_lck);
+
+  bnum_bin2bn(e_new, entry.e, entry.e_len);
+  bnum_bin2bn(ge_new, entry.ge, entry.ge_len);
+  sodium_memzero(&entry, sizeof(entry));
+  if (!e_new || !ge_new)
+    {
+      bnum_free(e_new);
+      bnum_free(ge_new);
+      return -1;
+    }
+
+  bnum_free(*e);
+  bnum_free(*ge);
+  *e = e_new;
+  *ge = ge_new;
+  return 0;
+}
+
+static void
+eph_x25519_keypair(uint8_t *public_key, uint8_t *private_key)
+{
+  if (eph_pool_x25519_take(public_key, private_key) == 0)
+    return;
+
+  crypto_box_keypair(public_key, private_key);
+}
+
+// Sets e to a random 256 bit exponent and ge = g^e mod N
+static void
+ng_ephemeral_new(bnum *e, bnum *ge, NGConstant *ng, bnum_ctx ctx)
+{
+  if (ng->ng_type == EPH_POOL_NG_TYPE && eph_pool_srp_take(e, ge) == 0)
+    return;
+
+  bnum_random(*e, 8 * EPH_POOL_SRP_EXP_LEN);
+  ng_modexp_g(*ge, ng, *e, ctx);
 }
 
 static int
@@ -285,25 +684,15 @@ static void
 calculate_M(enum hash_alg alg, NGConstant *ng, unsigned char *dest, const char *I, const bnum s,
             const bnum A, const bnum B, const unsigned char *K, int K_len)
 {
-  unsigned char H_N[ SHA512_DIGEST_LENGTH ];
-  unsigned char H_g[ SHA512_DIGEST_LENGTH ];
   unsigned char H_I[ SHA512_DIGEST_LENGTH ];
-  unsigned char H_xor[ SHA512_DIGEST_LENGTH ];
   HashCTX       ctx;
-  int           i = 0;
   int           hash_len = hash_length(alg);
 
-  hash_num( alg, ng->N, H_N );
-  hash_num( alg, ng->g, H_g );
-
   hash(alg, (const unsigned char *)I, strlen(I), H_I);
 
-  for (i=0; i < hash_len; i++ )
-    H_xor[i] = H_N[i] ^ H_g[i];
-    
   hash_init( alg, &ctx );
 
-  hash_update( alg, &ctx, H_xor, hash_len );
+  hash_update( alg, &ctx, ng->H_xor, hash_len );
   hash_update( alg, &ctx, H_I,   hash_len );
   update_hash_n( alg, &ctx, s );
   update_hash_n( alg, &ctx, A );
@@ -341,13 +730,14 @@ srp_user_new(enum hash_alg alg, SRP_NGType ng_type, const char *username,
     goto err_exit;
 
   usr->alg = alg;
-  usr->ng  = new_ng( ng_type, n_hex, g_hex );
+  usr->ng  = new_ng( alg, ng_type, n_hex, g_hex );
 
   bnum_new(usr->a);
   bnum_new(usr->A);
   bnum_new(usr->S);
+  bnum_ctx_new(usr->ctx);
 
-  if (!usr->ng || !usr->a || !usr->A || !usr->S)
+  if (!usr->ng || !usr->a || !usr->A || !usr->S || !usr->ctx)
     goto err_exit;
 
   usr->username     = malloc(ulen);
@@ -372,6 +762,9 @@ srp_user_new(enum hash_alg alg, SRP_NGType ng_type, const char *username,
   bnum_free(usr->a);
   bnum_free(usr->A);
   bnum_free(usr->S);
+  if (usr->ctx)
+    bnum_ctx_free(usr->ctx);
+  free_ng(usr->ng);
 
   free(usr->username);
   if (usr->password)
@@ -393,6 +786,7 @@ srp_user_free(struct SRPUser *usr)
   bnum_free(usr->a);
   bnum_free(usr->A);
   bnum_free(usr->S);
+  bnum_ctx_free(usr->ctx);
 
   free_ng(usr->ng);
 
@@ -434,15 +828,16 @@ srp_user_start_authentication(struct SRPUser *usr, const char **username,
                               const unsigned char **bytes_A, int *len_A)
 {
 //  BN_hex2bn(&(usr->a), "D929DFB605687233C9E9030C2280156D03BDB9FDCF3CCE3BC27D9CCFCB5FF6A1");
-  bnum_random(usr->a, 256);
 #ifdef DEBUG_SHORT_A
+  bnum_free(usr->a);
   bnum_bin2bn(usr->a, short_a, sizeof(short_a));
+  ng_modexp_g(usr->A, usr->ng, usr->a, usr->ctx);
+#else
+  ng_ephemeral_new(&usr->a, &usr->A, usr->ng, usr->ctx);
 #endif
 #ifdef DEBUG_PAIR
   bnum_dump("Random value of usr->a:\n", usr->a);
 #endif
-
-  bnum_modexp(usr->A, usr->ng->g, usr->a, usr->ng->N);
     
   *len_A   = bnum_num_bytes(usr->A);
   *bytes_A = malloc(*len_A);
@@ -467,7 +862,7 @@ srp_user_process_challenge(struct SRPUser *usr, const unsigned char *bytes_s, in
                            const unsigned char *bytes_B, int len_B,
                            const unsigned char **bytes_M, int *len_M )
 {
-  bnum s, B, k, v;
+  bnum s, B, v;
   bnum tmp1, tmp2, tmp3;
   bnum u, x;
 
@@ -477,14 +872,12 @@ srp_user_process_challenge(struct SRPUser *usr, const unsigned char *bytes_s, in
   bnum_bin2bn(s, bytes_s, len_s);
   bnum_bin2bn(B, bytes_B, len_B);
 
-  k = H_nn_pad(usr->alg, usr->ng->N, usr->ng->g, usr->ng->N_len);
-
   bnum_new(v);
   bnum_new(tmp1);
   bnum_new(tmp2);
   bnum_new(tmp3);
 
-  if (!s || !B || !k || !v || !tmp1 || !tmp2 || !tmp3)
+  if (!s || !B || !v || !tmp1 || !tmp2 || !tmp3)
     goto cleanup1;
 
   u = H_nn_pad(usr->alg, usr->A, B, usr->ng->N_len);
@@ -495,15 +888,14 @@ srp_user_process_challenge(struct SRPUser *usr, const unsigned char *bytes_s, in
   // SRP-6a safety check
   if (!bnum_is_zero(B) && !bnum_is_zero(u))
     {
-      bnum_modexp(v, usr->ng->g, x, usr->ng->N);
+      ng_modexp_g(v, usr->ng, x, usr->ctx);  // v = g^x
 
       // S = (B - k*(g^x)) ^ (a + ux)
-      bnum_mul(tmp1, u, x);
+      bnum_mul_ctx(tmp1, u, x, usr->ctx);
       bnum_add(tmp2, usr->a, tmp1);        // tmp2 = (a + ux)
-      bnum_modexp(tmp1, usr->ng->g, x, usr->ng->N);
-      bnum_mul(tmp3, k, tmp1);             // tmp3 = k*(g^x)
+      bnum_mul_ctx(tmp3, usr->ng->k, v, usr->ctx); // tmp3 = k*(g^x)
       bnum_sub(tmp1, B, tmp3);             // tmp1 = (B - K*(g^x))
-      bnum_modexp(usr->S, tmp1, tmp2, usr->ng->N);
+      ng_modexp(usr->S, usr->ng, tmp1, tmp2, usr->ctx);
 
       hash_num(usr->alg, usr->S, usr->session_key);
       usr->session_key_len = hash_length(usr->alg);
@@ -523,7 +915,6 @@ srp_user_process_challenge(struct SRPUser *usr, const unsigned char *bytes_s, in
   bnum_free(tmp2);
   bnum_free(tmp1);
   bnum_free(v);
-  bnum_free(k);
   bnum_free(B);
   bnum_free(s);
 }
@@ -547,18 +938,20 @@ srp_create_salted_verification_key(enum hash_alg alg,
                                    const char *n_hex, const char *g_hex )
 {
   bnum s, v, x;
+  bnum_ctx ctx;
   NGConstant *ng;
 
   bnum_new(s);
   bnum_new(v);
+  bnum_ctx_new(ctx);
   x = NULL;
 
-  ng = new_ng(ng_type, n_hex, g_hex);
+  ng = new_ng(alg, ng_type, n_hex, g_hex);
 
   *bytes_s = NULL;
   *bytes_v = NULL;
 
-  if (!s || !v || !ng)
+  if (!s || !v || !ctx || !ng)
     goto error;
 
   bnum_random(s, 128); // MODIFIED from csrp's BN_rand(s, 32, -1, 0)
@@ -570,7 +963,7 @@ srp_create_salted_verification_key(enum hash_alg alg,
   if (!x)
     goto error;
 
-  bnum_modexp(v, ng->g, x, ng->N);
+  ng_modexp_g(v, ng, x, ctx);
 
   *len_s = bnum_num_bytes(s);
   *len_v = bnum_num_bytes(v);
@@ -584,6 +977,7 @@ srp_create_salted_verification_key(enum hash_alg alg,
   bnum_bn2bin(v, (unsigned char *) *bytes_v, *len_v);
 
   free_ng(ng);
+  bnum_ctx_free(ctx);
   bnum_free(s);
   bnum_free(v);
   bnum_free(x);
@@ -593,95 +987,329 @@ srp_create_salted_verification_key(enum hash_alg alg,
   free(*bytes_s);
   free(*bytes_v);
   free_ng(ng);
+  if (ctx)
+    bnum_ctx_free(ctx);
   bnum_free(s);
   bnum_free(v);
   bnum_free(x);
   return -1;
 }
 
-static int
-srp_verifier_start_authentication(enum hash_alg alg, SRP_NGType ng_type,
-                                  const unsigned char *bytes_v, int len_v,
-                                  unsigned char **bytes_b, int *len_b,
-                                  unsigned char **bytes_B, int *len_B,
-                                  const char *n_hex, const char *g_hex)
+/* Optional cache of salt and verifier, so that a server that gets many setup
+ * requests with the same PIN only has to calculate them once per rotation
+ * interval. The PIN itself is not stored, entries are identified by a hash of
+ * username and PIN. Expired entries are removed whenever the cache is looked
+ * up, and there are at most VERIFIER_CACHE_ENTRIES_MAX entries (the oldest are
+ * dropped), so a server that shows a new PIN for each pairing doesn't make the
+ * cache grow.
+ */
+#define VERIFIER_CACHE_ENTRIES_MAX 16
+
+struct verifier_cache_entry
 {
-  bnum v, k, b, B, tmp1, tmp2;
-  NGConstant *ng;
+  enum hash_alg alg;
+  SRP_NGType ng_type;
+  unsigned char user_pw_hash[SHA512_DIGEST_LENGTH];
 
-  v = NULL;
-  k = NULL;
-  bnum_new(b);
-  bnum_new(B);
-  bnum_new(tmp1);
-  bnum_new(tmp2);
+  unsigned char *salt;
+  int salt_len;
+  unsigned char *v;
+  int v_len;
 
-  *len_b   = 0;
-  *bytes_b = NULL;
-  *len_B   = 0;
-  *bytes_B = NULL;
+  time_t created; // Monotonic time
 
-  ng = new_ng(ng_type, n_hex, g_hex);
+  struct verifier_cache_entry *next;
+};
 
-  if (!b || !B || !tmp1 || !tmp2 || !ng)
-    goto error;
+static struct verifier_cache_entry *verifier_cache; // Newest first
+static int verifier_cache_count;
+static int verifier_cache_rotation; // Seconds, 0 means cache disabled
+static pthread_mutex_t verifier_cache_lck = PTHREAD_MUTEX_INITIALIZER;
 
-  bnum_bin2bn(v, bytes_v, len_v);
+static time_t
+monotonic_now(void)
+{
+  struct timespec ts;
 
-  bnum_random(b, 256); // MODIFIED from BN_rand(b, 256, -1, 0)
-#ifdef DEBUG_PAIR
-  bnum_dump("Random value of b:\n", b);
-#endif
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
 
-  k = H_nn_pad(alg, ng->N, ng->g, ng->N_len); // MODIFIED from H_nn(alg, ng->N, ng->g)
-  if (!k)
-    goto error;
+static void
+verifier_cache_entry_free(struct verifier_cache_entry *entry)
+{
+  if (!entry)
+    return;
 
-  // B = kv + g^b
-  bnum_mul(tmp1, k, v);
-  bnum_modexp(tmp2, ng->g, b, ng->N);
-  bnum_modadd(B, tmp1, tmp2, ng->N);
+  if (entry->v)
+    sodium_memzero(entry->v, entry->v_len);
 
-  *len_B = bnum_num_bytes(B);
-  *len_b = bnum_num_bytes(b);
+  free(entry->v);
+  free(entry->salt);
+  sodium_memzero(entry, sizeof(struct verifier_cache_entry));
+  free(entry);
+}
 
-  *bytes_B = malloc(*len_B);
-  *bytes_b = malloc(*len_b);
-  if (!(*bytes_B) || !(*bytes_b))
-    goto error;
+static int
+verifier_cache_set(int rotation_secs)
+{
+  struct verifier_cache_entry *entry;
 
-  bnum_bn2bin(B, (unsigned char *) *bytes_B, *len_B);
-  bnum_bn2bin(b, (unsigned char *) *bytes_b, *len_b);
+  if (rotation_secs < 0)
+    return -1;
 
-  bnum_free(b);
-  bnum_free(B);
-  bnum_free(v);
-  bnum_free(k);
-  bnum_free(tmp1);
-  bnum_free(tmp2);
-  free_ng(ng);
-  return 0;
+  pthread_mutex_lock(&verifier_cache_lck);
 
- error:
-  free(*bytes_B);
-  free(*bytes_b);
-  bnum_free(b);
-  bnum_free(B);
-  bnum_free(v);
-  bnum_free(k);
-  bnum_free(tmp1);
-  bnum_free(tmp2);
-  free_ng(ng);
-  return -1;
+  verifier_cache_rotation = rotation_secs;
+
+  // Changing the setting always clears the cache
+  while ((entry = verifier_cache))
+    {
+      verifier_cache = entry->next;
+      verifier_cache_entry_free(entry);
+    }
+
+  verifier_cache_count = 0;
+
+  pthread_mutex_unlock(&verifier_cache_lck);
+  return 0;
 }
 
-static void
-srp_verifier_free(struct SRPVerifier *ver)
+// Returns the matching entry, removing expired entries on the way. Caller must
+// hold verifier_cache_lck.
+static struct verifier_cache_entry *
+verifier_cache_find(enum hash_alg alg, SRP_NGType ng_type, const unsigned char *user_pw_hash, time_t now)
 {
-  if (!ver)
-    return;
+  struct verifier_cache_entry *entry;
+  struct verifier_cache_entry *match = NULL;
+  struct verifier_cache_entry **prev;
 
-  free_ng(ver->ng);
+  prev = &verifier_cache;
+  while ((entry = *prev))
+    {
+      if (now - entry->created >= verifier_cache_rotation)
+	{
+	  *prev = entry->next;
+	  verifier_cache_entry_free(entry);
+	  verifier_cache_count--;
+	  continue;
+	}
+
+      if (!match && entry->alg == alg && entry->ng_type == ng_type && memcmp(entry->user_pw_hash, user_pw_hash, hash_length(alg)) == 0)
+	match = entry;
+
+      prev = &entry->next;
+    }
+
+  return match;
+}
+
+// Adds the entry as the newest, dropping the oldest if the cache is full.
+// Caller must hold verifier_cache_lck.
+static void
+verifier_cache_add(struct verifier_cache_entry *entry)
+{
+  struct verifier_cache_entry **prev;
+
+  entry->next = verifier_cache;
+  verifier_cache = entry;
+  verifier_cache_count++;
+
+  if (verifier_cache_count > VERIFIER_CACHE_ENTRIES_MAX)
+    {
+      for (prev = &verifier_cache; (*prev)->next; prev = &(*prev)->next)
+	; // Find the oldest
+
+      verifier_cache_entry_free(*prev);
+      *prev = NULL;
+      verifier_cache_count--;
+    }
+}
+
+static int
+verifier_cache_entry_copy(unsigned char **bytes_s, int *len_s, unsigned char **bytes_v, int *len_v, struct verifier_cache_entry *entry)
+{
+  *bytes_s = malloc(entry->salt_len);
+  *bytes_v = malloc(entry->v_len);
+  if (!*bytes_s || !*bytes_v)
+    {
+      free(*bytes_s);
+      free(*bytes_v);
+      *bytes_s = NULL;
+      *bytes_v = NULL;
+      return -1;
+    }
+
+  memcpy(*bytes_s, entry->salt, entry->salt_len);
+  *len_s = entry->salt_len;
+  memcpy(*bytes_v, entry->v, entry->v_len);
+  *len_v = entry->v_len;
+  return 0;
+}
+
+// Same as srp_create_salted_verification_key(), but might return a cached salt
+// and verifier. The caller must free them. The verifier is calculated without
+// holding the lock, so if two threads miss at the same time it is just made
+// twice, and the first one is cached.
+static int
+srp_salted_verification_key_get(enum hash_alg alg,
+                                SRP_NGType ng_type, const char *username,
+                                const unsigned char *password, int len_password,
+                                unsigned char **bytes_s, int *len_s,
+                                unsigned char **bytes_v, int *len_v)
+{
+  struct verifier_cache_entry *entry;
+  unsigned char user_pw_hash[SHA512_DIGEST_LENGTH];
+  HashCTX ctx;
+  time_t now;
+  int ret;
+
+  pthread_mutex_lock(&verifier_cache_lck);
+  if (verifier_cache_rotation == 0)
+    {
+      pthread_mutex_unlock(&verifier_cache_lck);
+      return srp_create_salted_verification_key(alg, ng_type, username, password, len_password, bytes_s, len_s, bytes_v, len_v, NULL, NULL);
+    }
+
+  hash_init(alg, &ctx);
+  hash_update(alg, &ctx, username, strlen(username));
+  hash_update(alg, &ctx, ":", 1);
+  hash_update(alg, &ctx, password, len_password);
+  hash_final(alg, &ctx, user_pw_hash);
+
+  now = monotonic_now();
+
+  entry = verifier_cache_find(alg, ng_type, user_pw_hash, now);
+  if (entry)
+    {
+      ret = verifier_cache_entry_copy(bytes_s, len_s, bytes_v, len_v, entry);
+      pthread_mutex_unlock(&verifier_cache_lck);
+      goto out;
+    }
+
+  pthread_mutex_unlock(&verifier_cache_lck);
+
+  entry = calloc(1, sizeof(struct verifier_cache_entry));
+  if (!entry)
+    {
+      ret = -1;
+      goto out;
+    }
+
+  ret = srp_create_salted_verification_key(alg, ng_type, username, password, len_password,
+    &entry->salt, &entry->salt_len, &entry->v, &entry->v_len, NULL, NULL);
+  if (ret == 0)
+    ret = verifier_cache_entry_copy(bytes_s, len_s, bytes_v, len_v, entry);
+  if (ret < 0)
+    {
+      verifier_cache_entry_free(entry);
+      goto out;
+    }
+
+  entry->alg = alg;
+  entry->ng_type = ng_type;
+  memcpy(entry->user_pw_hash, user_pw_hash, sizeof(entry->user_pw_hash));
+  entry->created = now;
+
+  // Someone else may have added it meanwhile, or disabled the cache
+  pthread_mutex_lock(&verifier_cache_lck);
+  if (verifier_cache_rotation > 0 && !verifier_cache_find(alg, ng_type, user_pw_hash, monotonic_now()))
+    verifier_cache_add(entry);
+  else
+    verifier_cache_entry_free(entry);
+  pthread_mutex_unlock(&verifier_cache_lck);
+
+ out:
+  if (ret < 0)
+    {
+      *bytes_s = NULL;
+      *bytes_v = NULL;
+    }
+  sodium_memzero(user_pw_hash, sizeof(user_pw_hash));
+  return ret;
+}
+
+static int
+srp_verifier_start_authentication(enum hash_alg alg, SRP_NGType ng_type,
+                                  const unsigned char *bytes_v, int len_v,
+                                  unsigned char **bytes_b, int *len_b,
+                                  unsigned char **bytes_B, int *len_B,
+                                  const char *n_hex, const char *g_hex)
+{
+  bnum v, b, B, tmp1, tmp2;
+  bnum_ctx ctx;
+  NGConstant *ng;
+
+  v = NULL;
+  bnum_new(b);
+  bnum_new(B);
+  bnum_new(tmp1);
+  bnum_new(tmp2);
+  bnum_ctx_new(ctx);
+
+  *len_b   = 0;
+  *bytes_b = NULL;
+  *len_B   = 0;
+  *bytes_B = NULL;
+
+  ng = new_ng(alg, ng_type, n_hex, g_hex);
+
+  if (!b || !B || !tmp1 || !tmp2 || !ctx || !ng)
+    goto error;
+
+  bnum_bin2bn(v, bytes_v, len_v);
+
+  // b = random 256 bit, MODIFIED from BN_rand(b, 256, -1, 0)
+  ng_ephemeral_new(&b, &tmp2, ng, ctx);
+#ifdef DEBUG_PAIR
+  bnum_dump("Random value of b:\n", b);
+#endif
+
+  // B = kv + g^b
+  bnum_mul_ctx(tmp1, ng->k, v, ctx);
+  bnum_modadd_ctx(B, tmp1, tmp2, ng->N, ctx);
+
+  *len_B = bnum_num_bytes(B);
+  *len_b = bnum_num_bytes(b);
+
+  *bytes_B = malloc(*len_B);
+  *bytes_b = malloc(*len_b);
+  if (!(*bytes_B) || !(*bytes_b))
+    goto error;
+
+  bnum_bn2bin(B, (unsigned char *) *bytes_B, *len_B);
+  bnum_bn2bin(b, (unsigned char *) *bytes_b, *len_b);
+
+  bnum_free(b);
+  bnum_free(B);
+  bnum_free(v);
+  bnum_free(tmp1);
+  bnum_free(tmp2);
+  bnum_ctx_free(ctx);
+  free_ng(ng);
+  return 0;
+
+ error:
+  free(*bytes_B);
+  free(*bytes_b);
+  bnum_free(b);
+  bnum_free(B);
+  bnum_free(v);
+  bnum_free(tmp1);
+  bnum_free(tmp2);
+  if (ctx)
+    bnum_ctx_free(ctx);
+  free_ng(ng);
+  return -1;
+}
+
+static void
+srp_verifier_free(struct SRPVerifier *ver)
+{
+  if (!ver)
+    return;
+
+  free_ng(ver->ng);
 
   free(ver->username);
 
@@ -699,7 +1327,8 @@ srp_verifier_new(enum hash_alg alg, SRP_NGType ng_type, const char *username,
                  const char *n_hex, const char *g_hex )
 {
   struct SRPVerifier *ver = NULL;
-  bnum s, v, A, b, B, S, tmp1, tmp2, u, k;
+  bnum s, v, A, b, B, S, tmp1, tmp2, u;
+  bnum_ctx ctx;
   NGConstant *ng;
   size_t ulen;
 
@@ -711,12 +1340,12 @@ srp_verifier_new(enum hash_alg alg, SRP_NGType ng_type, const char *username,
   bnum_new(S);
   bnum_new(tmp1);
   bnum_new(tmp2);
+  bnum_ctx_new(ctx);
   u = NULL;
-  k = NULL;
 
-  ng = new_ng(ng_type, n_hex, g_hex);
+  ng = new_ng(alg, ng_type, n_hex, g_hex);
 
-  if (!s || !v || !A || !B || !S || !b || !tmp1 || !tmp2 || !ng)
+  if (!s || !v || !A || !B || !S || !b || !tmp1 || !tmp2 || !ctx || !ng)
     goto error;
 
   ver = calloc(1, sizeof(struct SRPVerifier));
@@ -737,17 +1366,16 @@ srp_verifier_new(enum hash_alg alg, SRP_NGType ng_type, const char *username,
   ver->authenticated = 0;
 
   // SRP-6a safety check
-  bnum_mod(tmp1, A, ng->N);
+  bnum_mod_ctx(tmp1, A, ng->N, ctx);
   if (bnum_is_zero(tmp1))
     goto error;
 
-  k = H_nn_pad(alg, ng->N, ng->g, ng->N_len); // MODIFIED from H_nn(alg, ng->N, ng->g)
   u = H_nn_pad(alg, A, B, ng->N_len); // MODIFIED from H_nn(alg, A, B)
 
   // S = (A *(v^u)) ^ b
-  bnum_modexp(tmp1, v, u, ng->N);
-  bnum_mul(tmp2, A, tmp1);
-  bnum_modexp(S, tmp2, b, ng->N);
+  ng_modexp(tmp1, ng, v, u, ctx);
+  bnum_mul_ctx(tmp2, A, tmp1, ctx);
+  ng_modexp(S, ng, tmp2, b, ctx);
 
   hash_num(alg, S, ver->session_key);
   ver->session_key_len = hash_length(ver->alg);
@@ -761,12 +1389,12 @@ srp_verifier_new(enum hash_alg alg, SRP_NGType ng_type, const char *username,
   bnum_free(v);
   bnum_free(A);
   bnum_free(u);
-  bnum_free(k);
   bnum_free(B);
   bnum_free(S);
   bnum_free(b);
   bnum_free(tmp1);
   bnum_free(tmp2);
+  bnum_ctx_free(ctx);
   return ver;
 
  error:
@@ -775,12 +1403,13 @@ srp_verifier_new(enum hash_alg alg, SRP_NGType ng_type, const char *username,
   bnum_free(v);
   bnum_free(A);
   bnum_free(u);
-  bnum_free(k);
   bnum_free(B);
   bnum_free(S);
   bnum_free(b);
   bnum_free(tmp1);
   bnum_free(tmp2);
+  if (ctx)
+    bnum_ctx_free(ctx);
   return NULL;
 }
 
@@ -822,27 +1451,40 @@ hexread(uint8_t *out, size_t out_len, const char *in)
     }
 }
 
+static const char *
+error_errmsg(const uint8_t *value, size_t size)
+{
+  if (size != 1)
+    return "Device returned an invalid error\n";
+  else if (value[0] == TLVError_Authentication)
+    return "Device returned an authentication failure";
+  else if (value[0] == TLVError_Backoff)
+    return "Device told us to back off pairing attempts\n";
+  else if (value[0] == TLVError_MaxPeers)
+    return "Max peers trying to connect to device\n";
+  else if (value[0] == TLVError_MaxTries)
+    return "Max pairing attemps reached\n";
+  else if (value[0] == TLVError_Unavailable)
+    return "Device is unuavailble at this time\n";
+  else
+    return "Device is busy/returned unknown error\n";
+}
+
 static pair_tlv_values_t *
 message_process(const uint8_t *data, size_t data_len, const char **errmsg)
 {
   pair_tlv_values_t *response;
   pair_tlv_t *error;
-  int ret;
 
-  response = pair_tlv_new();
+  // The values will point into data (except for fragmented values), so data
+  // must be kept until the response is freed
+  response = pair_tlv_arena_parse_view(data, data_len);
   if (!response)
     {
-      *errmsg = "Out of memory\n";
+      *errmsg = "Could not parse TLV (invalid or out of memory)\n";
       return NULL;
     }
 
-  ret = pair_tlv_parse(data, data_len, response);
-  if (ret < 0)
-    {
-      *errmsg = "Could not parse TLV\n";
-      goto error;
-    }
-
 #ifdef DEBUG_PAIR
   pair_tlv_debug(response);
 #endif
@@ -850,19 +1492,7 @@ message_process(const uint8_t *data, size_t data_len, const char **errmsg)
   error = pair_tlv_get_value(response, TLVType_Error);
   if (error)
     {
-      if (error->value[0] == TLVError_Authentication)
-	*errmsg = "Device returned an authentication failure";
-      else if (error->value[0] == TLVError_Backoff)
-	*errmsg = "Device told us to back off pairing attempts\n";
-      else if (error->value[0] == TLVError_MaxPeers)
-	*errmsg = "Max peers trying to connect to device\n";
-      else if (error->value[0] == TLVError_MaxTries)
-	*errmsg = "Max pairing attemps reached\n";
-      else if (error->value[0] == TLVError_Unavailable)
-	*errmsg = "Device is unuavailble at this time\n";
-      else
-	*errmsg = "Device is busy/returned unknown error\n";
-
+      *errmsg = error_errmsg(error->value, error->size);
       goto error;
     }
 
@@ -873,208 +1503,359 @@ message_process(const uint8_t *data, size_t data_len, const char **errmsg)
   return NULL;
 }
 
-/* Executes SHA512 RFC 5869 extract + expand, writing a derived key to okm
-
-   hkdfExtract(SHA512, salt, salt_len, ikm, ikm_len, prk);
-   hkdfExpand(SHA512, prk, SHA512_LEN, info, info_len, okm, okm_len);
-*/
+/* SHA512 RFC 5869 extract and expand. The extract is keyed by the salt, so
+ * keys that share a salt (like the control read and write keys) can share the
+ * PRK and only need their own expand. We only ever need okm_len <= the hash
+ * length, so the expand is just one round: okm = HMAC(prk, info | 0x01).
+ */
 static int
-hkdf_extract_expand(uint8_t *okm, size_t okm_len, const uint8_t *ikm, size_t ikm_len, enum pair_keys pair_key)
+hmac_sha512(uint8_t out[SHA512_DIGEST_LENGTH], const uint8_t *key, size_t key_len, const uint8_t *data, size_t data_len, const uint8_t *data2, size_t data2_len)
 {
 #ifdef CONFIG_OPENSSL
-#include <openssl/kdf.h>
-  EVP_PKEY_CTX *pctx;
+  uint8_t buf[256];
+  unsigned int out_len = SHA512_DIGEST_LENGTH;
 
-  if (okm_len > SHA512_DIGEST_LENGTH)
-    return -1;
-  if (! (pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL)))
+  // HMAC() is one-shot, so the two inputs must be joined (data2 is short)
+  if (data2_len > 0)
+    {
+      if (data_len + data2_len > sizeof(buf))
+	return -1;
+
+      memcpy(buf, data, data_len);
+      memcpy(buf + data_len, data2, data2_len);
+      data = buf;
+      data_len += data2_len;
+    }
+
+  if (!HMAC(EVP_sha512(), key, key_len, data, data_len, out, &out_len))
     return -1;
-  if (EVP_PKEY_derive_init(pctx) <= 0)
-    goto error;
-  if (EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha512()) <= 0)
-    goto error;
-  if (EVP_PKEY_CTX_set1_hkdf_salt(pctx, (const unsigned char *)pair_keys_map[pair_key].salt, strlen(pair_keys_map[pair_key].salt)) <= 0)
-    goto error;
-  if (EVP_PKEY_CTX_set1_hkdf_key(pctx, ikm, ikm_len) <= 0)
-    goto error;
-  if (EVP_PKEY_CTX_add1_hkdf_info(pctx, (const unsigned char *)pair_keys_map[pair_key].info, strlen(pair_keys_map[pair_key].info)) <= 0)
-    goto error;
-  if (EVP_PKEY_derive(pctx, okm, &okm_len) <= 0)
-    goto error;
 
-  EVP_PKEY_CTX_free(pctx);
   return 0;
-
- error:
-  EVP_PKEY_CTX_free(pctx);
-  return -1;
 #elif CONFIG_GCRYPT
-  uint8_t prk[SHA512_DIGEST_LENGTH];
   gcry_md_hd_t hmac_handle;
 
-  if (okm_len > SHA512_DIGEST_LENGTH)
-    return -1; // Below calculation not valid if output is larger than hash size
   if (gcry_md_open(&hmac_handle, GCRY_MD_SHA512, GCRY_MD_FLAG_HMAC) != GPG_ERR_NO_ERROR)
     return -1;
-  if (gcry_md_setkey(hmac_handle, (const unsigned char *)pair_keys_map[pair_key].salt, strlen(pair_keys_map[pair_key].salt)) != GPG_ERR_NO_ERROR)
-    goto error;
-  gcry_md_write(hmac_handle, ikm, ikm_len);
-  memcpy(prk, gcry_md_read(hmac_handle, 0), sizeof(prk));
-
-  gcry_md_reset(hmac_handle);
+  if (gcry_md_setkey(hmac_handle, key, key_len) != GPG_ERR_NO_ERROR)
+    {
+      gcry_md_close(hmac_handle);
+      return -1;
+    }
 
-  if (gcry_md_setkey(hmac_handle, prk, sizeof(prk)) != GPG_ERR_NO_ERROR)
-    goto error;
-  gcry_md_write(hmac_handle, (const unsigned char *)pair_keys_map[pair_key].info, strlen(pair_keys_map[pair_key].info));
-  gcry_md_putc(hmac_handle, 1);
+  gcry_md_write(hmac_handle, data, data_len);
+  if (data2_len > 0)
+    gcry_md_write(hmac_handle, data2, data2_len);
 
-  memcpy(okm, gcry_md_read(hmac_handle, 0), okm_len);
+  memcpy(out, gcry_md_read(hmac_handle, 0), SHA512_DIGEST_LENGTH);
 
   gcry_md_close(hmac_handle);
   return 0;
-
- error:
-  gcry_md_close(hmac_handle);
-  return -1;
 #else
   return -1;
 #endif
 }
 
 static int
-encrypt_chacha(uint8_t *cipher, const uint8_t *plain, size_t plain_len, const uint8_t *key, size_t key_len, const void *ad, size_t ad_len, uint8_t *tag, size_t tag_len, const uint8_t nonce[NONCE_LENGTH])
+hkdf_extract(uint8_t prk[SHA512_DIGEST_LENGTH], const uint8_t *ikm, size_t ikm_len, const char *salt)
 {
-#ifdef CONFIG_OPENSSL
-  EVP_CIPHER_CTX *ctx;
-  int len;
+  return hmac_sha512(prk, (const uint8_t *)salt, strlen(salt), ikm, ikm_len, NULL, 0);
+}
+
+static int
+hkdf_expand(uint8_t *okm, size_t okm_len, const uint8_t prk[SHA512_DIGEST_LENGTH], const char *info)
+{
+  uint8_t counter = 1;
+  uint8_t t[SHA512_DIGEST_LENGTH];
+  int ret;
+
+  if (okm_len > SHA512_DIGEST_LENGTH)
+    return -1; // Below calculation not valid if output is larger than hash size
 
-  if (! (ctx = EVP_CIPHER_CTX_new()))
+  ret = hmac_sha512(t, prk, SHA512_DIGEST_LENGTH, (const uint8_t *)info, strlen(info), &counter, sizeof(counter));
+  if (ret < 0)
     return -1;
 
-  if (EVP_EncryptInit_ex(ctx, EVP_chacha20_poly1305(), NULL, key, nonce) != 1)
-    goto error;
+  memcpy(okm, t, okm_len);
+  sodium_memzero(t, sizeof(t));
+  return 0;
+}
 
-  if (EVP_CIPHER_CTX_set_padding(ctx, 0) != 1) // Maybe not necessary
-    goto error;
+/* Executes SHA512 RFC 5869 extract + expand, writing a derived key to okm
 
-  if (ad_len > 0 && EVP_EncryptUpdate(ctx, NULL, &len, ad, ad_len) != 1)
-    goto error;
+   hkdfExtract(SHA512, salt, salt_len, ikm, ikm_len, prk);
+   hkdfExpand(SHA512, prk, SHA512_LEN, info, info_len, okm, okm_len);
+*/
+static int
+hkdf_extract_expand(uint8_t *okm, size_t okm_len, const uint8_t *ikm, size_t ikm_len, enum pair_keys pair_key)
+{
+  uint8_t prk[SHA512_DIGEST_LENGTH];
+  int ret;
 
-  if (EVP_EncryptUpdate(ctx, cipher, &len, plain, plain_len) != 1)
-    goto error;
+  ret = hkdf_extract(prk, ikm, ikm_len, pair_keys_map[pair_key].salt);
+  if (ret == 0)
+    ret = hkdf_expand(okm, okm_len, prk, pair_keys_map[pair_key].info);
 
-  assert(len == plain_len);
+  sodium_memzero(prk, sizeof(prk));
+  return ret;
+}
 
-  if (EVP_EncryptFinal_ex(ctx, NULL, &len) != 1)
-    goto error;
+/* For deriving a number of keys from the same shared secret, e.g. the keys
+ * for several cipher channels. The PRK of each distinct salt is only made
+ * once, so each key just needs an expand.
+ */
+#define KEY_DERIVATION_SALTS_MAX 4
 
-  if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, tag_len, tag) != 1)
-    goto error;
+struct key_derivation
+{
+  const uint8_t *ikm;
+  size_t ikm_len;
+
+  struct
+  {
+    const char *salt;
+    uint8_t prk[SHA512_DIGEST_LENGTH];
+  } prks[KEY_DERIVATION_SALTS_MAX];
+  int prks_len;
+};
 
-  EVP_CIPHER_CTX_free(ctx);
-  return 0;
+static int
+key_derive(uint8_t *okm, size_t okm_len, struct key_derivation *kd, enum pair_keys pair_key)
+{
+  const char *salt = pair_keys_map[pair_key].salt;
+  int i;
 
- error:
-  EVP_CIPHER_CTX_free(ctx);
-  return -1;
-#elif CONFIG_GCRYPT
-  gcry_cipher_hd_t hd;
+  for (i = 0; i < kd->prks_len; i++)
+    {
+      if (strcmp(kd->prks[i].salt, salt) == 0)
+	break;
+    }
+
+  if (i == kd->prks_len)
+    {
+      if (i == KEY_DERIVATION_SALTS_MAX)
+	return hkdf_extract_expand(okm, okm_len, kd->ikm, kd->ikm_len, pair_key);
 
-  if (gcry_cipher_open(&hd, GCRY_CIPHER_CHACHA20, GCRY_CIPHER_MODE_POLY1305, 0) != GPG_ERR_NO_ERROR)
+      if (hkdf_extract(kd->prks[i].prk, kd->ikm, kd->ikm_len, salt) < 0)
+	return -1;
+
+      kd->prks[i].salt = salt;
+      kd->prks_len++;
+    }
+
+  return hkdf_expand(okm, okm_len, kd->prks[i].prk, pair_keys_map[pair_key].info);
+}
+
+/* The session ciphers keep a keyed handle for their whole lifetime, so per
+ * frame only the nonce is set - see cipher_new(). The handshake messages,
+ * which are only ciphered once per key, use encrypt_chacha()/decrypt_chacha().
+ */
+static int
+chacha_open(CipherCTX *hd, const uint8_t *key, size_t key_len, bool is_encrypt)
+{
+#ifdef CONFIG_SODIUM_CHACHA
+  if (key_len != crypto_aead_chacha20poly1305_ietf_KEYBYTES)
     return -1;
 
-  if (gcry_cipher_setkey(hd, key, key_len) != GPG_ERR_NO_ERROR)
-    goto error;
+  if (! (*hd = malloc(key_len)))
+    return -1;
 
-  if (gcry_cipher_setiv(hd, nonce, NONCE_LENGTH) != GPG_ERR_NO_ERROR)
-    goto error;
+  memcpy(*hd, key, key_len);
+  return 0;
+#elif CONFIG_OPENSSL
+  int ret;
 
-  if (ad_len > 0 && gcry_cipher_authenticate(hd, ad, ad_len) != GPG_ERR_NO_ERROR)
+  if (! (*hd = EVP_CIPHER_CTX_new()))
+    return -1;
+
+  if (is_encrypt)
+    ret = EVP_EncryptInit_ex(*hd, EVP_chacha20_poly1305(), NULL, key, NULL);
+  else
+    ret = EVP_DecryptInit_ex(*hd, EVP_chacha20_poly1305(), NULL, key, NULL);
+  if (ret != 1)
     goto error;
 
-  if (gcry_cipher_encrypt(hd, cipher, plain_len, plain, plain_len) != GPG_ERR_NO_ERROR)
+  if (EVP_CIPHER_CTX_set_padding(*hd, 0) != 1) // Maybe not necessary
     goto error;
 
-  if (gcry_cipher_gettag(hd, tag, tag_len) != GPG_ERR_NO_ERROR)
+  return 0;
+
+ error:
+  EVP_CIPHER_CTX_free(*hd);
+  *hd = NULL;
+  return -1;
+#elif CONFIG_GCRYPT
+  if (gcry_cipher_open(hd, GCRY_CIPHER_CHACHA20, GCRY_CIPHER_MODE_POLY1305, 0) != GPG_ERR_NO_ERROR)
+    return -1;
+
+  if (gcry_cipher_setkey(*hd, key, key_len) != GPG_ERR_NO_ERROR)
     goto error;
 
-  gcry_cipher_close(hd);
   return 0;
 
  error:
-  gcry_cipher_close(hd);
+  gcry_cipher_close(*hd);
+  *hd = NULL;
   return -1;
 #else
   return -1;
 #endif
 }
 
-static int
-decrypt_chacha(uint8_t *plain, const uint8_t *cipher, size_t cipher_len, const uint8_t *key, size_t key_len, const void *ad, size_t ad_len, uint8_t *tag, size_t tag_len, const uint8_t nonce[NONCE_LENGTH])
+static void
+chacha_close(CipherCTX hd)
 {
-#ifdef CONFIG_OPENSSL
-  EVP_CIPHER_CTX *ctx;
-  int len;
+#ifdef CONFIG_SODIUM_CHACHA
+  if (!hd)
+    return;
+
+  sodium_memzero(hd, crypto_aead_chacha20poly1305_ietf_KEYBYTES);
+  free(hd);
+#elif CONFIG_OPENSSL
+  EVP_CIPHER_CTX_free(hd);
+#elif CONFIG_GCRYPT
+  gcry_cipher_close(hd);
+#endif
+}
 
-  if (! (ctx = EVP_CIPHER_CTX_new()))
+static int
+encrypt_chacha_hd(CipherCTX hd, uint8_t *cipher, const uint8_t *plain, size_t plain_len, const void *ad, size_t ad_len, uint8_t *tag, size_t tag_len, const uint8_t nonce[NONCE_LENGTH])
+{
+#ifdef CONFIG_SODIUM_CHACHA
+  if (tag_len != crypto_aead_chacha20poly1305_ietf_ABYTES)
     return -1;
 
-  if (EVP_DecryptInit_ex(ctx, EVP_chacha20_poly1305(), NULL, key, nonce) != 1)
-    goto error;
+  if (crypto_aead_chacha20poly1305_ietf_encrypt_detached(cipher, tag, NULL, plain, plain_len, ad, ad_len, NULL, nonce, hd) != 0)
+    return -1;
 
-  if (EVP_CIPHER_CTX_set_padding(ctx, 0) != 1) // Maybe not necessary
-    goto error;
+  return 0;
+#elif CONFIG_OPENSSL
+  int len;
 
-  if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, tag_len, tag) != 1)
-    goto error;
+  // Keeps the key, but resets the nonce and the poly1305 state
+  if (EVP_EncryptInit_ex(hd, NULL, NULL, NULL, nonce) != 1)
+    return -1;
 
-  if (ad_len > 0 && EVP_DecryptUpdate(ctx, NULL, &len, ad, ad_len) != 1)
-    goto error;
+  if (ad_len > 0 && EVP_EncryptUpdate(hd, NULL, &len, ad, ad_len) != 1)
+    return -1;
 
-  if (EVP_DecryptUpdate(ctx, plain, &len, cipher, cipher_len) != 1)
-    goto error;
+  if (EVP_EncryptUpdate(hd, cipher, &len, plain, plain_len) != 1)
+    return -1;
 
-  if (EVP_DecryptFinal_ex(ctx, NULL, &len) != 1)
-    goto error;
+  assert(len == plain_len);
+
+  if (EVP_EncryptFinal_ex(hd, NULL, &len) != 1)
+    return -1;
+
+  if (EVP_CIPHER_CTX_ctrl(hd, EVP_CTRL_AEAD_GET_TAG, tag_len, tag) != 1)
+    return -1;
 
-  EVP_CIPHER_CTX_free(ctx);
   return 0;
+#elif CONFIG_GCRYPT
+  // Keeps the key, but resets the nonce and the poly1305 state
+  if (gcry_cipher_reset(hd) != GPG_ERR_NO_ERROR)
+    return -1;
 
- error:
-  EVP_CIPHER_CTX_free(ctx);
+  if (gcry_cipher_setiv(hd, nonce, NONCE_LENGTH) != GPG_ERR_NO_ERROR)
+    return -1;
+
+  if (ad_len > 0 && gcry_cipher_authenticate(hd, ad, ad_len) != GPG_ERR_NO_ERROR)
+    return -1;
+
+  if (gcry_cipher_encrypt(hd, cipher, plain_len, plain, plain_len) != GPG_ERR_NO_ERROR)
+    return -1;
+
+  if (gcry_cipher_gettag(hd, tag, tag_len) != GPG_ERR_NO_ERROR)
+    return -1;
+
+  return 0;
+#else
   return -1;
-#elif CONFIG_GCRYPT
-  gcry_cipher_hd_t hd;
+#endif
+}
+
+static int
+decrypt_chacha_hd(CipherCTX hd, uint8_t *plain, const uint8_t *cipher, size_t cipher_len, const void *ad, size_t ad_len, uint8_t *tag, size_t tag_len, const uint8_t nonce[NONCE_LENGTH])
+{
+#ifdef CONFIG_SODIUM_CHACHA
+  if (tag_len != crypto_aead_chacha20poly1305_ietf_ABYTES)
+    return -1;
 
-  if (gcry_cipher_open(&hd, GCRY_CIPHER_CHACHA20, GCRY_CIPHER_MODE_POLY1305, 0) != GPG_ERR_NO_ERROR)
+  // Verifies the tag before decrypting, so plain is untouched on failure
+  if (crypto_aead_chacha20poly1305_ietf_decrypt_detached(plain, NULL, cipher, cipher_len, tag, ad, ad_len, nonce, hd) != 0)
     return -1;
 
-  if (gcry_cipher_setkey(hd, key, key_len) != GPG_ERR_NO_ERROR)
-    goto error;
+  return 0;
+#elif CONFIG_OPENSSL
+  int len;
+
+  if (EVP_DecryptInit_ex(hd, NULL, NULL, NULL, nonce) != 1)
+    return -1;
+
+  if (EVP_CIPHER_CTX_ctrl(hd, EVP_CTRL_AEAD_SET_TAG, tag_len, tag) != 1)
+    return -1;
+
+  if (ad_len > 0 && EVP_DecryptUpdate(hd, NULL, &len, ad, ad_len) != 1)
+    return -1;
+
+  if (EVP_DecryptUpdate(hd, plain, &len, cipher, cipher_len) != 1)
+    return -1;
+
+  if (EVP_DecryptFinal_ex(hd, NULL, &len) != 1)
+    return -1;
+
+  return 0;
+#elif CONFIG_GCRYPT
+  if (gcry_cipher_reset(hd) != GPG_ERR_NO_ERROR)
+    return -1;
 
   if (gcry_cipher_setiv(hd, nonce, NONCE_LENGTH) != GPG_ERR_NO_ERROR)
-    goto error;
+    return -1;
 
   if (ad_len > 0 && gcry_cipher_authenticate(hd, ad, ad_len) != GPG_ERR_NO_ERROR)
-    goto error;
+    return -1;
 
   if (gcry_cipher_decrypt(hd, plain, cipher_len, cipher, cipher_len) != GPG_ERR_NO_ERROR)
-    goto error;
+    return -1;
 
   if (gcry_cipher_checktag(hd, tag, tag_len) != GPG_ERR_NO_ERROR)
-    goto error;
+    return -1;
 
-  gcry_cipher_close(hd);
   return 0;
-
- error:
-  gcry_cipher_close(hd);
-  return -1;
 #else
   return -1;
 #endif
 }
 
+static int
+encrypt_chacha(uint8_t *cipher, const uint8_t *plain, size_t plain_len, const uint8_t *key, size_t key_len, const void *ad, size_t ad_len, uint8_t *tag, size_t tag_len, const uint8_t nonce[NONCE_LENGTH])
+{
+  CipherCTX hd;
+  int ret;
+
+  if (chacha_open(&hd, key, key_len, true) < 0)
+    return -1;
+
+  ret = encrypt_chacha_hd(hd, cipher, plain, plain_len, ad, ad_len, tag, tag_len, nonce);
+
+  chacha_close(hd);
+  return ret;
+}
+
+static int
+decrypt_chacha(uint8_t *plain, const uint8_t *cipher, size_t cipher_len, const uint8_t *key, size_t key_len, const void *ad, size_t ad_len, uint8_t *tag, size_t tag_len, const uint8_t nonce[NONCE_LENGTH])
+{
+  CipherCTX hd;
+  int ret;
+
+  if (chacha_open(&hd, key, key_len, false) < 0)
+    return -1;
+
+  ret = decrypt_chacha_hd(hd, plain, cipher, cipher_len, ad, ad_len, tag, tag_len, nonce);
+
+  chacha_close(hd);
+  return ret;
+}
+
 static int
 create_info(uint8_t *info, size_t *info_len, uint8_t *a, size_t a_len, uint8_t *b, size_t b_len, uint8_t *c, size_t c_len)
 {
@@ -1090,9 +1871,8 @@ create_info(uint8_t *info, size_t *info_len, uint8_t *a, size_t a_len, uint8_t *
 }
 
 static int
-create_and_sign_device_info(uint8_t *msg, size_t *msg_len, const char *device_id, uint8_t *device_x, size_t device_x_len, uint8_t *pk, size_t pk_len, uint8_t *sk)
+create_and_sign_device_info(pair_tlv_writer_t *writer, const char *device_id, uint8_t *device_x, size_t device_x_len, uint8_t *pk, size_t pk_len, uint8_t *sk)
 {
-  pair_tlv_values_t *tlv;
   uint8_t device_info[256];
   size_t device_info_len;
   size_t device_id_len;
@@ -1108,20 +1888,13 @@ create_and_sign_device_info(uint8_t *msg, size_t *msg_len, const char *device_id
 
   crypto_sign_detached(signature, NULL, device_info, device_info_len, sk);
 
-  tlv = pair_tlv_new();
-  pair_tlv_add_value(tlv, TLVType_Identifier, (unsigned char *)device_id, device_id_len);
-  pair_tlv_add_value(tlv, TLVType_Signature, signature, sizeof(signature));
-
-  ret = pair_tlv_format(tlv, msg, msg_len);
-
-  pair_tlv_free(tlv);
-  return ret;
+  pair_tlv_writer_add(writer, TLVType_Identifier, (unsigned char *)device_id, device_id_len);
+  return pair_tlv_writer_add(writer, TLVType_Signature, signature, sizeof(signature));
 }
 
 static int
-create_and_sign_accessory_info(uint8_t *msg, size_t *msg_len, uint8_t *server_pk, size_t server_pk_len, const char *accessory_id, uint8_t *client_pk, size_t client_pk_len, uint8_t *sk)
+create_and_sign_accessory_info(pair_tlv_writer_t *writer, uint8_t *server_pk, size_t server_pk_len, const char *accessory_id, uint8_t *client_pk, size_t client_pk_len, uint8_t *sk)
 {
-  pair_tlv_values_t *tlv;
   uint8_t accessory_info[256];
   size_t accessory_info_len;
   size_t accessory_id_len;
@@ -1137,14 +1910,33 @@ create_and_sign_accessory_info(uint8_t *msg, size_t *msg_len, uint8_t *server_pk
 
   crypto_sign_detached(signature, NULL, accessory_info, accessory_info_len, sk);
 
-  tlv = pair_tlv_new();
-  pair_tlv_add_value(tlv, TLVType_Identifier, (unsigned char *)accessory_id, accessory_id_len);
-  pair_tlv_add_value(tlv, TLVType_Signature, signature, sizeof(signature));
+  pair_tlv_writer_add(writer, TLVType_Identifier, (unsigned char *)accessory_id, accessory_id_len);
+  return pair_tlv_writer_add(writer, TLVType_Signature, signature, sizeof(signature));
+}
+
+// Encrypts the TLV-encoded data in plain and writes it as EncryptedData, with
+// the auth tag at the end
+static int
+encrypted_data_add(pair_tlv_writer_t *writer, const uint8_t *plain, size_t plain_len, const uint8_t *key, size_t key_len, enum pair_keys msg_state)
+{
+  uint8_t nonce[NONCE_LENGTH] = { 0 };
+  uint8_t *encrypted_data;
+  size_t encrypted_data_len;
+  int ret;
+
+  memcpy(nonce + 4, pair_keys_map[msg_state].nonce, NONCE_LENGTH - 4);
+
+  encrypted_data_len = plain_len + AUTHTAG_LENGTH; // Space for ciphered payload and authtag
+  encrypted_data = malloc(encrypted_data_len);
+  if (!encrypted_data)
+    return -1;
 
-  ret = pair_tlv_format(tlv, msg, msg_len);
+  ret = encrypt_chacha(encrypted_data, plain, plain_len, key, key_len, NULL, 0, encrypted_data + plain_len, AUTHTAG_LENGTH, nonce);
+  if (ret == 0)
+    ret = pair_tlv_writer_add(writer, TLVType_EncryptedData, encrypted_data, encrypted_data_len);
 
-  pair_tlv_free(tlv);
-  return ret;
+  free(encrypted_data);
+  return ret < 0 ? -1 : 0;
 }
 
 static int
@@ -1163,6 +1955,278 @@ verify_info(uint8_t *signature, uint8_t *pk, uint8_t *a, size_t a_len, uint8_t *
 }
 
 
+/* ------------------------------ PAIR-RESUME ------------------------------- */
+
+/* After a completed pair verify, both peers can keep the shared secret with a
+ * session ID, so that when the client reconnects it can do a pair-resume. The
+ * client then sends the session ID and an auth tag made from the cached secret
+ * together with the new ephemeral public key, and if the server still has the
+ * session, the new shared secret is derived from the cached one. That skips
+ * the signatures and the X25519 exchange of a full verify. A session can only
+ * be resumed once, since a resume gives a new session ID. The server finds
+ * sessions by session ID and its own public key, the client by the server's
+ * public key. The server also keeps the ID of the controller, so it can check
+ * that the controller is still paired before accepting a resume.
+ */
+#define RESUME_SESSION_ID_LENGTH 8
+
+struct resume_session
+{
+  uint8_t session_id[RESUME_SESSION_ID_LENGTH];
+  uint8_t server_public_key[crypto_sign_PUBLICKEYBYTES];
+  char device_id[PAIR_AP_DEVICE_ID_LEN_MAX]; // Only set by server, may be empty
+  uint8_t shared_secret[crypto_scalarmult_BYTES];
+
+  time_t expires; // Monotonic time
+
+  struct resume_session *next;
+};
+
+struct resume_cache
+{
+  struct resume_session *sessions; // Newest first
+  int count;
+  int max_entries; // 0 means cache disabled
+  int ttl;
+  pthread_mutex_t lck;
+};
+
+static struct resume_cache resume_cache_client = { .lck = PTHREAD_MUTEX_INITIALIZER };
+static struct resume_cache resume_cache_server = { .lck = PTHREAD_MUTEX_INITIALIZER };
+
+static void
+resume_session_free(struct resume_session *session)
+{
+  sodium_memzero(session, sizeof(struct resume_session));
+  free(session);
+}
+
+static int
+resume_cache_set(struct resume_cache *cache, int max_entries, int ttl_secs)
+{
+  struct resume_session *session;
+
+  if (max_entries < 0 || ttl_secs < 0)
+    return -1;
+
+  pthread_mutex_lock(&cache->lck);
+
+  cache->max_entries = (ttl_secs > 0) ? max_entries : 0;
+  cache->ttl = ttl_secs;
+
+  // Changing the setting always clears the cache
+  while ((session = cache->sessions))
+    {
+      cache->sessions = session->next;
+      resume_session_free(session);
+    }
+
+  cache->count = 0;
+
+  pthread_mutex_unlock(&cache->lck);
+  return 0;
+}
+
+static int
+client_resume_cache_set(int max_entries, int ttl_secs)
+{
+  return resume_cache_set(&resume_cache_client, max_entries, ttl_secs);
+}
+
+static int
+server_resume_cache_set(int max_entries, int ttl_secs)
+{
+  return resume_cache_set(&resume_cache_server, max_entries, ttl_secs);
+}
+
+// Removes the session matching session_id and server_public_key (those that are
+// not NULL), and copies it to out if that is set. Expired sessions are removed
+// on the way. Caller must hold cache->lck.
+static int
+resume_cache_remove(struct resume_session *out, struct resume_cache *cache, const uint8_t *session_id, const uint8_t *server_public_key)
+{
+  struct resume_session *session;
+  struct resume_session **prev;
+  bool is_match;
+  bool is_expired;
+  time_t now;
+  int ret = -1;
+
+  now = monotonic_now();
+
+  prev = &cache->sessions;
+  while ((session = *prev))
+    {
+      is_expired = (now >= session->expires);
+      is_match = (ret < 0) &&
+                 (!session_id || memcmp(session->session_id, session_id, sizeof(session->session_id)) == 0) &&
+                 (!server_public_key || memcmp(session->server_public_key, server_public_key, sizeof(session->server_public_key)) == 0);
+
+      if (!is_match && !is_expired)
+	{
+	  prev = &session->next;
+	  continue;
+	}
+
+      if (is_match && !is_expired)
+	{
+	  if (out)
+	    *out = *session;
+	  ret = 0;
+	}
+
+      *prev = session->next;
+      resume_session_free(session);
+      cache->count--;
+    }
+
+  return ret;
+}
+
+// Gets and removes a session, returns -1 if there is no unexpired match
+static int
+resume_cache_take(struct resume_session *out, struct resume_cache *cache, const uint8_t *session_id, const uint8_t *server_public_key)
+{
+  int ret;
+
+  pthread_mutex_lock(&cache->lck);
+  ret = resume_cache_remove(out, cache, session_id, server_public_key);
+  pthread_mutex_unlock(&cache->lck);
+
+  return ret;
+}
+
+// Copies a session without removing it, returns -1 if there is no unexpired
+// match. Used by the server to check a resume request before the session is
+// taken, so a request with a bad tag can't evict the session.
+static int
+resume_cache_get(struct resume_session *out, struct resume_cache *cache, const uint8_t *session_id, const uint8_t *server_public_key)
+{
+  struct resume_session *session;
+  time_t now;
+  int ret = -1;
+
+  now = monotonic_now();
+
+  pthread_mutex_lock(&cache->lck);
+
+  for (session = cache->sessions; session; session = session->next)
+    {
+      if (now < session->expires &&
+          memcmp(session->session_id, session_id, sizeof(session->session_id)) == 0 &&
+          memcmp(session->server_public_key, server_public_key, sizeof(session->server_public_key)) == 0)
+	{
+	  *out = *session;
+	  ret = 0;
+	  break;
+	}
+    }
+
+  pthread_mutex_unlock(&cache->lck);
+
+  return ret;
+}
+
+// Adds a session, dropping the oldest if the cache is full. The client only has
+// one session per server. device_id is the verified controller (server only).
+static void
+resume_cache_add(struct resume_cache *cache, const uint8_t *session_id, const uint8_t *server_public_key, const char *device_id, const uint8_t *shared_secret)
+{
+  struct resume_session *session;
+  struct resume_session **prev;
+
+  pthread_mutex_lock(&cache->lck);
+
+  if (cache->max_entries == 0)
+    goto out;
+
+  if (cache == &resume_cache_client)
+    resume_cache_remove(NULL, cache, NULL, server_public_key);
+
+  session = calloc(1, sizeof(struct resume_session));
+  if (!session)
+    goto out;
+
+  memcpy(session->session_id, session_id, sizeof(session->session_id));
+  memcpy(session->server_public_key, server_public_key, sizeof(session->server_public_key));
+  if (device_id)
+    snprintf(session->device_id, sizeof(session->device_id), "%s", device_id);
+  memcpy(session->shared_secret, shared_secret, sizeof(session->shared_secret));
+  session->expires = monotonic_now() + cache->ttl;
+
+  session->next = cache->sessions;
+  cache->sessions = session;
+  cache->count++;
+
+  if (cache->count > cache->max_entries)
+    {
+      for (prev = &cache->sessions; (*prev)->next; prev = &(*prev)->next)
+	; // Find the oldest
+
+      resume_session_free(*prev);
+      *prev = NULL;
+      cache->count--;
+    }
+
+ out:
+  pthread_mutex_unlock(&cache->lck);
+}
+
+// Derives a key for pair-resume from the shared secret of the session that is
+// being resumed. The HKDF salt is the client's ephemeral public key + a session
+// ID, see pair_keys_map.
+static int
+resume_key_derive(uint8_t *okm, size_t okm_len, const uint8_t *shared_secret, const uint8_t *client_eph_public_key, const uint8_t *session_id, enum pair_keys pair_key)
+{
+  uint8_t salt[crypto_box_PUBLICKEYBYTES + RESUME_SESSION_ID_LENGTH];
+  uint8_t prk[SHA512_DIGEST_LENGTH];
+  int ret;
+
+  memcpy(salt, client_eph_public_key, crypto_box_PUBLICKEYBYTES);
+  memcpy(salt + crypto_box_PUBLICKEYBYTES, session_id, RESUME_SESSION_ID_LENGTH);
+
+  ret = hmac_sha512(prk, salt, sizeof(salt), shared_secret, crypto_scalarmult_BYTES, NULL, 0);
+  if (ret == 0)
+    ret = hkdf_expand(okm, okm_len, prk, pair_keys_map[pair_key].info);
+
+  sodium_memzero(prk, sizeof(prk));
+  return ret;
+}
+
+// The session ID that both peers get from a full pair verify
+static int
+resume_session_id_derive(uint8_t *session_id, const uint8_t *shared_secret)
+{
+  return hkdf_extract_expand(session_id, RESUME_SESSION_ID_LENGTH, shared_secret, crypto_scalarmult_BYTES, PAIR_VERIFY_RESUME_SESSION_ID);
+}
+
+// A pair-resume message has no encrypted payload, so EncryptedData is just the
+// auth tag
+static int
+resume_tag_add(pair_tlv_writer_t *writer, const uint8_t *key, size_t key_len, enum pair_keys msg_state)
+{
+  uint8_t empty[1] = { 0 };
+
+  return encrypted_data_add(writer, empty, 0, key, key_len, msg_state);
+}
+
+static int
+resume_tag_verify(pair_tlv_t *encrypted_data, const uint8_t *key, size_t key_len, enum pair_keys msg_state)
+{
+  uint8_t nonce[NONCE_LENGTH] = { 0 };
+  uint8_t tag[AUTHTAG_LENGTH];
+  uint8_t empty[1] = { 0 };
+
+  if (!encrypted_data || encrypted_data->size != AUTHTAG_LENGTH)
+    return -1;
+
+  memcpy(tag, encrypted_data->value, AUTHTAG_LENGTH);
+  memcpy(nonce + 4, pair_keys_map[msg_state].nonce, NONCE_LENGTH - 4);
+
+  return decrypt_chacha(empty, empty, 0, key, key_len, NULL, 0, tag, sizeof(tag), nonce);
+}
+
+
 /* ------------------------- CLIENT IMPLEMENTATION -------------------------- */
 
 static int
@@ -1208,6 +2272,9 @@ client_setup_free(struct pair_setup_context *handle)
 
   srp_user_free(sctx->user);
 
+  if (sctx->pin)
+    sodium_memzero(sctx->pin, strlen(sctx->pin));
+
   free(sctx->pkB);
   free(sctx->M2);
   free(sctx->salt);
@@ -1220,17 +2287,13 @@ static uint8_t *
 client_setup_request1(size_t *len, struct pair_setup_context *handle)
 {
   struct pair_client_setup_context *sctx = &handle->sctx.client;
-  pair_tlv_values_t *request;
+  pair_tlv_writer_t request;
   uint8_t *data;
-  size_t data_len;
   uint8_t method;
   uint8_t flags;
   int endian_test = 1;
-  int ret;
 
-  data_len = REQUEST_BUFSIZE;
-  data = malloc(data_len);
-  request = pair_tlv_new();
+  pair_tlv_writer_init(&request, NULL, 3 * PAIR_TLV_LEN(1));
 
   // Test here instead of setup_new() so we can give an error message
   if(*(char *)&endian_test != 1)
@@ -1247,30 +2310,26 @@ client_setup_request1(size_t *len, struct pair_setup_context *handle)
     }
 
   method = PairingMethodPairSetup;
-  pair_tlv_add_value(request, TLVType_State, &pair_keys_map[PAIR_SETUP_MSG01].state, sizeof(pair_keys_map[PAIR_SETUP_MSG01].state));
-  pair_tlv_add_value(request, TLVType_Method, &method, sizeof(method));
+  pair_tlv_writer_add(&request, TLVType_State, &pair_keys_map[PAIR_SETUP_MSG01].state, sizeof(pair_keys_map[PAIR_SETUP_MSG01].state));
+  pair_tlv_writer_add(&request, TLVType_Method, &method, sizeof(method));
 
   if (handle->type == &pair_client_homekit_transient)
     {
       flags = PairingFlagsTransient;
-      pair_tlv_add_value(request, TLVType_Flags, &flags, sizeof(flags));
+      pair_tlv_writer_add(&request, TLVType_Flags, &flags, sizeof(flags));
     }
 
-  ret = pair_tlv_format(request, data, &data_len);
-  if (ret < 0)
+  data = pair_tlv_writer_finish(&request, len);
+  if (!data)
     {
-      handle->errmsg = "Setup request 1: pair_tlv_format returned an error";
+      handle->errmsg = "Setup request 1: Error writing TLV";
       goto error;
     }
 
-  *len = data_len;
-
-  pair_tlv_free(request);
   return data;
 
  error:
-  pair_tlv_free(request);
-  free(data);
+  pair_tlv_writer_discard(&request);
   return NULL;
 }
 
@@ -1278,15 +2337,9 @@ static uint8_t *
 client_setup_request2(size_t *len, struct pair_setup_context *handle)
 {
   struct pair_client_setup_context *sctx = &handle->sctx.client;
-  pair_tlv_values_t *request;
+  pair_tlv_writer_t request;
   uint8_t *data;
-  size_t data_len;
   const char *auth_username = NULL;
-  int ret;
-
-  data_len = REQUEST_BUFSIZE;
-  data = malloc(data_len);
-  request = pair_tlv_new();
 
   // Calculate A
   srp_user_start_authentication(sctx->user, &auth_username, &sctx->pkA, &sctx->pkA_len);
@@ -1294,50 +2347,38 @@ client_setup_request2(size_t *len, struct pair_setup_context *handle)
   // Calculate M1 (client proof)
   srp_user_process_challenge(sctx->user, (const unsigned char *)sctx->salt, sctx->salt_len, (const unsigned char *)sctx->pkB, sctx->pkB_len, &sctx->M1, &sctx->M1_len);
 
-  pair_tlv_add_value(request, TLVType_State, &pair_keys_map[PAIR_SETUP_MSG03].state, sizeof(pair_keys_map[PAIR_SETUP_MSG03].state));
-  pair_tlv_add_value(request, TLVType_PublicKey, sctx->pkA, sctx->pkA_len);
-  pair_tlv_add_value(request, TLVType_Proof, sctx->M1, sctx->M1_len);
+  pair_tlv_writer_init(&request, NULL, PAIR_TLV_LEN(1) + PAIR_TLV_LEN(sctx->pkA_len) + PAIR_TLV_LEN(sctx->M1_len));
+  pair_tlv_writer_add(&request, TLVType_State, &pair_keys_map[PAIR_SETUP_MSG03].state, sizeof(pair_keys_map[PAIR_SETUP_MSG03].state));
+  pair_tlv_writer_add(&request, TLVType_PublicKey, sctx->pkA, sctx->pkA_len);
+  pair_tlv_writer_add(&request, TLVType_Proof, sctx->M1, sctx->M1_len);
 
-  ret = pair_tlv_format(request, data, &data_len);
-  if (ret < 0)
+  data = pair_tlv_writer_finish(&request, len);
+  if (!data)
     {
-      handle->errmsg = "Setup request 2: pair_tlv_format returned an error";
-      goto error;
+      handle->errmsg = "Setup request 2: Error writing TLV";
+      return NULL;
     }
 
-  *len = data_len;
-
-  pair_tlv_free(request);
   return data;
-
- error:
-  pair_tlv_free(request);
-  free(data);
-  return NULL;
 }
 
 static uint8_t *
 client_setup_request3(size_t *len, struct pair_setup_context *handle)
 {
   struct pair_client_setup_context *sctx = &handle->sctx.client;
-  pair_tlv_values_t *request;
+  pair_tlv_writer_t request;
+  pair_tlv_writer_t plain;
   uint8_t *data;
-  size_t data_len;
   const unsigned char *session_key;
   int session_key_len;
   uint8_t device_x[32];
-  uint8_t nonce[NONCE_LENGTH] = { 0 };
-  uint8_t tag[AUTHTAG_LENGTH];
   uint8_t derived_key[32];
-  pair_tlv_values_t *append;
-  size_t append_len;
-  uint8_t *encrypted_data = NULL;
-  size_t encrypted_data_len;
+  uint8_t *plain_data = NULL;
+  size_t plain_len;
   int ret;
 
-  data_len = REQUEST_BUFSIZE;
-  data = malloc(data_len);
-  request = pair_tlv_new();
+  pair_tlv_writer_init(&plain, NULL, PAIR_TLV_LEN(strlen(sctx->device_id)) + PAIR_TLV_LEN(crypto_sign_BYTES) + PAIR_TLV_LEN(sizeof(sctx->public_key)));
+  pair_tlv_writer_init(&request, NULL, PAIR_TLV_LEN(1) + PAIR_TLV_LEN(plain.size + AUTHTAG_LENGTH));
 
   session_key = srp_user_get_session_key(sctx->user, &session_key_len);
   if (!session_key)
@@ -1353,7 +2394,7 @@ client_setup_request3(size_t *len, struct pair_setup_context *handle)
       goto error;
     }
 
-  ret = create_and_sign_device_info(data, &data_len, sctx->device_id, device_x, sizeof(device_x), sctx->public_key, sizeof(sctx->public_key), sctx->private_key);
+  ret = create_and_sign_device_info(&plain, sctx->device_id, device_x, sizeof(device_x), sctx->public_key, sizeof(sctx->public_key), sctx->private_key);
   if (ret < 0)
     {
       handle->errmsg = "Setup request 3: error creating signed device info";
@@ -1367,54 +2408,38 @@ client_setup_request3(size_t *len, struct pair_setup_context *handle)
       goto error;
     }
 
-  // Append TLV-encoded public key to *data, which already has identifier and signature
-  append = pair_tlv_new();
-  append_len = REQUEST_BUFSIZE - data_len;
-  pair_tlv_add_value(append, TLVType_PublicKey, sctx->public_key, sizeof(sctx->public_key));
-  ret = pair_tlv_format(append, data + data_len, &append_len);
-  pair_tlv_free(append);
-  if (ret < 0)
+  // Append TLV-encoded public key, the plaintext already has identifier and signature
+  pair_tlv_writer_add(&plain, TLVType_PublicKey, sctx->public_key, sizeof(sctx->public_key));
+  plain_data = pair_tlv_writer_finish(&plain, &plain_len);
+  if (!plain_data)
     {
       handle->errmsg = "Setup request 3: error appending public key to TLV";
       goto error;
     }
-  data_len += append_len;
-
-  memcpy(nonce + 4, pair_keys_map[PAIR_SETUP_MSG05].nonce, NONCE_LENGTH - 4);
 
-  encrypted_data_len = data_len + sizeof(tag); // Space for ciphered payload and authtag
-  encrypted_data = malloc(encrypted_data_len);
+  pair_tlv_writer_add(&request, TLVType_State, &pair_keys_map[PAIR_SETUP_MSG05].state, sizeof(pair_keys_map[PAIR_SETUP_MSG05].state));
 
-  ret = encrypt_chacha(encrypted_data, data, data_len, derived_key, sizeof(derived_key), NULL, 0, tag, sizeof(tag), nonce);
+  ret = encrypted_data_add(&request, plain_data, plain_len, derived_key, sizeof(derived_key), PAIR_SETUP_MSG05);
   if (ret < 0)
     {
       handle->errmsg = "Setup request 3: Could not encrypt";
       goto error;
     }
 
-  memcpy(encrypted_data + data_len, tag, sizeof(tag));
-
-  pair_tlv_add_value(request, TLVType_State, &pair_keys_map[PAIR_SETUP_MSG05].state, sizeof(pair_keys_map[PAIR_SETUP_MSG05].state));
-  pair_tlv_add_value(request, TLVType_EncryptedData, encrypted_data, encrypted_data_len);
-
-  data_len = REQUEST_BUFSIZE; // Re-using *data, so pass original length to pair_tlv_format
-  ret = pair_tlv_format(request, data, &data_len);
-  if (ret < 0)
+  data = pair_tlv_writer_finish(&request, len);
+  if (!data)
     {
-      handle->errmsg = "Setup request 3: error appending public key to TLV";
+      handle->errmsg = "Setup request 3: Error writing TLV";
       goto error;
     }
 
-  *len = data_len;
-
-  free(encrypted_data);
-  pair_tlv_free(request);
+  free(plain_data);
   return data;
 
  error:
-  free(encrypted_data);
-  pair_tlv_free(request);
-  free(data);
+  free(plain_data);
+  pair_tlv_writer_discard(&plain);
+  pair_tlv_writer_discard(&request);
   return NULL;
 }
 
@@ -1662,11 +2687,11 @@ client_setup_result(struct pair_setup_context *handle)
   return 0;
 }
 
+// If server_public_key is NULL the server's signature is not validated
 static int
-client_verify_new(struct pair_verify_context *handle, const char *client_setup_keys, pair_cb cb, void *cb_arg, const char *device_id)
+client_verify_new_with_keys(struct pair_verify_context *handle, const uint8_t *client_private_key, const uint8_t *server_public_key, const char *device_id)
 {
   struct pair_client_verify_context *vctx = &handle->vctx.client;
-  size_t hexkey_len;
 
   if (!is_initialized())
     return -1;
@@ -1674,28 +2699,48 @@ client_verify_new(struct pair_verify_context *handle, const char *client_setup_k
   if (!device_id || strlen(device_id) >= PAIR_AP_DEVICE_ID_LEN_MAX)
     return -1;
 
+  memcpy(vctx->client_private_key, client_private_key, sizeof(vctx->client_private_key));
+  if (server_public_key)
+    {
+      memcpy(vctx->server_public_key, server_public_key, sizeof(vctx->server_public_key));
+      vctx->verify_server_signature = true;
+    }
+
+  crypto_sign_ed25519_sk_to_pk(vctx->client_public_key, vctx->client_private_key);
+
+  snprintf(vctx->device_id, sizeof(vctx->device_id), "%s", device_id);
+
+  return 0;
+}
+
+static int
+client_verify_new(struct pair_verify_context *handle, const char *client_setup_keys, pair_cb cb, void *cb_arg, const char *device_id)
+{
+  uint8_t client_private_key[crypto_sign_SECRETKEYBYTES];
+  uint8_t server_public_key[crypto_sign_PUBLICKEYBYTES];
+  size_t hexkey_len;
+  int ret;
+
   if (!client_setup_keys)
     return -1;
 
   hexkey_len = strlen(client_setup_keys);
-  if (hexkey_len == 2 * sizeof(vctx->client_private_key) + 2 * sizeof(vctx->server_public_key))
+  if (hexkey_len == 2 * sizeof(client_private_key) + 2 * sizeof(server_public_key))
     {
-      hexread(vctx->client_private_key, sizeof(vctx->client_private_key), client_setup_keys);
-      hexread(vctx->server_public_key, sizeof(vctx->server_public_key), client_setup_keys + 2 * sizeof(vctx->client_private_key));
-      vctx->verify_server_signature = true;
+      hexread(client_private_key, sizeof(client_private_key), client_setup_keys);
+      hexread(server_public_key, sizeof(server_public_key), client_setup_keys + 2 * sizeof(client_private_key));
+      ret = client_verify_new_with_keys(handle, client_private_key, server_public_key, device_id);
     }
-  else if (hexkey_len == 2 * sizeof(vctx->client_private_key)) // No server public key known, so signature validation will be skipped
+  else if (hexkey_len == 2 * sizeof(client_private_key)) // No server public key known, so signature validation will be skipped
     {
-      hexread(vctx->client_private_key, sizeof(vctx->client_private_key), client_setup_keys);
+      hexread(client_private_key, sizeof(client_private_key), client_setup_keys);
+      ret = client_verify_new_with_keys(handle, client_private_key, NULL, device_id);
     }
   else
     return -1;
 
-  crypto_sign_ed25519_sk_to_pk(vctx->client_public_key, vctx->client_private_key);
-
-  snprintf(vctx->device_id, sizeof(vctx->device_id), "%s", device_id);
-
-  return 0;
+  sodium_memzero(client_private_key, sizeof(client_private_key));
+  return ret;
 }
 
 static uint8_t *
@@ -1703,16 +2748,25 @@ client_verify_request1(size_t *len, struct pair_verify_context *handle)
 {
   struct pair_client_verify_context *vctx = &handle->vctx.client;
 //  const uint8_t basepoint[crypto_scalarmult_BYTES] = {9}; // 32 bytes
-  pair_tlv_values_t *request;
+  pair_tlv_writer_t request;
+  struct resume_session session;
+  uint8_t method = PairingMethodPairResume;
+  uint8_t derived_key[32];
+  size_t request_size;
   uint8_t *data;
-  size_t data_len;
   int ret;
 
-  data_len = REQUEST_BUFSIZE;
-  data = malloc(data_len);
-  request = pair_tlv_new();
+  eph_x25519_keypair(vctx->client_eph_public_key, vctx->client_eph_private_key);
 
-  crypto_box_keypair(vctx->client_eph_public_key, vctx->client_eph_private_key);
+  // Can only resume a session with a server whose identity we know
+  vctx->resume_tried = false;
+  if (vctx->verify_server_signature && resume_cache_take(&session, &resume_cache_client, NULL, vctx->server_public_key) == 0)
+    {
+      memcpy(vctx->resume_session_id, session.session_id, sizeof(vctx->resume_session_id));
+      memcpy(vctx->resume_shared_secret, session.shared_secret, sizeof(vctx->resume_shared_secret));
+      sodium_memzero(&session, sizeof(session));
+      vctx->resume_tried = true;
+    }
 
 /*
   // TODO keep around in case box_keypair doesn't work
@@ -1724,24 +2778,46 @@ client_verify_request1(size_t *len, struct pair_verify_context *handle)
     }
 */
 
-  pair_tlv_add_value(request, TLVType_State, &pair_keys_map[PAIR_VERIFY_MSG01].state, sizeof(pair_keys_map[PAIR_VERIFY_MSG01].state));
-  pair_tlv_add_value(request, TLVType_PublicKey, vctx->client_eph_public_key, sizeof(vctx->client_eph_public_key));
+  request_size = PAIR_TLV_LEN(1) + PAIR_TLV_LEN(sizeof(vctx->client_eph_public_key));
+  if (vctx->resume_tried)
+    request_size += PAIR_TLV_LEN(1) + PAIR_TLV_LEN(sizeof(vctx->resume_session_id)) + PAIR_TLV_LEN(AUTHTAG_LENGTH);
 
-  ret = pair_tlv_format(request, data, &data_len);
-  if (ret < 0)
+  pair_tlv_writer_init(&request, NULL, request_size);
+  pair_tlv_writer_add(&request, TLVType_State, &pair_keys_map[PAIR_VERIFY_MSG01].state, sizeof(pair_keys_map[PAIR_VERIFY_MSG01].state));
+  pair_tlv_writer_add(&request, TLVType_PublicKey, vctx->client_eph_public_key, sizeof(vctx->client_eph_public_key));
+
+  // If the server doesn't have the session it will just do a normal verify
+  if (vctx->resume_tried)
     {
-      handle->errmsg = "Verify request 1: pair_tlv_format returned an error";
-      goto error;
+      ret = resume_key_derive(derived_key, sizeof(derived_key), vctx->resume_shared_secret, vctx->client_eph_public_key, vctx->resume_session_id, PAIR_RESUME_MSG01);
+      if (ret < 0)
+	{
+	  handle->errmsg = "Verify request 1: hkdf error getting derived_key";
+	  goto error;
+	}
+
+      pair_tlv_writer_add(&request, TLVType_Method, &method, sizeof(method));
+      pair_tlv_writer_add(&request, TLVType_SessionID, vctx->resume_session_id, sizeof(vctx->resume_session_id));
+
+      ret = resume_tag_add(&request, derived_key, sizeof(derived_key), PAIR_RESUME_MSG01);
+      if (ret < 0)
+	{
+	  handle->errmsg = "Verify request 1: Could not encrypt";
+	  goto error;
+	}
     }
 
-  *len = data_len;
+  data = pair_tlv_writer_finish(&request, len);
+  if (!data)
+    {
+      handle->errmsg = "Verify request 1: Error writing TLV";
+      return NULL;
+    }
 
-  pair_tlv_free(request);
   return data;
 
  error:
-  pair_tlv_free(request);
-  free(data);
+  pair_tlv_writer_discard(&request);
   return NULL;
 }
 
@@ -1749,23 +2825,21 @@ static uint8_t *
 client_verify_request2(size_t *len, struct pair_verify_context *handle)
 {
   struct pair_client_verify_context *vctx = &handle->vctx.client;
-  pair_tlv_values_t *request;
+  pair_tlv_writer_t request;
+  pair_tlv_writer_t plain;
   uint8_t *data;
-  size_t data_len;
-  uint8_t nonce[NONCE_LENGTH] = { 0 };
-  uint8_t tag[AUTHTAG_LENGTH];
   uint8_t derived_key[32];
-  uint8_t *encrypted_data = NULL;
-  size_t encrypted_data_len;
+  uint8_t *plain_data = NULL;
+  size_t plain_len;
   int ret;
 
-  data_len = REQUEST_BUFSIZE;
-  data = malloc(data_len);
-  request = pair_tlv_new();
+  pair_tlv_writer_init(&plain, NULL, PAIR_TLV_LEN(strlen(vctx->device_id)) + PAIR_TLV_LEN(crypto_sign_BYTES));
+  pair_tlv_writer_init(&request, NULL, PAIR_TLV_LEN(1) + PAIR_TLV_LEN(plain.size + AUTHTAG_LENGTH));
 
-  ret = create_and_sign_device_info(data, &data_len, vctx->device_id, vctx->client_eph_public_key, sizeof(vctx->client_eph_public_key),
+  ret = create_and_sign_device_info(&plain, vctx->device_id, vctx->client_eph_public_key, sizeof(vctx->client_eph_public_key),
                                     vctx->server_eph_public_key, sizeof(vctx->server_eph_public_key), vctx->client_private_key);
-  if (ret < 0)
+  plain_data = pair_tlv_writer_finish(&plain, &plain_len);
+  if (ret < 0 || !plain_data)
     {
       handle->errmsg = "Verify request 2: error creating signed device info";
       goto error;
@@ -1778,49 +2852,95 @@ client_verify_request2(size_t *len, struct pair_verify_context *handle)
       goto error;
     }
 
-  memcpy(nonce + 4, pair_keys_map[PAIR_VERIFY_MSG03].nonce, NONCE_LENGTH - 4);
-
-  encrypted_data_len = data_len + sizeof(tag); // Space for ciphered payload and authtag
-  encrypted_data = malloc(encrypted_data_len);
+  pair_tlv_writer_add(&request, TLVType_State, &pair_keys_map[PAIR_VERIFY_MSG03].state, sizeof(pair_keys_map[PAIR_VERIFY_MSG03].state));
 
-  ret = encrypt_chacha(encrypted_data, data, data_len, derived_key, sizeof(derived_key), NULL, 0, tag, sizeof(tag), nonce);
+  ret = encrypted_data_add(&request, plain_data, plain_len, derived_key, sizeof(derived_key), PAIR_VERIFY_MSG03);
   if (ret < 0)
     {
       handle->errmsg = "Verify request 2: Could not encrypt";
       goto error;
     }
 
-  memcpy(encrypted_data + data_len, tag, sizeof(tag));
-
-  pair_tlv_add_value(request, TLVType_State, &pair_keys_map[PAIR_VERIFY_MSG03].state, sizeof(pair_keys_map[PAIR_VERIFY_MSG03].state));
-  pair_tlv_add_value(request, TLVType_EncryptedData, encrypted_data, encrypted_data_len);
-
-  data_len = REQUEST_BUFSIZE; // Re-using *data, so pass original length to pair_tlv_format
-  ret = pair_tlv_format(request, data, &data_len);
-  if (ret < 0)
+  data = pair_tlv_writer_finish(&request, len);
+  if (!data)
     {
-      handle->errmsg = "Verify request 2: pair_tlv_format returned an error";
+      handle->errmsg = "Verify request 2: Error writing TLV";
       goto error;
     }
 
-  *len = data_len;
-
-  free(encrypted_data);
-  pair_tlv_free(request);
+  free(plain_data);
   return data;
 
  error:
-  free(encrypted_data);
-  pair_tlv_free(request);
-  free(data);
+  free(plain_data);
+  pair_tlv_writer_discard(&plain);
+  pair_tlv_writer_discard(&request);
   return NULL;
 }
 
+// The server accepted our pair-resume, so the response just has a new session
+// ID and an auth tag, and the verification is completed
+static int
+client_verify_resume_response1(struct pair_verify_context *handle, pair_tlv_values_t *response)
+{
+  struct pair_client_verify_context *vctx = &handle->vctx.client;
+  pair_tlv_t *session_id;
+  uint8_t derived_key[32];
+  int ret;
+
+  if (!vctx->resume_tried)
+    {
+      handle->errmsg = "Verify response 1: Unexpected pair-resume response";
+      return -1;
+    }
+
+  session_id = pair_tlv_get_value(response, TLVType_SessionID);
+  if (!session_id || session_id->size != sizeof(vctx->resume_session_id))
+    {
+      handle->errmsg = "Verify response 1: Missing or invalid session_id";
+      return -1;
+    }
+
+  ret = resume_key_derive(derived_key, sizeof(derived_key), vctx->resume_shared_secret, vctx->client_eph_public_key, session_id->value, PAIR_RESUME_MSG02);
+  if (ret < 0)
+    {
+      handle->errmsg = "Verify response 1: hkdf error getting derived_key";
+      return -1;
+    }
+
+  ret = resume_tag_verify(pair_tlv_get_value(response, TLVType_EncryptedData), derived_key, sizeof(derived_key), PAIR_RESUME_MSG02);
+  sodium_memzero(derived_key, sizeof(derived_key));
+  if (ret < 0)
+    {
+      handle->errmsg = "Verify response 1: Pair-resume authentication failed";
+      return -1;
+    }
+
+  ret = resume_key_derive(vctx->shared_secret, sizeof(vctx->shared_secret), vctx->resume_shared_secret, vctx->client_eph_public_key, session_id->value, PAIR_RESUME_SHARED_SECRET);
+  if (ret < 0)
+    {
+      handle->errmsg = "Verify response 1: hkdf error getting shared secret";
+      return -1;
+    }
+
+  sodium_memzero(vctx->resume_shared_secret, sizeof(vctx->resume_shared_secret));
+
+  resume_cache_add(&resume_cache_client, session_id->value, vctx->server_public_key, NULL, vctx->shared_secret);
+
+  memcpy(handle->result.shared_secret, vctx->shared_secret, sizeof(vctx->shared_secret));
+  handle->result.shared_secret_len = sizeof(vctx->shared_secret);
+
+  handle->status = PAIR_STATUS_COMPLETED;
+
+  return 0;
+}
+
 static int
 client_verify_response1(struct pair_verify_context *handle, const uint8_t *data, size_t data_len)
 {
   struct pair_client_verify_context *vctx = &handle->vctx.client;
   pair_tlv_values_t *response;
+  pair_tlv_t *method;
   pair_tlv_t *encrypted_data;
   pair_tlv_t *public_key;
   pair_tlv_t *device_id;
@@ -1838,6 +2958,14 @@ client_verify_response1(struct pair_verify_context *handle, const uint8_t *data,
       return -1;
     }
 
+  method = pair_tlv_get_value(response, TLVType_Method);
+  if (method && method->size == 1 && method->value[0] == PairingMethodPairResume)
+    {
+      ret = client_verify_resume_response1(handle, response);
+      pair_tlv_free(response);
+      return ret;
+    }
+
   encrypted_data = pair_tlv_get_value(response, TLVType_EncryptedData);
   if (!encrypted_data)
     {
@@ -1928,6 +3056,7 @@ client_verify_response2(struct pair_verify_context *handle, const uint8_t *data,
 {
   struct pair_client_verify_context *vctx = &handle->vctx.client;
   pair_tlv_values_t *response;
+  uint8_t session_id[RESUME_SESSION_ID_LENGTH];
 
   response = message_process(data, data_len, &handle->errmsg);
   if (!response)
@@ -1938,6 +3067,9 @@ client_verify_response2(struct pair_verify_context *handle, const uint8_t *data,
   memcpy(handle->result.shared_secret, vctx->shared_secret, sizeof(vctx->shared_secret));
   handle->result.shared_secret_len = sizeof(vctx->shared_secret);
 
+  if (vctx->verify_server_signature && resume_session_id_derive(session_id, vctx->shared_secret) == 0)
+    resume_cache_add(&resume_cache_client, session_id, vctx->server_public_key, NULL, vctx->shared_secret);
+
   handle->status = PAIR_STATUS_COMPLETED;
 
   pair_tlv_free(response);
@@ -1947,11 +3079,31 @@ client_verify_response2(struct pair_verify_context *handle, const uint8_t *data,
 
 /* ------------------------- SERVER IMPLEMENTATION -------------------------- */
 
+/* The server identity is the Ed25519 keypair that goes with a device_id. It is
+ * registered with pair_server_identity_set() or derived from the device_id the
+ * first time it is needed, and then kept so that each setup and verify context
+ * can just copy it.
+ */
+#define SERVER_IDENTITY_MAX 16
+
+struct server_identity
+{
+  char device_id[PAIR_AP_DEVICE_ID_LEN_MAX];
+  uint8_t public_key[crypto_sign_PUBLICKEYBYTES];
+  uint8_t private_key[crypto_sign_SECRETKEYBYTES];
+
+  struct server_identity *next;
+};
+
+static struct server_identity *server_identities;
+static int server_identities_count;
+static pthread_mutex_t server_identities_lck = PTHREAD_MUTEX_INITIALIZER;
+
 // Use (unsecure) keys seeded from device_id. We need the keys to always be the
 // same during pair setup and pair verify, since the client saves them after
 // pair-setup 3, so that the signature in pair-verify 1 can be checked.
 static void
-server_keypair(uint8_t *public_key, uint8_t *private_key, const char *device_id)
+server_keypair_derive(uint8_t *public_key, uint8_t *private_key, const char *device_id)
 {
   uint8_t seed[crypto_sign_SEEDBYTES] = { 0 };
   size_t len;
@@ -1965,27 +3117,119 @@ server_keypair(uint8_t *public_key, uint8_t *private_key, const char *device_id)
   crypto_sign_seed_keypair(public_key, private_key, seed);
 }
 
-static uint8_t *
-server_auth_failed_response(size_t *len, enum pair_keys msg_state)
+// Caller must hold server_identities_lck
+static struct server_identity *
+server_identity_find(struct server_identity ***prev_out, const char *device_id)
 {
-  pair_tlv_values_t *response;
-  uint8_t *data;
-  size_t data_len;
-  uint8_t error = TLVError_Authentication;
+  struct server_identity *identity;
+  struct server_identity **prev;
+
+  for (prev = &server_identities; (identity = *prev); prev = &identity->next)
+    {
+      if (strcmp(identity->device_id, device_id) == 0)
+	break;
+    }
 
-  data_len = REQUEST_BUFSIZE;
-  data = malloc(data_len);
-  response = pair_tlv_new();
+  if (prev_out)
+    *prev_out = prev;
 
-  pair_tlv_add_value(response, TLVType_State, &pair_keys_map[msg_state].state, sizeof(pair_keys_map[msg_state].state));
-  pair_tlv_add_value(response, TLVType_Error, &error, sizeof(error));
+  return identity;
+}
 
-  pair_tlv_format(response, data, &data_len);
-  pair_tlv_free(response);
+static void
+server_keypair(uint8_t *public_key, uint8_t *private_key, const char *device_id)
+{
+  struct server_identity *identity;
 
-  *len = data_len;
+  pthread_mutex_lock(&server_identities_lck);
 
-  return data;
+  identity = server_identity_find(NULL, device_id);
+  if (!identity && server_identities_count < SERVER_IDENTITY_MAX)
+    {
+      identity = calloc(1, sizeof(struct server_identity));
+      if (identity)
+	{
+	  snprintf(identity->device_id, sizeof(identity->device_id), "%s", device_id);
+	  server_keypair_derive(identity->public_key, identity->private_key, device_id);
+	  identity->next = server_identities;
+	  server_identities = identity;
+	  server_identities_count++;
+	}
+    }
+
+  if (identity)
+    {
+      memcpy(public_key, identity->public_key, sizeof(identity->public_key));
+      memcpy(private_key, identity->private_key, sizeof(identity->private_key));
+    }
+
+  pthread_mutex_unlock(&server_identities_lck);
+
+  // Registry full (or out of memory), so fall back to deriving every time
+  if (!identity)
+    server_keypair_derive(public_key, private_key, device_id);
+}
+
+static int
+server_identity_set(const char *device_id, const uint8_t *public_key, const uint8_t *private_key)
+{
+  struct server_identity *identity;
+  struct server_identity **prev;
+
+  if (!device_id || strlen(device_id) >= PAIR_AP_DEVICE_ID_LEN_MAX)
+    return -1;
+
+  if (!public_key != !private_key)
+    return -1;
+
+  pthread_mutex_lock(&server_identities_lck);
+
+  identity = server_identity_find(&prev, device_id);
+  if (identity)
+    {
+      *prev = identity->next;
+      sodium_memzero(identity, sizeof(struct server_identity));
+      free(identity);
+      server_identities_count--;
+    }
+
+  // Only removing the identity, so the keys will be derived again if needed
+  if (!public_key)
+    {
+      pthread_mutex_unlock(&server_identities_lck);
+      return 0;
+    }
+
+  // Explicitly registered identities are not limited by SERVER_IDENTITY_MAX
+  identity = calloc(1, sizeof(struct server_identity));
+  if (!identity)
+    {
+      pthread_mutex_unlock(&server_identities_lck);
+      return -1;
+    }
+
+  snprintf(identity->device_id, sizeof(identity->device_id), "%s", device_id);
+  memcpy(identity->public_key, public_key, sizeof(identity->public_key));
+  memcpy(identity->private_key, private_key, sizeof(identity->private_key));
+  identity->next = server_identities;
+  server_identities = identity;
+  server_identities_count++;
+
+  pthread_mutex_unlock(&server_identities_lck);
+  return 0;
+}
+
+static uint8_t *
+server_auth_failed_response(size_t *len, enum pair_keys msg_state)
+{
+  pair_tlv_writer_t response;
+  uint8_t error = TLVError_Authentication;
+
+  pair_tlv_writer_init(&response, NULL, 2 * PAIR_TLV_LEN(1));
+  pair_tlv_writer_add(&response, TLVType_State, &pair_keys_map[msg_state].state, sizeof(pair_keys_map[msg_state].state));
+  pair_tlv_writer_add(&response, TLVType_Error, &error, sizeof(error));
+
+  return pair_tlv_writer_finish(&response, len);
 }
 
 static int
@@ -2023,10 +3267,16 @@ server_setup_free(struct pair_setup_context *handle)
 
   srp_verifier_free(sctx->verifier);
 
-  free(sctx->pkA);
+  // The context itself is wiped by pair_setup_free()
+  if (sctx->b)
+    sodium_memzero(sctx->b, sctx->b_len);
+  if (sctx->v)
+    sodium_memzero(sctx->v, sctx->v_len);
+  if (sctx->pin)
+    sodium_memzero(sctx->pin, strlen(sctx->pin));
+
   free(sctx->pkB);
   free(sctx->b);
-  free(sctx->M1);
   free(sctx->v);
   free(sctx->salt);
   free(sctx->pin);
@@ -2058,8 +3308,8 @@ server_setup_request1(struct pair_setup_context *handle, const uint8_t *data, si
   sctx->is_transient = (type && type->size == 1 && type->value[0] == PairingFlagsTransient);
 
   // Note this is modified to return a 16 byte salt
-  ret = srp_create_salted_verification_key(HASH_SHA512, SRP_NG_3072, USERNAME, (unsigned char *)sctx->pin, strlen(sctx->pin),
-    &sctx->salt, &sctx->salt_len, &sctx->v, &sctx->v_len, NULL, NULL);
+  ret = srp_salted_verification_key_get(HASH_SHA512, SRP_NG_3072, USERNAME, (unsigned char *)sctx->pin, strlen(sctx->pin),
+    &sctx->salt, &sctx->salt_len, &sctx->v, &sctx->v_len);
   if (ret < 0)
     {
       RETURN_ERROR(PAIR_STATUS_INVALID, "Setup request 1: Could not create verification key");
@@ -2096,7 +3346,7 @@ server_setup_request2(struct pair_setup_context *handle, const uint8_t *data, si
     }
 
   pk = pair_tlv_get_value(request, TLVType_PublicKey);
-  if (!pk || pk->size > N_len(SRP_NG_3072)) // 384 bytes or less
+  if (!pk || pk->size > sizeof(sctx->pkA)) // 384 bytes or less
     {
       RETURN_ERROR(PAIR_STATUS_INVALID, "Setup request 2: Missing og invalid public key");
     }
@@ -2108,11 +3358,9 @@ server_setup_request2(struct pair_setup_context *handle, const uint8_t *data, si
     }
 
   sctx->pkA_len = pk->size;
-  sctx->pkA = malloc(sctx->pkA_len);
   memcpy(sctx->pkA, pk->value, sctx->pkA_len);
 
   sctx->M1_len = proof->size;
-  sctx->M1 = malloc(sctx->M1_len);
   memcpy(sctx->M1, proof->value, sctx->M1_len);
 
   sctx->verifier = srp_verifier_new(HASH_SHA512, SRP_NG_3072, USERNAME, sctx->salt, sctx->salt_len, sctx->v, sctx->v_len,
@@ -2249,36 +3497,26 @@ server_setup_response1(size_t *len, struct pair_setup_context *handle)
 {
   struct pair_server_setup_context *sctx = &handle->sctx.server;
   enum pair_keys msg_state = PAIR_SETUP_MSG02;
-  pair_tlv_values_t *response;
+  pair_tlv_writer_t response;
   uint8_t *data;
-  size_t data_len;
-  int ret;
 
   if (handle->status == PAIR_STATUS_AUTH_FAILED)
     return server_auth_failed_response(len, msg_state);
 
-  data_len = REQUEST_BUFSIZE;
-  data = malloc(data_len);
-  response = pair_tlv_new();
+  pair_tlv_writer_init(&response, NULL, PAIR_TLV_LEN(1) + PAIR_TLV_LEN(sctx->salt_len) + PAIR_TLV_LEN(sctx->pkB_len));
+  pair_tlv_writer_add(&response, TLVType_State, &pair_keys_map[msg_state].state, sizeof(pair_keys_map[msg_state].state));
+  pair_tlv_writer_add(&response, TLVType_Salt, sctx->salt, sctx->salt_len); // 16
+  pair_tlv_writer_add(&response, TLVType_PublicKey, sctx->pkB, sctx->pkB_len); // 384
 
-  pair_tlv_add_value(response, TLVType_State, &pair_keys_map[msg_state].state, sizeof(pair_keys_map[msg_state].state));
-  pair_tlv_add_value(response, TLVType_Salt, sctx->salt, sctx->salt_len); // 16
-  pair_tlv_add_value(response, TLVType_PublicKey, sctx->pkB, sctx->pkB_len); // 384
-
-  ret = pair_tlv_format(response, data, &data_len);
-  if (ret < 0)
+  data = pair_tlv_writer_finish(&response, len);
+  if (!data)
     {
-      RETURN_ERROR(PAIR_STATUS_INVALID, "Setup response 1: pair_tlv_format returned an error");
+      RETURN_ERROR(PAIR_STATUS_INVALID, "Setup response 1: Error writing TLV");
     }
 
-  *len = data_len;
-
-  pair_tlv_free(response);
   return data;
 
  error:
-  free(data);
-  pair_tlv_free(response);
   return NULL;
 }
 
@@ -2287,27 +3525,22 @@ server_setup_response2(size_t *len, struct pair_setup_context *handle)
 {
   struct pair_server_setup_context *sctx = &handle->sctx.server;
   enum pair_keys msg_state = PAIR_SETUP_MSG04;
-  pair_tlv_values_t *response;
-  uint8_t *data;
-  size_t data_len;
+  pair_tlv_writer_t response;
+  uint8_t *data = NULL;
   const uint8_t *session_key;
   int session_key_len;
-  int ret;
 
   if (handle->status == PAIR_STATUS_AUTH_FAILED)
     return server_auth_failed_response(len, msg_state);
 
-  data_len = REQUEST_BUFSIZE;
-  data = malloc(data_len);
-  response = pair_tlv_new();
-
-  pair_tlv_add_value(response, TLVType_State, &pair_keys_map[msg_state].state, sizeof(pair_keys_map[msg_state].state));
-  pair_tlv_add_value(response, TLVType_Proof, sctx->M2, sctx->M2_len); // 384
+  pair_tlv_writer_init(&response, NULL, PAIR_TLV_LEN(1) + PAIR_TLV_LEN(sctx->M2_len));
+  pair_tlv_writer_add(&response, TLVType_State, &pair_keys_map[msg_state].state, sizeof(pair_keys_map[msg_state].state));
+  pair_tlv_writer_add(&response, TLVType_Proof, sctx->M2, sctx->M2_len); // 384
 
-  ret = pair_tlv_format(response, data, &data_len);
-  if (ret < 0)
+  data = pair_tlv_writer_finish(&response, len);
+  if (!data)
     {
-      RETURN_ERROR(PAIR_STATUS_INVALID, "Setup response 2: pair_tlv_format returned an error");
+      RETURN_ERROR(PAIR_STATUS_INVALID, "Setup response 2: Error writing TLV");
     }
 
   if (sctx->is_transient)
@@ -2326,14 +3559,10 @@ server_setup_response2(size_t *len, struct pair_setup_context *handle)
       handle->status = PAIR_STATUS_COMPLETED;
     }
 
-  *len = data_len;
-
-  pair_tlv_free(response);
   return data;
 
  error:
   free(data);
-  pair_tlv_free(response);
   return NULL;
 }
 
@@ -2344,25 +3573,20 @@ server_setup_response3(size_t *len, struct pair_setup_context *handle)
   enum pair_keys msg_state = PAIR_SETUP_MSG06;
   const uint8_t *session_key;
   int session_key_len;
-  pair_tlv_values_t *response;
-  uint8_t nonce[NONCE_LENGTH] = { 0 };
-  uint8_t tag[AUTHTAG_LENGTH];
+  pair_tlv_writer_t response;
+  pair_tlv_writer_t plain;
   uint8_t derived_key[32];
-  pair_tlv_values_t *append;
-  size_t append_len;
-  uint8_t *encrypted_data = NULL;
-  size_t encrypted_data_len;
+  uint8_t *plain_data = NULL;
+  size_t plain_len;
   uint8_t *data;
-  size_t data_len;
   uint8_t device_x[32];
   int ret;
 
   if (handle->status == PAIR_STATUS_AUTH_FAILED)
     return server_auth_failed_response(len, msg_state);
 
-  data_len = REQUEST_BUFSIZE;
-  data = malloc(data_len);
-  response = pair_tlv_new();
+  pair_tlv_writer_init(&plain, NULL, PAIR_TLV_LEN(strlen(sctx->device_id)) + PAIR_TLV_LEN(crypto_sign_BYTES) + PAIR_TLV_LEN(sizeof(sctx->public_key)));
+  pair_tlv_writer_init(&response, NULL, PAIR_TLV_LEN(1) + PAIR_TLV_LEN(plain.size + AUTHTAG_LENGTH));
 
   session_key = srp_verifier_get_session_key(sctx->verifier, &session_key_len);
   if (!session_key)
@@ -2376,23 +3600,19 @@ server_setup_response3(size_t *len, struct pair_setup_context *handle)
       RETURN_ERROR(PAIR_STATUS_INVALID, "Setup response 3: hkdf error getting device_x");
     }
 
-  ret = create_and_sign_device_info(data, &data_len, sctx->device_id, device_x, sizeof(device_x), sctx->public_key, sizeof(sctx->public_key), sctx->private_key);
+  ret = create_and_sign_device_info(&plain, sctx->device_id, device_x, sizeof(device_x), sctx->public_key, sizeof(sctx->public_key), sctx->private_key);
   if (ret < 0)
     {
       RETURN_ERROR(PAIR_STATUS_INVALID, "Setup response 3: create device info returned an error");
     }
 
-  // Append TLV-encoded public key to *data, which already has identifier and signature
-  append = pair_tlv_new();
-  append_len = REQUEST_BUFSIZE - data_len;
-  pair_tlv_add_value(append, TLVType_PublicKey, sctx->public_key, sizeof(sctx->public_key));
-  ret = pair_tlv_format(append, data + data_len, &append_len);
-  pair_tlv_free(append);
-  if (ret < 0)
+  // Append TLV-encoded public key, the plaintext already has identifier and signature
+  pair_tlv_writer_add(&plain, TLVType_PublicKey, sctx->public_key, sizeof(sctx->public_key));
+  plain_data = pair_tlv_writer_finish(&plain, &plain_len);
+  if (!plain_data)
     {
       RETURN_ERROR(PAIR_STATUS_INVALID, "Setup response 3: error appending public key to TLV");
     }
-  data_len += append_len;
 
   ret = hkdf_extract_expand(derived_key, sizeof(derived_key), session_key, session_key_len, msg_state);
   if (ret < 0)
@@ -2400,27 +3620,18 @@ server_setup_response3(size_t *len, struct pair_setup_context *handle)
       RETURN_ERROR(PAIR_STATUS_INVALID, "Setup response 3: hkdf error getting derived_key");
     }
 
-  memcpy(nonce + 4, pair_keys_map[msg_state].nonce, NONCE_LENGTH - 4);
-
-  encrypted_data_len = data_len + sizeof(tag); // Space for ciphered payload and authtag
-  encrypted_data = malloc(encrypted_data_len);
+  pair_tlv_writer_add(&response, TLVType_State, &pair_keys_map[msg_state].state, sizeof(pair_keys_map[msg_state].state));
 
-  ret = encrypt_chacha(encrypted_data, data, data_len, derived_key, sizeof(derived_key), NULL, 0, tag, sizeof(tag), nonce);
+  ret = encrypted_data_add(&response, plain_data, plain_len, derived_key, sizeof(derived_key), msg_state);
   if (ret < 0)
     {
       RETURN_ERROR(PAIR_STATUS_INVALID, "Setup response 3: Could not encrypt");
     }
 
-  memcpy(encrypted_data + data_len, tag, sizeof(tag));
-
-  pair_tlv_add_value(response, TLVType_State, &pair_keys_map[msg_state].state, sizeof(pair_keys_map[msg_state].state));
-  pair_tlv_add_value(response, TLVType_EncryptedData, encrypted_data, encrypted_data_len);
-
-  data_len = REQUEST_BUFSIZE; // Re-using *data, so pass original length to pair_tlv_format
-  ret = pair_tlv_format(response, data, &data_len);
-  if (ret < 0)
+  data = pair_tlv_writer_finish(&response, len);
+  if (!data)
     {
-      RETURN_ERROR(PAIR_STATUS_INVALID, "Setup response 3: error appending public key to TLV");
+      RETURN_ERROR(PAIR_STATUS_INVALID, "Setup response 3: Error writing TLV");
     }
 
   if (sctx->add_cb)
@@ -2428,16 +3639,13 @@ server_setup_response3(size_t *len, struct pair_setup_context *handle)
 
   handle->status = PAIR_STATUS_COMPLETED;
 
-  *len = data_len;
-
-  free(encrypted_data);
-  pair_tlv_free(response);
+  free(plain_data);
   return data;
 
  error:
-  free(encrypted_data);
-  free(data);
-  pair_tlv_free(response);
+  free(plain_data);
+  pair_tlv_writer_discard(&plain);
+  pair_tlv_writer_discard(&response);
   return NULL;
 }
 
@@ -2467,28 +3675,100 @@ server_verify_new(struct pair_verify_context *handle, const char *client_setup_k
   return 0;
 }
 
+// Checks if the client's pair-resume request is for a session we have, and if
+// so, makes the shared secret and session ID for the resumed session. If we
+// verify clients, the controller of the session must still be paired. The
+// session is only taken from the cache once the request's tag is verified.
 static int
-server_verify_request1(struct pair_verify_context *handle, const uint8_t *data, size_t data_len)
+server_verify_resume_request1(struct pair_verify_context *handle, pair_tlv_values_t *request)
 {
   struct pair_server_verify_context *vctx = &handle->vctx.server;
-//  enum pair_keys msg_state = PAIR_VERIFY_MSG01;
-  pair_tlv_values_t *request;
-  pair_tlv_t *pk;
+  struct resume_session session;
+  pair_tlv_t *session_id;
+  uint8_t client_public_key[crypto_sign_PUBLICKEYBYTES];
+  uint8_t derived_key[32];
+  int ret;
 
-  request = message_process(data, data_len, &handle->errmsg);
-  if (!request)
-    {
-      RETURN_ERROR(PAIR_STATUS_INVALID, handle->errmsg);
-    }
+  session_id = pair_tlv_get_value(request, TLVType_SessionID);
+  if (!session_id || session_id->size != sizeof(session.session_id))
+    return -1;
 
-  pk = pair_tlv_get_value(request, TLVType_PublicKey);
-  if (!pk || pk->size != sizeof(vctx->client_eph_public_key))
-    {
-      RETURN_ERROR(PAIR_STATUS_INVALID, "Verify request 1: Missing or invalid public_key");
-    }
+  ret = resume_cache_get(&session, &resume_cache_server, session_id->value, vctx->server_public_key);
+  if (ret < 0)
+    return -1;
+
+  ret = resume_key_derive(derived_key, sizeof(derived_key), session.shared_secret, vctx->client_eph_public_key, session.session_id, PAIR_RESUME_MSG01);
+  if (ret == 0)
+    ret = resume_tag_verify(pair_tlv_get_value(request, TLVType_EncryptedData), derived_key, sizeof(derived_key), PAIR_RESUME_MSG01);
+  if (ret < 0)
+    goto out;
+
+  // A session can only be resumed once, so if someone else took it meanwhile
+  // this one fails. It is also dropped if the controller is no longer paired.
+  ret = resume_cache_take(NULL, &resume_cache_server, session.session_id, vctx->server_public_key);
+  if (ret < 0)
+    goto out;
+
+  if (vctx->verify_client_signature)
+    {
+      ret = (session.device_id[0] != '\0') ? vctx->get_cb(client_public_key, session.device_id, vctx->get_cb_arg) : -1;
+      if (ret < 0)
+	goto out;
+
+      memcpy(handle->result.device_id, session.device_id, sizeof(session.device_id));
+      memcpy(handle->result.client_public_key, client_public_key, sizeof(client_public_key));
+    }
+
+  randombytes_buf(vctx->resume_session_id, sizeof(vctx->resume_session_id));
+
+  ret = resume_key_derive(vctx->shared_secret, sizeof(vctx->shared_secret), session.shared_secret, vctx->client_eph_public_key, vctx->resume_session_id, PAIR_RESUME_SHARED_SECRET);
+  if (ret < 0)
+    goto out;
+
+  // The response is authenticated with the old secret, which we don't keep
+  ret = resume_key_derive(vctx->resume_key, sizeof(vctx->resume_key), session.shared_secret, vctx->client_eph_public_key, vctx->resume_session_id, PAIR_RESUME_MSG02);
+
+ out:
+  if (ret < 0)
+    {
+      sodium_memzero(handle->result.device_id, sizeof(handle->result.device_id));
+      sodium_memzero(handle->result.client_public_key, sizeof(handle->result.client_public_key));
+    }
+  sodium_memzero(derived_key, sizeof(derived_key));
+  sodium_memzero(&session, sizeof(session));
+  return ret;
+}
+
+static int
+server_verify_request1(struct pair_verify_context *handle, const uint8_t *data, size_t data_len)
+{
+  struct pair_server_verify_context *vctx = &handle->vctx.server;
+//  enum pair_keys msg_state = PAIR_VERIFY_MSG01;
+  pair_tlv_values_t *request;
+  pair_tlv_t *pk;
+  pair_tlv_t *method;
+
+  request = message_process(data, data_len, &handle->errmsg);
+  if (!request)
+    {
+      RETURN_ERROR(PAIR_STATUS_INVALID, handle->errmsg);
+    }
+
+  pk = pair_tlv_get_value(request, TLVType_PublicKey);
+  if (!pk || pk->size != sizeof(vctx->client_eph_public_key))
+    {
+      RETURN_ERROR(PAIR_STATUS_INVALID, "Verify request 1: Missing or invalid public_key");
+    }
 
   memcpy(vctx->client_eph_public_key, pk->value, sizeof(vctx->client_eph_public_key));
 
+  // If pair-resume isn't possible we fall back to a normal verify, which is
+  // what the client expects in that case
+  method = pair_tlv_get_value(request, TLVType_Method);
+  vctx->is_resume = false;
+  if (method && method->size == 1 && method->value[0] == PairingMethodPairResume)
+    vctx->is_resume = (server_verify_resume_request1(handle, request) == 0);
+
   pair_tlv_free(request);
   return 0;
 
@@ -2588,6 +3868,9 @@ server_verify_request2(struct pair_verify_context *handle, const uint8_t *data,
           handle->status = PAIR_STATUS_AUTH_FAILED;
           goto out;
         }
+
+      memcpy(handle->result.device_id, id_str, sizeof(id_str));
+      memcpy(handle->result.client_public_key, client_public_key, sizeof(client_public_key));
     }
 
  out:
@@ -2601,29 +3884,72 @@ server_verify_request2(struct pair_verify_context *handle, const uint8_t *data,
   return -1;
 }
 
+static uint8_t *
+server_verify_resume_response1(size_t *len, struct pair_verify_context *handle)
+{
+  struct pair_server_verify_context *vctx = &handle->vctx.server;
+  enum pair_keys msg_state = PAIR_RESUME_MSG02;
+  pair_tlv_writer_t response;
+  uint8_t method = PairingMethodPairResume;
+  uint8_t *data;
+  int ret;
+
+  pair_tlv_writer_init(&response, NULL, PAIR_TLV_LEN(1) + PAIR_TLV_LEN(1) + PAIR_TLV_LEN(sizeof(vctx->resume_session_id)) + PAIR_TLV_LEN(AUTHTAG_LENGTH));
+
+  pair_tlv_writer_add(&response, TLVType_State, &pair_keys_map[msg_state].state, sizeof(pair_keys_map[msg_state].state));
+  pair_tlv_writer_add(&response, TLVType_Method, &method, sizeof(method));
+  pair_tlv_writer_add(&response, TLVType_SessionID, vctx->resume_session_id, sizeof(vctx->resume_session_id));
+
+  ret = resume_tag_add(&response, vctx->resume_key, sizeof(vctx->resume_key), msg_state);
+  sodium_memzero(vctx->resume_key, sizeof(vctx->resume_key));
+  if (ret < 0)
+    {
+      RETURN_ERROR(PAIR_STATUS_INVALID, "Verify response 1: Could not encrypt");
+    }
+
+  data = pair_tlv_writer_finish(&response, len);
+  if (!data)
+    {
+      RETURN_ERROR(PAIR_STATUS_INVALID, "Verify response 1: Error writing TLV");
+    }
+
+  resume_cache_add(&resume_cache_server, vctx->resume_session_id, vctx->server_public_key, handle->result.device_id, vctx->shared_secret);
+
+  memcpy(handle->result.shared_secret, vctx->shared_secret, sizeof(vctx->shared_secret));
+  handle->result.shared_secret_len = sizeof(vctx->shared_secret);
+
+  handle->status = PAIR_STATUS_COMPLETED;
+
+  return data;
+
+ error:
+  pair_tlv_writer_discard(&response);
+  return NULL;
+}
+
 static uint8_t *
 server_verify_response1(size_t *len, struct pair_verify_context *handle)
 {
   struct pair_server_verify_context *vctx = &handle->vctx.server;
   enum pair_keys msg_state = PAIR_VERIFY_MSG02;
-  pair_tlv_values_t *response;
-  uint8_t nonce[NONCE_LENGTH] = { 0 };
-  uint8_t tag[AUTHTAG_LENGTH];
+  pair_tlv_writer_t response;
+  pair_tlv_writer_t plain;
   uint8_t derived_key[32];
-  uint8_t *encrypted_data = NULL;
-  size_t encrypted_data_len;
+  uint8_t *plain_data = NULL;
+  size_t plain_len;
   uint8_t *data;
-  size_t data_len;
   int ret;
 
   if (handle->status == PAIR_STATUS_AUTH_FAILED)
     return server_auth_failed_response(len, msg_state);
 
-  data_len = REQUEST_BUFSIZE;
-  data = malloc(data_len);
-  response = pair_tlv_new();
+  if (vctx->is_resume)
+    return server_verify_resume_response1(len, handle);
 
-  crypto_box_keypair(vctx->server_eph_public_key, vctx->server_eph_private_key);
+  pair_tlv_writer_init(&plain, NULL, PAIR_TLV_LEN(strlen(vctx->device_id)) + PAIR_TLV_LEN(crypto_sign_BYTES));
+  pair_tlv_writer_init(&response, NULL, PAIR_TLV_LEN(1) + PAIR_TLV_LEN(sizeof(vctx->server_eph_public_key)) + PAIR_TLV_LEN(plain.size + AUTHTAG_LENGTH));
+
+  eph_x25519_keypair(vctx->server_eph_public_key, vctx->server_eph_private_key);
 
   ret = crypto_scalarmult(vctx->shared_secret, vctx->server_eph_private_key, vctx->client_eph_public_key);
   if (ret < 0)
@@ -2631,9 +3957,10 @@ server_verify_response1(size_t *len, struct pair_verify_context *handle)
       RETURN_ERROR(PAIR_STATUS_INVALID, "Verify response 1: Error generating shared secret");
     }
 
-  ret = create_and_sign_accessory_info(data, &data_len, vctx->server_eph_public_key, sizeof(vctx->server_eph_public_key), vctx->device_id,
+  ret = create_and_sign_accessory_info(&plain, vctx->server_eph_public_key, sizeof(vctx->server_eph_public_key), vctx->device_id,
                                        vctx->client_eph_public_key, sizeof(vctx->client_eph_public_key), vctx->server_private_key);
-  if (ret < 0)
+  plain_data = pair_tlv_writer_finish(&plain, &plain_len);
+  if (ret < 0 || !plain_data)
     {
       RETURN_ERROR(PAIR_STATUS_INVALID, "Verify response 1: Error creating device info");
     }
@@ -2644,40 +3971,28 @@ server_verify_response1(size_t *len, struct pair_verify_context *handle)
       RETURN_ERROR(PAIR_STATUS_INVALID, "Verify response 1: hkdf error getting derived_key");
     }
 
-  memcpy(nonce + 4, pair_keys_map[msg_state].nonce, NONCE_LENGTH - 4);
-
-  encrypted_data_len = data_len + sizeof(tag); // Space for ciphered payload and authtag
-  encrypted_data = malloc(encrypted_data_len);
+  pair_tlv_writer_add(&response, TLVType_State, &pair_keys_map[msg_state].state, sizeof(pair_keys_map[msg_state].state));
+  pair_tlv_writer_add(&response, TLVType_PublicKey, vctx->server_eph_public_key, sizeof(vctx->server_eph_public_key));
 
-  ret = encrypt_chacha(encrypted_data, data, data_len, derived_key, sizeof(derived_key), NULL, 0, tag, sizeof(tag), nonce);
+  ret = encrypted_data_add(&response, plain_data, plain_len, derived_key, sizeof(derived_key), msg_state);
   if (ret < 0)
     {
       RETURN_ERROR(PAIR_STATUS_INVALID, "Verify response 1: Could not encrypt");
     }
 
-  memcpy(encrypted_data + data_len, tag, sizeof(tag));
-
-  pair_tlv_add_value(response, TLVType_State, &pair_keys_map[msg_state].state, sizeof(pair_keys_map[msg_state].state));
-  pair_tlv_add_value(response, TLVType_PublicKey, vctx->server_eph_public_key, sizeof(vctx->server_eph_public_key));
-  pair_tlv_add_value(response, TLVType_EncryptedData, encrypted_data, encrypted_data_len);
-
-  data_len = REQUEST_BUFSIZE; // Re-using *data, so pass original length to pair_tlv_format
-  ret = pair_tlv_format(response, data, &data_len);
-  if (ret < 0)
+  data = pair_tlv_writer_finish(&response, len);
+  if (!data)
     {
-      RETURN_ERROR(PAIR_STATUS_INVALID, "Verify response 1: pair_tlv_format returned an error");
+      RETURN_ERROR(PAIR_STATUS_INVALID, "Verify response 1: Error writing TLV");
     }
 
-  *len = data_len;
-
-  free(encrypted_data);
-  pair_tlv_free(response);
+  free(plain_data);
   return data;
 
  error:
-  free(encrypted_data);
-  free(data);
-  pair_tlv_free(response);
+  free(plain_data);
+  pair_tlv_writer_discard(&plain);
+  pair_tlv_writer_discard(&response);
   return NULL;
 }
 
@@ -2686,39 +4001,33 @@ server_verify_response2(size_t *len, struct pair_verify_context *handle)
 {
   struct pair_server_verify_context *vctx = &handle->vctx.server;
   enum pair_keys msg_state = PAIR_VERIFY_MSG04;
-  pair_tlv_values_t *response;
+  pair_tlv_writer_t response;
+  uint8_t session_id[RESUME_SESSION_ID_LENGTH];
   uint8_t *data;
-  size_t data_len;
-  int ret;
 
   if (handle->status == PAIR_STATUS_AUTH_FAILED)
     return server_auth_failed_response(len, msg_state);
 
-  data_len = REQUEST_BUFSIZE;
-  data = malloc(data_len);
-  response = pair_tlv_new();
+  pair_tlv_writer_init(&response, NULL, PAIR_TLV_LEN(1));
+  pair_tlv_writer_add(&response, TLVType_State, &pair_keys_map[msg_state].state, sizeof(pair_keys_map[msg_state].state));
 
-  pair_tlv_add_value(response, TLVType_State, &pair_keys_map[msg_state].state, sizeof(pair_keys_map[msg_state].state));
-
-  ret = pair_tlv_format(response, data, &data_len);
-  if (ret < 0)
+  data = pair_tlv_writer_finish(&response, len);
+  if (!data)
     {
-      RETURN_ERROR(PAIR_STATUS_INVALID, "Verify response 2: pair_tlv_format returned an error");
+      RETURN_ERROR(PAIR_STATUS_INVALID, "Verify response 2: Error writing TLV");
     }
 
-  *len = data_len;
+  if (resume_session_id_derive(session_id, vctx->shared_secret) == 0)
+    resume_cache_add(&resume_cache_server, session_id, vctx->server_public_key, handle->result.device_id, vctx->shared_secret);
 
   memcpy(handle->result.shared_secret, vctx->shared_secret, sizeof(vctx->shared_secret));
   handle->result.shared_secret_len = sizeof(vctx->shared_secret);
 
   handle->status = PAIR_STATUS_COMPLETED;
 
-  pair_tlv_free(response);
   return data;
 
  error:
-  free(data);
-  pair_tlv_free(response);
   return NULL;
 }
 
@@ -2744,318 +4053,942 @@ server_add_remove_request(pair_cb cb, void *cb_arg, const uint8_t *in, size_t in
       goto error;
     }
 
-  // Only present when adding
-  pk = pair_tlv_get_value(request, TLVType_PublicKey);
-  if (pk && pk->size == crypto_sign_PUBLICKEYBYTES)
-    {
-      public_key = pk->value;
+  // Only present when adding
+  pk = pair_tlv_get_value(request, TLVType_PublicKey);
+  if (pk && pk->size == crypto_sign_PUBLICKEYBYTES)
+    {
+      public_key = pk->value;
+    }
+
+  memcpy(id_str, device_id->value, device_id->size);
+
+  cb(public_key, id_str, cb_arg);
+
+  pair_tlv_free(request);
+  return 0;
+
+ error:
+  pair_tlv_free(request);
+  return -1;
+}
+
+static uint8_t *
+server_add_remove_response(size_t *len)
+{
+  pair_tlv_writer_t response;
+  uint8_t state = 2;
+
+  pair_tlv_writer_init(&response, NULL, PAIR_TLV_LEN(1));
+  pair_tlv_writer_add(&response, TLVType_State, &state, sizeof(state));
+
+  return pair_tlv_writer_finish(&response, len);
+}
+
+static int
+server_add_remove(uint8_t **out, size_t *out_len, pair_cb cb, void *cb_arg, const uint8_t *in, size_t in_len)
+{
+  int ret;
+
+  ret = server_add_remove_request(cb, cb_arg, in, in_len);
+  if (ret < 0)
+    return -1;
+
+  *out = server_add_remove_response(out_len);
+  if (!*out)
+    return -1;
+
+  return 0;
+}
+
+static int
+server_list_cb(uint8_t public_key[crypto_sign_PUBLICKEYBYTES], const char *device_id, void *cb_arg)
+{
+  pair_tlv_writer_t *response = cb_arg;
+  uint8_t permissions = 1; // Means admin (TODO don't hardcode - let caller set)
+
+  // If this isn't the first iteration (item) then we must add a separator. The
+  // response starts with just the state.
+  if (response->len > PAIR_TLV_LEN(1))
+    pair_tlv_writer_add(response, TLVType_Separator, NULL, 0);
+
+  pair_tlv_writer_add(response, TLVType_Identifier, (unsigned char *)device_id, strlen(device_id));
+  pair_tlv_writer_add(response, TLVType_PublicKey, public_key, crypto_sign_PUBLICKEYBYTES);
+  pair_tlv_writer_add(response, TLVType_Permissions, &permissions, sizeof(permissions));
+
+  return 0;
+}
+
+static uint8_t *
+server_list_response(size_t *len, pair_list_cb cb, void *cb_arg)
+{
+  pair_tlv_writer_t response;
+  uint8_t state = 2;
+
+  pair_tlv_writer_init(&response, NULL, 256); // Grows as pairings are added
+  pair_tlv_writer_add(&response, TLVType_State, &state, sizeof(state));
+
+  cb(server_list_cb, &response, cb_arg);
+
+  return pair_tlv_writer_finish(&response, len);
+}
+
+static int
+server_list(uint8_t **out, size_t *out_len, pair_list_cb cb, void *cb_arg, const uint8_t *in, size_t in_len)
+{
+  // Skip reading the request, it just has state = 1 and pair method =
+  // PairingMethodListPairings
+
+  *out = server_list_response(out_len, cb, cb_arg);
+  if (!*out)
+    return -1;
+
+  return 0;
+}
+
+
+/* ----------------------- CIPHERING IMPLEMENTATION ------------------------- */
+
+static void
+cipher_free(struct pair_cipher_context *cctx)
+{
+  if (!cctx)
+    return;
+
+  chacha_close(cctx->encryption_ctx);
+  chacha_close(cctx->decryption_ctx);
+
+  sodium_memzero(cctx, sizeof(struct pair_cipher_context));
+  free(cctx);
+}
+
+static int
+channel_keys_get(enum pair_keys *write_key, enum pair_keys *read_key, int channel)
+{
+  // Note that events is opposite, probably because it is a reverse connection
+  switch (channel)
+    {
+      case 0:
+	*write_key = PAIR_CONTROL_WRITE;
+	*read_key = PAIR_CONTROL_READ;
+	break;
+      case 1:
+	*write_key = PAIR_EVENTS_READ;
+	*read_key = PAIR_EVENTS_WRITE;
+	break;
+      case 2:
+	*write_key = PAIR_CONTROL_READ;
+	*read_key = PAIR_CONTROL_WRITE;
+	break;
+      case 3:
+	*write_key = PAIR_EVENTS_WRITE;
+	*read_key = PAIR_EVENTS_READ;
+	break;
+      default:
+	return -1;
+    }
+
+  return 0;
+}
+
+static struct pair_cipher_context *
+cipher_derive(struct pair_definition *type, int channel, struct key_derivation *kd)
+{
+  struct pair_cipher_context *cctx;
+  enum pair_keys write_key;
+  enum pair_keys read_key;
+  int ret;
+
+  ret = channel_keys_get(&write_key, &read_key, channel);
+  if (ret < 0)
+    return NULL;
+
+  cctx = calloc(1, sizeof(struct pair_cipher_context));
+  if (!cctx)
+    goto error;
+
+  cctx->type = type;
+
+  ret = key_derive(cctx->encryption_key, sizeof(cctx->encryption_key), kd, write_key);
+  if (ret < 0)
+    goto error;
+
+  ret = key_derive(cctx->decryption_key, sizeof(cctx->decryption_key), kd, read_key);
+  if (ret < 0)
+    goto error;
+
+  ret = chacha_open(&cctx->encryption_ctx, cctx->encryption_key, sizeof(cctx->encryption_key), true);
+  if (ret < 0)
+    goto error;
+
+  ret = chacha_open(&cctx->decryption_ctx, cctx->decryption_key, sizeof(cctx->decryption_key), false);
+  if (ret < 0)
+    goto error;
+
+  return cctx;
+
+ error:
+  pair_cipher_free(cctx);
+  return NULL;
+}
+
+static struct pair_cipher_context *
+cipher_new(struct pair_definition *type, int channel, const uint8_t *shared_secret, size_t shared_secret_len)
+{
+  struct pair_cipher_context *cctx;
+  struct key_derivation kd = { .ikm = shared_secret, .ikm_len = shared_secret_len };
+
+  cctx = cipher_derive(type, channel, &kd);
+
+  sodium_memzero(&kd, sizeof(kd));
+  return cctx;
+}
+
+static int
+cipher_new_multi(struct pair_cipher_context **cctx, struct pair_definition *type, const int *channels, int nchannels, const uint8_t *shared_secret, size_t shared_secret_len)
+{
+  struct key_derivation kd = { .ikm = shared_secret, .ikm_len = shared_secret_len };
+  int i;
+
+  for (i = 0; i < nchannels; i++)
+    {
+      cctx[i] = cipher_derive(type, channels[i], &kd);
+      if (!cctx[i])
+	goto error;
+    }
+
+  sodium_memzero(&kd, sizeof(kd));
+  return 0;
+
+ error:
+  while (i-- > 0)
+    {
+      pair_cipher_free(cctx[i]);
+      cctx[i] = NULL;
+    }
+
+  sodium_memzero(&kd, sizeof(kd));
+  return -1;
+}
+
+// Encryption is done in blocks, where each block consists of a short, the
+// encrypted data and an auth tag. The short is the size of the encrypted data.
+// The encrypted data in the block cannot exceed ENCRYPTED_LEN_MAX.
+#define BLOCK_OVERHEAD (sizeof(uint16_t) + AUTHTAG_LENGTH)
+
+// A parallel encryption job must have at least this many blocks, so we don't
+// waste more on starting jobs than we gain
+#define ENCRYPT_PARALLEL_BLOCKS_MIN 16
+
+static ssize_t
+encrypted_len(size_t plaintext_len)
+{
+  size_t nblocks;
+
+  if (plaintext_len == 0)
+    return 0;
+
+  nblocks = 1 + ((plaintext_len - 1) / ENCRYPTED_LEN_MAX); // Ceiling of division
+
+  return nblocks * BLOCK_OVERHEAD + plaintext_len;
+}
+
+// Returns the plaintext length of the complete blocks in the ciphertext
+static ssize_t
+decrypted_len(const uint8_t *ciphertext, size_t ciphertext_len)
+{
+  const uint8_t *cipher_block;
+  uint16_t block_len;
+  size_t len;
+
+  for (len = 0, cipher_block = ciphertext; cipher_block + sizeof(block_len) <= ciphertext + ciphertext_len; )
+    {
+      memcpy(&block_len, cipher_block, sizeof(block_len)); // TODO BE or LE?
+      if (cipher_block + block_len + BLOCK_OVERHEAD > ciphertext + ciphertext_len)
+	break;
+
+      len += block_len;
+      cipher_block += block_len + BLOCK_OVERHEAD;
+    }
+
+  return len;
+}
+
+// Writes one block (length, ciphertext and tag) to cipher_block
+static int
+encrypt_block(uint8_t *cipher_block, const uint8_t *plain_block, uint16_t block_len, CipherCTX hd, uint64_t counter)
+{
+  uint8_t nonce[NONCE_LENGTH] = { 0 };
+  uint8_t tag[AUTHTAG_LENGTH];
+  int ret;
+
+  memcpy(nonce + 4, &counter, sizeof(counter));// TODO BE or LE?
+
+  memcpy(cipher_block, &block_len, sizeof(block_len)); // TODO BE or LE?
+  ret = encrypt_chacha_hd(hd, cipher_block + sizeof(block_len), plain_block, block_len, &block_len, sizeof(block_len), tag, sizeof(tag), nonce);
+  if (ret < 0)
+    return -1;
+
+  memcpy(cipher_block + sizeof(block_len) + block_len, tag, AUTHTAG_LENGTH);
+  return 0;
+}
+
+// Since the nonce of each block is just the counter, the blocks can be
+// encrypted independently of each other, so with pair_cipher_parallel_set()
+// large plaintexts are split in ranges of blocks that are encrypted by parallel
+// jobs. Each job uses its own cipher handle.
+struct encrypt_job
+{
+  uint8_t *ciphertext;
+  const uint8_t *plaintext;
+  size_t plaintext_len;
+  const uint8_t *key;
+  uint64_t counter;
+  int ret;
+};
+
+// Encrypts all of plaintext as full blocks (except the last) into ciphertext,
+// which must have room for it, starting with the given counter
+static int
+encrypt_range(uint8_t *ciphertext, const uint8_t *plaintext, size_t plaintext_len, CipherCTX hd, uint64_t counter)
+{
+  const uint8_t *plain_block;
+  uint8_t *cipher_block;
+  size_t len;
+  int ret;
+
+  for (plain_block = plaintext, cipher_block = ciphertext; plain_block < plaintext + plaintext_len; )
+    {
+      len = plaintext + plaintext_len - plain_block;
+      if (len > ENCRYPTED_LEN_MAX)
+	len = ENCRYPTED_LEN_MAX;
+
+      ret = encrypt_block(cipher_block, plain_block, len, hd, counter);
+      if (ret < 0)
+	return -1;
+
+      plain_block += len;
+      cipher_block += len + BLOCK_OVERHEAD;
+      counter++;
+    }
+
+  return 0;
+}
+
+static void
+encrypt_job_run(void *arg)
+{
+  struct encrypt_job *job = arg;
+  CipherCTX hd;
+
+  job->ret = chacha_open(&hd, job->key, 32, true);
+  if (job->ret < 0)
+    return;
+
+  job->ret = encrypt_range(job->ciphertext, job->plaintext, job->plaintext_len, hd, job->counter);
+
+  chacha_close(hd);
+}
+
+// Caller must make sure that ciphertext has room for all of plaintext. Returns
+// 1 if the plaintext was too small to split, then caller must do it serially.
+static int
+encrypt_parallel(uint8_t *ciphertext, const uint8_t *plaintext, size_t plaintext_len, struct pair_cipher_context *cctx)
+{
+  struct encrypt_job *jobs;
+  void **job_args;
+  size_t nblocks;
+  size_t blocks_per_job;
+  int njobs;
+  int ret;
+  int i;
+
+  nblocks = 1 + ((plaintext_len - 1) / ENCRYPTED_LEN_MAX);
+
+  njobs = nblocks / ENCRYPT_PARALLEL_BLOCKS_MIN;
+  if (njobs > cctx->parallel_jobs)
+    njobs = cctx->parallel_jobs;
+  if (njobs < 2)
+    return 1;
+
+  blocks_per_job = 1 + ((nblocks - 1) / njobs);
+  njobs = 1 + ((nblocks - 1) / blocks_per_job); // Last job might have become empty
+
+  jobs = calloc(njobs, sizeof(struct encrypt_job));
+  job_args = calloc(njobs, sizeof(void *));
+  if (!jobs || !job_args)
+    {
+      cctx->errmsg = "Out of memory for parallel encryption";
+      ret = -1;
+      goto out;
+    }
+
+  // All blocks but the last are full, so the offsets are easy to calculate
+  for (i = 0; i < njobs; i++)
+    {
+      jobs[i].ciphertext = ciphertext + i * blocks_per_job * (ENCRYPTED_LEN_MAX + BLOCK_OVERHEAD);
+      jobs[i].plaintext = plaintext + i * blocks_per_job * ENCRYPTED_LEN_MAX;
+      jobs[i].plaintext_len = (i + 1 == njobs) ? (plaintext + plaintext_len - jobs[i].plaintext) : blocks_per_job * ENCRYPTED_LEN_MAX;
+      jobs[i].key = cctx->encryption_key;
+      jobs[i].counter = cctx->encryption_counter + i * blocks_per_job;
+      job_args[i] = &jobs[i];
+    }
+
+  executor_run(cctx->executor, cctx->executor_arg, encrypt_job_run, job_args, njobs);
+
+  for (i = 0, ret = 0; i < njobs; i++)
+    {
+      if (jobs[i].ret < 0)
+	ret = -1;
+    }
+
+  if (ret < 0)
+    {
+      cctx->errmsg = "Encryption with chacha poly1305 failed";
+      goto out;
+    }
+
+  cctx->encryption_counter += nblocks;
+
+ out:
+  free(job_args);
+  free(jobs);
+  return ret;
+}
+
+static ssize_t
+encrypt_into(uint8_t *ciphertext, size_t *ciphertext_len, const uint8_t *plaintext, size_t plaintext_len, struct pair_cipher_context *cctx)
+{
+  const uint8_t *plain_block;
+  uint8_t *cipher_block;
+  size_t remaining;
+  size_t len;
+  int ret;
+
+  if (plaintext_len == 0 || !plaintext || !ciphertext)
+    return -1;
+
+  if (*ciphertext_len <= BLOCK_OVERHEAD)
+    {
+      cctx->errmsg = "Buffer too small for encryption";
+      return -1;
+    }
+
+  cctx->encryption_counter_prev = cctx->encryption_counter;
+
+  if (cctx->parallel_jobs > 1 && *ciphertext_len >= encrypted_len(plaintext_len))
+    {
+      ret = encrypt_parallel(ciphertext, plaintext, plaintext_len, cctx);
+      if (ret < 0)
+	return -1;
+      else if (ret == 0)
+	{
+	  plain_block = plaintext + plaintext_len;
+	  cipher_block = ciphertext + encrypted_len(plaintext_len);
+	  goto done;
+	}
+    }
+
+  for (plain_block = plaintext, cipher_block = ciphertext; plain_block < plaintext + plaintext_len; )
+    {
+      // Stop if there is no room for another block with at least one byte
+      remaining = ciphertext + *ciphertext_len - cipher_block;
+      if (remaining <= BLOCK_OVERHEAD)
+	break;
+
+      // If it is the last block we will encrypt only the remaining data, and
+      // if the buffer is almost full only what there is room for
+      len = plaintext + plaintext_len - plain_block;
+      if (len > ENCRYPTED_LEN_MAX)
+	len = ENCRYPTED_LEN_MAX;
+      if (len > remaining - BLOCK_OVERHEAD)
+	len = remaining - BLOCK_OVERHEAD;
+
+      ret = encrypt_block(cipher_block, plain_block, len, cctx->encryption_ctx, cctx->encryption_counter);
+      if (ret < 0)
+	{
+	  cctx->errmsg = "Encryption with chacha poly1305 failed";
+	  cctx->encryption_counter = cctx->encryption_counter_prev;
+	  return -1;
+	}
+
+      plain_block += len;
+      cipher_block += len + BLOCK_OVERHEAD;
+      cctx->encryption_counter++;
+    }
+
+ done:
+  *ciphertext_len = cipher_block - ciphertext;
+
+#ifdef DEBUG_PAIR
+  hexdump("Encrypted:\n", ciphertext, *ciphertext_len);
+#endif
+
+  return plain_block - plaintext;
+}
+
+// Same as encrypt_into(), but the plaintext is gathered from iovcnt segments.
+// A block that is contained in a single segment is encrypted directly from
+// there, only blocks crossing a segment boundary are assembled in a bounce
+// buffer first.
+static ssize_t
+encryptv(uint8_t *ciphertext, size_t *ciphertext_len, const struct iovec *iov, int iovcnt, struct pair_cipher_context *cctx)
+{
+  uint8_t bounce[ENCRYPTED_LEN_MAX];
+  const uint8_t *plain_block;
+  const uint8_t *seg;
+  uint8_t *cipher_block;
+  size_t seg_len;
+  size_t plaintext_len;
+  size_t total;
+  size_t remaining;
+  size_t len;
+  size_t n;
+  int i;
+  int j;
+  int ret;
+
+  for (i = 0, plaintext_len = 0; i < iovcnt; i++)
+    plaintext_len += iov[i].iov_len;
+
+  if (plaintext_len == 0 || !ciphertext)
+    return -1;
+
+  if (*ciphertext_len <= BLOCK_OVERHEAD)
+    {
+      cctx->errmsg = "Buffer too small for encryption";
+      return -1;
+    }
+
+  cctx->encryption_counter_prev = cctx->encryption_counter;
+
+  i = 0;
+  seg = iov[0].iov_base;
+  seg_len = iov[0].iov_len;
+
+  for (total = 0, cipher_block = ciphertext; total < plaintext_len; )
+    {
+      remaining = ciphertext + *ciphertext_len - cipher_block;
+      if (remaining <= BLOCK_OVERHEAD)
+	break;
+
+      len = plaintext_len - total;
+      if (len > ENCRYPTED_LEN_MAX)
+	len = ENCRYPTED_LEN_MAX;
+      if (len > remaining - BLOCK_OVERHEAD)
+	len = remaining - BLOCK_OVERHEAD;
+
+      // Skip to the first segment with data left
+      while (seg_len == 0)
+	{
+	  i++;
+	  seg = iov[i].iov_base;
+	  seg_len = iov[i].iov_len;
+	}
+
+      if (len <= seg_len)
+	{
+	  plain_block = seg;
+	  seg += len;
+	  seg_len -= len;
+	}
+      else
+	{
+	  for (n = 0, j = i; n < len; j++)
+	    {
+	      if (j > i)
+		{
+		  seg = iov[j].iov_base;
+		  seg_len = iov[j].iov_len;
+		}
+
+	      if (seg_len > len - n)
+		{
+		  memcpy(bounce + n, seg, len - n);
+		  seg += len - n;
+		  seg_len -= len - n;
+		  n = len;
+		}
+	      else
+		{
+		  memcpy(bounce + n, seg, seg_len);
+		  n += seg_len;
+		  seg_len = 0;
+		}
+	    }
+	  i = j - 1;
+	  plain_block = bounce;
+	}
+
+      ret = encrypt_block(cipher_block, plain_block, len, cctx->encryption_ctx, cctx->encryption_counter);
+      if (ret < 0)
+	{
+	  cctx->errmsg = "Encryption with chacha poly1305 failed";
+	  cctx->encryption_counter = cctx->encryption_counter_prev;
+	  return -1;
+	}
+
+      total += len;
+      cipher_block += len + BLOCK_OVERHEAD;
+      cctx->encryption_counter++;
     }
 
-  memcpy(id_str, device_id->value, device_id->size);
-
-  cb(public_key, id_str, cb_arg);
+  *ciphertext_len = cipher_block - ciphertext;
 
-  pair_tlv_free(request);
-  return 0;
+#ifdef DEBUG_PAIR
+  hexdump("Encrypted:\n", ciphertext, *ciphertext_len);
+#endif
 
- error:
-  pair_tlv_free(request);
-  return -1;
+  return total;
 }
 
-static uint8_t *
-server_add_remove_response(size_t *len)
+// Decrypts one block from cipher_block, which must contain all of it
+static int
+decrypt_block(uint8_t *plain_block, const uint8_t *cipher_block, uint16_t block_len, struct pair_cipher_context *cctx)
 {
-  pair_tlv_values_t *response;
-  uint8_t *data;
-  uint8_t state = 2;
-  size_t data_len;
+  uint8_t nonce[NONCE_LENGTH] = { 0 };
+  uint8_t tag[AUTHTAG_LENGTH];
   int ret;
 
-  data_len = REQUEST_BUFSIZE;
-  data = malloc(data_len);
-  response = pair_tlv_new();
+  memcpy(tag, cipher_block + sizeof(block_len) + block_len, sizeof(tag));
+  memcpy(nonce + 4, &(cctx->decryption_counter), sizeof(cctx->decryption_counter));// TODO BE or LE?
 
-  pair_tlv_add_value(response, TLVType_State, &state, sizeof(state));
-
-  ret = pair_tlv_format(response, data, &data_len);
+  ret = decrypt_chacha_hd(cctx->decryption_ctx, plain_block, cipher_block + sizeof(block_len), block_len, &block_len, sizeof(block_len), tag, sizeof(tag), nonce);
   if (ret < 0)
     {
-      goto error;
+      cctx->errmsg = "Decryption with chacha poly1305 failed";
+      stats_decrypt_auth_failure(cctx);
+      return -1;
     }
 
-  *len = data_len;
-
-  pair_tlv_free(response);
-  return data;
-
- error:
-  free(data);
-  pair_tlv_free(response);
-  return NULL;
+  cctx->decryption_counter++;
+  return 0;
 }
 
-static int
-server_add_remove(uint8_t **out, size_t *out_len, pair_cb cb, void *cb_arg, const uint8_t *in, size_t in_len)
+static ssize_t
+decrypt_into(uint8_t *plaintext, size_t *plaintext_len, const uint8_t *ciphertext, size_t ciphertext_len, struct pair_cipher_context *cctx)
 {
+  uint8_t *plain_block;
+  const uint8_t *cipher_block;
+  uint16_t block_len;
   int ret;
 
-  ret = server_add_remove_request(cb, cb_arg, in, in_len);
-  if (ret < 0)
+  if (ciphertext_len < sizeof(block_len) || !ciphertext)
     return -1;
 
-  *out = server_add_remove_response(out_len);
-  if (!*out)
-    return -1;
+  cctx->decryption_counter_prev = cctx->decryption_counter;
 
-  return 0;
-}
+  for (plain_block = plaintext, cipher_block = ciphertext; cipher_block + sizeof(block_len) <= ciphertext + ciphertext_len; )
+    {
+      memcpy(&block_len, cipher_block, sizeof(block_len)); // TODO BE or LE?
+      if (cipher_block + block_len + BLOCK_OVERHEAD > ciphertext + ciphertext_len)
+	{
+	  // The remaining ciphertext doesn't contain an entire block, so stop
+	  break;
+	}
 
-static int
-server_list_cb(uint8_t public_key[crypto_sign_PUBLICKEYBYTES], const char *device_id, void *cb_arg)
-{
-  pair_tlv_values_t *response = cb_arg;
-  pair_tlv_t *previous_id;
-  uint8_t permissions = 1; // Means admin (TODO don't hardcode - let caller set)
+      if (plain_block + block_len > plaintext + *plaintext_len)
+	{
+	  // No room for the decrypted block, so stop
+	  if (plain_block == plaintext)
+	    {
+	      cctx->errmsg = "Buffer too small for decryption";
+	      return -1;
+	    }
+	  break;
+	}
 
-  // If this isn't the first iteration (item) then we must add a separator
-  previous_id = pair_tlv_get_value(response, TLVType_Identifier);
-  if (previous_id)
-    pair_tlv_add_value(response, TLVType_Separator, NULL, 0);
+      ret = decrypt_block(plain_block, cipher_block, block_len, cctx);
+      if (ret < 0)
+	{
+	  cctx->decryption_counter = cctx->decryption_counter_prev;
+	  return -1;
+	}
 
-  pair_tlv_add_value(response, TLVType_Identifier, (unsigned char *)device_id, strlen(device_id));
-  pair_tlv_add_value(response, TLVType_PublicKey, public_key, crypto_sign_PUBLICKEYBYTES);
-  pair_tlv_add_value(response, TLVType_Permissions, &permissions, sizeof(permissions));
+      plain_block += block_len;
+      cipher_block += block_len + BLOCK_OVERHEAD;
+    }
 
-  return 0;
+  *plaintext_len = plain_block - plaintext;
+
+#ifdef DEBUG_PAIR
+  hexdump("Decrypted:\n", plaintext, *plaintext_len);
+#endif
+
+  return cipher_block - ciphertext;
 }
 
-static uint8_t *
-server_list_response(size_t *len, pair_list_cb cb, void *cb_arg)
+// Like decrypt_into(), but the ciphertext can be given in chunks of any size.
+// Blocks that are complete in the input are decrypted directly from there, and
+// an incomplete block at the end is kept in stream->partial until the next
+// call completes it. So all ciphertext is consumed, unless the plaintext
+// buffer is full.
+static ssize_t
+decrypt_stream(uint8_t *plaintext, size_t *plaintext_len, int *nframes, const uint8_t *ciphertext, size_t ciphertext_len, struct pair_decrypt_stream *stream)
 {
-  pair_tlv_values_t *response;
-  uint8_t *data;
-  uint8_t state = 2;
-  size_t data_len;
+  struct pair_cipher_context *cctx = stream->cctx;
+  const uint8_t *in = ciphertext;
+  const uint8_t *in_end = ciphertext + ciphertext_len;
+  uint8_t *out = plaintext;
+  uint8_t *out_end = plaintext + *plaintext_len;
+  uint16_t block_len;
+  size_t need;
+  size_t n;
   int ret;
 
-  data_len = REQUEST_BUFSIZE;
-  data = malloc(data_len);
-  response = pair_tlv_new();
-
-  pair_tlv_add_value(response, TLVType_State, &state, sizeof(state));
+  cctx->decryption_counter_prev = cctx->decryption_counter;
+  memcpy(stream->partial_prev, stream->partial, stream->partial_len);
+  stream->partial_len_prev = stream->partial_len;
 
-  cb(server_list_cb, response, cb_arg);
+  *nframes = 0;
 
-  ret = pair_tlv_format(response, data, &data_len);
-  if (ret < 0)
+  for (;;)
     {
-      goto error;
+      // Fast path, the entire block is in the input
+      if (stream->partial_len == 0 && in + sizeof(block_len) <= in_end)
+	{
+	  memcpy(&block_len, in, sizeof(block_len)); // TODO BE or LE?
+	  if (block_len > ENCRYPTED_LEN_MAX)
+	    goto invalid;
+
+	  if (in + block_len + BLOCK_OVERHEAD <= in_end)
+	    {
+	      if (out + block_len > out_end)
+		goto full;
+
+	      ret = decrypt_block(out, in, block_len, cctx);
+	      if (ret < 0)
+		goto error;
+
+	      in += block_len + BLOCK_OVERHEAD;
+	      out += block_len;
+	      (*nframes)++;
+	      continue;
+	    }
+	}
+
+      // Slow path, collect the block in the partial buffer
+      if (stream->partial_len < sizeof(block_len))
+	{
+	  n = sizeof(block_len) - stream->partial_len;
+	  if (n > in_end - in)
+	    n = in_end - in;
+
+	  memcpy(stream->partial + stream->partial_len, in, n);
+	  stream->partial_len += n;
+	  in += n;
+
+	  if (stream->partial_len < sizeof(block_len))
+	    break;
+	}
+
+      memcpy(&block_len, stream->partial, sizeof(block_len)); // TODO BE or LE?
+      if (block_len > ENCRYPTED_LEN_MAX)
+	goto invalid;
+
+      need = block_len + BLOCK_OVERHEAD;
+
+      n = need - stream->partial_len;
+      if (n > in_end - in)
+	n = in_end - in;
+
+      memcpy(stream->partial + stream->partial_len, in, n);
+      stream->partial_len += n;
+      in += n;
+
+      if (stream->partial_len < need)
+	break;
+
+      // The block stays in the partial buffer until there is room for it
+      if (out + block_len > out_end)
+	goto full;
+
+      ret = decrypt_block(out, stream->partial, block_len, cctx);
+      if (ret < 0)
+	goto error;
+
+      stream->partial_len = 0;
+      out += block_len;
+      (*nframes)++;
     }
 
-  *len = data_len;
+ done:
+  *plaintext_len = out - plaintext;
 
-  pair_tlv_free(response);
-  return data;
+#ifdef DEBUG_PAIR
+  hexdump("Decrypted:\n", plaintext, *plaintext_len);
+#endif
 
- error:
-  free(data);
-  pair_tlv_free(response);
-  return NULL;
-}
+  return in - ciphertext;
 
-static int
-server_list(uint8_t **out, size_t *out_len, pair_list_cb cb, void *cb_arg, const uint8_t *in, size_t in_len)
-{
-  // Skip reading the request, it just has state = 1 and pair method =
-  // PairingMethodListPairings
+ full:
+  if (out > plaintext)
+    goto done;
 
-  *out = server_list_response(out_len, cb, cb_arg);
-  if (!*out)
-    return -1;
+  cctx->errmsg = "Buffer too small for decryption";
+  goto error;
 
-  return 0;
+ invalid:
+  cctx->errmsg = "Invalid block length in ciphertext";
+ error:
+  cctx->decryption_counter = cctx->decryption_counter_prev;
+  memcpy(stream->partial, stream->partial_prev, stream->partial_len_prev);
+  stream->partial_len = stream->partial_len_prev;
+  return -1;
 }
 
-
-/* ----------------------- CIPHERING IMPLEMENTATION ------------------------- */
+// Encrypts the same plaintext for multiple sessions. The block layout is the
+// same for all of them, so the output for session i is at i * ciphertext_len.
+// Each session is encrypted with its own handle, so a job can be a batch of
+// sessions.
+struct fanout_job
+{
+  uint8_t *ciphertext;
+  size_t ciphertext_len;
+  const uint8_t *plaintext;
+  size_t plaintext_len;
+  struct pair_cipher_context **cctx;
+  int ncctx;
+  int ret;
+};
 
 static void
-cipher_free(struct pair_cipher_context *cctx)
+fanout_job_run(void *arg)
 {
-  if (!cctx)
-    return;
+  struct fanout_job *job = arg;
+  int i;
 
-  free(cctx);
+  for (i = 0, job->ret = 0; i < job->ncctx && job->ret == 0; i++)
+    job->ret = encrypt_range(job->ciphertext + i * job->ciphertext_len, job->plaintext, job->plaintext_len, job->cctx[i]->encryption_ctx, job->cctx[i]->encryption_counter);
 }
 
-static struct pair_cipher_context *
-cipher_new(struct pair_definition *type, int channel, const uint8_t *shared_secret, size_t shared_secret_len)
+static ssize_t
+encrypt_fanout(uint8_t **ciphertext, size_t *ciphertext_len, const uint8_t *plaintext, size_t plaintext_len, struct pair_cipher_context **cctx, int ncctx, int njobs, pair_executor_cb executor, void *cb_arg)
 {
-  struct pair_cipher_context *cctx;
-  enum pair_keys write_key;
-  enum pair_keys read_key;
+  struct fanout_job *jobs;
+  void **job_args;
+  size_t nblocks;
+  int per_job;
   int ret;
+  int i;
 
-  // Note that events is opposite, probably because it is a reverse connection
-  switch (channel)
+  if (plaintext_len == 0 || !plaintext || ncctx <= 0)
+    return -1;
+
+  nblocks = 1 + ((plaintext_len - 1) / ENCRYPTED_LEN_MAX);
+
+  if (njobs < 1)
+    njobs = 1;
+  if (njobs > ncctx)
+    njobs = ncctx;
+
+  per_job = 1 + ((ncctx - 1) / njobs);
+  njobs = 1 + ((ncctx - 1) / per_job);
+
+  *ciphertext_len = encrypted_len(plaintext_len);
+  *ciphertext = malloc(ncctx * *ciphertext_len);
+  jobs = calloc(njobs, sizeof(struct fanout_job));
+  job_args = calloc(njobs, sizeof(void *));
+  if (!*ciphertext || !jobs || !job_args)
     {
-      case 0:
-	write_key = PAIR_CONTROL_WRITE;
-	read_key = PAIR_CONTROL_READ;
-	break;
-      case 1:
-	write_key = PAIR_EVENTS_READ;
-	read_key = PAIR_EVENTS_WRITE;
-	break;
-      case 2:
-	write_key = PAIR_CONTROL_READ;
-	read_key = PAIR_CONTROL_WRITE;
-	break;
-      case 3:
-	write_key = PAIR_EVENTS_WRITE;
-	read_key = PAIR_EVENTS_READ;
-	break;
-      default:
-	return NULL;
+      cctx[0]->errmsg = "Out of memory for fanout encryption";
+      goto error;
     }
 
-  cctx = calloc(1, sizeof(struct pair_cipher_context));
-  if (!cctx)
-    goto error;
+  for (i = 0; i < njobs; i++)
+    {
+      jobs[i].ciphertext = *ciphertext + i * per_job * *ciphertext_len;
+      jobs[i].ciphertext_len = *ciphertext_len;
+      jobs[i].plaintext = plaintext;
+      jobs[i].plaintext_len = plaintext_len;
+      jobs[i].cctx = cctx + i * per_job;
+      jobs[i].ncctx = (i + 1 == njobs) ? (ncctx - i * per_job) : per_job;
+      job_args[i] = &jobs[i];
+    }
 
-  cctx->type = type;
+  if (njobs == 1)
+    fanout_job_run(&jobs[0]);
+  else
+    executor_run(executor, cb_arg, fanout_job_run, job_args, njobs);
 
-  ret = hkdf_extract_expand(cctx->encryption_key, sizeof(cctx->encryption_key), shared_secret, shared_secret_len, write_key);
-  if (ret < 0)
-    goto error;
+  for (i = 0, ret = 0; i < njobs; i++)
+    {
+      if (jobs[i].ret < 0)
+	ret = -1;
+    }
 
-  ret = hkdf_extract_expand(cctx->decryption_key, sizeof(cctx->decryption_key), shared_secret, shared_secret_len, read_key);
   if (ret < 0)
-    goto error;
+    {
+      cctx[0]->errmsg = "Encryption with chacha poly1305 failed";
+      goto error;
+    }
 
-  return cctx;
+  // Only update the counters when all sessions succeeded
+  for (i = 0; i < ncctx; i++)
+    {
+      cctx[i]->encryption_counter_prev = cctx[i]->encryption_counter;
+      cctx[i]->encryption_counter += nblocks;
+    }
+
+  free(job_args);
+  free(jobs);
+  return plaintext_len;
 
  error:
-  pair_cipher_free(cctx);
-  return NULL;
+  free(job_args);
+  free(jobs);
+  free(*ciphertext);
+  return -1;
 }
 
 static ssize_t
 encrypt(uint8_t **ciphertext, size_t *ciphertext_len, const uint8_t *plaintext, size_t plaintext_len, struct pair_cipher_context *cctx)
 {
-  uint8_t nonce[NONCE_LENGTH] = { 0 };
-  uint8_t tag[AUTHTAG_LENGTH];
-  const uint8_t *plain_block;
-  uint8_t *cipher_block;
-  uint16_t block_len;
-  int nblocks;
-  int ret;
-  int i;
+  ssize_t ret;
 
   if (plaintext_len == 0 || !plaintext)
     return -1;
 
-  // Encryption is done in blocks, where each block consists of a short, the
-  // encrypted data and an auth tag. The short is the size of the encrypted
-  // data. The encrypted data in the block cannot exceed ENCRYPTED_LEN_MAX.
-  nblocks = 1 + ((plaintext_len - 1) / ENCRYPTED_LEN_MAX); // Ceiling of division
-
-  *ciphertext_len = nblocks * (sizeof(block_len) + AUTHTAG_LENGTH) + plaintext_len;
+  *ciphertext_len = encrypted_len(plaintext_len);
   *ciphertext = malloc(*ciphertext_len);
 
-  cctx->encryption_counter_prev = cctx->encryption_counter;
-
-  for (i = 0, plain_block = plaintext, cipher_block = *ciphertext; i < nblocks; i++)
+  ret = encrypt_into(*ciphertext, ciphertext_len, plaintext, plaintext_len, cctx);
+  if (ret < 0)
     {
-      // If it is the last block we will encrypt only the remaining data
-      block_len = (i + 1 == nblocks) ? (plaintext + plaintext_len - plain_block) : ENCRYPTED_LEN_MAX;
-
-      memcpy(nonce + 4, &(cctx->encryption_counter), sizeof(cctx->encryption_counter));// TODO BE or LE?
-
-      // Write the ciphered block
-      memcpy(cipher_block, &block_len, sizeof(block_len)); // TODO BE or LE?
-      ret = encrypt_chacha(cipher_block + sizeof(block_len), plain_block, block_len, cctx->encryption_key, sizeof(cctx->encryption_key), &block_len, sizeof(block_len), tag, sizeof(tag), nonce);
-      if (ret < 0)
-	{
-	  cctx->errmsg = "Encryption with chacha poly1305 failed";
-	  cctx->encryption_counter = cctx->encryption_counter_prev;
-	  free(*ciphertext);
-	  return -1;
-	}
-      memcpy(cipher_block + sizeof(block_len) + block_len, tag, AUTHTAG_LENGTH);
-
-      plain_block += block_len;
-      cipher_block += block_len + sizeof(block_len) + AUTHTAG_LENGTH;
-      cctx->encryption_counter++;
+      free(*ciphertext);
+      return -1;
     }
 
-#ifdef DEBUG_PAIR
-  hexdump("Encrypted:\n", *ciphertext, *ciphertext_len);
-#endif
-
-  return plain_block - plaintext;
+  return ret;
 }
 
 static ssize_t
 decrypt(uint8_t **plaintext, size_t *plaintext_len, const uint8_t *ciphertext, size_t ciphertext_len, struct pair_cipher_context *cctx)
 {
-  uint8_t nonce[NONCE_LENGTH] = { 0 };
-  uint8_t tag[AUTHTAG_LENGTH];
-  uint8_t *plain_block;
-  const uint8_t *cipher_block;
-  uint16_t block_len;
-  int ret;
+  ssize_t ret;
 
-  if (ciphertext_len < sizeof(block_len) || !ciphertext)
+  if (ciphertext_len < sizeof(uint16_t) || !ciphertext)
     return -1;
 
-  // This will allocate more than we need. Since we don't know the number of
-  // blocks in the ciphertext yet we can't calculate the exact required length.
-  *plaintext = malloc(ciphertext_len);
-
-  cctx->decryption_counter_prev = cctx->decryption_counter;
+  // Scanning the block headers first lets us allocate the exact length
+  *plaintext_len = decrypted_len(ciphertext, ciphertext_len);
+  *plaintext = malloc(*plaintext_len ? *plaintext_len : 1);
 
-  for (plain_block = *plaintext, cipher_block = ciphertext; cipher_block < ciphertext + ciphertext_len; )
+  ret = decrypt_into(*plaintext, plaintext_len, ciphertext, ciphertext_len, cctx);
+  if (ret < 0)
     {
-      memcpy(&block_len, cipher_block, sizeof(block_len)); // TODO BE or LE?
-      if (cipher_block + block_len + sizeof(block_len) + AUTHTAG_LENGTH > ciphertext + ciphertext_len)
-	{
-	  // The remaining ciphertext doesn't contain an entire block, so stop
-	  break;
-	}
-
-      memcpy(tag, cipher_block + sizeof(block_len) + block_len, sizeof(tag));
-      memcpy(nonce + 4, &(cctx->decryption_counter), sizeof(cctx->decryption_counter));// TODO BE or LE?
-
-      ret = decrypt_chacha(plain_block, cipher_block + sizeof(block_len), block_len, cctx->decryption_key, sizeof(cctx->decryption_key), &block_len, sizeof(block_len), tag, sizeof(tag), nonce);
-      if (ret < 0)
-	{
-	  cctx->errmsg = "Decryption with chacha poly1305 failed";
-	  cctx->decryption_counter = cctx->decryption_counter_prev;
-	  free(*plaintext);
-	  return -1;
-	}
-
-      plain_block += block_len;
-      cipher_block += block_len + sizeof(block_len) + AUTHTAG_LENGTH;
-      cctx->decryption_counter++;
+      free(*plaintext);
+      return -1;
     }
 
-  *plaintext_len = plain_block - *plaintext;
-
-#ifdef DEBUG_PAIR
-  hexdump("Decrypted:\n", *plaintext, *plaintext_len);
-#endif
-
-  return cipher_block - ciphertext;
+  return ret;
 }
 
+// Only peeks at the raw message, the full parse is left to the handler
 static int
 state_get(const char **errmsg, const uint8_t *data, size_t data_len)
 {
-  pair_tlv_values_t *message;
-  pair_tlv_t *state;
+  const uint8_t *value;
+  size_t size;
   int ret;
 
   if (!data || data_len == 0)
@@ -3063,27 +4996,21 @@ state_get(const char **errmsg, const uint8_t *data, size_t data_len)
       return 0; // state 0 = no incoming data yet -> first request
     }
 
-  message = message_process(data, data_len, errmsg);
-  if (!message)
+  ret = pair_tlv_peek(data, data_len, TLVType_Error, &value, &size);
+  if (ret == 0)
     {
-      goto error;
+      *errmsg = error_errmsg(value, size);
+      return -1;
     }
 
-  state = pair_tlv_get_value(message, TLVType_State);
-  if (!state || state->size != 1)
+  ret = pair_tlv_peek(data, data_len, TLVType_State, &value, &size);
+  if (ret < 0 || size != 1)
     {
       *errmsg = "Could not get message state";
-      goto error;
+      return -1;
     }
 
-  ret = state->value[0];
-
-  pair_tlv_free(message);
-  return ret;
-
- error:
-  pair_tlv_free(message);
-  return -1;
+  return value[0];
 }
 
 static void
@@ -3108,6 +5035,7 @@ const struct pair_definition pair_client_homekit_normal =
   .pair_setup_response3 = client_setup_response3,
 
   .pair_verify_new = client_verify_new,
+  .pair_verify_new_with_keys = client_verify_new_with_keys,
 
   .pair_verify_request1 = client_verify_request1,
   .pair_verify_request2 = client_verify_request2,
@@ -3116,12 +5044,25 @@ const struct pair_definition pair_client_homekit_normal =
   .pair_verify_response2 = client_verify_response2,
 
   .pair_cipher_new = cipher_new,
+  .pair_cipher_new_multi = cipher_new_multi,
   .pair_cipher_free = cipher_free,
 
   .pair_encrypt = encrypt,
+  .pair_encrypt_into = encrypt_into,
+  .pair_encryptv = encryptv,
+  .pair_encrypt_fanout = encrypt_fanout,
+  .pair_encrypted_len = encrypted_len,
   .pair_decrypt = decrypt,
+  .pair_decrypt_into = decrypt_into,
+  .pair_decrypt_stream = decrypt_stream,
+  .pair_decrypted_len = decrypted_len,
 
   .pair_state_get = state_get,
+
+  .pair_precompute_set = eph_pool_set,
+  .pair_precompute_fill = eph_pool_fill,
+
+  .pair_verify_resume_cache = client_resume_cache_set,
 };
 
 const struct pair_definition pair_client_homekit_transient =
@@ -3138,6 +5079,7 @@ const struct pair_definition pair_client_homekit_transient =
   .pair_setup_response3 = client_setup_response3,
 
   .pair_verify_new = client_verify_new,
+  .pair_verify_new_with_keys = client_verify_new_with_keys,
 
   .pair_verify_request1 = client_verify_request1,
   .pair_verify_request2 = client_verify_request2,
@@ -3146,12 +5088,23 @@ const struct pair_definition pair_client_homekit_transient =
   .pair_verify_response2 = client_verify_response2,
 
   .pair_cipher_new = cipher_new,
+  .pair_cipher_new_multi = cipher_new_multi,
   .pair_cipher_free = cipher_free,
 
   .pair_encrypt = encrypt,
+  .pair_encrypt_into = encrypt_into,
+  .pair_encryptv = encryptv,
+  .pair_encrypt_fanout = encrypt_fanout,
+  .pair_encrypted_len = encrypted_len,
   .pair_decrypt = decrypt,
+  .pair_decrypt_into = decrypt_into,
+  .pair_decrypt_stream = decrypt_stream,
+  .pair_decrypted_len = decrypted_len,
 
   .pair_state_get = state_get,
+
+  .pair_precompute_set = eph_pool_set,
+  .pair_precompute_fill = eph_pool_fill,
 };
 
 const struct pair_definition pair_server_homekit =
@@ -3180,11 +5133,27 @@ const struct pair_definition pair_server_homekit =
   .pair_list = server_list,
 
   .pair_cipher_new = cipher_new,
+  .pair_cipher_new_multi = cipher_new_multi,
   .pair_cipher_free = cipher_free,
 
   .pair_encrypt = encrypt,
+  .pair_encrypt_into = encrypt_into,
+  .pair_encryptv = encryptv,
+  .pair_encrypt_fanout = encrypt_fanout,
+  .pair_encrypted_len = encrypted_len,
   .pair_decrypt = decrypt,
+  .pair_decrypt_into = decrypt_into,
+  .pair_decrypt_stream = decrypt_stream,
+  .pair_decrypted_len = decrypted_len,
 
   .pair_state_get = state_get,
   .pair_public_key_get = public_key_get,
+
+  .pair_setup_verifier_cache = verifier_cache_set,
+  .pair_server_identity_set = server_identity_set,
+
+  .pair_precompute_set = eph_pool_set,
+  .pair_precompute_fill = eph_pool_fill,
+
+  .pair_verify_resume_cache = server_resume_cache_set,
 };
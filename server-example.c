@@ -27,8 +27,10 @@
 #include <string.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <assert.h>
+#include <sys/uio.h>
 
 #include <event2/event.h>
 #include <event2/buffer.h>
@@ -36,6 +38,7 @@
 #include <event2/listener.h>
 
 #include "pair.h"
+#include "pair-store.h"
 
 #ifdef CONFIG_GCRYPT
 # include <gcrypt.h>
@@ -43,25 +46,63 @@
 
 #define DEVICE_ID "FFEEDDCCBBAA9988"
 #define LISTEN_PORT 7000
+#define PAIRINGS_FILE "server-example.pairings"
 #define CONTENT_TYPE_OCTET "application/octet-stream"
 #define RTSP_VERSION "RTSP/1.0"
 #define OPTIONS "OPTIONS *"
+#define RTSP_HEADERS_LEN_MAX 8192
+#define SERVER_THREADS_MAX 64
+#define ASYNC_THREADS 2 // Per server thread
+#define CONTEXT_POOL_SIZE 64 // Released handshake contexts kept for reuse
+
+// Each server thread has its own event loop and listener on LISTEN_PORT, the
+// kernel distributes new connections between the listeners (SO_REUSEPORT)
+struct server_thread
+{
+  pthread_t tid;
+  struct event_base *evbase;
+  struct evconnlistener *listener;
+
+  // Pairing steps run on these worker threads, so they don't block the event
+  // loop. The callbacks are made in the server thread.
+  struct pair_async *async;
+  struct event *async_ev;
+};
+
+// A connection stays with the server thread that accepted it
+// State of the parsing of the message at the start of the pending buffer, so
+// that parsing can continue when more data arrives
+struct rtsp_parser
+{
+  size_t scan_offset; // Where to continue searching for the end of the headers
+  size_t headers_len; // Set when the end of the headers has been found
+  int content_length;
+};
 
 struct connection_ctx
 {
+  struct server_thread *thread;
+  struct bufferevent *bev;
   struct evbuffer *pending;
+  struct rtsp_parser parser;
   struct pair_setup_context *setup_ctx;
   struct pair_verify_context *verify_ctx;
   struct pair_cipher_context *cipher_ctx;
+  struct pair_decrypt_stream *decrypt_stream;
 
   int pair_completed;
+
+  // Set while a pair-setup or pair-verify step is running on a worker thread
+  int async_pending;
+  int async_cseq;
+  int closed;
 };
 
 struct rtsp_msg
 {
   int content_length;
-  char *content_type;
-  char *first_line;
+  const char *content_type;
+  const char *first_line;
   int cseq;
 
   const uint8_t *body;
@@ -71,13 +112,9 @@ struct rtsp_msg
   size_t datalen;
 };
 
-struct pairings
-{
-  char device_id[PAIR_AP_DEVICE_ID_LEN_MAX];
-  uint8_t public_key[32];
-
-  struct pairings *next;
-} *pairings;
+// The pairing callbacks are made from the worker threads of all server threads,
+// the store takes care of locking
+static struct pair_store *pairings;
 
 
 static void
@@ -88,6 +125,8 @@ connection_free(struct connection_ctx *conn_ctx)
 
   evbuffer_free(conn_ctx->pending);
   pair_setup_free(conn_ctx->setup_ctx);
+  pair_verify_free(conn_ctx->verify_ctx);
+  pair_decrypt_stream_free(conn_ctx->decrypt_stream);
   pair_cipher_free(conn_ctx->cipher_ctx);
 
   free(conn_ctx);
@@ -106,6 +145,16 @@ response_headers_add(struct evbuffer *response, int cseq, size_t content_length,
   evbuffer_add_printf(response, "\r\n");
 }
 
+// Used when a pairing step fails, so the client isn't left waiting
+static void
+response_create_error(struct evbuffer *response, int cseq)
+{
+  evbuffer_add_printf(response, "%s 500 Internal Server Error\r\n", RTSP_VERSION);
+  evbuffer_add_printf(response, "Server: MyServer/1.0\r\n");
+  evbuffer_add_printf(response, "CSeq: %d\r\n", cseq);
+  evbuffer_add_printf(response, "\r\n");
+}
+
 static void
 response_create_from_raw(struct evbuffer *response, uint8_t *body, size_t body_len, int cseq, const char *content_type)
 {
@@ -125,51 +174,136 @@ encryption_enable(struct connection_ctx *conn_ctx, const uint8_t *shared_secret,
       return -1;
     }
 
+  conn_ctx->decrypt_stream = pair_decrypt_stream_new(conn_ctx->cipher_ctx);
+  if (!conn_ctx->decrypt_stream)
+    {
+      printf("Error setting up decryption: %s\n", pair_cipher_errmsg(conn_ctx->cipher_ctx));
+      return -1;
+    }
+
   return 0;
 }
 
+// When the handshake is done only the cipher context is needed, so the long
+// lived encrypted sessions don't keep the much larger handshake contexts
+static void
+handshake_contexts_free(struct connection_ctx *conn_ctx)
+{
+  pair_setup_free(conn_ctx->setup_ctx);
+  conn_ctx->setup_ctx = NULL;
+  pair_verify_free(conn_ctx->verify_ctx);
+  conn_ctx->verify_ctx = NULL;
+}
+
+// Encrypts the content of the input evbuffer without first making it
+// contiguous, the segments are passed directly to pair_encryptv()
 static int
-buffer_encrypt(struct evbuffer *output, uint8_t *in, size_t in_len, struct connection_ctx *conn_ctx)
+buffer_encrypt(struct evbuffer *output, struct evbuffer *input, struct connection_ctx *conn_ctx)
 {
-  uint8_t *out;
+  struct evbuffer_iovec in_iov[8];
+  struct iovec iov[8];
+  struct evbuffer_iovec out_iov;
+  size_t in_len;
   size_t out_len;
-  int ret;
+  ssize_t ret;
+  int n;
+  int i;
+
+  in_len = evbuffer_get_length(input);
 
-  ret = pair_encrypt(&out, &out_len, in, in_len, conn_ctx->cipher_ctx);
+  n = evbuffer_peek(input, -1, NULL, in_iov, sizeof(in_iov)/sizeof(in_iov[0]));
+  if (n < 0 || n > sizeof(in_iov)/sizeof(in_iov[0]))
+    {
+      // Too fragmented, so must make it contiguous after all
+      evbuffer_pullup(input, -1);
+      n = evbuffer_peek(input, -1, NULL, in_iov, 1);
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      iov[i].iov_base = in_iov[i].iov_base;
+      iov[i].iov_len = in_iov[i].iov_len;
+    }
+
+  ret = pair_encrypted_len(in_len, conn_ctx->cipher_ctx);
+  if (ret < 0 || evbuffer_reserve_space(output, ret, &out_iov, 1) != 1)
+    {
+      printf("Error reserving space for encryption\n");
+      return -1;
+    }
+
+  out_len = ret;
+  ret = pair_encryptv(out_iov.iov_base, &out_len, iov, n, conn_ctx->cipher_ctx);
   if (ret < 0)
     {
       printf("Error encrypting: %s\n", pair_cipher_errmsg(conn_ctx->cipher_ctx));
       return -1;
     }
 
-  evbuffer_add(output, out, out_len);
-  free(out);
+  out_iov.iov_len = out_len;
+  evbuffer_commit_space(output, &out_iov, 1);
   return 0;
 }
 
+// Decrypts the input evbuffer segment by segment, so it never needs to be made
+// contiguous. An incomplete block at the end is saved by the decrypt stream, so
+// all of the input can be drained.
 static int
 buffer_decrypt(struct evbuffer *output, struct evbuffer *input, struct connection_ctx *conn_ctx)
 {
-  uint8_t *in;
+  struct evbuffer_iovec in_iov[8];
+  struct evbuffer_iovec out_iov;
+  const uint8_t *in;
   size_t in_len;
-  ssize_t bytes_decrypted;
-  uint8_t *plain;
   size_t plain_len;
+  ssize_t bytes_decrypted;
+  size_t drain_len;
+  int nframes;
+  int n;
+  int i;
 
-  in = evbuffer_pullup(input, -1);
-  in_len = evbuffer_get_length(input);
-
-  // Note that bytes_decrypted is not necessarily equal to plain_len
-  bytes_decrypted = pair_decrypt(&plain, &plain_len, in, in_len, conn_ctx->cipher_ctx);
-  if (bytes_decrypted < 0)
+  while (evbuffer_get_length(input) > 0)
     {
-      printf("Error decrypting: %s\n", pair_cipher_errmsg(conn_ctx->cipher_ctx));
-      return -1;
+      drain_len = 0;
+      n = evbuffer_peek(input, -1, NULL, in_iov, sizeof(in_iov)/sizeof(in_iov[0]));
+      if (n > sizeof(in_iov)/sizeof(in_iov[0]))
+	n = sizeof(in_iov)/sizeof(in_iov[0]);
+
+      for (i = 0; i < n; i++)
+	{
+	  in = in_iov[i].iov_base;
+	  in_len = in_iov[i].iov_len;
+
+	  while (in_len > 0)
+	    {
+	      // Plaintext is never longer than the ciphertext + a buffered block
+	      if (evbuffer_reserve_space(output, in_len + 1024, &out_iov, 1) != 1)
+		{
+		  printf("Error reserving space for decryption\n");
+		  return -1;
+		}
+
+	      plain_len = out_iov.iov_len;
+	      bytes_decrypted = pair_decrypt_stream_process(out_iov.iov_base, &plain_len, &nframes, in, in_len, conn_ctx->decrypt_stream);
+	      if (bytes_decrypted < 0)
+		{
+		  printf("Error decrypting: %s\n", pair_cipher_errmsg(conn_ctx->cipher_ctx));
+		  return -1;
+		}
+
+	      out_iov.iov_len = plain_len;
+	      evbuffer_commit_space(output, &out_iov, 1);
+
+	      in += bytes_decrypted;
+	      in_len -= bytes_decrypted;
+	    }
+
+	  drain_len += in_iov[i].iov_len;
+	}
+
+      evbuffer_drain(input, drain_len);
     }
 
-  evbuffer_add(output, plain, plain_len);
-  evbuffer_drain(input, bytes_decrypted);
-  free(plain);
   return 0;
 }
 
@@ -179,101 +313,42 @@ buffer_decrypt(struct evbuffer *output, struct evbuffer *input, struct connectio
 /*  securely verifying the client + don't require support for the pair-add,   */
 /*                   pair-remove and pair-list methods.                       */
 
-static struct pairings *
-pairing_find(const char *device_id)
-{
-  struct pairings *pairing;
-
-  for (pairing = pairings; pairing; pairing = pairing->next)
-    {
-      if (strcmp(device_id, pairing->device_id) == 0)
-        break;
-    }
-
-  return pairing;
-}
-
 static int
 pairing_add_cb(uint8_t public_key[32], const char *device_id, void *cb_arg)
 {
-  struct pairings *pairing;
-
   printf("Adding paired device %s\n", device_id);
 
-  pairing = pairing_find(device_id);
-  if (pairing)
-    {
-      memcpy(pairing->public_key, public_key, sizeof(pairing->public_key));
-      return 0;
-    }
-
-  pairing = calloc(1, sizeof(struct pairings));
-  snprintf(pairing->device_id, sizeof(pairing->device_id), "%s", device_id);
-  memcpy(pairing->public_key, public_key, sizeof(pairing->public_key));
-
-  pairing->next = pairings;
-  pairings = pairing;
-
-  return 0;
+  return pair_store_add_cb(public_key, device_id, pairings);
 }
 
 static int
 pairing_remove_cb(uint8_t public_key[32], const char *device_id, void *cb_arg)
 {
-  struct pairings *pairing;
-  struct pairings *iter;
-
   printf("Removing paired device %s\n", device_id);
 
-  pairing = pairing_find(device_id);
-  if (!pairing)
+  if (pair_store_remove_cb(public_key, device_id, pairings) < 0)
     {
       printf("Remove callback for unknown device\n");
       return -1;
     }
 
-  if (pairing == pairings)
-    pairings = pairing->next;
-  else
-    {
-      for (iter = pairings; iter && (iter->next != pairing); iter = iter->next)
-	; /* EMPTY */
-
-      if (iter)
-	iter->next = pairing->next;
-    }
-
-  free(pairing);
   return 0;
 }
 
 static void
 pairing_list_cb(pair_cb enum_cb, void *enum_cb_arg, void *cb_arg)
 {
-  struct pairings *pairing;
-
   printf("Listing paired devices\n");
 
-  for (pairing = pairings; pairing; pairing = pairing->next)
-    {
-      enum_cb(pairing->public_key, pairing->device_id, enum_cb_arg);
-    }
+  pair_store_list_cb(enum_cb, enum_cb_arg, pairings);
 }
 
 static int
 pairing_get_cb(uint8_t public_key[32], const char *device_id, void *cb_arg)
 {
-  struct pairings *pairing;
-
   printf("Returning public key for paired device %s\n", device_id);
 
-  pairing = pairing_find(device_id);
-  if (!pairing)
-    return -1;
-
-  memcpy(public_key, pairing->public_key, sizeof(pairing->public_key));
-
-  return 0;
+  return pair_store_get_cb(public_key, device_id, pairings);
 }
 
 
@@ -289,12 +364,65 @@ handle_pin_start(struct evbuffer *output, struct connection_ctx *conn_ctx, struc
   return 0;
 }
 
+static void pending_process(struct connection_ctx *conn_ctx);
+
+// Returns 1 if the connection was closed while the step was running, then the
+// connection is freed
 static int
-handle_pair_setup(struct evbuffer *output, struct connection_ctx *conn_ctx, struct rtsp_msg *msg)
+async_done(struct connection_ctx *conn_ctx)
 {
-  uint8_t *out;
-  size_t out_len;
+  conn_ctx->async_pending = 0;
+  if (!conn_ctx->closed)
+    return 0;
+
+  connection_free(conn_ctx);
+  return 1;
+}
+
+static void
+pair_setup_done_cb(int ret, uint8_t *out, size_t out_len, void *arg)
+{
+  struct connection_ctx *conn_ctx = arg;
   struct pair_result *result;
+
+  if (async_done(conn_ctx))
+    goto out;
+
+  // The context can't continue, so a new pair-setup starts with a new one
+  if (ret < 0)
+    {
+      printf("Pair setup error: %s\n", pair_setup_errmsg(conn_ctx->setup_ctx));
+      pair_setup_free(conn_ctx->setup_ctx);
+      conn_ctx->setup_ctx = NULL;
+      response_create_error(bufferevent_get_output(conn_ctx->bev), conn_ctx->async_cseq);
+      pending_process(conn_ctx);
+      goto out;
+    }
+
+  ret = pair_setup_result(NULL, &result, conn_ctx->setup_ctx);
+  if (ret == 0 && result->shared_secret_len > 0) // Transient pairing completed (step 2)
+    {
+      encryption_enable(conn_ctx, result->shared_secret, result->shared_secret_len);
+      conn_ctx->pair_completed = 1;
+    }
+
+  // After a normal pair-setup the client continues with a new pair-verify, and
+  // the pairing was saved by pairing_add_cb(), so nothing is needed from here
+  if (ret == 0)
+    handshake_contexts_free(conn_ctx);
+
+  response_create_from_raw(bufferevent_get_output(conn_ctx->bev), out, out_len, conn_ctx->async_cseq, CONTENT_TYPE_OCTET);
+
+  // Handle anything the client sent while we were busy
+  pending_process(conn_ctx);
+
+ out:
+  free(out);
+}
+
+static int
+handle_pair_setup(struct evbuffer *output, struct connection_ctx *conn_ctx, struct rtsp_msg *msg)
+{
   int ret;
 
   if (!conn_ctx->setup_ctx)
@@ -307,32 +435,58 @@ handle_pair_setup(struct evbuffer *output, struct connection_ctx *conn_ctx, stru
         }
     }
 
-  ret = pair_setup(&out, &out_len, conn_ctx->setup_ctx, msg->body, msg->bodylen);
+  // The response is made by pair_setup_done_cb()
+  ret = pair_async_setup(conn_ctx->thread->async, conn_ctx->setup_ctx, msg->body, msg->bodylen, pair_setup_done_cb, conn_ctx);
   if (ret < 0)
     {
-      printf("Pair setup error: %s\n", pair_setup_errmsg(conn_ctx->setup_ctx));
+      printf("Error starting pair setup\n");
       return -1;
     }
 
-  ret = pair_setup_result(NULL, &result, conn_ctx->setup_ctx);
-  if (ret == 0 && result->shared_secret_len > 0) // Transient pairing completed (step 2)
+  conn_ctx->async_pending = 1;
+  conn_ctx->async_cseq = msg->cseq;
+
+  return 0;
+}
+
+static void
+pair_verify_done_cb(int ret, uint8_t *out, size_t out_len, void *arg)
+{
+  struct connection_ctx *conn_ctx = arg;
+  struct pair_result *result;
+
+  if (async_done(conn_ctx))
+    goto out;
+
+  if (ret < 0)
+    {
+      printf("Pair verify error: %s\n", pair_verify_errmsg(conn_ctx->verify_ctx));
+      pair_verify_free(conn_ctx->verify_ctx);
+      conn_ctx->verify_ctx = NULL;
+      response_create_error(bufferevent_get_output(conn_ctx->bev), conn_ctx->async_cseq);
+      pending_process(conn_ctx);
+      goto out;
+    }
+
+  ret = pair_verify_result(&result, conn_ctx->verify_ctx);
+  if (ret == 0)
     {
       encryption_enable(conn_ctx, result->shared_secret, result->shared_secret_len);
       conn_ctx->pair_completed = 1;
+      handshake_contexts_free(conn_ctx);
     }
 
-  response_create_from_raw(output, out, out_len, msg->cseq, CONTENT_TYPE_OCTET);
-  free(out);
+  response_create_from_raw(bufferevent_get_output(conn_ctx->bev), out, out_len, conn_ctx->async_cseq, CONTENT_TYPE_OCTET);
 
-  return 0;
+  pending_process(conn_ctx);
+
+ out:
+  free(out);
 }
 
 static int
 handle_pair_verify(struct evbuffer *output, struct connection_ctx *conn_ctx, struct rtsp_msg *msg)
 {
-  uint8_t *out;
-  size_t out_len;
-  struct pair_result *result;
   int ret;
 
   if (!conn_ctx->verify_ctx)
@@ -345,22 +499,16 @@ handle_pair_verify(struct evbuffer *output, struct connection_ctx *conn_ctx, str
         }
     }
 
-  ret = pair_verify(&out, &out_len, conn_ctx->verify_ctx, msg->body, msg->bodylen);
+  // The response is made by pair_verify_done_cb()
+  ret = pair_async_verify(conn_ctx->thread->async, conn_ctx->verify_ctx, msg->body, msg->bodylen, pair_verify_done_cb, conn_ctx);
   if (ret < 0)
     {
-      printf("Pair verify error: %s\n", pair_verify_errmsg(conn_ctx->verify_ctx));
+      printf("Error starting pair verify\n");
       return -1;
     }
 
-  ret = pair_verify_result(&result, conn_ctx->verify_ctx);
-  if (ret == 0)
-    {
-      encryption_enable(conn_ctx, result->shared_secret, result->shared_secret_len);
-      conn_ctx->pair_completed = 1;
-    }
-
-  response_create_from_raw(output, out, out_len, msg->cseq, CONTENT_TYPE_OCTET);
-  free(out);
+  conn_ctx->async_pending = 1;
+  conn_ctx->async_cseq = msg->cseq;
 
   return 0;
 }
@@ -429,8 +577,6 @@ static int
 handle_options(struct evbuffer *output, struct connection_ctx *conn_ctx, struct rtsp_msg *msg)
 {
   struct evbuffer *response;
-  uint8_t *plain;
-  size_t plain_len;
   int ret;
 
   response = evbuffer_new();
@@ -444,10 +590,7 @@ handle_options(struct evbuffer *output, struct connection_ctx *conn_ctx, struct
       return 0;
     }
 
-  plain = evbuffer_pullup(response, -1);
-  plain_len = evbuffer_get_length(response);
-
-  ret = buffer_encrypt(output, plain, plain_len, conn_ctx);
+  ret = buffer_encrypt(output, response, conn_ctx);
 
   evbuffer_free(response);
   return ret;
@@ -481,81 +624,151 @@ response_send(struct evbuffer *output, struct connection_ctx *conn_ctx, struct r
 
 /* --------------------- A basic RTSP server implementation ----------------- */
 
-static void
-rtsp_clear(struct rtsp_msg *msg)
+// Returns the value of the header if line is that header. The line doesn't have
+// to be null-terminated, the value ends at the \r.
+static const char *
+header_value(const char *line, const char *name)
 {
-  free(msg->first_line);
-  free(msg->content_type);
+  size_t len = strlen(name);
+
+  if (strncmp(line, name, len) != 0 || line[len] != ':')
+    return NULL;
+
+  for (line += len + 1; *line == ' '; line++)
+    ; /* EMPTY */
+
+  return line;
 }
 
-// Very primitive RTSP message parser, hope you have a better one
+// Parses the message at the start of the input buffer, if it is complete. The
+// search for the end of the headers continues where it stopped last time, so
+// a message that arrives in small pieces isn't scanned from the start every
+// time. The message is parsed in place, so the strings and body in msg point
+// into the buffer and are valid until msg->datalen bytes are drained. Returns
+// 1 if the message is incomplete, then the parser must be kept for the next
+// call. When a message has been parsed, the caller must reset the parser.
 static int
-rtsp_parse(struct rtsp_msg *msg, uint8_t *in, size_t in_len)
+rtsp_parse(struct rtsp_msg *msg, struct rtsp_parser *parser, struct evbuffer *input)
 {
+  struct evbuffer_ptr start;
+  struct evbuffer_ptr end;
+  size_t in_len;
+  char *data;
   char *line;
-  int i;
+  char *eol;
+  const char *value;
+
+  memset(msg, 0, sizeof(struct rtsp_msg));
 
-  line = (char *)in;
-  for (i = 0; i < in_len; i++)
+  in_len = evbuffer_get_length(input);
+
+  if (parser->headers_len == 0)
     {
-      if (in[i] != '\n' && in[i - 1] != '\r')
-	continue;
+      if (evbuffer_ptr_set(input, &start, parser->scan_offset, EVBUFFER_PTR_SET) < 0)
+	return -1;
 
-      if (in[i - 2] == '\n' && in[i - 3] == '\r')
+      end = evbuffer_search(input, "\r\n\r\n", 4, &start);
+      if (end.pos < 0)
 	{
-	  msg->bodylen = in_len - (i + 1);
-	  if (msg->bodylen != msg->content_length)
-	    {
-	      printf("Incomplete read (have %zu, content-length %d), waiting for more data\n\n", msg->bodylen, msg->content_length);
-	      rtsp_clear(msg);
-	      return 1;
-	    }
-	  else if (msg->bodylen > 0)
-	    msg->body = in + i + 1;
+	  if (in_len > RTSP_HEADERS_LEN_MAX)
+	    return -1;
 
-	  break;
+	  // The end of the headers might begin in the last 3 bytes
+	  parser->scan_offset = (in_len > 3) ? in_len - 3 : 0;
+	  return 1;
 	}
 
-      in[i - 1] = '\0';
+      parser->headers_len = end.pos + 4;
 
-      if (!msg->first_line)
-	msg->first_line = strdup(line);
+      data = (char *)evbuffer_pullup(input, parser->headers_len);
+      for (line = data; line < data + parser->headers_len - 2; line = eol + 1)
+	{
+	  eol = memchr(line, '\n', data + parser->headers_len - line);
+	  if ((value = header_value(line, "Content-Length")))
+	    parser->content_length = atoi(value);
+	}
 
-      if (strncmp(line, "CSeq: ", strlen("CSeq: ")) == 0)
-	msg->cseq = atoi(line + strlen("CSeq: "));
+      if (parser->content_length < 0)
+	return -1;
+    }
 
-      if (strncmp(line, "Content-Length: ", strlen("Content-Length: ")) == 0)
-	msg->content_length = atoi(line + strlen("Content-Length: "));
+  if (in_len < parser->headers_len + parser->content_length)
+    {
+      printf("Incomplete read (have %zu, content-length %d), waiting for more data\n\n", in_len - parser->headers_len, parser->content_length);
+      return 1;
+    }
 
-      if (strncmp(line, "Content-Type: ", strlen("Content-Type: ")) == 0 && !msg->content_type)
-	msg->content_type = strdup(line + strlen("Content-Type: "));
+  data = (char *)evbuffer_pullup(input, parser->headers_len + parser->content_length);
 
-      in[i - 1] = '\r';
+  // Null-terminate each header line in place, the last line is the empty one
+  for (line = data; line < data + parser->headers_len - 2; line = eol + 1)
+    {
+      eol = memchr(line, '\n', data + parser->headers_len - line);
+      if (eol > line && eol[-1] == '\r')
+	eol[-1] = '\0';
+      *eol = '\0';
 
-      line = (char *)in + i + 1;
+      if (!msg->first_line)
+	msg->first_line = line;
+      else if ((value = header_value(line, "CSeq")))
+	msg->cseq = atoi(value);
+      else if ((value = header_value(line, "Content-Type")) && !msg->content_type)
+	msg->content_type = value;
     }
 
-  msg->data = in;
-  msg->datalen = in_len;
+  msg->content_length = parser->content_length;
+  msg->bodylen = parser->content_length;
+  if (msg->bodylen > 0)
+    msg->body = (uint8_t *)data + parser->headers_len;
+
+  msg->data = (uint8_t *)data;
+  msg->datalen = parser->headers_len + parser->content_length;
 
   return 0;
 }
 
+// Handles all the complete messages in the pending buffer, and leaves what is
+// left of an incomplete message for the next read. Stops if a message starts a
+// pairing step, the step's callback will call this again.
+static void
+pending_process(struct connection_ctx *conn_ctx)
+{
+  struct evbuffer *output;
+  struct rtsp_msg msg;
+  int ret;
+
+  output = bufferevent_get_output(conn_ctx->bev);
+
+  while (!conn_ctx->async_pending && evbuffer_get_length(conn_ctx->pending) > 0)
+    {
+      ret = rtsp_parse(&msg, &conn_ctx->parser, conn_ctx->pending);
+      if (ret < 0)
+	{
+	  printf("Could not parse RTSP message\n");
+	  evbuffer_drain(conn_ctx->pending, evbuffer_get_length(conn_ctx->pending));
+	  memset(&conn_ctx->parser, 0, sizeof(struct rtsp_parser));
+	  return;
+	}
+      else if (ret == 1)
+	return; // Message incomplete, wait for more data
+
+      printf("\n--------------------------------------------------------------------------\n");
+
+      // Errors are printed by the handlers
+      response_send(output, conn_ctx, &msg);
+
+      evbuffer_drain(conn_ctx->pending, msg.datalen);
+      memset(&conn_ctx->parser, 0, sizeof(struct rtsp_parser));
+    }
+}
+
 static void
 in_read_cb(struct bufferevent *bev, void *arg)
 {
   struct connection_ctx *conn_ctx = arg;
   struct evbuffer *input;
-  struct evbuffer *output;
-  uint8_t *plain;
-  size_t plain_len;
-  struct rtsp_msg msg = { 0 };
-  int ret;
 
   input = bufferevent_get_input(bev);
-  output = bufferevent_get_output(bev);
-
-  printf("\n--------------------------------------------------------------------------\n");
 
   if (conn_ctx->pair_completed)
     {
@@ -566,30 +779,11 @@ in_read_cb(struct bufferevent *bev, void *arg)
       evbuffer_add_buffer(conn_ctx->pending, input);
     }
 
-  // Pending holds all the message we have received so far, incl. what parts we
-  // might have received in previous callbacks
-  plain = evbuffer_pullup(conn_ctx->pending, -1);
-  plain_len = evbuffer_get_length(conn_ctx->pending);
-
-  ret = rtsp_parse(&msg, plain, plain_len);
-  if (ret < 0)
-    {
-      printf("Could not parse RTSP message\n");
-      goto error;
-    }
-  else if (ret == 1)
-    return; // Message incomplete, wait for more data
-
-  ret = response_send(output, conn_ctx, &msg);
-  if (ret < 0)
-    {
-      goto error;
-    }
+  // Wait for the running pairing step, its callback will process what we got
+  if (conn_ctx->async_pending)
+    return;
 
- error:
-  rtsp_clear(&msg);
-  evbuffer_drain(conn_ctx->pending, evbuffer_get_length(conn_ctx->pending));
-  return;
+  pending_process(conn_ctx);
 }
 
 static void
@@ -603,6 +797,14 @@ in_event_cb(struct bufferevent *bev, short events, void *arg)
   if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
     bufferevent_free(bev);
 
+  // A worker thread is still using the connection's pair context, so let the
+  // callback free it
+  if (conn_ctx->async_pending)
+    {
+      conn_ctx->closed = 1;
+      return;
+    }
+
   connection_free(conn_ctx);
 }
 
@@ -617,6 +819,8 @@ in_accept_cb(struct evconnlistener *listener, evutil_socket_t sock, struct socka
   struct connection_ctx *conn_ctx;
 
   conn_ctx = calloc(1, sizeof(struct connection_ctx));
+  conn_ctx->thread = ctx;
+  conn_ctx->bev = bev;
   conn_ctx->pending = evbuffer_new();
 
   bufferevent_setcb(bev, in_read_cb, NULL, in_event_cb, conn_ctx);
@@ -633,7 +837,7 @@ in_error_cb(struct evconnlistener *listener, void *ctx)
 }
 
 static struct evconnlistener *
-listen_add(struct event_base *evbase, evconnlistener_cb req_cb, evconnlistener_errorcb err_cb, unsigned short port)
+listen_add(struct event_base *evbase, evconnlistener_cb req_cb, evconnlistener_errorcb err_cb, unsigned short port, void *cb_arg)
 {
   struct evconnlistener *listener;
   struct addrinfo hints = { 0 };
@@ -653,7 +857,7 @@ listen_add(struct event_base *evbase, evconnlistener_cb req_cb, evconnlistener_e
       return NULL;
     }
 
-  listener = evconnlistener_new_bind(evbase, req_cb, NULL, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1, servinfo->ai_addr, servinfo->ai_addrlen);
+  listener = evconnlistener_new_bind(evbase, req_cb, cb_arg, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE | LEV_OPT_REUSEABLE_PORT, -1, servinfo->ai_addr, servinfo->ai_addrlen);
   freeaddrinfo(servinfo);
   if (!listener)
     {
@@ -666,11 +870,77 @@ listen_add(struct event_base *evbase, evconnlistener_cb req_cb, evconnlistener_e
   return listener;
 }
 
+static void
+async_cb(evutil_socket_t fd, short what, void *arg)
+{
+  struct server_thread *thread = arg;
+
+  pair_async_dispatch(thread->async);
+}
+
+static void
+server_thread_deinit(struct server_thread *thread)
+{
+  if (thread->listener)
+    evconnlistener_free(thread->listener);
+  if (thread->async_ev)
+    event_free(thread->async_ev);
+  pair_async_free(thread->async);
+  if (thread->evbase)
+    event_base_free(thread->evbase);
+}
+
+static int
+server_thread_init(struct server_thread *thread)
+{
+  thread->evbase = event_base_new();
+  if (!thread->evbase)
+    goto error;
+
+  thread->async = pair_async_new(ASYNC_THREADS);
+  if (!thread->async)
+    {
+      printf("Could not start pairing worker threads\n");
+      goto error;
+    }
+
+  thread->async_ev = event_new(thread->evbase, pair_async_fd(thread->async), EV_READ | EV_PERSIST, async_cb, thread);
+  if (!thread->async_ev || event_add(thread->async_ev, NULL) < 0)
+    goto error;
+
+  thread->listener = listen_add(thread->evbase, in_accept_cb, in_error_cb, LISTEN_PORT, thread);
+  if (!thread->listener)
+    goto error;
+
+  return 0;
+
+ error:
+  server_thread_deinit(thread);
+  return -1;
+}
+
+static void *
+server_thread_run(void *arg)
+{
+  struct server_thread *thread = arg;
+
+  event_base_dispatch(thread->evbase);
+
+  return NULL;
+}
+
 int
 main(int argc, char * argv[])
 {
-  struct event_base *evbase;
-  struct evconnlistener *listener;
+  struct server_thread *threads;
+  int nthreads = 1;
+  int i;
+
+  if (argc > 2 || (argc == 2 && (nthreads = atoi(argv[1])) < 1) || nthreads > SERVER_THREADS_MAX)
+    {
+      printf("%s [number of threads, default 1]\n", argv[0]);
+      return -1;
+    }
 
 // libgcrypt requires that the application initializes the library
 #ifdef CONFIG_GCRYPT
@@ -683,18 +953,47 @@ main(int argc, char * argv[])
   gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
 #endif
 
-  evbase = event_base_new();
+  pair_context_pool_set(CONTEXT_POOL_SIZE);
 
-  listener = listen_add(evbase, in_accept_cb, in_error_cb, LISTEN_PORT);
-  if (!listener)
+  pairings = pair_store_new(PAIRINGS_FILE);
+  if (!pairings)
+    {
+      printf("Could not open pairing store %s\n", PAIRINGS_FILE);
+      return -1;
+    }
+
+  threads = calloc(nthreads, sizeof(struct server_thread));
+  if (!threads)
     return -1;
 
-  printf("Listening for pairing requests on port %d\n", LISTEN_PORT);
+  for (i = 0; i < nthreads; i++)
+    {
+      if (server_thread_init(&threads[i]) < 0)
+	return -1;
+    }
+
+  printf("Listening for pairing requests on port %d with %d thread(s)\n", LISTEN_PORT, nthreads);
+
+  // The first server thread is the main thread
+  for (i = 1; i < nthreads; i++)
+    {
+      if (pthread_create(&threads[i].tid, NULL, server_thread_run, &threads[i]) != 0)
+	{
+	  printf("Could not start server thread\n");
+	  return -1;
+	}
+    }
+
+  server_thread_run(&threads[0]);
+
+  for (i = 1; i < nthreads; i++)
+    pthread_join(threads[i].tid, NULL);
 
-  event_base_dispatch(evbase);
+  for (i = 0; i < nthreads; i++)
+    server_thread_deinit(&threads[i]);
 
-  evconnlistener_free(listener);
-  event_base_free(evbase);
+  free(threads);
+  pair_store_free(pairings);
 
   return 0;
 }